@@ -1,8 +1,39 @@
 #include "buffer/buffer_pool_manager.h"
 #include "common/logger.h"
+#include "logging/log_recovery.h"
 
 namespace cmudb {
 
+// page capture installed by the calling thread, and on which buffer pool
+static thread_local PageCapture *page_capture = nullptr;
+static thread_local BufferPoolManager *page_capture_owner = nullptr;
+
+/*
+ * the calling thread captures page_id
+ */
+bool BufferPoolManager::IsCaptured(page_id_t page_id) {
+  return page_capture != nullptr && page_capture_owner == this &&
+         page_capture->frames.count(page_id) != 0;
+}
+
+/*
+ * remember what page looked like before the capturing thread touched it, and
+ * pin it for the capture. Must hold latch_
+ */
+void BufferPoolManager::CapturePage(Page *page, bool new_page) {
+  if (page_capture == nullptr || page_capture_owner != this ||
+      page_capture->frames.count(page->GetPageId()) != 0) {
+    return;
+  }
+  page_capture->before_images[page->GetPageId()].assign(
+      page->GetData(), page->GetData() + PAGE_SIZE);
+  page_capture->frames[page->GetPageId()] = page;
+  page->pin_count_++;
+  if (new_page) {
+    page_capture->new_pages.insert(page->GetPageId());
+  }
+}
+
 /*
  * BufferPoolManager Constructor
  * When log_manager is nullptr, logging is disabled (for test purpose)
@@ -46,9 +77,23 @@ BufferPoolManager::~BufferPoolManager() {
  * entry for the new page.
  * 4. Update page metadata, read page content from disk file and return page
  * pointer
+ * 5. During lazy recovery, let recovery bring the page up to date first
  */
 Page *BufferPoolManager::FetchPage(page_id_t page_id) {
-  std::lock_guard<std::mutex> lck (latch_);
+  Page *page = FetchFrame(page_id);
+  LogRecovery *recovery = lazy_recovery_;
+  if (page != nullptr && recovery != nullptr && recovery->RecoverPage(page)) {
+    std::lock_guard<std::mutex> lck (latch_);
+    page->is_dirty_ = true;
+  }
+  return page;
+}
+
+/*
+ * steps 1 - 4 of FetchPage
+ */
+Page *BufferPoolManager::FetchFrame(page_id_t page_id) {
+  std::unique_lock<std::mutex> lck (latch_);
   if (page_id == INVALID_PAGE_ID) {
     //LOG_INFO("INVALID_PAGE_ID");
     return nullptr;
@@ -59,28 +104,23 @@ Page *BufferPoolManager::FetchPage(page_id_t page_id) {
     ret_page->pin_count_++;
     //pinned的Frame必定不能被置换出
     replacer_->Erase(ret_page);
+    CapturePage(ret_page, false);
     return ret_page;
-  } else if (!free_list_->empty()) {
-    //1.2 free_list_
-    ret_page = free_list_->front();
-    free_list_->pop_front();
-  } else {
-    //1.2 lru
-    if (replacer_->Victim(ret_page)) {
-      //LOG_INFO("Victim SUCCESS");
-      if (ret_page->GetPinCount() != 0) {
-        //LOG_INFO("Page needed to be replaced is pinned");
-        return nullptr;
-      }
-      if (ret_page->is_dirty_) {
-        //2 write back
-        disk_manager_->WritePage(ret_page->GetPageId(), ret_page->GetData());
-      }
-      page_table_->Remove(ret_page->GetPageId());
-    } else {
-      //LOG_INFO("Victim ERROR");
-      return nullptr;
-    }
+  } else if (!FindVictim(ret_page, lck)) {
+    //1.2, 2
+    //LOG_INFO("Victim ERROR");
+    return nullptr;
+  }
+  Page *fetched;
+  if (page_table_->Find(page_id, fetched)) {
+    // fetched by another thread while latch_ was dropped
+    ret_page->page_id_ = INVALID_PAGE_ID;
+    ret_page->is_dirty_ = false;
+    free_list_->push_back(ret_page);
+    fetched->pin_count_++;
+    replacer_->Erase(fetched);
+    CapturePage(fetched, false);
+    return fetched;
   }
   //3 update hash_table
   ret_page->page_id_ = page_id;
@@ -88,7 +128,9 @@ Page *BufferPoolManager::FetchPage(page_id_t page_id) {
   //4 
   disk_manager_->ReadPage(ret_page->GetPageId(), ret_page->data_);
   ret_page->is_dirty_ = false;
+  ret_page->rec_lsn_ = INVALID_LSN;
   ret_page->pin_count_ = 1;
+  CapturePage(ret_page, false);
   //LOG_INFO("Fetch Page");
   return ret_page; 
 }
@@ -97,7 +139,7 @@ Page *BufferPoolManager::FetchPage(page_id_t page_id) {
  * Implementation of unpin page
  * if pin_count>0, decrement it and if it becomes zero, put it back to
  * replacer if pin_count<=0 before this call, return false. is_dirty: set the
- * dirty flag of this page
+ * dirty flag of this page, a clean unpin does not clear it
  */
 bool BufferPoolManager::UnpinPage(page_id_t page_id, bool is_dirty) {
   std::lock_guard<std::mutex> lck (latch_);
@@ -108,12 +150,22 @@ bool BufferPoolManager::UnpinPage(page_id_t page_id, bool is_dirty) {
   if (page->GetPinCount() <= 0) {
     return false;
   }
+  if (IsCaptured(page_id)) {
+    // the pin of the capture stays, the page is only dirty if it changed,
+    // which the capture owner finds out
+    if (page->pin_count_ <= 1 ||
+        page_capture->deleted_pages.count(page_id) != 0) {
+      return false;
+    }
+    page->pin_count_--;
+    return true;
+  }
   page->pin_count_--;
 //LOG_INFO("%d PinCount = %d", page_id, page->pin_count_);
   if (page->pin_count_ <= 0) {
     replacer_->Insert(page);
   }
-  page->is_dirty_ = is_dirty;
+  page->is_dirty_ = page->is_dirty_ || is_dirty;
   //LOG_INFO("UnpinPage");
   return true;
 }
@@ -121,17 +173,34 @@ bool BufferPoolManager::UnpinPage(page_id_t page_id, bool is_dirty) {
 /*
  * Used to flush a particular page of the buffer pool to disk. Should call the
  * write_page method of the disk manager
- * if page is not found in page table, return false
+ * if page is not found in page table, return false. The log is forced up to
+ * the page lsn first (write ahead logging), a page with changes still in a
+ * private txn log is not written (false)
  * NOTE: make sure page_id != INVALID_PAGE_ID
  */
 bool BufferPoolManager::FlushPage(page_id_t page_id) {
-  std::lock_guard<std::mutex> lck (latch_); 
+  std::unique_lock<std::mutex> lck (latch_); 
   if (page_id == INVALID_PAGE_ID) {
     //LOG_INFO("INVALID_PAGE_ID");
     return false;
   }
   Page *page;
   if (page_table_->Find(page_id, page)) {
+    if (page->InPrivateLog()) {
+      // changed by a private txn log that is not in the log yet, there is
+      // nothing to force (see LogManager::AppendTxnLogRecord)
+      return false;
+    }
+    lsn_t lsn;
+    while ((lsn = GetWriteBackLSN(page)) != INVALID_LSN) {
+      if (!ForceLog(page, lsn, lck)) {
+        // its log can't be made durable, neither can the page
+        return false;
+      }
+    }
+    // cleared first, a change racing with the write keeps the page dirty
+    page->rec_lsn_ = INVALID_LSN;
+    page->is_dirty_ = false;
     disk_manager_->WritePage(page->GetPageId(), page->GetData());
     //LOG_INFO("Flush Page");
     return true;
@@ -150,16 +219,24 @@ bool BufferPoolManager::FlushPage(page_id_t page_id) {
  */
 bool BufferPoolManager::DeletePage(page_id_t page_id) {
   std::lock_guard<std::mutex> lck (latch_); 
+  if (IsCaptured(page_id)) {
+    // deleted by the capture owner, after it logged the other pages
+    page_capture->deleted_pages.insert(page_id);
+    return true;
+  }
   Page *page;
   if (page_table_->Find(page_id, page)) {
     if (page->GetPinCount() > 0) {
       return false;
     }
     page_table_->Remove(page->GetPageId());
+    // the free list owns the frame now, it is no victim any more
+    replacer_->Erase(page);
     page->ResetMemory();
     page->page_id_ = INVALID_PAGE_ID;
     page->pin_count_ = 0;
     page->is_dirty_ = false;
+    page->rec_lsn_ = INVALID_LSN;
     free_list_->push_back(page);
   }
   disk_manager_->DeallocatePage(page_id);
@@ -176,37 +253,155 @@ bool BufferPoolManager::DeletePage(page_id_t page_id) {
  * into page table. return nullptr if all the pages in pool are pinned
  */
 Page *BufferPoolManager::NewPage(page_id_t &page_id) {
-  std::lock_guard<std::mutex> lck (latch_); 
+  std::unique_lock<std::mutex> lck (latch_); 
   Page *res = nullptr;
-  if(!free_list_->empty())
-  {
-    res = free_list_->front();
-    free_list_->pop_front();
-  }
-  else
-  {
-    if(!replacer_->Victim(res))
-    {
-      return nullptr;
-    }
+  if (!FindVictim(res, lck)) {
+    return nullptr;
   }
 
-
   page_id = disk_manager_->AllocatePage();
-  if(res->is_dirty_)
-  {
-    disk_manager_->WritePage(res->page_id_, res->GetData());
-  }
-
-  page_table_->Remove(res->page_id_);
-
   page_table_->Insert(page_id, res);
 
   res->page_id_ = page_id;
   res->is_dirty_ = false;
+  res->rec_lsn_ = INVALID_LSN;
   res->pin_count_ = 1;
   res->ResetMemory();
+  CapturePage(res, true);
 
   return res;
 }
+
+/*
+ * Frame for another page, from the free list first (always). Otherwise the
+ * least recently used unpinned frame, preferring
+ * 1. a clean frame, nothing to write
+ * 2. a frame whose logged changes are all durable already
+ * 3. any frame. If the log is not durable up to its page lsn yet, it is
+ *    forced first (write ahead logging) and the search starts over
+ * so that eviction only waits for a log flush when every frame needs one.
+ * The evicted page is written back and removed from the page table. Must hold
+ * latch_ in lock, it is dropped while the log is forced, so the page table
+ * may have changed when this returns
+ */
+bool BufferPoolManager::FindVictim(Page *&page,
+                                   std::unique_lock<std::mutex> &lock) {
+  for (;;) {
+    if (!free_list_->empty()) {
+      page = free_list_->front();
+      free_list_->pop_front();
+      return true;
+    }
+    bool logging = ENABLE_LOGGING && log_manager_ != nullptr;
+    if (!replacer_->Victim(page, [](Page *const &frame) {
+          return !frame->is_dirty_;
+        })) {
+      lsn_t persistent_lsn = logging ? log_manager_->GetPersistentLSN() : 0;
+      if (!(logging &&
+            replacer_->Victim(page, [&](Page *const &frame) {
+              return frame->rec_lsn_ != INVALID_LSN &&
+                     GetPageLSN(frame) <= persistent_lsn;
+            })) &&
+          !replacer_->Victim(page)) {
+        return false;
+      }
+    }
+    if (page->GetPinCount() != 0) {
+      //LOG_INFO("Page needed to be replaced is pinned");
+      return false;
+    }
+    lsn_t lsn = page->is_dirty_ ? GetWriteBackLSN(page) : INVALID_LSN;
+    if (lsn != INVALID_LSN) {
+      if (!ForceLog(page, lsn, lock)) {
+        return false;
+      }
+      continue;
+    }
+    if (page->is_dirty_) {
+      disk_manager_->WritePage(page->GetPageId(), page->GetData());
+    }
+    page->rec_lsn_ = INVALID_LSN;
+    page_table_->Remove(page->GetPageId());
+    return true;
+  }
+}
+
+/*
+ * lsn the log must be durable up to before page is written back, INVALID_LSN
+ * if it is already (or page has no logged changes). Must hold latch_
+ */
+lsn_t BufferPoolManager::GetWriteBackLSN(Page *page) {
+  if (page->rec_lsn_ == INVALID_LSN || !ENABLE_LOGGING ||
+      log_manager_ == nullptr) {
+    return INVALID_LSN;
+  }
+  lsn_t lsn = GetPageLSN(page);
+  return lsn > log_manager_->GetPersistentLSN() ? lsn : INVALID_LSN;
+}
+
+/*
+ * wait until the log is durable up to lsn, without latch_ (held in lock).
+ * page stays pinned meanwhile, so it is neither evicted nor deleted
+ * @return: false if a log write failed, the page must not be written back
+ */
+bool BufferPoolManager::ForceLog(Page *page, lsn_t lsn,
+                                 std::unique_lock<std::mutex> &lock) {
+  if (page->pin_count_++ == 0) {
+    replacer_->Erase(page);
+  }
+  lock.unlock();
+  bool durable = log_manager_->WaitUntilPersistent(lsn);
+  lock.lock();
+  if (--page->pin_count_ == 0) {
+    replacer_->Insert(page);
+  }
+  return durable;
+}
+
+/*
+ * lsn of the newest logged change of page. The header page has no lsn field,
+ * everything logged so far counts
+ */
+lsn_t BufferPoolManager::GetPageLSN(Page *page) {
+  if (page->GetPageId() == HEADER_PAGE_ID) {
+    return log_manager_->GetNextLSN() - 1;
+  }
+  return page->GetLSN();
+}
+
+/*
+ * Collect page id -> recLSN of every buffered page that has logged changes
+ * not written back yet, for fuzzy checkpoints.
+ * Page modifications append their log record and set the page lsn while
+ * holding the page write latch, so latching every frame once first makes
+ * sure that any change logged before this call shows up in the table.
+ */
+void BufferPoolManager::GetDirtyPageTable(
+    std::unordered_map<page_id_t, lsn_t> &dirty_page_table) {
+  for (size_t i = 0; i < pool_size_; ++i) {
+    pages_[i].RLatch();
+    pages_[i].RUnlatch();
+  }
+  std::lock_guard<std::mutex> lck (latch_);
+  for (size_t i = 0; i < pool_size_; ++i) {
+    lsn_t rec_lsn = pages_[i].rec_lsn_;
+    if (pages_[i].page_id_ != INVALID_PAGE_ID && rec_lsn != INVALID_LSN) {
+      dirty_page_table[pages_[i].page_id_] = rec_lsn;
+    }
+  }
+}
+bool BufferPoolManager::IsRecovering() {
+  LogRecovery *recovery = lazy_recovery_;
+  return recovery != nullptr && recovery->IsRecovering();
+}
+
+/*
+ * Install capture for the calling thread only, other threads are not
+ * recorded
+ */
+void BufferPoolManager::SetPageCapture(PageCapture *capture) {
+  page_capture = capture;
+  page_capture_owner = capture == nullptr ? nullptr : this;
+}
+
 } // namespace cmudb
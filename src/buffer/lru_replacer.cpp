@@ -46,6 +46,23 @@ template <typename T> bool LRUReplacer<T>::Victim(T &value) {
     return true;
 }
 
+/*
+ * Like Victim, but skip the values filter rejects, they keep their place
+ */
+template <typename T>
+bool LRUReplacer<T>::Victim(T &value,
+                            const std::function<bool(const T &)> &filter) {
+	std::lock_guard<std::mutex> lck (mtx_);
+	for (auto iter = vec_.rbegin(); iter != vec_.rend(); ++iter) {
+		if (filter(*iter)) {
+			value = *iter;
+			vec_.erase(std::next(iter).base());
+			return true;
+		}
+	}
+	return false;
+}
+
 /*
  * Remove value from LRU. If removal is successful, return true, otherwise
  * return false
@@ -2,6 +2,23 @@
 
 namespace cmudb {
   std::atomic<bool> ENABLE_LOGGING(false);  // for virtual table
+  bool COMPACT_LOG_HEADER = true;
+  bool COMPRESS_LOG = false;
+  bool PRIVATE_TXN_LOG = false;
+  int LOG_STREAMS = 1;
+  bool LAZY_RECOVERY = false;
+  int LOCK_ESCALATION_THRESHOLD = 1000;
+  bool SLOT_ROW_LOCKS = false;
+  bool EARLY_LOCK_RELEASE = false;
   std::chrono::duration<long long int> LOG_TIMEOUT =
    std::chrono::seconds(1);
+  std::chrono::microseconds GROUP_COMMIT_TIMEOUT =
+   std::chrono::microseconds(1000);
+  std::chrono::milliseconds ASYNC_COMMIT_WINDOW =
+   std::chrono::milliseconds(50);
+  int ASYNC_COMMIT_BYTES = 64 * 1024;
+  std::chrono::duration<long long int> CHECKPOINT_TIMEOUT =
+   std::chrono::seconds(30);
+  std::chrono::milliseconds DEADLOCK_DETECTION_INTERVAL =
+   std::chrono::milliseconds(50);
 }
@@ -3,173 +3,870 @@
  */
 
 #include "concurrency/lock_manager.h"
+#include <algorithm>
 #include <cassert>
+#include <unordered_set>
+#include <vector>
 
 namespace cmudb {
 
-bool LockManager::LockShared(Transaction *txn, const RID &rid) {
-    std::unique_lock<std::mutex> lk(mutex_);
+// can a request in the first mode be granted next to one in the second,
+// indexed by LockMode
+static const bool COMPATIBLE[5][5] = {
+    //          S      X      IS     IX     SIX
+    /* S   */ {true,  false, true,  false, false},
+    /* X   */ {false, false, false, false, false},
+    /* IS  */ {true,  false, true,  true,  true},
+    /* IX  */ {false, false, true,  true,  false},
+    /* SIX */ {false, false, true,  false, false},
+};
+
+static inline bool Compatible(LockMode a, LockMode b) {
+    return COMPATIBLE[static_cast<int>(a)][static_cast<int>(b)];
+}
+
+// does a lock in mode held allow everything one in mode wanted does
+static bool Covers(LockMode held, LockMode wanted) {
+    switch (wanted) {
+    case LockMode::INTENTION_SHARED:
+        return true;
+    case LockMode::INTENTION_EXCLUSIVE:
+        return held == LockMode::INTENTION_EXCLUSIVE ||
+               held == LockMode::SHARED_INTENTION_EXCLUSIVE ||
+               held == LockMode::EXCLUSIVE;
+    case LockMode::SHARED:
+        return held == LockMode::SHARED ||
+               held == LockMode::SHARED_INTENTION_EXCLUSIVE ||
+               held == LockMode::EXCLUSIVE;
+    case LockMode::SHARED_INTENTION_EXCLUSIVE:
+        return held == LockMode::SHARED_INTENTION_EXCLUSIVE ||
+               held == LockMode::EXCLUSIVE;
+    default:
+        return held == LockMode::EXCLUSIVE;
+    }
+}
+
+// does a table lock in mode held lock the page below it in mode wanted too,
+// intention locks lock nothing below
+static bool CoversBelow(LockMode held, LockMode wanted) {
+    if (held == LockMode::EXCLUSIVE) {
+        return true;
+    }
+    return (held == LockMode::SHARED ||
+            held == LockMode::SHARED_INTENTION_EXCLUSIVE) &&
+           (wanted == LockMode::INTENTION_SHARED || wanted == LockMode::SHARED);
+}
+
+// the weakest mode covering both, only S and IX need a third one
+static LockMode Combine(LockMode held, LockMode wanted) {
+    if (Covers(held, wanted)) {
+        return held;
+    }
+    if (Covers(wanted, held)) {
+        return wanted;
+    }
+    return LockMode::SHARED_INTENTION_EXCLUSIVE;
+}
+
+bool LockManager::LockShared(Transaction *txn, const RID &rid,
+                             std::atomic<txn_id_t> *slot_lock) {
     if (txn->GetState() == TransactionState::ABORTED) {
         return false;
     }
     assert(txn->GetState() == TransactionState::GROWING);
     assert(txn->GetSharedLockSet()->count(rid) == 0);
+    if (HoldsLock(txn, rid, LockMode::SHARED)) {
+        return true;
+    }
+
+    if (!Lock(txn, rid, LockMode::SHARED, true, slot_lock)) {
+        return false;
+    }
+    txn->GetSharedLockSet()->insert(rid);
+    CountRowLock(txn, rid);
+    return true;
+}
+
+bool LockManager::LockExclusive(Transaction *txn, const RID &rid,
+                                std::atomic<txn_id_t> *slot_lock) {
+    if (txn->GetState() == TransactionState::ABORTED) {
+        return false;
+    }
+    assert(txn->GetState() == TransactionState::GROWING);
+    assert(txn->GetExclusiveLockSet()->count(rid) == 0);
+    if (HoldsLock(txn, rid, LockMode::EXCLUSIVE)) {
+        return true;
+    }
+
+    if (!LockSlot(txn, rid, slot_lock) &&
+        !Lock(txn, rid, LockMode::EXCLUSIVE, true, slot_lock)) {
+        return false;
+    }
+    txn->GetExclusiveLockSet()->insert(rid);
+    CountRowLock(txn, rid);
+    return true;
+}
+
+bool LockManager::LockUpgrade(Transaction *txn, const RID &rid,
+                              std::atomic<txn_id_t> *slot_lock) {
+    if (txn->GetState() == TransactionState::ABORTED) {
+        return false;
+    }
+    assert(txn->GetState() == TransactionState::GROWING);
+    assert(txn->GetSharedLockSet()->count(rid) != 0);
+
+    if (!Lock(txn, rid, LockMode::EXCLUSIVE, true, slot_lock)) {
+        return false;
+    }
+    txn->GetSharedLockSet()->erase(rid);
+    txn->GetExclusiveLockSet()->insert(rid);
+    return true;
+}
+
+bool LockManager::LockTable(Transaction *txn, page_id_t table_id,
+                            LockMode lock_mode) {
+    return LockObject(txn, TableLockId(table_id), lock_mode);
+}
+
+bool LockManager::LockPage(Transaction *txn, page_id_t table_id,
+                           page_id_t page_id, LockMode lock_mode) {
+    LockMode table_mode = lock_mode == LockMode::INTENTION_SHARED ||
+                          lock_mode == LockMode::SHARED
+                          ? LockMode::INTENTION_SHARED
+                          : LockMode::INTENTION_EXCLUSIVE;
+    if (!LockTable(txn, table_id, table_mode)) {
+        return false;
+    }
+    txn->GetLockedPages()[page_id] = table_id;
+    // a table lock covering the whole page makes the page lock useless
+    if (CoversBelow(txn->GetTableLockSet()[TableLockId(table_id)], lock_mode)) {
+        return true;
+    }
+    return LockObject(txn, PageLockId(page_id), lock_mode);
+}
+
+bool LockManager::LockKey(Transaction *txn, const RID &key_lock,
+                          LockMode lock_mode, bool instant, bool wait) {
+    return LockObject(txn, key_lock, lock_mode, instant, wait);
+}
+
+bool LockManager::HoldsLock(Transaction *txn, const RID &rid,
+                            LockMode lock_mode) {
+    if (txn->GetExclusiveLockSet()->count(rid) != 0 ||
+        (lock_mode == LockMode::SHARED &&
+         txn->GetSharedLockSet()->count(rid) != 0)) {
+        return true;
+    }
+    auto page = txn->GetLockedPages().find(rid.GetPageId());
+    if (page == txn->GetLockedPages().end()) {
+        return false;
+    }
+    auto &table_locks = txn->GetTableLockSet();
+    for (const RID &lock_id : {TableLockId(page->second),
+                               PageLockId(page->first)}) {
+        auto held = table_locks.find(lock_id);
+        if (held != table_locks.end() && Covers(held->second, lock_mode)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    Request request{txn->GetTransactionId(), LockMode::SHARED, false};
-    if (lock_table_.count(rid) == 0) {
-        lock_table_[rid].oldest = txn->GetTransactionId();
-        lock_table_[rid].list.push_back(request);
+bool LockManager::Unlock(Transaction *txn, const RID &rid,
+                         std::atomic<txn_id_t> *slot_lock) {
+    assert(txn->GetSharedLockSet()->count(rid) ||
+           txn->GetExclusiveLockSet()->count(rid) ||
+           txn->GetTableLockSet().count(rid));
+
+    if (strict_2PL_) {
+        if (txn->GetState() != TransactionState::ABORTED &&
+                txn->GetState() != TransactionState::COMMITTED) {
+            txn->SetState(TransactionState::ABORTED);
+            return false;
+        }
+    }
+    if (txn->GetState() == TransactionState::GROWING) {
+        txn->SetState(TransactionState::SHRINKING);
+    }
+
+    if (txn->GetTableLockSet().count(rid) != 0) {
+        Release(txn, rid);
+        Forget(txn, rid);
     } else {
-        // 如果等待队列中没有排他锁，就不需要检测新老程度了，因为这种情况下共享锁都会被授权
-        // 不会出现等待的情况，也就不会死锁
-        if (lock_table_[rid].exclusive_cnt != 0 && txn->GetTransactionId() > lock_table_[rid].oldest) {
+        ReleaseRow(txn, rid, slot_lock);
+    }
+    return true;
+}
+
+/*
+ * Locks are released by shard: the locks of txn are bucketed by shard first,
+ * then each shard latch is taken once for all of its locks.
+ */
+bool LockManager::ReleaseAll(Transaction *txn, lsn_t commit_lsn,
+                             lsn_t persistent_lsn) {
+    if (strict_2PL_) {
+        if (txn->GetState() != TransactionState::ABORTED &&
+                txn->GetState() != TransactionState::COMMITTED) {
             txn->SetState(TransactionState::ABORTED);
             return false;
-        } else {
-            lock_table_[rid].oldest = txn->GetTransactionId();
-            lock_table_[rid].list.push_back(request);
+        }
+    }
+    if (txn->GetState() == TransactionState::GROWING) {
+        txn->SetState(TransactionState::SHRINKING);
+    }
+
+    // locks held in their slot are not in the lock table, their lock words
+    // are left stale
+    std::unordered_set<RID> slot_locks;
+    if (txn->IsSlotLockOwner()) {
+        {
+            std::lock_guard<std::mutex> latch(txn->GetSlotLockLatch());
+            for (const RID &rid : txn->GetSlotLockSet()) {
+                RecordRelease(GetShard(rid), rid, commit_lsn, persistent_lsn);
+            }
+            slot_locks.swap(txn->GetSlotLockSet());
+        }
+        UnregisterSlotOwner(txn);
+    }
+    std::vector<RID> lock_ids[LOCK_TABLE_SHARDS];
+    for (const RID &rid : *txn->GetSharedLockSet()) {
+        lock_ids[GetShardIndex(rid)].push_back(rid);
+    }
+    for (const RID &rid : *txn->GetExclusiveLockSet()) {
+        if (slot_locks.count(rid) == 0) {
+            lock_ids[GetShardIndex(rid)].push_back(rid);
+        }
+    }
+    for (auto &held : txn->GetTableLockSet()) {
+        lock_ids[GetShardIndex(held.first)].push_back(held.first);
+    }
+    for (int i = 0; i < LOCK_TABLE_SHARDS; i++) {
+        if (lock_ids[i].empty()) {
+            continue;
+        }
+        std::lock_guard<std::mutex> latch(shards_[i].mutex);
+        for (const RID &lock_id : lock_ids[i]) {
+            RecordRelease(shards_[i], lock_id, commit_lsn, persistent_lsn);
+            ReleaseLatched(shards_[i], txn, lock_id);
         }
     }
 
-    // 通过条件：前面全是已授权的shared请求
-    Request *cur = nullptr;
-    cv_.wait(lk, [&]() -> bool {
+    txn->GetSharedLockSet()->clear();
+    txn->GetExclusiveLockSet()->clear();
+    txn->GetTableLockSet().clear();
+    txn->GetLockedPages().clear();
+    txn->GetRowLockCounts().clear();
+    return true;
+}
 
-        for (auto it = lock_table_[rid].list.begin();
-                it != lock_table_[rid].list.end(); ++it) {
-            if (it->txn_id != txn->GetTransactionId()) {
-                if (it->lock_mode != LockMode::SHARED || it->granted) {
-                    return false;
-                }
-            } else {
-                cur = &(*it);
+/*
+ * A new request joins the end of the queue and is granted once every request
+ * before it is granted and compatible with it (FIFO). An upgrade keeps its
+ * place and is granted once every other granted request is compatible with
+ * the new mode. While it waits policy_ breaks deadlocks.
+ */
+bool LockManager::Lock(Transaction *txn, const RID &lock_id,
+                       LockMode lock_mode, bool wait,
+                       std::atomic<txn_id_t> *slot_lock) {
+    Shard &shard = GetShard(lock_id);
+    std::unique_lock<std::mutex> lk(shard.mutex);
+    bool created = shard.lock_table.count(lock_id) == 0;
+    WaitList &wait_list = shard.lock_table[lock_id];
+    if (created) {
+        // from now on the row is taken in the lock table only
+        contended_[GetContendedIndex(lock_id)]++;
+        InflateSlot(shard, lock_id, slot_lock, wait_list);
+    }
+    txn_id_t txn_id = txn->GetTransactionId();
+
+    auto cur = wait_list.list.begin();
+    while (cur != wait_list.list.end() && cur->txn != txn) {
+        ++cur;
+    }
+    bool upgrade = cur != wait_list.list.end();
+    if (upgrade) {
+        lock_mode = Combine(cur->lock_mode, lock_mode);
+        if (lock_mode == cur->lock_mode) {
+            return true;
+        }
+        cur->wanted = lock_mode;
+    } else {
+        cur = NewRequest(shard, wait_list.list, wait_list.list.end(), txn,
+                         lock_mode, false);
+    }
+
+    bool waiting = false;
+    bool granted = false;
+    std::vector<Transaction *> blockers;
+    while (true) {
+        blockers.clear();
+        GetBlockers(wait_list.list, cur, blockers);
+        if (blockers.empty()) {
+            granted = true;
+            break;
+        }
+        // aborted by an older txn or by the deadlock detector
+        if (!wait || txn->GetState() == TransactionState::ABORTED) {
+            break;
+        }
+        if (policy_ == DeadlockPolicy::WAIT_DIE) {
+            bool die = false;
+            for (Transaction *blocker : blockers) {
+                die = die || blocker->GetTransactionId() < txn_id;
+            }
+            if (die) {
+                Abort(txn, AbortReason::DIED);
                 break;
             }
+        } else if (policy_ == DeadlockPolicy::WOUND_WAIT) {
+            std::vector<Transaction *> wounded;
+            for (Transaction *blocker : blockers) {
+                if (blocker->GetTransactionId() > txn_id &&
+                    Abort(blocker, AbortReason::WOUNDED)) {
+                    wounded.push_back(blocker);
+                }
+            }
+            // the wounded may wait in another shard
+            if (!wounded.empty()) {
+                lk.unlock();
+                for (Transaction *victim : wounded) {
+                    WakeUp(victim);
+                }
+                lk.lock();
+            }
         }
-        return true;
-    });
+        if (!waiting) {
+            // checks the state once more before waiting, see WakeUp
+            std::lock_guard<std::mutex> latch(waiting_latch_);
+            waiting_.emplace(txn_id, lock_id);
+            waiting = true;
+            continue;
+        }
+        wait_list.cv.wait(lk);
+    }
+    if (waiting) {
+        std::lock_guard<std::mutex> latch(waiting_latch_);
+        waiting_.erase(txn_id);
+    }
 
+    if (!granted) {
+        if (upgrade) {
+            cur->wanted = cur->lock_mode;
+        } else {
+            FreeRequest(shard, wait_list.list, cur);
+            if (wait_list.list.empty()) {
+                shard.lock_table.erase(lock_id);
+                contended_[GetContendedIndex(lock_id)]--;
+                return false;
+            }
+        }
+        wait_list.cv.notify_all();
+        return false;
+    }
+    cur->lock_mode = lock_mode;
+    cur->wanted = lock_mode;
     cur->granted = true;
-    txn->GetSharedLockSet()->insert(rid);
+    txn->AddDependency(GetReleaseLSN(shard, lock_id));
+    // 条件已经发生了变化，后面的请求可能有机会获取
+    wait_list.cv.notify_all();
+    return true;
+}
+
+/*
+ * release_latch is taken last, under a shard latch or the slot lock latch of
+ * a txn, and nothing else is taken while holding it.
+ */
+void LockManager::RecordRelease(Shard &shard, const RID &lock_id,
+                                lsn_t commit_lsn, lsn_t persistent_lsn) {
+    if (commit_lsn == INVALID_LSN) {
+        return;
+    }
+    std::lock_guard<std::mutex> latch(shard.release_latch);
+    if (shard.release_lsns.size() >= RELEASE_LSNS) {
+        for (auto it = shard.release_lsns.begin();
+             it != shard.release_lsns.end();) {
+            if (it->second <= persistent_lsn) {
+                it = shard.release_lsns.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    lsn_t &release_lsn =
+            shard.release_lsns.emplace(lock_id, INVALID_LSN).first->second;
+    release_lsn = std::max(release_lsn, commit_lsn);
+}
+
+lsn_t LockManager::GetReleaseLSN(Shard &shard, const RID &lock_id) {
+    std::lock_guard<std::mutex> latch(shard.release_latch);
+    auto it = shard.release_lsns.find(lock_id);
+    return it == shard.release_lsns.end() ? INVALID_LSN : it->second;
+}
+
+std::list<LockManager::Request>::iterator
+LockManager::NewRequest(Shard &shard, std::list<Request> &list,
+                        std::list<Request>::iterator pos, Transaction *txn,
+                        LockMode lock_mode, bool granted) {
+    if (shard.free_requests.empty()) {
+        return list.emplace(pos, txn, lock_mode, granted);
+    }
+    auto request = shard.free_requests.begin();
+    *request = Request(txn, lock_mode, granted);
+    list.splice(pos, shard.free_requests, request);
+    return request;
+}
+
+void LockManager::FreeRequest(Shard &shard, std::list<Request> &list,
+                              std::list<Request>::iterator request) {
+    if (shard.free_requests.size() >= FREE_REQUESTS) {
+        list.erase(request);
+        return;
+    }
+    shard.free_requests.splice(shard.free_requests.begin(), list, request);
+}
 
-    // 条件已经发生了变化，其他共享锁请求有机会获取
-    cv_.notify_all();
+void LockManager::GetBlockers(std::list<Request> &list,
+                              std::list<Request>::iterator cur,
+                              std::vector<Transaction *> &blockers) {
+    bool upgrade = cur->granted;
+    for (auto it = list.begin(); it != list.end(); ++it) {
+        if (it == cur) {
+            if (!upgrade) {
+                break;
+            }
+            continue;
+        }
+        if (upgrade ? it->granted && !Compatible(it->lock_mode, cur->wanted)
+                    : !it->granted || !Compatible(it->lock_mode, cur->wanted)) {
+            blockers.push_back(it->txn);
+        }
+    }
+}
+
+bool LockManager::Abort(Transaction *victim, AbortReason reason) {
+    if (!victim->Kill()) {
+        return false;
+    }
+    aborts_[static_cast<int>(reason)]++;
     return true;
 }
 
-bool LockManager::LockExclusive(Transaction *txn, const RID &rid) {
-    std::unique_lock<std::mutex> lk(mutex_);
-    if (txn->GetState() == TransactionState::ABORTED) {
+/*
+ * The victim registers in waiting_ before its last state check and checks
+ * and waits under its shard latch, so it either sees its new state or is
+ * already waiting when it is notified here.
+ */
+void LockManager::WakeUp(Transaction *victim) {
+    RID lock_id;
+    {
+        std::lock_guard<std::mutex> latch(waiting_latch_);
+        auto it = waiting_.find(victim->GetTransactionId());
+        if (it == waiting_.end()) {
+            return;
+        }
+        lock_id = it->second;
+    }
+    Shard &shard = GetShard(lock_id);
+    std::lock_guard<std::mutex> latch(shard.mutex);
+    auto entry = shard.lock_table.find(lock_id);
+    if (entry != shard.lock_table.end()) {
+        entry->second.cv.notify_all();
+    }
+}
+
+// @return: whether the graph has a cycle reachable from node, found by depth
+// first search. The cycle is left at the end of path
+static bool FindCycle(
+    txn_id_t node,
+    std::unordered_map<txn_id_t, std::vector<txn_id_t>> &graph,
+    std::unordered_map<txn_id_t, int> &state, std::vector<txn_id_t> &path) {
+    // 1: on path, 2: done
+    auto edges = graph.find(node);
+    if (edges == graph.end()) {
+        // waits for nobody
         return false;
     }
-    assert(txn->GetState() == TransactionState::GROWING);
-    assert(txn->GetExclusiveLockSet()->count(rid) == 0);
+    state[node] = 1;
+    path.push_back(node);
+    for (txn_id_t next : edges->second) {
+        if (state[next] == 1) {
+            path.erase(path.begin(),
+                       std::find(path.begin(), path.end(), next));
+            return true;
+        }
+        if (state[next] == 0 && FindCycle(next, graph, state, path)) {
+            return true;
+        }
+    }
+    state[node] = 2;
+    path.pop_back();
+    return false;
+}
 
-    Request request{txn->GetTransactionId(), LockMode::EXCLUSIVE, false};
-    if (lock_table_.count(rid) == 0) {
-        lock_table_[rid].oldest = txn->GetTransactionId();
-        lock_table_[rid].list.push_back(request);
-    } else {
-        if (txn->GetTransactionId() > lock_table_[rid].oldest) {
-            txn->SetState(TransactionState::ABORTED);
-            return false;
-        } else {
-            lock_table_[rid].oldest = txn->GetTransactionId();
-            lock_table_[rid].list.push_back(request);
-        }
-    }
-    // 通过条件：当前请求之前没有任何已授权的请求
-    Request *cur = nullptr;
-    cv_.wait(lk, [&]() -> bool {
-        for (auto it = lock_table_[rid].list.begin();
-                it != lock_table_[rid].list.end(); ++it) {
-            if (it->txn_id != txn->GetTransactionId()) {
-                if (it->granted) {
-                    return false;
+/*
+ * Every shard is latched while the waits-for graph is built and its cycles
+ * are broken, so the transactions in it can not move on meanwhile.
+ */
+int LockManager::DetectDeadlocks() {
+    std::vector<std::unique_lock<std::mutex>> latches;
+    for (Shard &shard : shards_) {
+        latches.emplace_back(shard.mutex);
+    }
+
+    // waiting txn -> the txns it waits for
+    std::unordered_map<txn_id_t, std::vector<txn_id_t>> graph;
+    std::unordered_map<txn_id_t, Transaction *> txns;
+    std::unordered_map<txn_id_t, WaitList *> waits_in;
+    std::vector<Transaction *> blockers;
+    for (Shard &shard : shards_) {
+        for (auto &entry : shard.lock_table) {
+            auto &list = entry.second.list;
+            for (auto it = list.begin(); it != list.end(); ++it) {
+                if ((it->granted && it->wanted == it->lock_mode) ||
+                    it->txn->GetState() == TransactionState::ABORTED) {
+                    continue;
                 }
-            } else {
-                cur = &(*it);
+                txn_id_t txn_id = it->txn->GetTransactionId();
+                txns[txn_id] = it->txn;
+                waits_in[txn_id] = &entry.second;
+                blockers.clear();
+                GetBlockers(list, it, blockers);
+                for (Transaction *blocker : blockers) {
+                    // an aborted blocker releases its locks soon
+                    if (blocker->GetState() != TransactionState::ABORTED) {
+                        graph[txn_id].push_back(blocker->GetTransactionId());
+                        txns[blocker->GetTransactionId()] = blocker;
+                    }
+                }
+            }
+        }
+    }
+
+    auto cost = [&](txn_id_t txn_id) {
+        Transaction *txn = txns[txn_id];
+        return txn->GetSharedLockSet()->size() +
+               txn->GetExclusiveLockSet()->size() +
+               txn->GetTableLockSet().size();
+    };
+    int victims = 0;
+    while (true) {
+        std::unordered_map<txn_id_t, int> state;
+        std::vector<txn_id_t> cycle;
+        for (auto &node : graph) {
+            if (state[node.first] == 0 &&
+                FindCycle(node.first, graph, state, cycle)) {
                 break;
             }
         }
-        return true;
-    });
+        if (cycle.empty()) {
+            break;
+        }
+        txn_id_t victim = cycle.front();
+        for (txn_id_t txn_id : cycle) {
+            if (cost(txn_id) < cost(victim) ||
+                (cost(txn_id) == cost(victim) && txn_id > victim)) {
+                victim = txn_id;
+            }
+        }
+        // only waiting txns are on a cycle, their shard is latched here
+        if (Abort(txns[victim], AbortReason::DEADLOCK)) {
+            waits_in[victim]->cv.notify_all();
+            victims++;
+        }
+        graph.erase(victim);
+    }
+    return victims;
+}
 
-    cur->granted = true;
-    lock_table_[rid].exclusive_cnt++;
-    txn->GetExclusiveLockSet()->insert(rid);
+void LockManager::RunDetectionThread() {
+    std::lock_guard<std::mutex> lock(detection_latch_);
+    if (running_) {
+        return;
+    }
+    running_ = true;
+    detection_thread_ = std::thread([this] {
+        std::unique_lock<std::mutex> lock(detection_latch_);
+        while (running_) {
+            if (!detection_cv_.wait_for(lock, DEADLOCK_DETECTION_INTERVAL,
+                                        [&] { return !running_; })) {
+                lock.unlock();
+                DetectDeadlocks();
+                lock.lock();
+            }
+        }
+    });
+}
 
-    // 授权一个排它锁后，无论共享锁还是排它锁都不可能有机会获取，所以不需要notify
-    return true;
+void LockManager::StopDetectionThread() {
+    {
+        std::lock_guard<std::mutex> lock(detection_latch_);
+        if (!running_) {
+            return;
+        }
+        running_ = false;
+    }
+    detection_cv_.notify_one();
+    detection_thread_.join();
 }
 
-bool LockManager::LockUpgrade(Transaction *txn, const RID &rid) {
-    std::unique_lock<std::mutex> lk(mutex_);
+bool LockManager::LockObject(Transaction *txn, const RID &lock_id,
+                             LockMode lock_mode, bool instant, bool wait) {
+    // rolling back an aborted txn still goes through the locks it holds
+    auto &table_locks = txn->GetTableLockSet();
+    auto held = table_locks.find(lock_id);
+    if (held != table_locks.end() && Covers(held->second, lock_mode)) {
+        return true;
+    }
     if (txn->GetState() == TransactionState::ABORTED) {
         return false;
     }
     assert(txn->GetState() == TransactionState::GROWING);
-    assert(txn->GetSharedLockSet()->count(rid) != 0);
 
-    // 通过条件：想要升级的这个shared请求是唯一一个granted请求
-    cv_.wait(lk, [&]() -> bool {
-        for (auto it = lock_table_[rid].list.begin();
-                it != lock_table_[rid].list.end(); ++it) {
-            if (it == lock_table_[rid].list.begin() && it->txn_id != txn->GetTransactionId()) {
-                return false;
-            }
-            if (it != lock_table_[rid].list.begin() && it->granted) {
-                return false;
-            }
-        }
+    if (!Lock(txn, lock_id, lock_mode, wait)) {
+        return false;
+    }
+    // an upgrade of a held lock is kept
+    if (instant && held == table_locks.end()) {
+        Release(txn, lock_id);
         return true;
-    });
-
-    auto cur = lock_table_[rid].list.begin();
-    cur->lock_mode = LockMode::EXCLUSIVE;
-    lock_table_[rid].exclusive_cnt++;
-    txn->GetSharedLockSet()->erase(rid);
-    txn->GetExclusiveLockSet()->insert(rid);
+    }
+    table_locks[lock_id] = held == table_locks.end()
+                           ? lock_mode : Combine(held->second, lock_mode);
     return true;
 }
 
-bool LockManager::Unlock(Transaction *txn, const RID &rid) {
-    std::unique_lock<std::mutex> latch(mutex_);
-    assert(txn->GetSharedLockSet()->count(rid) || txn->GetExclusiveLockSet()->count(rid));
+void LockManager::Release(Transaction *txn, const RID &lock_id) {
+    Shard &shard = GetShard(lock_id);
+    std::lock_guard<std::mutex> latch(shard.mutex);
+    ReleaseLatched(shard, txn, lock_id);
+}
 
-    if (strict_2PL_) {
-        if (txn->GetState() != TransactionState::ABORTED ||
-                txn->GetState() != TransactionState::COMMITTED) {
-            txn->SetState(TransactionState::ABORTED);
-            return false;
+void LockManager::ReleaseLatched(Shard &shard, Transaction *txn,
+                                 const RID &lock_id) {
+    auto entry = shard.lock_table.find(lock_id);
+    if (entry == shard.lock_table.end()) {
+        return;
+    }
+    WaitList &wait_list = entry->second;
+    for (auto it = wait_list.list.begin();
+            it != wait_list.list.end(); ++it) {
+        if (it->txn == txn) {
+            FreeRequest(shard, wait_list.list, it);
+            break;
         }
     }
-    if (txn->GetState() == TransactionState::GROWING) {
-        txn->SetState(TransactionState::SHRINKING);
+    // nobody waits for it
+    if (wait_list.list.empty()) {
+        shard.lock_table.erase(entry);
+        contended_[GetContendedIndex(lock_id)]--;
+        return;
+    }
+    wait_list.cv.notify_all();
+}
+
+void LockManager::Forget(Transaction *txn, const RID &lock_id) {
+    if (txn->GetTableLockSet().erase(lock_id) != 0) {
+        return;
+    }
+    if (txn->GetSharedLockSet()->erase(lock_id) == 0 &&
+        txn->GetExclusiveLockSet()->erase(lock_id) == 0) {
+        return;
+    }
+    auto page = txn->GetLockedPages().find(lock_id.GetPageId());
+    if (page != txn->GetLockedPages().end()) {
+        txn->GetRowLockCounts()[page->second]--;
+    }
+}
+
+void LockManager::CountRowLock(Transaction *txn, const RID &rid) {
+    auto page = txn->GetLockedPages().find(rid.GetPageId());
+    if (page == txn->GetLockedPages().end()) {
+        return;
+    }
+    int count = ++txn->GetRowLockCounts()[page->second];
+    // retried every threshold row locks if the table lock was not free
+    if (count % LOCK_ESCALATION_THRESHOLD == 0) {
+        Escalate(txn, page->second);
+    }
+}
+
+/*
+ * Trade the row locks of txn on the table for a table lock: S if they are
+ * all shared, X otherwise. Escalation never waits, a busy table keeps the
+ * row locks. Rows held in their slot stay there, they take no room in the
+ * lock table, and their lock words (whose pages may be gone from the buffer
+ * pool by now) would be left stale.
+ */
+void LockManager::Escalate(Transaction *txn, page_id_t table_id) {
+    auto &pages = txn->GetLockedPages();
+    auto in_table = [&](const RID &rid) {
+        auto page = pages.find(rid.GetPageId());
+        return page != pages.end() && page->second == table_id;
+    };
+    std::vector<RID> rows;
+    bool exclusive = false;
+    {
+        std::lock_guard<std::mutex> latch(txn->GetSlotLockLatch());
+        for (const RID &rid : *txn->GetExclusiveLockSet()) {
+            if (in_table(rid)) {
+                exclusive = true;
+                if (txn->GetSlotLockSet().count(rid) == 0) {
+                    rows.push_back(rid);
+                }
+            }
+        }
+    }
+    for (const RID &rid : *txn->GetSharedLockSet()) {
+        if (in_table(rid)) {
+            rows.push_back(rid);
+        }
     }
 
-    for (auto it = lock_table_[rid].list.begin();
-            it != lock_table_[rid].list.end(); ++it) {
-        if (it->txn_id == txn->GetTransactionId()) {
-            if (it->lock_mode == LockMode::SHARED) {
-                txn->GetSharedLockSet()->erase(rid);
+    RID lock_id = TableLockId(table_id);
+    auto held = txn->GetTableLockSet().find(lock_id);
+    if (held == txn->GetTableLockSet().end()) {
+        return;
+    }
+    LockMode lock_mode = Combine(held->second, exclusive ? LockMode::EXCLUSIVE
+                                                          : LockMode::SHARED);
+    if (!Lock(txn, lock_id, lock_mode, false)) {
+        return;
+    }
+    held->second = lock_mode;
+    for (const RID &rid : rows) {
+        Release(txn, rid);
+        Forget(txn, rid);
+    }
+}
+
+void LockManager::ReleaseRow(Transaction *txn, const RID &rid,
+                             std::atomic<txn_id_t> *slot_lock) {
+    if (!UnlockSlot(txn, rid, slot_lock)) {
+        Release(txn, rid);
+    }
+    Forget(txn, rid);
+}
+
+/*
+ * The lock word is set before the contended counter of the row is read, and
+ * the first request in the lock table bumps the counter before it reads the
+ * word (see Lock), so at least one of them sees the other: either the slot
+ * lock is given up here, or InflateSlot finds it. The slot lock latch of txn
+ * is held until the lock is in its slot lock set, where InflateSlot looks.
+ */
+bool LockManager::LockSlot(Transaction *txn, const RID &rid,
+                           std::atomic<txn_id_t> *slot_lock) {
+    if (!SLOT_ROW_LOCKS || slot_lock == nullptr || IsContended(rid)) {
+        return false;
+    }
+    txn_id_t owner = slot_lock->load();
+    if (owner != INVALID_TXN_ID && !ClearStaleSlot(rid, slot_lock, owner)) {
+        return false;
+    }
+    RegisterSlotOwner(txn);
+    bool locked = false;
+    bool none = false;
+    {
+        std::lock_guard<std::mutex> latch(txn->GetSlotLockLatch());
+        txn_id_t free = INVALID_TXN_ID;
+        if (slot_lock->compare_exchange_strong(free, txn->GetTransactionId())) {
+            if (IsContended(rid)) {
+                slot_lock->store(INVALID_TXN_ID);
             } else {
-                txn->GetExclusiveLockSet()->erase(rid);
-                lock_table_[rid].exclusive_cnt--;
+                txn->GetSlotLockSet().insert(rid);
+                txn->AddDependency(GetReleaseLSN(GetShard(rid), rid));
+                locked = true;
             }
-            lock_table_[rid].list.erase(it);
-            break;
         }
+        none = txn->GetSlotLockSet().empty();
+    }
+    // an owner stays registered only as long as it may hold slot locks
+    if (none) {
+        UnregisterSlotOwner(txn);
     }
-    // 更新oldest
-    for (auto it = lock_table_[rid].list.begin();
-            it != lock_table_[rid].list.end(); ++it) {
-        if (it->txn_id < lock_table_[rid].oldest) {
-            lock_table_[rid].oldest = it->txn_id;
+    return locked;
+}
+
+bool LockManager::UnlockSlot(Transaction *txn, const RID &rid,
+                             std::atomic<txn_id_t> *slot_lock) {
+    if (!txn->IsSlotLockOwner()) {
+        return false;
+    }
+    bool held;
+    bool last;
+    {
+        std::lock_guard<std::mutex> latch(txn->GetSlotLockLatch());
+        held = txn->GetSlotLockSet().erase(rid) != 0;
+        if (held && slot_lock != nullptr) {
+            txn_id_t owner = txn->GetTransactionId();
+            slot_lock->compare_exchange_strong(owner, INVALID_TXN_ID);
         }
+        last = txn->GetSlotLockSet().empty();
     }
-    cv_.notify_all();
+    if (last) {
+        UnregisterSlotOwner(txn);
+    }
+    return held;
+}
+
+void LockManager::InflateSlot(Shard &shard, const RID &rid,
+                              std::atomic<txn_id_t> *slot_lock,
+                              WaitList &wait_list) {
+    if (slot_lock == nullptr) {
+        return;
+    }
+    txn_id_t owner_id = slot_lock->load();
+    if (owner_id == INVALID_TXN_ID) {
+        return;
+    }
+    std::lock_guard<std::mutex> owners_latch(slot_owners_latch_);
+    auto owner = slot_owners_.find(owner_id);
+    if (owner == slot_owners_.end()) {
+        return;
+    }
+    Transaction *txn = owner->second;
+    std::lock_guard<std::mutex> latch(txn->GetSlotLockLatch());
+    if (txn->GetSlotLockSet().erase(rid) != 0) {
+        NewRequest(shard, wait_list.list, wait_list.list.begin(), txn,
+                   LockMode::EXCLUSIVE, true);
+    }
+}
+
+/*
+ * The owner can neither register nor take a slot lock while the word is
+ * checked and cleared here.
+ */
+bool LockManager::ClearStaleSlot(const RID &rid,
+                                 std::atomic<txn_id_t> *slot_lock,
+                                 txn_id_t owner_id) {
+    std::lock_guard<std::mutex> owners_latch(slot_owners_latch_);
+    auto owner = slot_owners_.find(owner_id);
+    if (owner == slot_owners_.end()) {
+        slot_lock->compare_exchange_strong(owner_id, INVALID_TXN_ID);
+        return true;
+    }
+    Transaction *txn = owner->second;
+    std::lock_guard<std::mutex> latch(txn->GetSlotLockLatch());
+    if (txn->GetSlotLockSet().count(rid) != 0) {
+        return false;
+    }
+    slot_lock->compare_exchange_strong(owner_id, INVALID_TXN_ID);
     return true;
 }
 
-} // namespace cmudb
\ No newline at end of file
+void LockManager::RegisterSlotOwner(Transaction *txn) {
+    if (txn->IsSlotLockOwner()) {
+        return;
+    }
+    std::lock_guard<std::mutex> latch(slot_owners_latch_);
+    slot_owners_[txn->GetTransactionId()] = txn;
+    txn->SetSlotLockOwner(true);
+}
+
+void LockManager::UnregisterSlotOwner(Transaction *txn) {
+    std::lock_guard<std::mutex> latch(slot_owners_latch_);
+    slot_owners_.erase(txn->GetTransactionId());
+    txn->SetSlotLockOwner(false);
+}
+
+} // namespace cmudb
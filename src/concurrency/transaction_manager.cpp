@@ -2,14 +2,23 @@
  * transaction_manager.cpp
  *
  */
+#include "common/exception.h"
 #include "concurrency/transaction_manager.h"
 #include "table/table_heap.h"
 
+#include <algorithm>
 #include <cassert>
 namespace cmudb {
 
-Transaction *TransactionManager::Begin() {
+Transaction *TransactionManager::Begin(bool read_only) {
   Transaction *txn = new Transaction(next_txn_id_++);
+  txn->SetAsyncCommit(async_commit_);
+  if (read_only && version_store_ != nullptr) {
+    std::lock_guard<std::mutex> lock(ts_latch_);
+    txn->SetReadTimestamp(last_commit_ts_);
+    snapshots_.insert(last_commit_ts_);
+    return txn;
+  }
 
   if (ENABLE_LOGGING) {
     // TODO: write log and update transaction's prev_lsn here
@@ -17,6 +26,8 @@ Transaction *TransactionManager::Begin() {
                     LogRecordType::BEGIN);
       lsn_t lsn = log_manager_->AppendLogRecord(log);
       txn->SetPrevLSN(lsn);
+      std::lock_guard<std::mutex> lock(active_latch_);
+      active_txns_[txn->GetTransactionId()] = std::make_pair(txn, lsn);
   }
 
   return txn;
@@ -24,7 +35,20 @@ Transaction *TransactionManager::Begin() {
 
 void TransactionManager::Commit(Transaction *txn) {
   txn->SetState(TransactionState::COMMITTED);
-  // truly delete before commit
+  if (txn->IsReadOnly()) {
+    EndSnapshot(txn);
+    return;
+  }
+  timestamp_t commit_ts = INVALID_TIMESTAMP;
+  if (version_store_ != nullptr) {
+    // the place of txn among the commits, taken while it still holds its
+    // row locks and before deletes free their slots, so whoever changes its
+    // rows next commits after it. Snapshots see it once it is published
+    std::lock_guard<std::mutex> lock(ts_latch_);
+    commit_ts = ++issued_commit_ts_;
+    pending_commits_.insert(commit_ts);
+  }
+  // truly delete before commit, each delete publishes the private log first
   auto write_set = txn->GetWriteSet();
   while (!write_set->empty()) {
     auto &item = write_set->back();
@@ -41,24 +65,52 @@ void TransactionManager::Commit(Transaction *txn) {
     // TODO: write log and update transaction's prev_lsn here
       LogRecord log(txn->GetTransactionId(), txn->GetPrevLSN(),
                     LogRecordType::COMMIT);
-      lsn_t lsn = log_manager_->AppendLogRecord(log);
-      txn->SetPrevLSN(lsn);
+      // the rest of the private log goes out with the commit record
+      lsn_t lsn = log_manager_->PublishTxnLog(txn, &log);
+      {
+        std::lock_guard<std::mutex> lock(active_latch_);
+        active_txns_.erase(txn->GetTransactionId());
+      }
+      if (EARLY_LOCK_RELEASE) {
+        // the commit is decided, only its durability is pending: whoever
+        // takes the locks now waits for lsn too
+        lock_manager_->ReleaseAll(txn, lsn,
+                                  log_manager_->GetPersistentLSN());
+      }
+      // the changes txn read from early released locks are durable first
+      lsn = std::max(lsn, txn->GetDependencyLSN());
+      if (txn->IsAsyncCommit()) {
+        // the flush thread makes it durable within the async commit window
+        log_manager_->FlushAsync(lsn);
+      } else if (!log_manager_->WaitUntilPersistent(lsn)) {
+        // group commit: the flush thread batches concurrent commits. The
+        // log can't be written anymore, the commit may be lost in a crash
+        // so snapshots never see it
+        PublishCommit(txn, commit_ts, false);
+        if (!EARLY_LOCK_RELEASE) {
+          lock_manager_->ReleaseAll(txn);
+        }
+        throw Exception(EXCEPTION_TYPE_TRANSACTION,
+                        "commit is not durable, log write failed");
+      }
+      PublishCommit(txn, commit_ts, true);
+      if (EARLY_LOCK_RELEASE) {
+        return;
+      }
+  } else {
+    PublishCommit(txn, commit_ts, true);
   }
 
   // release all the lock
-  std::unordered_set<RID> lock_set;
-  for (auto item : *txn->GetSharedLockSet())
-    lock_set.emplace(item);
-  for (auto item : *txn->GetExclusiveLockSet())
-    lock_set.emplace(item);
-  // release all the lock
-  for (auto locked_rid : lock_set) {
-    lock_manager_->Unlock(txn, locked_rid);
-  }
+  lock_manager_->ReleaseAll(txn);
 }
 
 void TransactionManager::Abort(Transaction *txn) {
   txn->SetState(TransactionState::ABORTED);
+  if (txn->IsReadOnly()) {
+    EndSnapshot(txn);
+    return;
+  }
   // rollback before releasing lock
   auto write_set = txn->GetWriteSet();
   while (!write_set->empty()) {
@@ -77,24 +129,82 @@ void TransactionManager::Abort(Transaction *txn) {
     write_set->pop_back();
   }
   write_set->clear();
+  // the rows are back as they were before txn
+  if (version_store_ != nullptr) {
+    version_store_->Abort(txn->GetTransactionId());
+  }
 
   if (ENABLE_LOGGING) {
     // TODO: write log and update transaction's prev_lsn here
       LogRecord log(txn->GetTransactionId(), txn->GetPrevLSN(),
                     LogRecordType::ABORT);
-      lsn_t lsn = log_manager_->AppendLogRecord(log);
-      txn->SetPrevLSN(lsn);
+      log_manager_->PublishTxnLog(txn, &log);
+      std::lock_guard<std::mutex> lock(active_latch_);
+      active_txns_.erase(txn->GetTransactionId());
   }
 
   // release all the lock
-  std::unordered_set<RID> lock_set;
-  for (auto item : *txn->GetSharedLockSet())
-    lock_set.emplace(item);
-  for (auto item : *txn->GetExclusiveLockSet())
-    lock_set.emplace(item);
-  // release all the lock
-  for (auto locked_rid : lock_set) {
-    lock_manager_->Unlock(txn, locked_rid);
+  lock_manager_->ReleaseAll(txn);
+}
+
+/*
+ * Snapshots read at last_commit_ts_, it only moves past a commit timestamp
+ * once every commit up to it is published. A commit published ahead of an
+ * older one has its versions marked already, snapshots taken in between
+ * read at a timestamp before both and step over them.
+ */
+void TransactionManager::PublishCommit(Transaction *txn, timestamp_t commit_ts,
+                                       bool durable) {
+  if (version_store_ == nullptr) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(ts_latch_);
+  pending_commits_.erase(commit_ts);
+  last_commit_ts_ = pending_commits_.empty() ? issued_commit_ts_
+                                             : *pending_commits_.begin() - 1;
+  if (durable) {
+    version_store_->Commit(txn->GetTransactionId(), commit_ts,
+                           snapshots_.empty() ? last_commit_ts_
+                                              : *snapshots_.begin());
+  }
+}
+
+void TransactionManager::EndSnapshot(Transaction *txn) {
+  timestamp_t oldest_ts;
+  {
+    std::lock_guard<std::mutex> lock(ts_latch_);
+    snapshots_.erase(snapshots_.find(txn->GetReadTimestamp()));
+    oldest_ts = snapshots_.empty() ? last_commit_ts_ : *snapshots_.begin();
+    // the oldest snapshot is still running
+    if (oldest_ts <= txn->GetReadTimestamp()) {
+      return;
+    }
+  }
+  version_store_->Prune(oldest_ts);
+}
+
+/*
+ * BEGIN/COMMIT/ABORT are appended without the latch, the table is updated
+ * right after. A transaction still in the table may have appended its
+ * COMMIT/ABORT already, which comes after its BEGIN so the checkpoint's
+ * recovery offset still covers it. One whose BEGIN is appended but that is
+ * not in the table yet has no other log record, recovery copes with a
+ * transaction whose BEGIN it does not read.
+ * The last lsn of a running transaction is only exact for log records whose
+ * page latch was released before this call (see
+ * BufferPoolManager::GetDirtyPageTable), the checkpoint takes care of that.
+ */
+void TransactionManager::GetActiveTxnTable(
+    std::vector<std::pair<txn_id_t, lsn_t>> &active_txn_table,
+    lsn_t &oldest_lsn) {
+  std::lock_guard<std::mutex> lock(active_latch_);
+  oldest_lsn = INVALID_LSN;
+  for (auto &entry : active_txns_) {
+    active_txn_table.emplace_back(entry.first,
+                                  entry.second.first->GetPrevLSN());
+    if (oldest_lsn == INVALID_LSN || entry.second.second < oldest_lsn) {
+      oldest_lsn = entry.second.second;
+    }
   }
 }
 } // namespace cmudb
@@ -0,0 +1,123 @@
+/**
+ * version_store.cpp
+ */
+
+#include "concurrency/version_store.h"
+
+namespace cmudb {
+
+void VersionStore::AddVersion(txn_id_t writer, const RID &rid,
+                              const Tuple *before) {
+  std::lock_guard<std::mutex> latch(latch_);
+  chains_[rid].emplace_back(writer, before != nullptr,
+                            before != nullptr ? *before : Tuple());
+  writes_[writer].push_back(rid);
+}
+
+void VersionStore::Commit(txn_id_t writer, timestamp_t commit_ts,
+                          timestamp_t oldest_ts) {
+  std::lock_guard<std::mutex> latch(latch_);
+  auto writes = writes_.find(writer);
+  if (writes == writes_.end()) {
+    return;
+  }
+  for (const RID &rid : writes->second) {
+    for (auto &version : chains_[rid]) {
+      if (version.writer == writer) {
+        version.commit_ts = commit_ts;
+      }
+    }
+  }
+  for (const RID &rid : writes->second) {
+    PruneChain(rid, oldest_ts);
+  }
+  writes_.erase(writes);
+}
+
+void VersionStore::Abort(txn_id_t writer) {
+  std::lock_guard<std::mutex> latch(latch_);
+  auto writes = writes_.find(writer);
+  if (writes == writes_.end()) {
+    return;
+  }
+  for (const RID &rid : writes->second) {
+    auto chain = chains_.find(rid);
+    if (chain == chains_.end()) {
+      continue;
+    }
+    auto &versions = chain->second;
+    for (auto it = versions.begin(); it != versions.end();) {
+      it = it->writer == writer ? versions.erase(it) : std::next(it);
+    }
+    if (versions.empty()) {
+      chains_.erase(chain);
+    }
+  }
+  writes_.erase(writes);
+}
+
+bool VersionStore::Read(const RID &rid, timestamp_t read_ts, Tuple &tuple,
+                        bool exists) {
+  std::lock_guard<std::mutex> latch(latch_);
+  auto chain = chains_.find(rid);
+  if (chain == chains_.end()) {
+    return exists;
+  }
+  for (auto it = chain->second.rbegin(); it != chain->second.rend(); ++it) {
+    if (it->commit_ts != INVALID_TIMESTAMP && it->commit_ts <= read_ts) {
+      // this change and every one before it is in the snapshot
+      break;
+    }
+    exists = it->exists;
+    if (exists) {
+      tuple = it->tuple;
+    }
+  }
+  return exists;
+}
+
+void VersionStore::Prune(timestamp_t oldest_ts) {
+  std::lock_guard<std::mutex> latch(latch_);
+  std::vector<RID> rids;
+  for (auto &chain : chains_) {
+    rids.push_back(chain.first);
+  }
+  for (const RID &rid : rids) {
+    PruneChain(rid, oldest_ts);
+  }
+}
+
+size_t VersionStore::GetVersionCount() {
+  std::lock_guard<std::mutex> latch(latch_);
+  size_t count = 0;
+  for (auto &chain : chains_) {
+    count += chain.second.size();
+  }
+  return count;
+}
+
+/*
+ * A snapshot stops at the newest change committed at or before its read_ts,
+ * so once no snapshot older than oldest_ts runs, the newest version committed
+ * at or before oldest_ts and everything before it are never read again.
+ */
+void VersionStore::PruneChain(const RID &rid, timestamp_t oldest_ts) {
+  auto chain = chains_.find(rid);
+  if (chain == chains_.end()) {
+    return;
+  }
+  auto &versions = chain->second;
+  size_t drop = 0;
+  for (size_t i = 0; i < versions.size(); i++) {
+    if (versions[i].commit_ts != INVALID_TIMESTAMP &&
+        versions[i].commit_ts <= oldest_ts) {
+      drop = i + 1;
+    }
+  }
+  versions.erase(versions.begin(), versions.begin() + drop);
+  if (versions.empty()) {
+    chains_.erase(chain);
+  }
+}
+
+} // namespace cmudb
@@ -1,46 +1,39 @@
 /**
  * disk_manager.cpp
  */
+#include <algorithm>
 #include <assert.h>
+#include <cstdio>
 #include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
 #include <iostream>
 #include <sys/stat.h>
 #include <thread>
+#include <unistd.h>
+#include <vector>
 
 #include "common/logger.h"
 #include "disk/disk_manager.h"
 
 namespace cmudb {
 
-static char *buffer_used = nullptr;
-
 /**
  * Constructor: open/create a single database file & log file
  * @input db_file: database file name
  */
 DiskManager::DiskManager(const std::string &db_file)
-    : file_name_(db_file), next_page_id_(0), num_flushes_(0), flush_log_(false),
-      flush_log_f_(nullptr) {
+    : next_page_id_(0), num_flushes_(0), flush_log_(false),
+      flush_log_f_(nullptr), log_fd_(-1), first_segment_(0), last_segment_(0),
+      segment_size_(0), file_name_(db_file) {
   std::string::size_type n = file_name_.find(".");
   if (n == std::string::npos) {
     LOG_DEBUG("wrong file format");
     return;
   }
   log_name_ = file_name_.substr(0, n) + ".log";
-
-  log_io_.open(log_name_,
-               std::ios::binary | std::ios::in | std::ios::app | std::ios::out);
-  // directory or file does not exist
-  if (!log_io_.is_open()) {
-    log_io_.clear();
-    // create a new file
-    log_io_.open(log_name_, std::ios::binary | std::ios::trunc | std::ios::app |
-                                std::ios::out);
-    log_io_.close();
-    // reopen with original mode
-    log_io_.open(log_name_, std::ios::binary | std::ios::in | std::ios::app |
-                                std::ios::out);
-  }
+  master_name_ = file_name_.substr(0, n) + ".master";
+  OpenLog();
 
   db_io_.open(db_file,
               std::ios::binary | std::ios::in | std::ios::out | std::ios::out);
@@ -55,9 +48,37 @@ DiskManager::DiskManager(const std::string &db_file)
   }
 }
 
+/**
+ * Constructor of an extra log stream: only the log "<db name>_<stream>.log"
+ * is opened, pages and the master record stay with the primary
+ */
+DiskManager::DiskManager(const std::string &db_file, int log_stream)
+    : next_page_id_(0), num_flushes_(0), flush_log_(false),
+      flush_log_f_(nullptr), log_fd_(-1), first_segment_(0), last_segment_(0),
+      segment_size_(0), file_name_(db_file) {
+  std::string::size_type n = file_name_.find(".");
+  if (n == std::string::npos) {
+    LOG_DEBUG("wrong file format");
+    return;
+  }
+  log_name_ =
+      file_name_.substr(0, n) + "_" + std::to_string(log_stream) + ".log";
+  OpenLog();
+}
+
+/**
+ * Constructor used by subclasses which keep pages and log somewhere else,
+ * no file is opened here
+ */
+DiskManager::DiskManager()
+    : next_page_id_(0), num_flushes_(0), flush_log_(false),
+      flush_log_f_(nullptr), log_fd_(-1), first_segment_(0), last_segment_(0),
+      segment_size_(0) {}
+
 DiskManager::~DiskManager() {
   db_io_.close();
-  log_io_.close();
+  if (log_fd_ >= 0)
+    close(log_fd_);
 }
 
 /**
@@ -96,6 +117,8 @@ void DiskManager::ReadPage(page_id_t page_id, char *page_data) {
       LOG_DEBUG("Read less than a page");
       // std::cerr << "Read less than a page" << std::endl;
       memset(page_data + read_count, 0, PAGE_SIZE - read_count);
+      // a short read fails the stream, later writes would be dropped
+      db_io_.clear();
     }
   }
 }
@@ -104,13 +127,23 @@ void DiskManager::ReadPage(page_id_t page_id, char *page_data) {
  * Write the contents of the log into disk file
  * Only return when sync is done, and only perform sequence write
  */
-void DiskManager::WriteLog(char *log_data, int size) {
-  // enforce swap log buffer
-  assert(log_data != buffer_used);
-  buffer_used = log_data;
+bool DiskManager::WriteLog(char *log_data, int size) {
+  struct iovec iov;
+  iov.iov_base = log_data;
+  iov.iov_len = size;
+  return WriteLog(&iov, 1);
+}
 
+/**
+ * Same for several buffers, which are written as is (no copy) with writev
+ */
+bool DiskManager::WriteLog(const struct iovec *log_data, int count) {
+  int size = 0;
+  for (int i = 0; i < count; i++) {
+    size += log_data[i].iov_len;
+  }
   if (size == 0) // no effect on num_flushes_ if log buffer is empty
-    return;
+    return true;
 
   flush_log_ = true;
 
@@ -119,49 +152,214 @@ void DiskManager::WriteLog(char *log_data, int size) {
     assert(flush_log_f_->wait_for(std::chrono::seconds(10)) ==
            std::future_status::ready);
 
+  std::lock_guard<std::mutex> lock(log_latch_);
   num_flushes_ += 1;
-  // sequence write
-  log_io_.write(log_data, size);
-
-  // check for I/O error
-  if (log_io_.bad()) {
-    LOG_DEBUG("I/O error while writing log");
-    return;
+  // advanced past what is written
+  std::vector<struct iovec> iov(log_data, log_data + count);
+  size_t first = 0;
+  // sequence write, a full segment is synced before the next one is started
+  while (size > 0) {
+    if (segment_size_ == LOG_SEGMENT_SIZE) {
+      if (log_fd_ >= 0 && fdatasync(log_fd_) != 0) {
+        LOG_DEBUG("I/O error while syncing log");
+        flush_log_ = false;
+        return false;
+      }
+      OpenLogSegment(last_segment_ + 1);
+    }
+    // the buffers that fit in the segment, the last one may be cut
+    int room = LOG_SEGMENT_SIZE - segment_size_;
+    size_t last = first;
+    int batch = 0;
+    while (last < iov.size() && batch < room) {
+      batch += iov[last++].iov_len;
+    }
+    size_t cut = batch > room ? batch - room : 0;
+    iov[last - 1].iov_len -= cut;
+    ssize_t res =
+        log_fd_ < 0 ? -1 : writev(log_fd_, &iov[first], last - first);
+    iov[last - 1].iov_len += cut;
+    // check for I/O error
+    if (res <= 0) {
+      LOG_DEBUG("I/O error while writing log");
+      flush_log_ = false;
+      return false;
+    }
+    size -= res;
+    segment_size_ += res;
+    while (res > 0) {
+      if (static_cast<size_t>(res) >= iov[first].iov_len) {
+        res -= iov[first++].iov_len;
+      } else {
+        iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + res;
+        iov[first].iov_len -= res;
+        res = 0;
+      }
+    }
+  }
+  // the log is only durable once it reaches the device
+  bool synced = log_fd_ >= 0 && fdatasync(log_fd_) == 0;
+  if (!synced) {
+    LOG_DEBUG("I/O error while syncing log");
   }
-  // needs to flush to keep disk file in sync
-  log_io_.flush();
   flush_log_ = false;
+  return synced;
 }
 
 /**
  * Read the contents of the log into the given memory area
- * Always read from the beginning and perform sequence read
- * @return: false means already reach the end
+ * Always read from the beginning and perform sequence read, a read may span
+ * several segments
+ * @return: false means already reach the end, or the offset was truncated
  */
-bool DiskManager::ReadLog(char *log_data, int size, int offset) {
-  if (offset >= GetFileSize(log_name_)) {
+bool DiskManager::ReadLog(char *log_data, int size, log_offset_t offset) {
+  std::lock_guard<std::mutex> lock(log_latch_);
+  if (offset >= GetSegmentOffset(last_segment_) + segment_size_) {
     // LOG_DEBUG("end of log file");
-    // LOG_DEBUG("file size is %d", GetFileSize(log_name_));
     return false;
   }
-  log_io_.seekp(offset);
-  log_io_.read(log_data, size);
+  if (offset < GetSegmentOffset(first_segment_)) {
+    LOG_DEBUG("read of truncated log");
+    return false;
+  }
+  int read_count = 0;
+  while (read_count < size) {
+    int segment = static_cast<int>((offset + read_count) / LOG_SEGMENT_SIZE);
+    int pos = static_cast<int>((offset + read_count) % LOG_SEGMENT_SIZE);
+    int count = std::min(size - read_count, LOG_SEGMENT_SIZE - pos);
+    int fd = segment == last_segment_
+                 ? log_fd_
+                 : open(GetSegmentName(segment).c_str(), O_RDONLY);
+    ssize_t res = fd < 0 ? -1 : pread(fd, log_data + read_count, count, pos);
+    if (fd >= 0 && fd != log_fd_) {
+      close(fd);
+    }
+    if (res <= 0) {
+      break;
+    }
+    read_count += res;
+    if (res < count || segment == last_segment_) {
+      break;
+    }
+  }
   // if log file ends before reading "size"
-  int read_count = log_io_.gcount();
   if (read_count < size) {
-    log_io_.clear();
     memset(log_data + read_count, 0, size - read_count);
   }
 
   return true;
 }
 
+/**
+ * Size of the log file, new log records are appended from there
+ */
+log_offset_t DiskManager::GetLogSize() {
+  std::lock_guard<std::mutex> lock(log_latch_);
+  return GetSegmentOffset(last_segment_) + segment_size_;
+}
+
+/**
+ * Delete every segment that ends at or before offset, the segment being
+ * written is always kept
+ */
+void DiskManager::TruncateLog(log_offset_t offset) {
+  std::lock_guard<std::mutex> lock(log_latch_);
+  while (first_segment_ < last_segment_ &&
+         GetSegmentOffset(first_segment_ + 1) <= offset) {
+    if (remove(GetSegmentName(first_segment_).c_str()) != 0) {
+      LOG_DEBUG("can't remove log segment %d", first_segment_);
+    }
+    first_segment_++;
+  }
+}
+
+/**
+ * Drop the log from offset on, segments after the one holding offset are
+ * deleted and that one is cut, new log is appended at offset afterwards
+ */
+void DiskManager::TruncateLogTail(log_offset_t offset) {
+  std::lock_guard<std::mutex> lock(log_latch_);
+  int segment =
+      std::max(static_cast<int>(offset / LOG_SEGMENT_SIZE), first_segment_);
+  offset = std::max(offset, GetSegmentOffset(segment));
+  if (offset >= GetSegmentOffset(last_segment_) + segment_size_) {
+    return;
+  }
+  for (int i = last_segment_; i > segment; i--) {
+    if (remove(GetSegmentName(i).c_str()) != 0) {
+      LOG_DEBUG("can't remove log segment %d", i);
+    }
+  }
+  if (truncate(GetSegmentName(segment).c_str(), offset % LOG_SEGMENT_SIZE) !=
+      0) {
+    LOG_DEBUG("can't truncate log segment %d", segment);
+  }
+  OpenLogSegment(segment);
+  if (fdatasync(log_fd_) != 0) {
+    LOG_DEBUG("I/O error while syncing log");
+  }
+}
+
+DiskManager *DiskManager::OpenLogStream(int log_stream) {
+  return new DiskManager(file_name_, log_stream);
+}
+
+/**
+ * Overwrite the master record in place and sync it, 8 aligned bytes never
+ * span two sectors so the update is atomic
+ */
+void DiskManager::WriteMasterRecord(log_offset_t checkpoint_offset) {
+  int fd = open(master_name_.c_str(), O_WRONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    LOG_DEBUG("can't open master record file");
+    return;
+  }
+  if (pwrite(fd, &checkpoint_offset, sizeof(log_offset_t), 0) !=
+          sizeof(log_offset_t) ||
+      fdatasync(fd) != 0) {
+    LOG_DEBUG("I/O error while writing master record");
+  }
+  close(fd);
+}
+
+/**
+ * @return: false means no checkpoint was taken yet
+ * Master records written before log offsets were 64 bit hold an int
+ */
+bool DiskManager::ReadMasterRecord(log_offset_t &checkpoint_offset) {
+  int fd = open(master_name_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  char record[sizeof(log_offset_t)];
+  ssize_t res = pread(fd, record, sizeof(record), 0);
+  close(fd);
+  if (res == sizeof(log_offset_t)) {
+    memcpy(&checkpoint_offset, record, sizeof(log_offset_t));
+    return true;
+  }
+  if (res == sizeof(int32_t)) {
+    int32_t offset;
+    memcpy(&offset, record, sizeof(int32_t));
+    checkpoint_offset = offset;
+    return true;
+  }
+  return false;
+}
+
 /**
  * Allocate new page (operations like create index/table)
  * For now just keep an increasing counter
  */
 page_id_t DiskManager::AllocatePage() { return next_page_id_++; }
 
+void DiskManager::ReservePages(page_id_t page_id) {
+  page_id_t next = next_page_id_;
+  while (next <= page_id &&
+         !next_page_id_.compare_exchange_weak(next, page_id + 1)) {
+  }
+}
+
 /**
  * Deallocate page (operations like drop index/table)
  * Need bitmap in header page for tracking pages
@@ -180,6 +378,75 @@ int DiskManager::GetNumFlushes() const { return num_flushes_; }
  */
 bool DiskManager::GetFlushState() const { return flush_log_; }
 
+/**
+ * Open the last segment of log_name_, called from the constructors
+ */
+void DiskManager::OpenLog() {
+  // find the log segments of earlier runs, segment 0 is the plain log file
+  // name and segment i is "<log file>.i"
+  std::string::size_type slash = log_name_.rfind('/');
+  std::string dir_name =
+      slash == std::string::npos ? "." : log_name_.substr(0, slash);
+  std::string base_name =
+      slash == std::string::npos ? log_name_ : log_name_.substr(slash + 1);
+  std::string prefix = base_name + ".";
+  first_segment_ = last_segment_ = -1;
+  DIR *dir = opendir(dir_name.c_str());
+  if (dir != nullptr) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+      std::string name = entry->d_name;
+      int segment;
+      if (name == base_name) {
+        segment = 0;
+      } else if (name.size() > prefix.size() &&
+                 name.compare(0, prefix.size(), prefix) == 0 &&
+                 name.find_first_not_of("0123456789", prefix.size()) ==
+                     std::string::npos) {
+        segment = std::stoi(name.substr(prefix.size()));
+      } else {
+        continue;
+      }
+      if (first_segment_ == -1 || segment < first_segment_) {
+        first_segment_ = segment;
+      }
+      last_segment_ = std::max(last_segment_, segment);
+    }
+    closedir(dir);
+  }
+  if (last_segment_ == -1) {
+    first_segment_ = last_segment_ = 0;
+  }
+  OpenLogSegment(last_segment_);
+}
+
+log_offset_t DiskManager::GetSegmentOffset(int segment) {
+  return static_cast<log_offset_t>(segment) * LOG_SEGMENT_SIZE;
+}
+
+std::string DiskManager::GetSegmentName(int segment) {
+  return segment == 0 ? log_name_ : log_name_ + "." + std::to_string(segment);
+}
+
+/**
+ * Make segment the one new log is appended to, should be called when holding
+ * log_latch_ (or from the constructor)
+ */
+void DiskManager::OpenLogSegment(int segment) {
+  if (log_fd_ >= 0) {
+    close(log_fd_);
+  }
+  // the descriptor that writes the log is the one fdatasync'ed, and the
+  // segment is read through it too
+  log_fd_ = open(GetSegmentName(segment).c_str(),
+                 O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (log_fd_ < 0) {
+    LOG_DEBUG("can't open log segment %d", segment);
+  }
+  last_segment_ = segment;
+  segment_size_ = std::max(GetFileSize(GetSegmentName(segment)), 0);
+}
+
 /**
  * Private helper function to get disk file size
  */
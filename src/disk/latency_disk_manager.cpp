@@ -0,0 +1,277 @@
+/**
+ * latency_disk_manager.cpp
+ */
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#include "disk/latency_disk_manager.h"
+
+namespace cmudb {
+
+LatencyDiskManager::LatencyDiskManager(DiskManager *disk_manager,
+                                       const DiskLatencyConfig &config)
+    : disk_manager_(disk_manager), config_(config), generator_(config.seed),
+      busy_until_(std::chrono::steady_clock::now()), num_ios_(0),
+      injected_delay_(0), log_start_(0), master_record_(-1) {}
+
+LatencyDiskManager::LatencyDiskManager(const DiskLatencyConfig &config)
+    : LatencyDiskManager(nullptr, config) {}
+
+/**
+ * Write the contents of the specified page, after the emulated write latency
+ */
+void LatencyDiskManager::WritePage(page_id_t page_id, const char *page_data) {
+  Delay(config_.write_page, PAGE_SIZE);
+  if (disk_manager_ != nullptr) {
+    disk_manager_->WritePage(page_id, page_data);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(file_latch_);
+  size_t offset = static_cast<size_t>(page_id) * PAGE_SIZE;
+  if (db_file_.size() < offset + PAGE_SIZE) {
+    db_file_.resize(offset + PAGE_SIZE, 0);
+  }
+  memcpy(db_file_.data() + offset, page_data, PAGE_SIZE);
+}
+
+/**
+ * Read the contents of the specified page, after the emulated read latency
+ * A page that was never written reads as zeros
+ */
+void LatencyDiskManager::ReadPage(page_id_t page_id, char *page_data) {
+  Delay(config_.read_page, PAGE_SIZE);
+  if (disk_manager_ != nullptr) {
+    disk_manager_->ReadPage(page_id, page_data);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(file_latch_);
+  size_t offset = static_cast<size_t>(page_id) * PAGE_SIZE;
+  if (offset >= db_file_.size()) {
+    memset(page_data, 0, PAGE_SIZE);
+    return;
+  }
+  memcpy(page_data, db_file_.data() + offset, PAGE_SIZE);
+}
+
+/**
+ * Append the log, after the emulated write latency
+ */
+bool LatencyDiskManager::WriteLog(const struct iovec *log_data, int count) {
+  int size = 0;
+  for (int i = 0; i < count; i++) {
+    size += log_data[i].iov_len;
+  }
+  if (size == 0) // no effect on num_flushes_ if log buffer is empty
+    return true;
+  flush_log_ = true;
+  Delay(config_.write_log, size);
+  bool written = true;
+  if (disk_manager_ != nullptr) {
+    written = disk_manager_->WriteLog(log_data, count);
+  } else {
+    std::lock_guard<std::mutex> lock(file_latch_);
+    for (int i = 0; i < count; i++) {
+      auto *data = static_cast<const char *>(log_data[i].iov_base);
+      log_file_.insert(log_file_.end(), data, data + log_data[i].iov_len);
+    }
+    num_flushes_ += 1;
+  }
+  flush_log_ = false;
+  return written;
+}
+
+/**
+ * Read the log starting from offset, after the emulated read latency
+ * @return: false means already reach the end
+ */
+bool LatencyDiskManager::ReadLog(char *log_data, int size,
+                                 log_offset_t offset) {
+  Delay(config_.read_log, size);
+  if (disk_manager_ != nullptr) {
+    return disk_manager_->ReadLog(log_data, size, offset);
+  }
+  std::lock_guard<std::mutex> lock(file_latch_);
+  offset -= log_start_;
+  if (offset < 0 || static_cast<size_t>(offset) >= log_file_.size()) {
+    return false;
+  }
+  int read_count = static_cast<int>(
+      std::min<log_offset_t>(size, log_file_.size() - offset));
+  memcpy(log_data, log_file_.data() + offset, read_count);
+  if (read_count < size) {
+    memset(log_data + read_count, 0, size - read_count);
+  }
+  return true;
+}
+
+log_offset_t LatencyDiskManager::GetLogSize() {
+  if (disk_manager_ != nullptr) {
+    return disk_manager_->GetLogSize();
+  }
+  std::lock_guard<std::mutex> lock(file_latch_);
+  return log_start_ + log_file_.size();
+}
+
+/**
+ * Drop the in memory log before offset, in whole segments like on disk
+ */
+void LatencyDiskManager::TruncateLog(log_offset_t offset) {
+  if (disk_manager_ != nullptr) {
+    disk_manager_->TruncateLog(offset);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(file_latch_);
+  log_offset_t count =
+      (offset - log_start_) / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+  count = std::min<log_offset_t>(
+      count, log_file_.size() / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE);
+  if (count > 0) {
+    log_file_.erase(log_file_.begin(), log_file_.begin() + count);
+    log_start_ += count;
+  }
+}
+
+void LatencyDiskManager::TruncateLogTail(log_offset_t offset) {
+  if (disk_manager_ != nullptr) {
+    disk_manager_->TruncateLogTail(offset);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(file_latch_);
+  offset = std::max<log_offset_t>(offset - log_start_, 0);
+  if (static_cast<size_t>(offset) < log_file_.size()) {
+    log_file_.resize(offset);
+  }
+}
+
+DiskManager *LatencyDiskManager::OpenLogStream(int log_stream) {
+  if (disk_manager_ == nullptr) {
+    return new LatencyDiskManager(config_);
+  }
+  auto *stream =
+      new LatencyDiskManager(disk_manager_->OpenLogStream(log_stream), config_);
+  stream->stream_disk_manager_.reset(stream->disk_manager_);
+  return stream;
+}
+
+/**
+ * Overwrite the master record, after the emulated write latency
+ */
+void LatencyDiskManager::WriteMasterRecord(log_offset_t checkpoint_offset) {
+  Delay(config_.write_page, sizeof(log_offset_t));
+  if (disk_manager_ != nullptr) {
+    disk_manager_->WriteMasterRecord(checkpoint_offset);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(file_latch_);
+  master_record_ = checkpoint_offset;
+}
+
+bool LatencyDiskManager::ReadMasterRecord(log_offset_t &checkpoint_offset) {
+  Delay(config_.read_page, sizeof(log_offset_t));
+  if (disk_manager_ != nullptr) {
+    return disk_manager_->ReadMasterRecord(checkpoint_offset);
+  }
+  std::lock_guard<std::mutex> lock(file_latch_);
+  checkpoint_offset = master_record_;
+  return master_record_ >= 0;
+}
+
+page_id_t LatencyDiskManager::AllocatePage() {
+  if (disk_manager_ != nullptr) {
+    return disk_manager_->AllocatePage();
+  }
+  return next_page_id_++;
+}
+
+void LatencyDiskManager::ReservePages(page_id_t page_id) {
+  if (disk_manager_ != nullptr) {
+    disk_manager_->ReservePages(page_id);
+    return;
+  }
+  DiskManager::ReservePages(page_id);
+}
+
+void LatencyDiskManager::DeallocatePage(page_id_t page_id) {
+  if (disk_manager_ != nullptr) {
+    disk_manager_->DeallocatePage(page_id);
+  }
+}
+
+int LatencyDiskManager::GetNumFlushes() const {
+  if (disk_manager_ != nullptr) {
+    return disk_manager_->GetNumFlushes();
+  }
+  return num_flushes_;
+}
+
+bool LatencyDiskManager::GetFlushState() const { return flush_log_; }
+
+void LatencyDiskManager::SetFlushLogFuture(std::future<void> *f) {
+  if (disk_manager_ != nullptr) {
+    disk_manager_->SetFlushLogFuture(f);
+  }
+  flush_log_f_ = f;
+}
+
+bool LatencyDiskManager::HasFlushLogFuture() {
+  if (disk_manager_ != nullptr) {
+    return disk_manager_->HasFlushLogFuture();
+  }
+  return flush_log_f_ != nullptr;
+}
+
+/*
+ * The transfer of `size` bytes is serialized on the device time line (this is
+ * what enforces the bandwidth cap), then the sampled latency is added on top.
+ * Latencies of concurrent I/O overlap, transfers do not.
+ */
+void LatencyDiskManager::Delay(const IoLatency &latency, int size) {
+  std::chrono::steady_clock::time_point done;
+  {
+    std::lock_guard<std::mutex> lock(latch_);
+    auto now = std::chrono::steady_clock::now();
+    auto start = std::max(now, busy_until_);
+    if (config_.bandwidth != 0) {
+      busy_until_ = start + std::chrono::microseconds(
+                                static_cast<uint64_t>(size) * 1000000 /
+                                config_.bandwidth);
+    } else {
+      busy_until_ = start;
+    }
+    done = busy_until_ + SampleLatency(latency);
+    num_ios_++;
+    injected_delay_ +=
+        std::chrono::duration_cast<std::chrono::microseconds>(done - now)
+            .count();
+  }
+  std::this_thread::sleep_until(done);
+}
+
+/*
+ * should be called when holding the latch
+ */
+std::chrono::microseconds
+LatencyDiskManager::SampleLatency(const IoLatency &latency) {
+  auto mean = latency.mean.count();
+  if (mean <= 0) {
+    return std::chrono::microseconds(0);
+  }
+  switch (latency.distribution) {
+  case LatencyDistribution::UNIFORM: {
+    auto jitter = std::min(latency.jitter.count(), mean);
+    std::uniform_int_distribution<long long> dist(mean - jitter,
+                                                  mean + jitter);
+    return std::chrono::microseconds(dist(generator_));
+  }
+  case LatencyDistribution::EXPONENTIAL: {
+    std::exponential_distribution<double> dist(1.0 / mean);
+    return std::chrono::microseconds(
+        static_cast<long long>(dist(generator_)));
+  }
+  default:
+    return latency.mean;
+  }
+}
+
+} // namespace cmudb
@@ -7,8 +7,12 @@
  */
 
 #pragma once
+#include <atomic>
 #include <list>
 #include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "buffer/lru_replacer.h"
 #include "disk/disk_manager.h"
@@ -17,6 +21,24 @@
 #include "page/page.h"
 
 namespace cmudb {
+class LogRecovery;
+
+// what the pages touched by one thread looked like before, filled by the
+// buffer pool while it is installed (B+ tree operations log the bytes they
+// wrote from this). A captured page keeps one extra pin, so it can't be
+// written back before it is logged, and unpinning it does not make it dirty.
+// Deleting it only records it. Once the capture is uninstalled, its owner
+// logs the pages, then unpins them (dirty if changed) and deletes the
+// deleted ones.
+struct PageCapture {
+  // page id -> content at its first fetch, zeros for new pages
+  std::unordered_map<page_id_t, std::vector<char>> before_images;
+  // page id -> its frame, pinned by the capture
+  std::unordered_map<page_id_t, Page *> frames;
+  std::unordered_set<page_id_t> new_pages;
+  std::unordered_set<page_id_t> deleted_pages;
+};
+
 class BufferPoolManager {
 public:
   BufferPoolManager(size_t pool_size, DiskManager *disk_manager,
@@ -26,15 +48,45 @@ public:
 
   Page *FetchPage(page_id_t page_id);
 
+  // is_dirty only ever sets the dirty flag: a clean unpin leaves a page that
+  // another pin holder dirtied dirty
   bool UnpinPage(page_id_t page_id, bool is_dirty);
 
+  // write the page back and mark it clean (its recLSN is reset), after the
+  // log is durable up to its page lsn
   bool FlushPage(page_id_t page_id);
 
   Page *NewPage(page_id_t &page_id);
 
   bool DeletePage(page_id_t page_id);
 
+  // page id -> recLSN of the pages with unflushed logged changes
+  void GetDirtyPageTable(std::unordered_map<page_id_t, lsn_t> &dirty_page_table);
+
+  // record the pages the calling thread fetches, creates and deletes into
+  // capture from now on, nullptr stops
+  void SetPageCapture(PageCapture *capture);
+
+  inline LogManager *GetLogManager() { return log_manager_; }
+
+  // pages are handed to recovery before they are handed out, until it has
+  // recovered all of them (see LogRecovery::StartLazyRecovery). nullptr stops
+  inline void SetLazyRecovery(LogRecovery *recovery) {
+    lazy_recovery_ = recovery;
+  }
+  // some page may still miss logged changes
+  bool IsRecovering();
+
 private:
+  Page *FetchFrame(page_id_t page_id);
+  bool FindVictim(Page *&page, std::unique_lock<std::mutex> &lock);
+  lsn_t GetPageLSN(Page *page);
+  lsn_t GetWriteBackLSN(Page *page);
+  bool ForceLog(Page *page, lsn_t lsn, std::unique_lock<std::mutex> &lock);
+  // page capture of the calling thread, see PageCapture
+  bool IsCaptured(page_id_t page_id);
+  void CapturePage(Page *page, bool new_page);
+
   size_t pool_size_; // number of pages in buffer pool
   Page *pages_;      // array of pages
   DiskManager *disk_manager_;
@@ -43,5 +95,6 @@ private:
   Replacer<Page *> *replacer_;   // to find an unpinned page for replacement
   std::list<Page *> *free_list_; // to find a free page for replacement
   std::mutex latch_;             // to protect shared data structure
+  std::atomic<LogRecovery *> lazy_recovery_{nullptr};
 };
 } // namespace cmudb
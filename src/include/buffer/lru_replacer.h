@@ -27,6 +27,8 @@ public:
 
   bool Victim(T &value);
 
+  bool Victim(T &value, const std::function<bool(const T &)> &filter);
+
   bool Erase(const T &value);
 
   size_t Size();
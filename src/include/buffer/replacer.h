@@ -6,6 +6,7 @@
 #pragma once
 
 #include <cstdlib>
+#include <functional>
 
 namespace cmudb {
 
@@ -15,6 +16,8 @@ public:
   virtual ~Replacer() {}
   virtual void Insert(const T &value) = 0;
   virtual bool Victim(T &value) = 0;
+  // least recently used value that filter accepts, false if there is none
+  virtual bool Victim(T &value, const std::function<bool(const T &)> &filter) = 0;
   virtual bool Erase(const T &value) = 0;
   virtual size_t Size() = 0;
 };
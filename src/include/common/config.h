@@ -14,20 +14,71 @@ namespace cmudb {
 
 extern std::chrono::duration<long long int> LOG_TIMEOUT;
 
+// max time the flush thread waits for more commits to join one group commit
+extern std::chrono::microseconds GROUP_COMMIT_TIMEOUT;
+
+// async commits are durable at the latest this long after they return, or
+// as soon as this many bytes of log are waiting for the flush thread
+extern std::chrono::milliseconds ASYNC_COMMIT_WINDOW;
+extern int ASYNC_COMMIT_BYTES;
+
+// time between two fuzzy checkpoints taken by the checkpoint thread
+extern std::chrono::duration<long long int> CHECKPOINT_TIMEOUT;
+
 extern std::atomic<bool> ENABLE_LOGGING;
 
+// log records are appended with the compact varint header
+extern bool COMPACT_LOG_HEADER;
+// log buffers are compressed by the flush thread before they are written
+extern bool COMPRESS_LOG;
+// transactions keep their tuple log records in a private log until they
+// commit, abort or fill it (see LogManager::AppendTxnLogRecord), off by
+// default: the changed pages stay pinned until then
+extern bool PRIVATE_TXN_LOG;
+// number of log streams (files) the log is split into, read when the log
+// manager is created
+extern int LOG_STREAMS;
+// after a crash pages are recovered on demand, the database opens right
+// after the log is analyzed. Off by default: redo and undo run in full
+// before the database opens
+extern bool LAZY_RECOVERY;
+// row locks a transaction holds on one table before they are traded for one
+// table lock
+extern int LOCK_ESCALATION_THRESHOLD;
+// time between two searches for deadlocks, with DeadlockPolicy::DETECTION
+extern std::chrono::milliseconds DEADLOCK_DETECTION_INTERVAL;
+// an uncontended exclusive row lock is the id of its owner in the slot of the
+// row on its table page, the lock table only sees contended rows. Only tables
+// created while it is on have slots with room for it
+extern bool SLOT_ROW_LOCKS;
+// a committing transaction releases its locks once its COMMIT record has an
+// lsn, before it is durable. Transactions taking the released locks wait for
+// that lsn when they commit
+extern bool EARLY_LOCK_RELEASE;
+
 #define INVALID_PAGE_ID -1 // representing an invalid page id
 #define INVALID_TXN_ID -1  // representing an invalid txn id
 #define INVALID_LSN -1     // representing an invalid lsn
+#define INVALID_TIMESTAMP -1 // representing an invalid commit timestamp
 #define HEADER_PAGE_ID 0   // the header page id
 #define PAGE_SIZE 512     // size of a data page in byte
 #define LOG_BUFFER_SIZE                                                            \
   ((BUFFER_POOL_SIZE + 1) * PAGE_SIZE) // size of a log buffer in byte
+#define LOG_BUFFER_COUNT 4             // number of log buffers in the ring
+#define LOG_SEGMENT_SIZE                                                           \
+  (64 * LOG_BUFFER_SIZE)               // size of a log file segment in byte
+#define REDO_WORKERS 4                 // number of threads applying redo
+#define TXN_LOG_BUFFER_SIZE                                                        \
+  (4 * PAGE_SIZE)                      // size of a private txn log in byte
+#define TXN_LOG_MAX_PAGES 2            // pages a private txn log keeps pinned
+#define LOCK_TABLE_SHARDS 16           // latches the lock table is split by
 #define BUCKET_SIZE 50                 // size of extendible hash bucket
 #define BUFFER_POOL_SIZE 10            // size of buffer pool
 
 typedef int32_t page_id_t; // page id type
 typedef int32_t txn_id_t;  // transaction id type
 typedef int32_t lsn_t;     // log sequence number type
+typedef int64_t timestamp_t; // commit timestamp type
+typedef int64_t log_offset_t; // offset in a log file type
 
 } // namespace cmudb
\ No newline at end of file
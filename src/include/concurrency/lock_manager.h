@@ -2,41 +2,100 @@
 /**
  * lock_manager.h
  *
- * Tuple level lock manager, use wait-die to prevent deadlocks
+ * Tuple level lock manager. Deadlocks are handled by one of the
+ * DeadlockPolicy, wait-die by default.
+ * The lock table is split into LOCK_TABLE_SHARDS shards by rid, each with its
+ * own latch, and the waiters of a rid wait on its own condition variable, so
+ * locking one rid never blocks or wakes up the waiters of another.
+ * Tables and pages are locked hierarchically on top of rows: IS/IX on a table
+ * and a page announce row locks below them, S/SIX/X on a table or page cover
+ * every row in it. Once a transaction holds LOCK_ESCALATION_THRESHOLD row
+ * locks of one table they are traded for a single S or X table lock.
+ * With SLOT_ROW_LOCKS an exclusive row lock nobody else asks for is only the
+ * id of its owner, set by compare-and-swap in the lock word of the slot of
+ * the row (tables created with SLOT_ROW_LOCKS have one, see TablePage). The first request that goes to the lock table for the row moves
+ * that lock into it, so the lock table holds every lock of a contended row.
+ * Indexes lock keys for serializable range scans (next-key locking): the lock
+ * of a key covers the key and the gap down to the key before it.
  */
 
 #pragma once
 
+#include <atomic>
+#include <climits>
 #include <condition_variable>
 #include <list>
 #include <memory>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
+#include "common/config.h"
 #include "common/rid.h"
 #include "concurrency/transaction.h"
 
 namespace cmudb {
 
-enum class LockMode {SHARED = 0, EXCLUSIVE};
+/*
+ * WAIT_DIE: a transaction waiting for an older one aborts itself.
+ * WOUND_WAIT: a transaction waiting for younger ones aborts them, and waits
+ * for older ones.
+ * DETECTION: every transaction waits, a background thread looks for cycles
+ * in the waits-for graph and aborts the transaction holding the fewest locks
+ * in each of them.
+ */
+enum class DeadlockPolicy { WAIT_DIE, WOUND_WAIT, DETECTION };
+
+// why the lock manager aborted a transaction
+enum class AbortReason { DIED = 0, WOUNDED, DEADLOCK };
 
 class LockManager {
     struct Request {
-        Request(txn_id_t id, LockMode m, bool g) :
-            txn_id(id), lock_mode(m), granted(g) {}
-        txn_id_t txn_id;
+        Request(Transaction *t, LockMode m, bool g) :
+            txn(t), lock_mode(m), granted(g), wanted(m) {}
+        Transaction *txn;
+        // held if granted, else requested
         LockMode lock_mode;
         bool granted;
+        // mode an upgrade of a granted request waits for, else lock_mode
+        LockMode wanted;
     };
 
     struct WaitList {
-        int exclusive_cnt = 0;
-        txn_id_t oldest = -1;
         std::list<Request> list;
+        // the requests of list wait on it
+        std::condition_variable cv;
+    };
+
+    // a WaitList lives as long as its list is not empty
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<RID, WaitList> lock_table;
+        // nodes of released requests, new requests take them before
+        // allocating one
+        std::list<Request> free_requests;
+        // lock id -> latest commit lsn it was released early at, not durable
+        // yet maybe. Whoever is granted that lock waits for it. Outlives the
+        // entry of the lock, dropped once durable
+        std::unordered_map<RID, lsn_t> release_lsns;
+        std::mutex release_latch;
     };
 
 public:
-  LockManager(bool strict_2PL) : strict_2PL_(strict_2PL){};
+  LockManager(bool strict_2PL,
+              DeadlockPolicy policy = DeadlockPolicy::WAIT_DIE)
+      : strict_2PL_(strict_2PL), policy_(policy), running_(false) {
+    if (policy_ == DeadlockPolicy::DETECTION) {
+      RunDetectionThread();
+    }
+  }
+
+  ~LockManager() { StopDetectionThread(); }
+
+  // disable copy
+  LockManager(LockManager const &) = delete;
+  LockManager &operator=(LockManager const &) = delete;
 
   /*** below are APIs need to implement ***/
   // lock:
@@ -44,20 +103,194 @@ public:
   // it should be blocked on waiting and should return true when granted
   // note the behavior of trying to lock locked rids by same txn is undefined
   // it is transaction's job to keep track of its current locks
-  bool LockShared(Transaction *txn, const RID &rid);
-  bool LockExclusive(Transaction *txn, const RID &rid);
-  bool LockUpgrade(Transaction *txn, const RID &rid);
+  // rows of a table page come with the lock word of their slot (see
+  // TablePage::GetSlotLock), nullptr for rows without one
+  bool LockShared(Transaction *txn, const RID &rid,
+                  std::atomic<txn_id_t> *slot_lock = nullptr);
+  bool LockExclusive(Transaction *txn, const RID &rid,
+                     std::atomic<txn_id_t> *slot_lock = nullptr);
+  bool LockUpgrade(Transaction *txn, const RID &rid,
+                   std::atomic<txn_id_t> *slot_lock = nullptr);
 
   // unlock:
-  // release the lock hold by the txn
-  bool Unlock(Transaction *txn, const RID &rid);
+  // release the lock hold by the txn. Without the lock word a lock held in
+  // the slot leaves a stale owner behind, cleared by the next locker
+  bool Unlock(Transaction *txn, const RID &rid,
+              std::atomic<txn_id_t> *slot_lock = nullptr);
+  // release every lock of txn, row, table, page and key locks alike, taking
+  // each shard latch once. With commit_lsn the locks are released early,
+  // before the COMMIT record at commit_lsn is durable. The log is durable up
+  // to persistent_lsn, earlier releases need no waiting any more
+  bool ReleaseAll(Transaction *txn, lsn_t commit_lsn = INVALID_LSN,
+                  lsn_t persistent_lsn = INVALID_LSN);
   /*** END OF APIs ***/
 
+  // lock a table, named by its first page id, in any mode. Locking it again
+  // upgrades the lock to the weakest mode covering both.
+  // return false if transaction is aborted
+  bool LockTable(Transaction *txn, page_id_t table_id, LockMode lock_mode);
+  // lock a page of a table, the table gets the matching intention lock first
+  bool LockPage(Transaction *txn, page_id_t table_id, page_id_t page_id,
+                LockMode lock_mode);
+
+  // lock a key of an index, or the gap before it, named by KeyLockId. An
+  // instant lock is released as soon as it is granted, it only waits for
+  // the locks of others. Without wait give up (txn stays alive) instead of
+  // waiting. return false if not granted
+  bool LockKey(Transaction *txn, const RID &key_lock, LockMode lock_mode,
+               bool instant, bool wait);
+
+  // does txn hold rid in lock_mode, by a row lock or by a table or page lock
+  static bool HoldsLock(Transaction *txn, const RID &rid, LockMode lock_mode);
+
+  // abort one transaction of every cycle in the waits-for graph, the one
+  // holding the fewest locks (the youngest of them on a tie).
+  // @return: number of transactions aborted
+  int DetectDeadlocks();
+  // search for deadlocks every DEADLOCK_DETECTION_INTERVAL
+  void RunDetectionThread();
+  void StopDetectionThread();
+
+  // transactions aborted by the lock manager so far
+  inline int GetAbortCount(AbortReason reason) const {
+    return aborts_[static_cast<int>(reason)];
+  }
+
+  // ids of table and page locks, to Unlock them. Rows never use these slots
+  static inline RID TableLockId(page_id_t table_id) {
+    return RID(table_id, TABLE_LOCK_SLOT);
+  }
+  static inline RID PageLockId(page_id_t page_id) {
+    return RID(page_id, PAGE_LOCK_SLOT);
+  }
+  // ids of the key locks of an index, named by hashes of the index and of
+  // the key. Keys with the same hash share a lock. The end of the index is
+  // locked for the gap after the last key. Rows never use these page ids
+  static inline RID KeyLockId(size_t index_hash, size_t key_hash) {
+    return RID(KeyLockPageId(index_hash),
+               static_cast<int>(key_hash % END_KEY_LOCK_SLOT));
+  }
+  static inline RID EndKeyLockId(size_t index_hash) {
+    return RID(KeyLockPageId(index_hash), END_KEY_LOCK_SLOT);
+  }
+
+  // rows with an entry in the lock table, or sharing a counter with one
+  inline bool IsContended(const RID &rid) {
+    return contended_[GetContendedIndex(rid)] != 0;
+  }
+
 private:
+  static const int TABLE_LOCK_SLOT = INT_MAX;
+  static const int PAGE_LOCK_SLOT = INT_MAX - 1;
+  static const int CONTENDED_COUNTERS = 1024;
+  // free request nodes kept per shard
+  static const size_t FREE_REQUESTS = 1024;
+  // early releases kept per shard before the durable ones are dropped
+  static const size_t RELEASE_LSNS = 1024;
+  static const int END_KEY_LOCK_SLOT = INT_MAX;
+  static const int KEY_LOCK_INDEXES = 1 << 20;
+
+  static inline page_id_t KeyLockPageId(size_t index_hash) {
+    return INVALID_PAGE_ID - 1 -
+           static_cast<page_id_t>(index_hash % KEY_LOCK_INDEXES);
+  }
+
+  static inline size_t GetContendedIndex(const RID &rid) {
+    size_t hash = std::hash<RID>()(rid);
+    return (hash ^ (hash >> 32)) % CONTENDED_COUNTERS;
+  }
+
+  static inline size_t GetShardIndex(const RID &rid) {
+    size_t hash = std::hash<RID>()(rid);
+    return (hash ^ (hash >> 32)) % LOCK_TABLE_SHARDS;
+  }
+
+  inline Shard &GetShard(const RID &rid) { return shards_[GetShardIndex(rid)]; }
+
+  // insert a request into list before pos, on a free node of shard if any
+  static std::list<Request>::iterator
+  NewRequest(Shard &shard, std::list<Request> &list,
+             std::list<Request>::iterator pos, Transaction *txn,
+             LockMode lock_mode, bool granted);
+  // remove request from list, keeping its node for a later request
+  static void FreeRequest(Shard &shard, std::list<Request> &list,
+                          std::list<Request>::iterator request);
+
+  // append the transactions the request cur waits for to blockers
+  static void GetBlockers(std::list<Request> &list,
+                          std::list<Request>::iterator cur,
+                          std::vector<Transaction *> &blockers);
+  // abort victim for reason, @return: false if it already finished
+  bool Abort(Transaction *victim, AbortReason reason);
+  // wake up victim if it waits for a lock
+  void WakeUp(Transaction *victim);
+
+  // request lock_mode on lock_id, or upgrade the request of txn to cover it.
+  // Without wait give up (txn stays alive) instead of waiting
+  bool Lock(Transaction *txn, const RID &lock_id, LockMode lock_mode,
+            bool wait, std::atomic<txn_id_t> *slot_lock = nullptr);
+  // table, page and key locks, skipped if a held one covers lock_mode
+  bool LockObject(Transaction *txn, const RID &lock_id, LockMode lock_mode,
+                  bool instant = false, bool wait = true);
+  // drop the request of txn on lock_id and wake up the waiters
+  void Release(Transaction *txn, const RID &lock_id);
+  // the same with the latch of shard held
+  void ReleaseLatched(Shard &shard, Transaction *txn, const RID &lock_id);
+  // lock_id of shard is released early at commit_lsn (INVALID_LSN if not)
+  static void RecordRelease(Shard &shard, const RID &lock_id,
+                            lsn_t commit_lsn, lsn_t persistent_lsn);
+  // latest commit lsn lock_id was released early at, INVALID_LSN if none
+  static lsn_t GetReleaseLSN(Shard &shard, const RID &lock_id);
+  // drop lock_id from the lock sets of txn
+  void Forget(Transaction *txn, const RID &lock_id);
+  // release a row lock, held in its slot or in the lock table
+  void ReleaseRow(Transaction *txn, const RID &rid,
+                  std::atomic<txn_id_t> *slot_lock);
+
+  // take rid in its slot, @return: false if the row is contended
+  bool LockSlot(Transaction *txn, const RID &rid,
+                std::atomic<txn_id_t> *slot_lock);
+  // drop rid from the slot locks of txn, @return: false if not held there
+  bool UnlockSlot(Transaction *txn, const RID &rid,
+                  std::atomic<txn_id_t> *slot_lock);
+  // the owner of the lock word of rid, if still holding it, gets a granted
+  // request at the front of wait_list instead. Called with the shard latch
+  // held when the entry of rid is created
+  void InflateSlot(Shard &shard, const RID &rid,
+                   std::atomic<txn_id_t> *slot_lock, WaitList &wait_list);
+  // clear a lock word whose owner does not hold it any more,
+  // @return: false if the owner does
+  bool ClearStaleSlot(const RID &rid, std::atomic<txn_id_t> *slot_lock,
+                      txn_id_t owner);
+  void RegisterSlotOwner(Transaction *txn);
+  void UnregisterSlotOwner(Transaction *txn);
+  // count a new row lock, escalate once the table has too many
+  void CountRowLock(Transaction *txn, const RID &rid);
+  void Escalate(Transaction *txn, page_id_t table_id);
+
   bool strict_2PL_;
-  std::mutex mutex_;
-  std::condition_variable cv_;
-  std::unordered_map<RID, WaitList> lock_table_;
+  DeadlockPolicy policy_;
+  Shard shards_[LOCK_TABLE_SHARDS];
+  std::atomic<int> aborts_[3]{};
+
+  // entries of the lock table per counter of their row, a row taken in its
+  // slot while its counter is not 0 goes to the lock table instead
+  std::atomic<int> contended_[CONTENDED_COUNTERS]{};
+  // txns holding slot locks. Taken after a shard latch and before the slot
+  // lock latch of a txn, never the other way around
+  std::mutex slot_owners_latch_;
+  std::unordered_map<txn_id_t, Transaction *> slot_owners_;
+
+  // lock each txn waits for, so it can be woken up once aborted. Taken
+  // after a shard latch, never before
+  std::mutex waiting_latch_;
+  std::unordered_map<txn_id_t, RID> waiting_;
+
+  // detection thread
+  bool running_;
+  std::mutex detection_latch_;
+  std::condition_variable detection_cv_;
+  std::thread detection_thread_;
 };
 
-} // namespace cmudb
\ No newline at end of file
+} // namespace cmudb
@@ -7,11 +7,15 @@
 #include <atomic>
 #include <deque>
 #include <memory>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "common/config.h"
 #include "common/logger.h"
+#include "logging/log_record.h"
 #include "page/page.h"
 #include "table/tuple.h"
 
@@ -30,7 +34,17 @@ enum class TransactionState { GROWING, SHRINKING, COMMITTED, ABORTED };
 
 enum class WType { INSERT = 0, DELETE, UPDATE };
 
+// rows are locked SHARED or EXCLUSIVE, tables and pages in any mode
+enum class LockMode {
+  SHARED = 0,
+  EXCLUSIVE,
+  INTENTION_SHARED,
+  INTENTION_EXCLUSIVE,
+  SHARED_INTENTION_EXCLUSIVE
+};
+
 class TableHeap;
+class BufferPoolManager;
 
 // write set record
 class WriteRecord {
@@ -52,8 +66,13 @@ public:
   Transaction(txn_id_t txn_id)
       : state_(TransactionState::GROWING),
         thread_id_(std::this_thread::get_id()),
-        txn_id_(txn_id), prev_lsn_(INVALID_LSN), shared_lock_set_{new std::unordered_set<RID>},
-        exclusive_lock_set_{new std::unordered_set<RID>} {
+        txn_id_(txn_id), prev_lsn_(INVALID_LSN),
+        dependency_lsn_(INVALID_LSN), async_commit_(false),
+        read_ts_(INVALID_TIMESTAMP),
+        private_log_size_(0),
+        shared_lock_set_{new std::unordered_set<RID>},
+        exclusive_lock_set_{new std::unordered_set<RID>},
+        slot_lock_owner_(false) {
     // initialize sets
     write_set_.reset(new std::deque<WriteRecord>);
     page_set_.reset(new std::deque<Page *>);
@@ -93,16 +112,111 @@ public:
     return exclusive_lock_set_;
   }
 
+  // lock id (see LockManager::TableLockId/PageLockId/KeyLockId) -> mode of
+  // the table, page and key locks held
+  inline std::unordered_map<RID, LockMode> &GetTableLockSet() {
+    return table_lock_set_;
+  }
+
+  // page id -> table (its first page id) of the pages locked by
+  // LockManager::LockPage, the row locks on them count towards escalation
+  inline std::unordered_map<page_id_t, page_id_t> &GetLockedPages() {
+    return locked_pages_;
+  }
+
+  // table -> row locks held on it
+  inline std::unordered_map<page_id_t, int> &GetRowLockCounts() {
+    return row_lock_counts_;
+  }
+
+  // rows of the exclusive lock set locked in their slot (see SLOT_ROW_LOCKS)
+  // instead of the lock table. The lock manager moves them to its lock table
+  // from other threads, under the latch
+  inline std::unordered_set<RID> &GetSlotLockSet() { return slot_lock_set_; }
+
+  inline std::mutex &GetSlotLockLatch() { return slot_lock_latch_; }
+
+  // is the transaction known to the lock manager as a slot lock owner
+  inline bool IsSlotLockOwner() { return slot_lock_owner_; }
+
+  inline void SetSlotLockOwner(bool owner) { slot_lock_owner_ = owner; }
+
   inline TransactionState GetState() { return state_; }
 
   inline void SetState(TransactionState state) { state_ = state; }
 
+  // abort the transaction from another thread (see LockManager),
+  // @return: false if it already committed or aborted
+  inline bool Kill() {
+    TransactionState state = state_;
+    while (state != TransactionState::COMMITTED &&
+           state != TransactionState::ABORTED) {
+      if (state_.compare_exchange_weak(state, TransactionState::ABORTED)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
   inline lsn_t GetPrevLSN() { return prev_lsn_; }
 
   inline void SetPrevLSN(lsn_t prev_lsn) { prev_lsn_ = prev_lsn; }
 
+  // the commit of the transaction waits until the log is durable up to here:
+  // the latest commit record of the transactions whose early released locks
+  // it took (see EARLY_LOCK_RELEASE)
+  inline lsn_t GetDependencyLSN() { return dependency_lsn_; }
+
+  inline void AddDependency(lsn_t lsn) {
+    if (lsn > dependency_lsn_) {
+      dependency_lsn_ = lsn;
+    }
+  }
+
+  // commit returns before the commit record is durable, see
+  // ASYNC_COMMIT_WINDOW
+  inline bool IsAsyncCommit() { return async_commit_; }
+
+  inline void SetAsyncCommit(bool async_commit) { async_commit_ = async_commit; }
+
+  // a read-only transaction reads the snapshot of what was committed up to
+  // its read timestamp and takes no locks (see VersionStore),
+  // INVALID_TIMESTAMP for the others
+  inline bool IsReadOnly() { return read_ts_ != INVALID_TIMESTAMP; }
+
+  inline timestamp_t GetReadTimestamp() { return read_ts_; }
+
+  inline void SetReadTimestamp(timestamp_t read_ts) { read_ts_ = read_ts; }
+
+  // log records not appended to the log yet, see
+  // LogManager::AppendTxnLogRecord
+  inline std::vector<LogRecord> &GetPrivateLog() { return private_log_; }
+
+  inline int GetPrivateLogSize() { return private_log_size_; }
+
+  inline void SetPrivateLogSize(int size) { private_log_size_ = size; }
+
+  // pages changed by the private log -> the page and the buffer pool its pin
+  // is kept in until the private log is appended (nullptr if not kept)
+  inline std::unordered_map<page_id_t, std::pair<Page *, BufferPoolManager *>> &
+  GetPrivateLogPages() {
+    return private_log_pages_;
+  }
+
+  // keep the pin of the caller on page if the private log changed it and
+  // holds no pin on it yet, @return: false if the caller should unpin it
+  inline bool KeepPrivateLogPin(Page *page, BufferPoolManager *bpm) {
+    auto it = private_log_pages_.find(page->GetPageId());
+    if (it == private_log_pages_.end() || it->second.second != nullptr) {
+      return false;
+    }
+    it->second.second = bpm;
+    return true;
+  }
+
 private:
-  TransactionState state_;
+  // the lock manager may abort a waiting transaction
+  std::atomic<TransactionState> state_;
   // thread id, single-threaded transactions
   std::thread::id thread_id_;
   // transaction id
@@ -112,6 +226,16 @@ private:
   std::shared_ptr<std::deque<WriteRecord>> write_set_;
   // prev lsn当前执行过最新的日志记录
   lsn_t prev_lsn_;
+  lsn_t dependency_lsn_;
+  // a crash may lose this transaction once committed, up to the async
+  // commit window
+  bool async_commit_;
+  timestamp_t read_ts_;
+  // tuple log records kept back and their serialized size
+  std::vector<LogRecord> private_log_;
+  int private_log_size_;
+  std::unordered_map<page_id_t, std::pair<Page *, BufferPoolManager *>>
+      private_log_pages_;
 
   // Below are used by concurrent index
   // this deque contains page pointer that was latche during index operation
@@ -124,5 +248,11 @@ private:
   std::shared_ptr<std::unordered_set<RID>> shared_lock_set_;
   // this set contains rid of exclusive-locked tuples by this transaction
   std::shared_ptr<std::unordered_set<RID>> exclusive_lock_set_;
+  std::unordered_map<RID, LockMode> table_lock_set_;
+  std::unordered_map<page_id_t, page_id_t> locked_pages_;
+  std::unordered_map<page_id_t, int> row_lock_counts_;
+  std::unordered_set<RID> slot_lock_set_;
+  std::mutex slot_lock_latch_;
+  bool slot_lock_owner_;
 };
 } // namespace cmudb
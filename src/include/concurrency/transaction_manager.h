@@ -5,27 +5,73 @@
 
 #pragma once
 #include <atomic>
+#include <mutex>
+#include <set>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "common/config.h"
 #include "concurrency/lock_manager.h"
+#include "concurrency/version_store.h"
 #include "logging/log_manager.h"
 
 namespace cmudb {
 class TransactionManager {
 public:
   TransactionManager(LockManager *lock_manager,
-                           LogManager *log_manager = nullptr)
-      : next_txn_id_(0), lock_manager_(lock_manager),
-        log_manager_(log_manager) {}
-  Transaction *Begin();
+                           LogManager *log_manager = nullptr,
+                           VersionStore *version_store = nullptr)
+      : next_txn_id_(0), async_commit_(false), lock_manager_(lock_manager),
+        log_manager_(log_manager), version_store_(version_store),
+        issued_commit_ts_(0), last_commit_ts_(0) {}
+  // with a version store a read-only transaction reads a snapshot of what
+  // is committed when it begins, without locks and without logging
+  Transaction *Begin(bool read_only = false);
+  // throws if the commit record can't be made durable (a log write failed).
+  // Snapshots see the commit once its COMMIT record is durable (appended
+  // with async commit), never before
   void Commit(Transaction *txn);
   void Abort(Transaction *txn);
 
+  // default commit mode of transactions begun from now on
+  inline void SetAsyncCommit(bool async_commit) { async_commit_ = async_commit; }
+
+  // txn id -> last lsn of every running transaction, for fuzzy checkpoints.
+  // oldest_lsn is the lsn of the oldest BEGIN among them (INVALID_LSN if
+  // none), undo may need the log back to there.
+  void GetActiveTxnTable(std::vector<std::pair<txn_id_t, lsn_t>> &active_txn_table,
+                         lsn_t &oldest_lsn);
+
 private:
   std::atomic<txn_id_t> next_txn_id_;
+  std::atomic<bool> async_commit_;
+  // running transactions and their BEGIN lsn, only kept with logging on.
+  // Added after BEGIN is appended, removed after COMMIT/ABORT is appended;
+  // the latch only covers the table, appends do not serialize on it.
+  std::unordered_map<txn_id_t, std::pair<Transaction *, lsn_t>> active_txns_;
+  std::mutex active_latch_;
   LockManager *lock_manager_;
   LogManager *log_manager_;
+
+  // end the snapshot of a read-only txn, prune what no snapshot needs
+  void EndSnapshot(Transaction *txn);
+  // make the commit of txn at commit_ts visible to snapshots, or if it is
+  // not durable only let the commits after it through
+  void PublishCommit(Transaction *txn, timestamp_t commit_ts, bool durable);
+
+  // keeps the changes of writers, they get a commit timestamp when they
+  // commit. Commits and snapshots are ordered by the latch
+  VersionStore *version_store_;
+  // last commit timestamp handed out
+  timestamp_t issued_commit_ts_;
+  // snapshots read at this one, every commit up to it is published
+  timestamp_t last_commit_ts_;
+  // handed out but not published yet
+  std::set<timestamp_t> pending_commits_;
+  // read timestamps of the running snapshots
+  std::multiset<timestamp_t> snapshots_;
+  std::mutex ts_latch_;
 };
 
 } // namespace cmudb
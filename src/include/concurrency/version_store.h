@@ -0,0 +1,79 @@
+/**
+ * version_store.h
+ *
+ * Old versions of rows, for snapshot reads (multi-versioning).
+ * A table page only holds the newest version of a row. Before a writer
+ * changes a row the version it replaces is added to the chain of the row,
+ * found by its rid, newest last. Versions of a writer become visible at its
+ * commit timestamp. A snapshot reading the row at read_ts starts from the
+ * page and steps back through the chain until it meets a change committed at
+ * or before read_ts. Writers hold their row locks until they commit, so the
+ * changes of a row are in commit order along its chain.
+ */
+
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "common/config.h"
+#include "common/rid.h"
+#include "table/tuple.h"
+
+namespace cmudb {
+
+class VersionStore {
+  struct Version {
+    Version(txn_id_t w, bool e, const Tuple &t)
+        : writer(w), commit_ts(INVALID_TIMESTAMP), exists(e), tuple(t) {}
+    // the change made by writer replaced this version
+    txn_id_t writer;
+    // INVALID_TIMESTAMP until writer commits
+    timestamp_t commit_ts;
+    // false if writer inserted the row
+    bool exists;
+    Tuple tuple;
+  };
+
+public:
+  VersionStore() = default;
+
+  // disable copy
+  VersionStore(VersionStore const &) = delete;
+  VersionStore &operator=(VersionStore const &) = delete;
+
+  // remember the row at rid as it was before writer changed it, nullptr if
+  // there was none. Called with the write latch of its page held
+  void AddVersion(txn_id_t writer, const RID &rid, const Tuple *before);
+
+  // the changes of writer are visible from commit_ts on. Versions no
+  // snapshot at or after oldest_ts needs are dropped right away
+  void Commit(txn_id_t writer, timestamp_t commit_ts, timestamp_t oldest_ts);
+
+  // drop the versions of writer, its changes are rolled back
+  void Abort(txn_id_t writer);
+
+  // turn the row at rid as it is on its page (exists, tuple) into the row as
+  // of read_ts. Called with the read latch of its page held.
+  // @return: whether the row exists as of read_ts
+  bool Read(const RID &rid, timestamp_t read_ts, Tuple &tuple, bool exists);
+
+  // drop the versions every snapshot at or after oldest_ts sees through
+  void Prune(timestamp_t oldest_ts);
+
+  // number of versions kept
+  size_t GetVersionCount();
+
+private:
+  // drop the committed versions of chain older than oldest_ts
+  void PruneChain(const RID &rid, timestamp_t oldest_ts);
+
+  std::mutex latch_;
+  std::unordered_map<RID, std::deque<Version>> chains_;
+  // rows with versions of each writer that has not finished yet
+  std::unordered_map<txn_id_t, std::vector<RID>> writes_;
+};
+
+} // namespace cmudb
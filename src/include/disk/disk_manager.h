@@ -11,7 +11,9 @@
 #include <atomic>
 #include <fstream>
 #include <future>
+#include <mutex>
 #include <string>
+#include <sys/uio.h>
 
 #include "common/config.h"
 
@@ -20,34 +22,76 @@ namespace cmudb {
 class DiskManager {
 public:
   DiskManager(const std::string &db_file);
-  ~DiskManager();
+  virtual ~DiskManager();
 
-  void WritePage(page_id_t page_id, const char *page_data);
-  void ReadPage(page_id_t page_id, char *page_data);
+  virtual void WritePage(page_id_t page_id, const char *page_data);
+  virtual void ReadPage(page_id_t page_id, char *page_data);
 
-  void WriteLog(char *log_data, int size);
-  bool ReadLog(char *log_data, int size, int offset);
+  // @return: false if the log could not be written or synced, part of it
+  // may have reached the log file
+  bool WriteLog(char *log_data, int size);
+  // write count buffers back to back, with a single sync (gather write)
+  virtual bool WriteLog(const struct iovec *log_data, int count);
+  virtual bool ReadLog(char *log_data, int size, log_offset_t offset);
+  // bytes already in the log file
+  virtual log_offset_t GetLogSize();
+  // delete log segments that end before offset, reading there fails afterwards
+  virtual void TruncateLog(log_offset_t offset);
+  // drop the log from offset on (recovery cuts a torn tail with it)
+  virtual void TruncateLogTail(log_offset_t offset);
+  // disk manager of an extra log stream (see LOG_STREAMS), owned by the caller
+  virtual DiskManager *OpenLogStream(int log_stream);
 
-  page_id_t AllocatePage();
-  void DeallocatePage(page_id_t page_id);
+  // master record: log offset of the block holding the last complete
+  // checkpoint record
+  virtual void WriteMasterRecord(log_offset_t checkpoint_offset);
+  virtual bool ReadMasterRecord(log_offset_t &checkpoint_offset);
 
-  int GetNumFlushes() const;
-  bool GetFlushState() const;
-  inline void SetFlushLogFuture(std::future<void> *f) { flush_log_f_ = f; }
-  inline bool HasFlushLogFuture() { return flush_log_f_ != nullptr; }
+  virtual page_id_t AllocatePage();
+  virtual void DeallocatePage(page_id_t page_id);
+  // pages up to page_id are in use, AllocatePage goes on after them
+  virtual void ReservePages(page_id_t page_id);
+
+  virtual int GetNumFlushes() const;
+  virtual bool GetFlushState() const;
+  virtual void SetFlushLogFuture(std::future<void> *f) { flush_log_f_ = f; }
+  virtual bool HasFlushLogFuture() { return flush_log_f_ != nullptr; }
+
+protected:
+  // for subclasses that do not own a database/log file
+  DiskManager();
+
+  std::atomic<page_id_t> next_page_id_;
+  int num_flushes_;
+  bool flush_log_;
+  std::future<void> *flush_log_f_;
 
 private:
+  DiskManager(const std::string &db_file, int log_stream);
   int GetFileSize(const std::string &name);
-  // stream to write log file
-  std::fstream log_io_;
+  void OpenLog();
+  // the log is split into LOG_SEGMENT_SIZE files, log offsets are counted
+  // from the start of segment 0 and stay valid across rotation (they are 64
+  // bit, the log ever written may outgrow an int long after old segments
+  // are dropped)
+  std::string GetSegmentName(int segment);
+  // log offset of the first byte of segment
+  log_offset_t GetSegmentOffset(int segment);
+  void OpenLogSegment(int segment);
+  // descriptor of the last log segment, opened for append: log writes,
+  // fdatasync and reads of that segment all go through it
+  int log_fd_;
   std::string log_name_;
+  // protects the segment bookkeeping below
+  std::mutex log_latch_;
+  int first_segment_;
+  int last_segment_;
+  // bytes in the last segment
+  int segment_size_;
   // stream to write db file
   std::fstream db_io_;
   std::string file_name_;
-  std::atomic<page_id_t> next_page_id_;
-  int num_flushes_;
-  bool flush_log_;
-  std::future<void> *flush_log_f_;
+  std::string master_name_;
 };
 
 } // namespace cmudb
\ No newline at end of file
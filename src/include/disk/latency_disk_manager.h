@@ -0,0 +1,119 @@
+/**
+ * latency_disk_manager.h
+ *
+ * Disk manager decorator that emulates a slow storage device. Every page/log
+ * I/O is delayed by a latency sampled from a configurable distribution, and
+ * the bytes transferred are throttled by a bandwidth cap that is shared by
+ * all I/O (the device serves one transfer at a time).
+ *
+ * It either forwards the I/O to another disk manager after the delay, or keeps
+ * pages and log in memory so that benchmarks do not depend on the page cache.
+ */
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include "disk/disk_manager.h"
+
+namespace cmudb {
+
+enum class LatencyDistribution { FIXED = 0, UNIFORM, EXPONENTIAL };
+
+// latency of one kind of I/O
+struct IoLatency {
+  IoLatency(std::chrono::microseconds mean = std::chrono::microseconds(0),
+            LatencyDistribution distribution = LatencyDistribution::FIXED,
+            std::chrono::microseconds jitter = std::chrono::microseconds(0))
+      : mean(mean), distribution(distribution), jitter(jitter) {}
+  std::chrono::microseconds mean;
+  LatencyDistribution distribution;
+  // for UNIFORM: latency is drawn from [mean - jitter, mean + jitter]
+  std::chrono::microseconds jitter;
+};
+
+struct DiskLatencyConfig {
+  IoLatency read_page;
+  IoLatency write_page;
+  IoLatency write_log;
+  IoLatency read_log;
+  // bandwidth cap in bytes per second, 0 means unlimited
+  uint64_t bandwidth = 0;
+  // seed of the latency generator, same seed => same delays
+  uint32_t seed = 0;
+};
+
+class LatencyDiskManager : public DiskManager {
+public:
+  // delay I/O, then forward it to disk_manager (not owned)
+  LatencyDiskManager(DiskManager *disk_manager,
+                     const DiskLatencyConfig &config);
+  // delay I/O, pages and log live in memory
+  explicit LatencyDiskManager(const DiskLatencyConfig &config);
+  ~LatencyDiskManager() {}
+
+  void WritePage(page_id_t page_id, const char *page_data) override;
+  void ReadPage(page_id_t page_id, char *page_data) override;
+
+  using DiskManager::WriteLog;
+  bool WriteLog(const struct iovec *log_data, int count) override;
+  bool ReadLog(char *log_data, int size, log_offset_t offset) override;
+  log_offset_t GetLogSize() override;
+  void TruncateLog(log_offset_t offset) override;
+  void TruncateLogTail(log_offset_t offset) override;
+  // an extra log stream is another emulated device with the same latencies
+  DiskManager *OpenLogStream(int log_stream) override;
+
+  void WriteMasterRecord(log_offset_t checkpoint_offset) override;
+  bool ReadMasterRecord(log_offset_t &checkpoint_offset) override;
+
+  page_id_t AllocatePage() override;
+  void DeallocatePage(page_id_t page_id) override;
+  void ReservePages(page_id_t page_id) override;
+
+  int GetNumFlushes() const override;
+  bool GetFlushState() const override;
+  void SetFlushLogFuture(std::future<void> *f) override;
+  bool HasFlushLogFuture() override;
+
+  // statistics, for benchmark report
+  inline uint64_t GetNumIOs() const { return num_ios_; }
+  inline std::chrono::microseconds GetInjectedDelay() const {
+    return std::chrono::microseconds(injected_delay_);
+  }
+
+private:
+  // block the caller as long as the emulated device needs for this I/O
+  void Delay(const IoLatency &latency, int size);
+  std::chrono::microseconds SampleLatency(const IoLatency &latency);
+
+  DiskManager *disk_manager_; // nullptr when backed by memory
+  // disk_manager_ of a log stream, which is owned
+  std::unique_ptr<DiskManager> stream_disk_manager_;
+  DiskLatencyConfig config_;
+
+  // protect the generator and the device time line
+  std::mutex latch_;
+  std::mt19937 generator_;
+  // emulated device is busy transferring until this time point
+  std::chrono::steady_clock::time_point busy_until_;
+  // statistics, read without the latch
+  std::atomic<uint64_t> num_ios_;
+  // in microseconds
+  std::atomic<int64_t> injected_delay_;
+
+  // in memory "files"
+  std::mutex file_latch_;
+  std::vector<char> db_file_;
+  std::vector<char> log_file_;
+  // log offset of log_file_[0], moves forward on truncation
+  log_offset_t log_start_;
+  log_offset_t master_record_;
+};
+
+} // namespace cmudb
@@ -7,6 +7,16 @@
  * (2) support insert & remove
  * (3) The structure should shrink and grow dynamically
  * (4) Implement index iterator for range scan
+ * (5) With logging on, every insert/remove logs the bytes it wrote to its
+ *     pages (splits, merges, redistributions and root changes included) in
+ *     one log record, before any of them can be written back, so recovery
+ *     brings the tree back without a rebuild. The record also holds the key
+ *     a transaction inserted or removed: recovery takes it out again (or
+ *     puts it back) if the transaction is a loser
+ * (6) With a lock manager, transactions lock the keys they read and write
+ *     and the gaps next to them (next-key locking), so range scans are
+ *     serializable: an insert waits for the lock of the key after it, which
+ *     a range scan holds for every key it read and the first one past it
  */
 #pragma once
 
@@ -14,6 +24,7 @@
 #include <vector>
 #include <mutex>
 
+#include "concurrency/lock_manager.h"
 #include "concurrency/transaction.h"
 #include "index/index_iterator.h"
 #include "page/b_plus_tree_internal_page.h"
@@ -29,7 +40,8 @@ public:
   explicit BPlusTree(const std::string &name,
                            BufferPoolManager *buffer_pool_manager,
                            const KeyComparator &comparator,
-                           page_id_t root_page_id = INVALID_PAGE_ID);
+                           page_id_t root_page_id = INVALID_PAGE_ID,
+                           LockManager *lock_manager = nullptr);
 
   // Returns true if this B+ tree has no keys and values.
   bool IsEmpty() const;
@@ -45,6 +57,12 @@ public:
   bool GetValue(const KeyType &key, std::vector<ValueType> &result,
                 Transaction *transaction = nullptr);
 
+  // the values of the keys from low to high, in key order. Inserts into the
+  // range wait until transaction ends
+  bool GetRange(const KeyType &low, const KeyType &high,
+                std::vector<ValueType> &result,
+                Transaction *transaction = nullptr);
+
   // index iterator
   INDEXITERATOR_TYPE Begin();
   INDEXITERATOR_TYPE Begin(const KeyType &key);
@@ -90,13 +108,40 @@ private:
 
   void UpdateRootPageId(int insert_record = false);
 
+  // key locks are taken with a lock manager, for transactions reading
+  // without a snapshot
+  bool IsLocking(Transaction *transaction);
+  RID KeyLockId(const KeyType &key);
+  // lock of the first key after key, or of the end of the index
+  RID NextKeyLockId(const KeyType &key);
+  // take key_locks in lock_mode (the first one instantly if instant_first)
+  // with mtx held. mtx is released to wait for a lock, the tree may change
+  // meanwhile: false is returned with restart set, to retry.
+  // @return: false if transaction is aborted
+  bool LockKeys(const std::vector<RID> &key_locks, LockMode lock_mode,
+                bool instant_first, Transaction *transaction, bool &restart);
+
+  // record the pages an operation touches, then log what it wrote to them
+  // and the key change op of transaction (if any)
+  void BeginPageLog(PageCapture &capture);
+  void EndPageLog(PageCapture &capture, Transaction *transaction,
+                  IndexKeyOp op, const KeyType &key, const ValueType &value);
+
   // member variable
   std::string index_name_;
   page_id_t root_page_id_;
   BufferPoolManager *buffer_pool_manager_;
   KeyComparator comparator_;
+  LockManager *lock_manager_;
+  // names the key locks of the tree
+  size_t index_hash_;
 
   std::mutex mtx;
 };
 
+// undo the key change of an INDEXPAGE log record of a loser in the tree it
+// names, without logging: the key is removed, or inserted back, wherever it
+// is now. Throws if the tree is gone
+void UndoIndexKey(LogRecord &log, BufferPoolManager *buffer_pool_manager);
+
 } // namespace cmudb
@@ -90,6 +90,8 @@ public:
   // constructor
   GenericComparator(Schema *key_schema) : key_schema_(key_schema) {}
 
+  inline Schema *GetKeySchema() const { return key_schema_; }
+
 private:
   Schema *key_schema_;
 };
@@ -0,0 +1,66 @@
+/**
+ * checkpoint_manager.h
+ * Fuzzy checkpoints: the active transaction table and the dirty page table
+ * are written into a CHECKPOINT log record while transactions keep running,
+ * nothing is flushed and nothing is blocked. The master record points at the
+ * last checkpoint record, so recovery only reads the log from the oldest
+ * log record still needed by a dirty page or a running transaction.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "buffer/buffer_pool_manager.h"
+#include "concurrency/transaction_manager.h"
+#include "disk/disk_manager.h"
+#include "logging/log_manager.h"
+
+namespace cmudb {
+
+class CheckpointManager {
+public:
+  CheckpointManager(TransactionManager *transaction_manager,
+                    LogManager *log_manager,
+                    BufferPoolManager *buffer_pool_manager,
+                    DiskManager *disk_manager)
+      : transaction_manager_(transaction_manager), log_manager_(log_manager),
+        buffer_pool_manager_(buffer_pool_manager), disk_manager_(disk_manager),
+        truncate_offset_(0), running_(false), checkpoint_thread_(nullptr) {}
+
+  ~CheckpointManager() { StopCheckpointThread(); }
+
+  // disable copy
+  CheckpointManager(CheckpointManager const &) = delete;
+  CheckpointManager &operator=(CheckpointManager const &) = delete;
+
+  // take a checkpoint every CHECKPOINT_TIMEOUT
+  void RunCheckpointThread();
+  void StopCheckpointThread();
+
+  // take a fuzzy checkpoint, returns the lsn of the checkpoint record
+  lsn_t Checkpoint();
+
+  // log file before this offset is not needed by recovery any more
+  inline log_offset_t GetTruncateOffset() { return truncate_offset_; }
+
+private:
+  TransactionManager *transaction_manager_;
+  LogManager *log_manager_;
+  BufferPoolManager *buffer_pool_manager_;
+  DiskManager *disk_manager_;
+
+  // one checkpoint at a time
+  std::mutex checkpoint_latch_;
+  std::atomic<log_offset_t> truncate_offset_;
+
+  // checkpoint thread
+  bool running_;
+  std::mutex latch_;
+  std::condition_variable cv_;
+  std::thread *checkpoint_thread_;
+};
+
+} // namespace cmudb
@@ -0,0 +1,48 @@
+/**
+ * log_compression.h
+ * Block compression of flushed log buffers. Each log buffer that shrinks is
+ * written as one self-describing frame
+ *-------------------------------------------------------------
+ * | 0x00 | 0xFF | 0 | 0 | raw_size | data_size | compressed data |
+ *-------------------------------------------------------------
+ * the frame holds whole log records only (they never span log buffers). A log
+ * record never starts with 0x00 0xFF (see log_record.h), so frames and plain
+ * log records can follow each other in the log file. A buffer that does not
+ * shrink is written as plain log records.
+ * The compressed data is a byte-oriented LZ77: a sequence of
+ * | token | literal length | literals | match offset | match length |
+ * where the token holds 4 bits of each length, 15 means more length bytes
+ * follow. The last sequence is literals only.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace cmudb {
+
+class LogCompression {
+public:
+  static const int FRAME_HEADER_SIZE = 12;
+
+  // compress size bytes of src into a frame at dst, dst has room for size
+  // bytes. @return: frame size, 0 if the frame would not be smaller than size
+  static int CompressBlock(const char *src, int size, char *dst);
+
+  // is there the header of a frame at data?
+  static bool IsFrame(const char *data, int available);
+  // size of the frame at data, including its header
+  static int GetFrameSize(const char *data);
+
+  // decompress the frame at data into dst, which has room for capacity bytes
+  // @return: false if the frame is corrupt or does not fit
+  static bool DecompressBlock(const char *data, char *dst, int capacity,
+                              int &raw_size);
+
+private:
+  static const int MIN_MATCH = 4;
+  static const int MAX_OFFSET = 0xFFFF;
+  static const int HASH_BITS = 12;
+};
+
+} // namespace cmudb
@@ -3,6 +3,30 @@
  * log manager maintain a separate thread that is awaken when the log buffer is
  * full or time out(every X second) to write log buffer's content into disk log
  * file.
+ * Committing transactions ask the flush thread for durability and wait. While
+ * more than one of them waits, the flush thread lingers up to
+ * GROUP_COMMIT_TIMEOUT so that all commits arriving meanwhile are made durable
+ * by the same write + fdatasync (group commit).
+ * Async commits do not wait, the flush thread makes them durable within
+ * ASYNC_COMMIT_WINDOW or ASYNC_COMMIT_BYTES of log, whichever comes first.
+ * Appenders do not serialize on a latch: each one reserves its lsn and its
+ * range of the log buffer with a single atomic fetch_add, then copies the
+ * record concurrently with the others.
+ * Sealed log buffers queue up in a ring of LOG_BUFFER_COUNT buffers, appenders
+ * only block when every buffer of the ring is waiting to be flushed. The flush
+ * thread writes only the filled part of each buffer, so a log record may span
+ * two LOG_BUFFER_SIZE blocks of the log file. With COMPRESS_LOG it writes each
+ * buffer as a compressed frame instead (see log_compression.h).
+ * With PRIVATE_TXN_LOG the tuple changes of a transaction collect in its
+ * private log and reach the log buffer together, with one reservation, when
+ * it commits or aborts (or runs out of private log). Until then the pages
+ * they changed stay pinned and FlushPage refuses them, so they can't be
+ * written back ahead of their log.
+ * With LOG_STREAMS > 1 the log is split into streams, each with its own log
+ * file, buffer ring and flush thread. The log records of a transaction all go
+ * to stream txn_id % LOG_STREAMS, the others to stream 0 (this log manager).
+ * Lsns still come from one counter shared by the streams, recovery merges the
+ * streams back into lsn order.
  */
 
 #pragma once
@@ -10,27 +34,44 @@
 #include <algorithm>
 #include <condition_variable>
 #include <future>
+#include <map>
 #include <mutex>
+#include <vector>
 
 #include "disk/disk_manager.h"
 #include "logging/log_record.h"
 
 namespace cmudb {
 
+    class Page;
+    class Transaction;
+
     class LogManager {
     public:
         explicit LogManager(DiskManager *disk_manager)
-                : promise(nullptr), flush_lsn_(0), next_lsn_(0), persistent_lsn_(INVALID_LSN),
-                  offset_(0), disk_manager_(disk_manager) {
-            log_buffer_ = new char[LOG_BUFFER_SIZE];
-            flush_buffer_ = new char[LOG_BUFFER_SIZE];
+                : LogManager(disk_manager, nullptr) {
+            streams_.push_back(this);
+            if (LOG_STREAMS > 1) {
+                global_lsn_ = &next_lsn_;
+                for (int i = 1; i < LOG_STREAMS; i++) {
+                    streams_.push_back(new LogManager(
+                            disk_manager_->OpenLogStream(i), global_lsn_));
+                }
+            }
         }
 
         ~LogManager() {
-            delete[] log_buffer_;
-            delete[] flush_buffer_;
+            for (size_t i = 1; i < streams_.size(); i++) {
+                delete streams_[i]->disk_manager_;
+                delete streams_[i];
+            }
+            for (int i = 0; i < LOG_BUFFER_COUNT; i++) {
+                delete[] buffers_[i];
+                buffers_[i] = nullptr;
+            }
+            delete[] compress_buffer_;
             log_buffer_ = nullptr;
-            flush_buffer_ = nullptr;
+            compress_buffer_ = nullptr;
         }
 
         // disable copy
@@ -43,39 +84,170 @@ namespace cmudb {
 
         // append a log record into log buffer
         lsn_t AppendLogRecord(LogRecord &log_record);
+        // same, offset is where the log record will be in the uncompressed
+        // log, use GetLogOffset for the log file once it is flushed
+        lsn_t AppendLogRecord(LogRecord &log_record, log_offset_t &offset);
+
+        // append a tuple log record of txn that changed page (latched by the
+        // caller), INSERT/MARKDELETE stay in the private log of txn
+        // @return: lsn, INVALID_LSN if the log record was kept back
+        lsn_t AppendTxnLogRecord(LogRecord &log_record, Transaction *txn,
+                                 Page *page);
+        // append the private log of txn, then tail (if any), and drop the
+        // pins it keeps. Must not hold a page latch
+        // @return: lsn of the last log record, INVALID_LSN if none
+        lsn_t PublishTxnLog(Transaction *txn, LogRecord *tail = nullptr);
+        // make room in the private log of txn for one more tuple change
+        void ReserveTxnLog(Transaction *txn);
+
+        // block until every log record up to and including lsn is on disk
+        // @return: false if it never will be, a log write failed
+        bool WaitUntilPersistent(lsn_t lsn);
+        // make lsn durable within the async commit window, does not block
+        void FlushAsync(lsn_t lsn);
 
         // get/set helper functions
-        inline lsn_t GetPersistentLSN() { return persistent_lsn_; }
+        // every log record up to and including it is on disk, in all streams
+        lsn_t GetPersistentLSN();
         inline void SetPersistentLSN(lsn_t lsn) { persistent_lsn_ = lsn; }
         inline char *GetLogBuffer() { return log_buffer_; }
+        // lsn the next appended log record will get
+        lsn_t GetNextLSN();
 
-        inline std::promise<void> *GetPromise() { return promise; }
-        inline void SetPromise(std::promise<void> *p) { promise = p; }
+        // log streams, stream 0 is the log of disk_manager
+        inline int GetStreamCount() { return streams_.size(); }
+        inline DiskManager *GetDiskManager(int stream) {
+            return streams_[stream]->disk_manager_;
+        }
+        // stream that holds the log records of txn_id
+        static inline int GetStreamOf(txn_id_t txn_id, int stream_count) {
+            return txn_id == INVALID_TXN_ID ? 0 : txn_id % stream_count;
+        }
+
+        // log file offset of stream to read from to find the log records
+        // from lsn on
+        log_offset_t GetLogOffset(lsn_t lsn, int stream = 0);
+        // forget the log file offsets of log records older than lsn
+        void DiscardLogOffsets(lsn_t lsn);
+        // continue the lsn sequence of the log after recovery, must be
+        // called (for every stream) before anything is appended. Log records
+        // of stream from oldest_lsn on are at oldest_offset and after in its
+        // log file.
+        void Resume(lsn_t next_lsn, lsn_t oldest_lsn, log_offset_t oldest_offset,
+                    int stream = 0);
 
+        // force flush everything appended so far, promise (if any) is
+        // fulfilled once it is durable
         void WakeupFlushThread(std::promise<void> *promise);
 
     private:
-        inline void swapBuffer();
-
-        //用于日志刷新线程通知wake_up线程，日志已成功写入
-        std::promise<void> *promise;
-
-        // last log records in the flush_buffer_;
-        lsn_t flush_lsn_;
+        // a stream, lsns come from global_lsn (nullptr: from reserve_)
+        LogManager(DiskManager *disk_manager, std::atomic<lsn_t> *global_lsn)
+                : persistent_lsn_(INVALID_LSN), head_(0), tail_(0),
+                  num_sealed_(0), reserve_(0), completed_(0), generation_(0),
+                  global_lsn_(global_lsn), next_lsn_(0), last_lsn_(INVALID_LSN),
+                  flush_requested_(false), num_waiters_(0),
+                  async_lsn_(INVALID_LSN), write_failed_(false),
+                  flush_thread_(nullptr), disk_manager_(disk_manager) {
+            log_offset_ = disk_manager_->GetLogSize();
+            write_offset_ = log_offset_;
+            flushed_offset_ = log_offset_;
+            offset_index_[0] = log_offset_;
+            for (int i = 0; i < LOG_BUFFER_COUNT; i++) {
+                buffers_[i] = new char[LOG_BUFFER_SIZE];
+                buffer_size_[i] = 0;
+                buffer_lsn_[i] = INVALID_LSN;
+                buffer_first_lsn_[i] = INVALID_LSN;
+            }
+            log_buffer_ = buffers_[head_];
+            compress_buffer_ =
+                    new char[(LOG_BUFFER_COUNT - 1) * LOG_BUFFER_SIZE];
+        }
 
-        // atomic counter, record the next log sequence number
-        std::atomic<lsn_t> next_lsn_;
+        void FlushLoop();
+        // close the log buffer for new reservations, queue it for the flush
+        // thread and move on to the next buffer of the ring, should be called
+        // when holding the lock, which is dropped while copies are in flight
+        void SealLogBuffer(std::unique_lock<std::mutex> &lock, int size,
+                           lsn_t next_lsn);
+        // seal whatever is in the log buffer, called by the flush thread
+        void ForceSealLogBuffer(std::unique_lock<std::mutex> &lock);
+        void SerializeLogRecord(const LogRecord &log_record, char *data);
+        // stream of the log records of txn_id
+        inline LogManager *GetStream(txn_id_t txn_id) {
+            return streams_[GetStreamOf(txn_id, streams_.size())];
+        }
+        // min(lsn, last lsn appended to this stream)
+        lsn_t GetStreamLSN(lsn_t lsn);
+        // WaitUntilPersistent/FlushAsync of this stream alone
+        bool WaitUntilStreamPersistent(lsn_t lsn);
+        void FlushStreamAsync(lsn_t lsn);
+        // append count log records with consecutive lsns, they must fit in a
+        // log buffer. chain: each one after the first gets the one before as
+        // prev lsn. @return: lsn of the last, offset of the first
+        lsn_t AppendLogRecords(LogRecord **records, int count,
+                               log_offset_t &log_offset, bool chain);
 
         // log records before & include persistent_lsn_ have been written to disk
         std::atomic<lsn_t> persistent_lsn_;
 
-        // log buffer related
+        // log buffer ring, log_buffer_ is buffers_[head_] and the sealed
+        // buffers waiting for the flush thread start at tail_
+        char *buffers_[LOG_BUFFER_COUNT];
+        // bytes used in each sealed buffer
+        int buffer_size_[LOG_BUFFER_COUNT];
+        // last log record in each sealed buffer
+        lsn_t buffer_lsn_[LOG_BUFFER_COUNT];
+        // first log record in each buffer, only kept with several streams
+        lsn_t buffer_first_lsn_[LOG_BUFFER_COUNT];
+        int head_;
+        int tail_;
+        int num_sealed_;
         char *log_buffer_;
-        char *flush_buffer_;
+        // compressed frames of the sealed buffers, with COMPRESS_LOG
+        char *compress_buffer_;
+        // offset of log_buffer_ in the uncompressed log
+        log_offset_t log_offset_;
+        // log file offset the next flush is written at
+        log_offset_t write_offset_;
+        // first lsn of each flushed log buffer -> its log file offset
+        std::map<lsn_t, log_offset_t> offset_index_;
+
+        // appenders reserve lsn and buffer space with one fetch_add:
+        // | next lsn (high 32 bits) | next offset in log_buffer_ (low 32 bits) |
+        // an offset beyond LOG_BUFFER_SIZE means the buffer is being sealed
+        std::atomic<uint64_t> reserve_;
+        // bytes of log_buffer_ whose copy is finished
+        std::atomic<int> completed_;
+        // bumped each time log_buffer_ is switched
+        std::atomic<uint64_t> generation_;
+
+        // every stream, this one first. Empty in the other streams
+        std::vector<LogManager *> streams_;
+        // with several streams, lsns are taken from this counter (next_lsn_
+        // of stream 0) together with the buffer range under append_latch_,
+        // so that each stream stays in lsn order
+        std::atomic<lsn_t> *global_lsn_;
+        std::atomic<lsn_t> next_lsn_;
+        std::mutex append_latch_;
+        // last lsn appended to this stream, protected by append_latch_
+        lsn_t last_lsn_;
 
-        int offset_;
+        // a committer (or buffer pool) is waiting for durability
+        bool flush_requested_;
+        // threads blocked in WaitUntilStreamPersistent
+        int num_waiters_;
+        // last async commit that is not durable yet (or INVALID_LSN), the
+        // flush thread wakes up at its deadline
+        lsn_t async_lsn_;
+        std::chrono::steady_clock::time_point async_deadline_;
+        // offset in the uncompressed log up to which the log is durable
+        log_offset_t flushed_offset_;
+        // a log write or sync failed: the log file may be torn, nothing is
+        // written (or made durable) anymore
+        bool write_failed_;
 
-        // latch to protect shared member variables
+        // latch to protect buffer switching and flush related members
         std::mutex latch_;
 
         // flush thread
@@ -83,6 +255,11 @@ namespace cmudb {
 
         // for notifying flush thread
         std::condition_variable cv_;
+        // for notifying threads waiting on a flush to finish (which frees
+        // buffers of the ring)
+        std::condition_variable flushed_cv_;
+        // for notifying appenders waiting on log buffer switching
+        std::condition_variable switched_cv_;
 
         // disk manager
         DiskManager *disk_manager_;
@@ -6,6 +6,17 @@
  *-------------------------------------------------------------
  * | size | LSN | transID | prevLSN | LogType |
  *-------------------------------------------------------------
+ * or, when COMPACT_LOG_HEADER is set, a compact header (7 bytes and up)
+ *-------------------------------------------------------------
+ * | LogType | 0x80 + flags | size | LSN | transID | prevLSN |
+ *-------------------------------------------------------------
+ * size, transID and prevLSN are varints, LSN is 4 bytes because it is only
+ * known once the record has its place in the log buffer. transID/prevLSN are
+ * left out when INVALID (flagged), prevLSN also when it is LSN - 1 (flagged,
+ * records of a transaction appended together). The second byte of a 20-byte header is
+ * always below 0x80 since a record fits in a log buffer, so both formats can
+ * be told apart and read back. No record starts with 0x00 0xFF, the header
+ * of a compressed block (see log_compression.h).
  * For insert type log record
  *-------------------------------------------------------------
  * | HEADER | tuple_rid | tuple_size | tuple_data(char[] array) |
@@ -19,15 +30,48 @@
  * | HEADER | tuple_rid | tuple_size | old_tuple_data | tuple_size |
  * | new_tuple_data |
  *------------------------------------------------------------------------------
+ * For update type log record that only carries the changed byte ranges
+ * (UPDATEDELTA, picked automatically when it is smaller than UPDATE)
+ *------------------------------------------------------------------------------
+ * | HEADER | tuple_rid | old_tuple_size | new_tuple_size | range_count |
+ * | offset | old_len | new_len | old_data | new_data | ... (range_count times)
+ *------------------------------------------------------------------------------
+ * range offsets are relative to the old tuple, ranges are sorted by offset
  * For new page type log record
  *-------------------------------------------------------------
- * | HEADER | prev_page_id |
+ * | HEADER | prev_page_id | [slot_locks] |
  *-------------------------------------------------------------
+ * slot_locks (4) is only there for pages of a table with slot lock words
+ * For fuzzy checkpoint log record (transID is INVALID_TXN_ID)
+ *------------------------------------------------------------------------------
+ * | HEADER | redo_lsn | recovery_offset (8) | txn_count | txn_id | last_lsn |
+ * | ... | page_count | page_id | rec_lsn | ... |
+ * | [stream_count | offset (8) | ... ] |
+ *------------------------------------------------------------------------------
+ * redo starts at redo_lsn, recovery reads the log from recovery_offset (the
+ * first record any active transaction or dirty page still needs). With
+ * several log streams the same offset of streams 1.. follows
+ * For index page log record
+ *------------------------------------------------------------------------------
+ * | HEADER | key_op | [ name_size | index_name | rid | column_count | type |
+ * | length | ... | key_size | key_data ] | page_count | page_id | new_page |
+ * | delta_size | range_count | offset | length | data | ... | ... |
+ *------------------------------------------------------------------------------
+ * the bytes one B+ tree operation wrote to every page it changed (the header
+ * page included), a new page is zeroed before its ranges are copied in. With
+ * a transaction, the key it inserted or removed comes first, with the value,
+ * the index name and the key schema (type and length of each column):
+ * recovery undoes it for a loser by removing or inserting the key again.
+ * Without a transaction (transID is INVALID_TXN_ID, key_op is NONE), the
+ * record is redo only.
  */
 
 #pragma once
 
 #include <cassert>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "common/config.h"
 #include "table/tuple.h"
@@ -46,6 +90,16 @@ namespace cmudb {
         COMMIT,
         ABORT,
         NEWPAGE,  // when create a new page in heap table
+        UPDATEDELTA,  // update that only logs the changed byte ranges
+        CHECKPOINT,   // active transaction table + dirty page table
+        INDEXPAGE,    // bytes written to pages by a B+ tree operation
+    };
+
+// key change of an INDEXPAGE log record
+    enum class IndexKeyOp {
+        NONE = 0,
+        INSERT,
+        REMOVE,
     };
 
     class LogRecord {
@@ -81,30 +135,80 @@ namespace cmudb {
             size_ = HEADER_SIZE + sizeof(RID) + sizeof(int32_t) + tuple.GetLength();
         }
 
-        // constructor for UPDATE type
+        // constructor for UPDATE type, switches to UPDATEDELTA when the changed
+        // byte ranges are smaller than both tuple images
         LogRecord(txn_id_t txn_id, lsn_t prev_lsn, LogRecordType log_record_type,
                   const RID &update_rid, const Tuple &old_tuple,
                   const Tuple &new_tuple)
                 : lsn_(INVALID_LSN), txn_id_(txn_id), prev_lsn_(prev_lsn),
                   log_record_type_(log_record_type), update_rid_(update_rid),
                   old_tuple_(old_tuple), new_tuple_(new_tuple) {
+            assert(log_record_type == LogRecordType::UPDATE);
             // calculate log record size
             size_ = HEADER_SIZE + sizeof(RID) + old_tuple.GetLength() +
                     new_tuple.GetLength() + 2*sizeof(int32_t);
+            BuildUpdateDelta();
+            if (HEADER_SIZE + sizeof(RID) + update_delta_.size() <
+                static_cast<size_t>(size_)) {
+                log_record_type_ = LogRecordType::UPDATEDELTA;
+                size_ = HEADER_SIZE + sizeof(RID) + update_delta_.size();
+            } else {
+                update_delta_.clear();
+            }
         }
 
         // constructor for NEWPAGE type
         LogRecord(txn_id_t txn_id, lsn_t prev_lsn, LogRecordType log_record_type,
-                  page_id_t page_id)
+                  page_id_t page_id, bool slot_locks = false)
                 : size_(HEADER_SIZE), lsn_(INVALID_LSN), txn_id_(txn_id),
                   prev_lsn_(prev_lsn), log_record_type_(log_record_type),
-                  prev_page_id_(page_id) {
+                  prev_page_id_(page_id), slot_locks_(slot_locks) {
+            // calculate log record size
+            size_ = HEADER_SIZE + sizeof(page_id_t) +
+                    (slot_locks ? sizeof(int32_t) : 0);
+        }
+
+        // constructor for CHECKPOINT type
+        LogRecord(LogRecordType log_record_type, lsn_t redo_lsn,
+                  log_offset_t recovery_offset,
+                  const std::vector<std::pair<txn_id_t, lsn_t>> &active_txn_table,
+                  const std::vector<std::pair<page_id_t, lsn_t>> &dirty_page_table,
+                  const std::vector<log_offset_t> &stream_offsets =
+                          std::vector<log_offset_t>())
+                : lsn_(INVALID_LSN), txn_id_(INVALID_TXN_ID), prev_lsn_(INVALID_LSN),
+                  log_record_type_(log_record_type), redo_lsn_(redo_lsn),
+                  recovery_offset_(recovery_offset),
+                  active_txn_table_(active_txn_table),
+                  dirty_page_table_(dirty_page_table),
+                  stream_offsets_(stream_offsets) {
+            assert(log_record_type == LogRecordType::CHECKPOINT);
             // calculate log record size
-            size_ = HEADER_SIZE + sizeof(page_id_t);
+            size_ = HEADER_SIZE + sizeof(lsn_t) + sizeof(log_offset_t) +
+                    2 * sizeof(int32_t) +
+                    active_txn_table.size() * (sizeof(txn_id_t) + sizeof(lsn_t)) +
+                    dirty_page_table.size() * (sizeof(page_id_t) + sizeof(lsn_t));
+            if (!stream_offsets.empty()) {
+                size_ += sizeof(int32_t) +
+                         stream_offsets.size() * sizeof(log_offset_t);
+            }
+        }
+
+        // constructor for INDEXPAGE type, the key change of txn (if any) and
+        // the changed pages are added by SetIndexKey and AddIndexPage
+        LogRecord(LogRecordType log_record_type, txn_id_t txn_id, lsn_t prev_lsn)
+                : size_(HEADER_SIZE + 2 * sizeof(int32_t)), lsn_(INVALID_LSN),
+                  txn_id_(txn_id), prev_lsn_(prev_lsn),
+                  log_record_type_(log_record_type) {
+            assert(log_record_type == LogRecordType::INDEXPAGE);
         }
 
         ~LogRecord() {}
 
+        // switch to the compact header, size_ shrinks accordingly. chained:
+        // the record will get the lsn right after prev_lsn_, which is then
+        // left out
+        void UseCompactHeader(bool chained = false);
+
         inline RID &GetDeleteRID() { return delete_rid_; }
 
         inline Tuple &GetInserteTuple() { return insert_tuple_; }
@@ -117,10 +221,75 @@ namespace cmudb {
 
         inline Tuple &GetUpdateOldTuple() { return old_tuple_; }
 
+        // rebuild the other image of an UPDATEDELTA tuple: the new tuple from
+        // the old one (redo), or the old tuple from the new one (undo)
+        // @return: false if image does not match the logged tuple size
+        bool ApplyUpdateDelta(const Tuple &image, Tuple &result, bool undo) const;
+
         inline page_id_t GetNewPageRecord() { return prev_page_id_; }
+        // the new page has slot lock words (see TablePage)
+        inline bool HasSlotLocks() { return slot_locks_; }
+
+        // key (of key_size bytes) inserted into or removed from the index
+        // named index_name, columns: type and length of each key column
+        void SetIndexKey(IndexKeyOp op, const std::string &index_name,
+                         const char *key, int key_size,
+                         const std::vector<std::pair<TypeId, int32_t>> &columns,
+                         const RID &rid);
+
+        // log the byte ranges that differ between the old and the new image
+        // of a page
+        void AddIndexPage(page_id_t page_id, bool new_page,
+                          const char *old_data, const char *new_data);
+
+        inline int GetIndexPageCount() { return index_pages_.size(); }
+
+        inline page_id_t GetIndexPageId(int i = 0) {
+            return index_pages_[i].page_id;
+        }
+
+        inline bool IsNewIndexPage(int i = 0) { return index_pages_[i].new_page; }
+
+        // copy the logged byte ranges of page i into data
+        void ApplyPageDelta(char *data, int i = 0) const;
+
+        // the changes of page i alone, with the same lsn. Redo replays an
+        // INDEXPAGE record page by page
+        LogRecord GetIndexPagePart(int i) const;
+
+        inline IndexKeyOp GetIndexKeyOp() { return index_key_op_; }
+
+        inline const std::string &GetIndexName() { return index_name_; }
+
+        inline const std::vector<char> &GetIndexKey() { return index_key_; }
+
+        inline const std::vector<std::pair<TypeId, int32_t>> &GetIndexKeyColumns() {
+            return index_key_columns_;
+        }
+
+        inline RID &GetIndexRID() { return index_rid_; }
+
+        inline lsn_t GetRedoLSN() { return redo_lsn_; }
+
+        inline log_offset_t GetRecoveryOffset() { return recovery_offset_; }
+
+        inline std::vector<std::pair<txn_id_t, lsn_t>> &GetActiveTxnTable() {
+            return active_txn_table_;
+        }
+
+        inline std::vector<std::pair<page_id_t, lsn_t>> &GetDirtyPageTable() {
+            return dirty_page_table_;
+        }
+
+        // recovery offsets of log streams 1.., empty with a single stream
+        inline std::vector<log_offset_t> &GetStreamOffsets() {
+            return stream_offsets_;
+        }
 
         inline int32_t GetSize() { return size_; }
 
+        inline int32_t GetHeaderSize() { return header_size_; }
+
         inline lsn_t GetLSN() { return lsn_; }
 
         inline txn_id_t GetTxnId() { return txn_id_; }
@@ -151,6 +320,10 @@ namespace cmudb {
         txn_id_t txn_id_ = INVALID_TXN_ID;
         lsn_t prev_lsn_ = INVALID_LSN;
         LogRecordType log_record_type_ = LogRecordType::INVALID;
+        // HEADER_SIZE, or the size of the compact header
+        int32_t header_size_ = HEADER_SIZE;
+        // compact header without prevLSN, see UseCompactHeader
+        bool chained_ = false;
 
         // case1: for delete operation, delete_tuple_ for UNDO operation
         RID delete_rid_;
@@ -164,10 +337,55 @@ namespace cmudb {
         RID update_rid_;
         Tuple old_tuple_;
         Tuple new_tuple_;
+        // UPDATEDELTA body after the rid, old_tuple_/new_tuple_ are empty
+        // when the log record is read back from disk
+        std::vector<char> update_delta_;
 
         // case4: for new page operation
         page_id_t prev_page_id_ = INVALID_PAGE_ID;
+        bool slot_locks_ = false;
+
+        // case5: for checkpoint
+        lsn_t redo_lsn_ = INVALID_LSN;
+        log_offset_t recovery_offset_ = 0;
+        std::vector<std::pair<txn_id_t, lsn_t>> active_txn_table_;
+        std::vector<std::pair<page_id_t, lsn_t>> dirty_page_table_;
+        std::vector<log_offset_t> stream_offsets_;
+
+        // case6: for index page, one delta per page
+        struct IndexPageDelta {
+            page_id_t page_id;
+            bool new_page;
+            // | range_count | offset | length | data | ... |
+            std::vector<char> delta;
+        };
+        std::vector<IndexPageDelta> index_pages_;
+        // the key change undone for a loser
+        IndexKeyOp index_key_op_ = IndexKeyOp::NONE;
+        std::string index_name_;
+        std::vector<char> index_key_;
+        std::vector<std::pair<TypeId, int32_t>> index_key_columns_;
+        RID index_rid_;
         const static int HEADER_SIZE = 20;
+        // second byte of a compact header
+        const static uint8_t COMPACT_HEADER = 0x80;
+        const static uint8_t NO_TXN_ID = 0x01;
+        const static uint8_t NO_PREV_LSN = 0x02;
+        const static uint8_t CHAINED_PREV_LSN = 0x04;
+        // | offset | old_len | new_len | of an UPDATEDELTA range
+        const static int RANGE_HEADER_SIZE = 12;
+        // | offset | length | of an INDEXPAGE range
+        const static int PAGE_RANGE_HEADER_SIZE = 8;
+
+        void BuildUpdateDelta();
+        static void BuildPageDelta(const char *old_data, const char *new_data,
+                                   std::vector<char> &delta);
+
+        // LEB128 varints of the compact header
+        static int VarintSize(uint32_t value);
+        static int PutVarint(char *data, uint32_t value);
+        // @return: bytes read, 0 if the varint does not end within available
+        static int GetVarint(const char *data, int available, uint32_t &value);
     }; // namespace cmudb
 
 } // namespace cmudb
\ No newline at end of file
@@ -1,12 +1,24 @@
 /**
  * recovery_manager.h
  * Read log file from disk, redo and undo
+ * With several log streams (LOG_STREAMS) redo merges them back into lsn
+ * order. Streams are flushed independently, so a crash can leave one stream
+ * ahead of the others: replay stops at the first missing lsn and every
+ * stream is cut there. Give the log manager (if there is one) so that the
+ * same log files are used.
+ * StartLazyRecovery replaces Redo + Undo for an instant restart: pages are
+ * recovered when the buffer pool first fetches them, or by a background
+ * thread, while the database is already in use.
  */
 
 #pragma once
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "buffer/buffer_pool_manager.h"
 #include "concurrency/lock_manager.h"
@@ -14,38 +26,133 @@
 
 namespace cmudb {
 
+class TablePage;
+
 class LogRecovery {
 public:
   LogRecovery(DiskManager *disk_manager,
-                    BufferPoolManager *buffer_pool_manager)
+                    BufferPoolManager *buffer_pool_manager,
+                    LogManager *log_manager = nullptr)
       : disk_manager_(disk_manager), buffer_pool_manager_(buffer_pool_manager),
-        offset_(0) {
-    // global transaction through recovery phase
-    log_buffer_ = new char[LOG_BUFFER_SIZE];
+        log_manager_(log_manager), redo_pending_(0), lazy_(false),
+        lazy_pending_(false), lazy_stop_(false), lazy_thread_(nullptr) {
+    OpenLogStreams();
   }
 
   ~LogRecovery() {
-    delete[] log_buffer_;
-    log_buffer_ = nullptr;
+    lazy_stop_ = true;
+    WaitLazyRecovery();
+    for (auto *stream : owned_streams_) {
+      delete stream;
+    }
   }
 
   void Redo();
   void Undo();
-  bool DeserializeLogRecord(const char *data, LogRecord &log_record);
+  // analyze the log, then recover pages on demand (instead of Redo + Undo)
+  void StartLazyRecovery();
+  // block until every page is recovered
+  void WaitLazyRecovery();
+  // called by the buffer pool before it hands out page (pinned)
+  // @return: true if page was changed
+  bool RecoverPage(Page *page);
+  // some page has not been recovered yet
+  inline bool IsRecovering() { return lazy_pending_; }
+  bool DeserializeLogRecord(const char *data, LogRecord &log_record,
+                            int available = LOG_BUFFER_SIZE);
 
 private:
+  // records of one page go to one worker, so each page sees them in lsn order
+  struct RedoQueue {
+    std::mutex latch;
+    std::condition_variable cv;
+    std::vector<LogRecord> records;
+    bool closed = false;
+  };
+  // log records handed to a worker at once
+  static const size_t REDO_BATCH_SIZE = 32;
+  // lazy recovery: the changes a page misses
+  struct LazyPage {
+    // lsn order
+    std::vector<LogRecord> redo;
+    // newest first
+    std::vector<LogRecord> undo;
+    bool recovering = false;
+  };
+
+  // reads the log file of one stream block by block
+  struct LogReader {
+    DiskManager *disk_manager;
+    // log file offset of the block in buffer
+    log_offset_t offset = 0;
+    // bytes of log records in buffer
+    int size = 0;
+    // size of the block in the log file if it is a compressed frame, else 0
+    int frame_size = 0;
+    // next log record in buffer, and the last one returned
+    int pos = 0;
+    int record_pos = 0;
+    bool loaded = false;
+    std::vector<char> buffer = std::vector<char>(LOG_BUFFER_SIZE);
+    // a compressed block, before it is decompressed into buffer
+    std::vector<char> frame = std::vector<char>(LOG_BUFFER_SIZE);
+  };
+
+  static int DeserializeCompactHeader(const char *data, int available,
+                                      uint32_t &size, lsn_t &lsn,
+                                      txn_id_t &txn_id, lsn_t &prev_lsn);
+  void OpenLogStreams();
+  bool ReadLogBlock(LogReader &reader);
+  // next log record of the stream, @return: false at the end of it
+  bool NextLogRecord(LogReader &reader, LogRecord &log,
+                     log_offset_t &log_offset);
+  // drop the log of the stream from the record NextLogRecord returned last
+  // (at_record), or from where it ended
+  void CutLogStream(LogReader &reader, bool at_record);
+  static page_id_t GetLogPageId(LogRecord &log);
+  void RedoLogRecord(LogRecord &log);
+  void RedoPage(LogRecord &log, Page *page);
+  void UndoPage(LogRecord &log, TablePage *page);
+  void CollectUndo(std::vector<LogRecord> &records);
+  void LazyRecoveryLoop();
+  void DispatchRedo(LogRecord &log);
+  void SubmitRedo(int worker);
+  void WaitRedoWorkers();
+  void RedoWorker(RedoQueue *queue);
+
   // TODO: you can add whatever member variable here
   // Don't forget to initialize newly added variable in constructor
   DiskManager *disk_manager_;
   BufferPoolManager *buffer_pool_manager_;
+  // told where the lsn sequence continues after redo, if not nullptr
+  LogManager *log_manager_;
+  // disk manager of each log stream, the first one is disk_manager_
+  std::vector<DiskManager *> streams_;
+  std::vector<DiskManager *> owned_streams_;
+  // parallel redo
+  RedoQueue redo_queues_[REDO_WORKERS];
+  std::vector<LogRecord> redo_batches_[REDO_WORKERS];
+  // records submitted but not applied yet
+  size_t redo_pending_;
+  std::mutex redo_latch_;
+  std::condition_variable redo_idle_cv_;
   // maintain active transactions and its corresponds latest lsn
   //在redo中更新，方便在undo中快速定位每个事务最新的日志记录
   std::unordered_map<txn_id_t, lsn_t> active_txn_;
-  // mapping log sequence number to log file offset, for undo purpose
-  std::unordered_map<lsn_t, int> lsn_mapping_;
-  // log buffer related
-  int offset_;
-  char *log_buffer_;
+  // mapping log sequence number to log file offset (in the log stream of
+  // the record), for undo purpose
+  std::unordered_map<lsn_t, log_offset_t> lsn_mapping_;
+  // log file offset of each active transaction's BEGIN, undo reads from there
+  std::unordered_map<txn_id_t, log_offset_t> begin_offset_;
+  // lazy recovery
+  bool lazy_;
+  std::unordered_map<page_id_t, LazyPage> lazy_pages_;
+  std::mutex lazy_latch_;
+  // notified when a page is recovered
+  std::condition_variable lazy_cv_;
+  std::atomic<bool> lazy_pending_;
+  std::atomic<bool> lazy_stop_;
+  std::thread *lazy_thread_;
 };
 
 } // namespace cmudb
@@ -8,6 +8,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <cstring>
 #include <iostream>
 
@@ -35,7 +36,23 @@ public:
   inline void RLatch() { rwlatch_.RLock(); }
 
   inline lsn_t GetLSN() { return *reinterpret_cast<lsn_t *>(GetData() + 4); }
-  inline void SetLSN(lsn_t lsn) { memcpy(GetData() + 4, &lsn, 4); }
+  inline void SetLSN(lsn_t lsn) {
+    memcpy(GetData() + 4, &lsn, 4);
+    SetRecLSN(lsn);
+  }
+  // first logged change since the page was last written back, pages without
+  // an lsn field (header page) only call this
+  inline void SetRecLSN(lsn_t lsn) {
+    lsn_t clean = INVALID_LSN;
+    rec_lsn_.compare_exchange_strong(clean, lsn);
+  }
+  // lsn of the oldest change not on disk yet, INVALID_LSN if none
+  inline lsn_t GetRecLSN() { return rec_lsn_; }
+  // private txn logs holding changes of the page that are not appended to
+  // the log yet, the page can't be written back while there is one
+  inline void AddPrivateLog() { private_logs_++; }
+  inline void DropPrivateLog() { private_logs_--; }
+  inline bool InPrivateLog() { return private_logs_ > 0; }
 
 private:
   // method used by buffer pool manager
@@ -45,6 +62,8 @@ private:
   page_id_t page_id_ = INVALID_PAGE_ID;
   int pin_count_ = 0;
   bool is_dirty_ = false;
+  std::atomic<lsn_t> rec_lsn_{INVALID_LSN};
+  std::atomic<int> private_logs_{0};
   RWMutex rwlatch_;
 };
 
@@ -12,14 +12,20 @@
  *  --------------------------------------------------------------------------
  * | PageId (4)| LSN (4)| PrevPageId (4)| NextPageId (4)| FreeSpacePointer(4) |
  *  --------------------------------------------------------------------------
- *  --------------------------------------------------------------
- * | TupleCount (4) | Tuple_1 offset (4) | Tuple_1 size (4) | ... |
- *  --------------------------------------------------------------
+ *  --------------------------------------------------------------------------
+ * | TupleCount (4) | Tuple_1 offset (4) | Tuple_1 size (4) | ...
+ *  --------------------------------------------------------------------------
  *
+ *  Pages of a table created with SLOT_ROW_LOCKS have a third word in each
+ *  slot, its lock word, and SLOT_LOCK_FLAG set in TupleCount. The lock word
+ *  holds the id of the txn holding the row lock when it is not in the lock
+ *  table, INVALID_TXN_ID if none. It is a hint only, the lock manager tells
+ *  a stale word from a held lock. Other pages keep 8 byte slots.
  */
 
 #pragma once
 
+#include <atomic>
 #include <cstring>
 
 #include "common/rid.h"
@@ -35,8 +41,10 @@ public:
   /**
    * Header related
    */
+  // slot_locks: slots get a lock word, pages of a table should agree
   void Init(page_id_t page_id, size_t page_size, page_id_t prev_page_id,
-            LogManager *log_manager, Transaction *txn);
+            LogManager *log_manager, Transaction *txn,
+            bool slot_locks = false);
   page_id_t GetPageId();
   page_id_t GetPrevPageId();
   page_id_t GetNextPageId();
@@ -49,6 +57,8 @@ public:
   bool InsertTuple(const Tuple &tuple, RID &rid, Transaction *txn,
                    LockManager *lock_manager,
                    LogManager *log_manager); // return rid if success
+  // recovery only, insert at the slot of rid
+  bool InsertTupleAt(const Tuple &tuple, const RID &rid);
   bool MarkDelete(const RID &rid, Transaction *txn, LockManager *lock_manager,
                   LogManager *log_manager); // delete
   bool UpdateTuple(const Tuple &new_tuple, Tuple &old_tuple, const RID &rid,
@@ -67,11 +77,23 @@ public:
 
   /**
    * Tuple iterator
+   * all_slots also stops at empty and deleted slots, for snapshot scans
    */
-  bool GetFirstTupleRid(RID &first_rid);
-  bool GetNextTupleRid(const RID &cur_rid, RID &next_rid);
+  bool GetFirstTupleRid(RID &first_rid, bool all_slots = false);
+  bool GetNextTupleRid(const RID &cur_rid, RID &next_rid,
+                       bool all_slots = false);
+
+  // lock word of a slot, passed to the lock manager with its row. nullptr
+  // if the slots of the page have none
+  std::atomic<txn_id_t> *GetSlotLock(int slot_num);
+  bool HasSlotLocks();
 
 private:
+  // offset and size, followed by the lock word with SLOT_LOCK_FLAG
+  static const int SLOT_SIZE = 8;
+  static const int LOCK_SLOT_SIZE = 12;
+  static const int32_t SLOT_LOCK_FLAG = 1 << 30;
+
   /**
    * helper functions
    */
@@ -84,6 +106,7 @@ private:
   int32_t GetTupleCount(); // Note that this tuple count may be larger than # of
                            // actual tuples because some slots may be empty
   void SetTupleCount(int32_t tuple_count);
+  int32_t GetSlotSize();
   int32_t GetFreeSpaceSize();
 };
 } // namespace cmudb
@@ -7,6 +7,7 @@
 #pragma once
 
 #include "buffer/buffer_pool_manager.h"
+#include "concurrency/version_store.h"
 #include "logging/log_manager.h"
 #include "page/table_page.h"
 #include "table/table_iterator.h"
@@ -20,13 +21,16 @@ class TableHeap {
 public:
   ~TableHeap() {}
 
-  // open a table heap
+  // open a table heap. Without a version store read-only transactions see
+  // the newest rows
   TableHeap(BufferPoolManager *buffer_pool_manager, LockManager *lock_manager,
-            LogManager *log_manager, page_id_t first_page_id);
+            LogManager *log_manager, page_id_t first_page_id,
+            VersionStore *version_store = nullptr);
 
   // create table heap
   TableHeap(BufferPoolManager *buffer_pool_manager, LockManager *lock_manager,
-            LogManager *log_manager, Transaction *txn);
+            LogManager *log_manager, Transaction *txn,
+            VersionStore *version_store = nullptr);
 
   // for insert, if tuple is too large (>~page_size), return false
   bool InsertTuple(const Tuple &tuple, RID &rid, Transaction *txn);
@@ -42,6 +46,7 @@ public:
                    Transaction *txn); // when commit delete or rollback insert
   void RollbackDelete(const RID &rid, Transaction *txn); // when rollback delete
 
+  // a read-only txn gets the version of its snapshot, without locking
   bool GetTuple(const RID &rid, Tuple &tuple, Transaction *txn);
 
   bool DeleteTableHeap();
@@ -53,6 +58,14 @@ public:
   inline page_id_t GetFirstPageId() const { return first_page_id_; }
 
 private:
+  // lock the table and page of a row before it is read (IS) or changed (IX),
+  // @return: false if txn is aborted
+  bool LockPage(page_id_t page_id, LockMode lock_mode, Transaction *txn);
+  // keep the row at rid as it was before txn changes it
+  void AddVersion(const RID &rid, const Tuple *before, Transaction *txn);
+  // unpin a page txn changed, unless the private log of txn keeps its pin
+  void ReleasePage(Page *page, Transaction *txn);
+
   /**
    * Members
    */
@@ -60,6 +73,7 @@ private:
   LockManager *lock_manager_;
   LogManager *log_manager_;
   page_id_t first_page_id_;
+  VersionStore *version_store_;
 };
 
 } // namespace cmudb
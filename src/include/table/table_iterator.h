@@ -40,6 +40,9 @@ public:
   TableIterator operator++(int);
 
 private:
+  // does txn_ scan a snapshot
+  bool IsSnapshot();
+
   TableHeap *table_heap_;
   Tuple *tuple_;
   Transaction *txn_;
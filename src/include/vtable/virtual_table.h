@@ -8,7 +8,9 @@
 #include "catalog/schema.h"
 #include "concurrency/transaction_manager.h"
 #include "index/b_plus_tree_index.h"
+#include "logging/checkpoint_manager.h"
 #include "logging/log_manager.h"
+#include "logging/log_recovery.h"
 #include "sqlite/sqlite3ext.h"
 #include "table/table_heap.h"
 #include "table/tuple.h"
@@ -76,24 +78,38 @@ public:
 
     // txn related
     lock_manager_ = new LockManager(true); // S2PL
-    transaction_manager_ = new TransactionManager(lock_manager_, log_manager_);
+    // old row versions for read-only statements
+    version_store_ = new VersionStore();
+    transaction_manager_ = new TransactionManager(lock_manager_, log_manager_,
+                                                  version_store_);
+    checkpoint_manager_ =
+        new CheckpointManager(transaction_manager_, log_manager_,
+                              buffer_pool_manager_, disk_manager_);
   }
 
   ~StorageEngine() {
+    delete log_recovery_;
+    checkpoint_manager_->StopCheckpointThread();
     if (ENABLE_LOGGING)
       log_manager_->StopFlushThread();
+    delete checkpoint_manager_;
     delete disk_manager_;
     delete buffer_pool_manager_;
     delete log_manager_;
     delete lock_manager_;
     delete transaction_manager_;
+    delete version_store_;
   }
 
   DiskManager *disk_manager_;
   BufferPoolManager *buffer_pool_manager_;
   LockManager *lock_manager_;
   TransactionManager *transaction_manager_;
+  VersionStore *version_store_;
   LogManager *log_manager_;
+  CheckpointManager *checkpoint_manager_;
+  // recovery of the last run, while pages are recovered lazily
+  LogRecovery *log_recovery_ = nullptr;
 };
 
 StorageEngine *storage_engine_;
@@ -111,12 +127,14 @@ public:
     if (first_page_id != INVALID_PAGE_ID) {
       // reopen an exist table
       table_heap_ = new TableHeap(buffer_pool_manager, lock_manager,
-                                  log_manager, first_page_id);
+                                  log_manager, first_page_id,
+                                  storage_engine_->version_store_);
     } else {
       // create table for the first time
       Transaction *txn = storage_engine_->transaction_manager_->Begin();
-      table_heap_ =
-          new TableHeap(buffer_pool_manager, lock_manager, log_manager, txn);
+      table_heap_ = new TableHeap(buffer_pool_manager, lock_manager,
+                                  log_manager, txn,
+                                  storage_engine_->version_store_);
       storage_engine_->transaction_manager_->Commit(txn);
     }
   }
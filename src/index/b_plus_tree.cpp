@@ -1,7 +1,10 @@
 /**
  * b_plus_tree.cpp
  */
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <map>
 #include <string>
 
 #include "common/exception.h"
@@ -16,9 +19,12 @@ INDEX_TEMPLATE_ARGUMENTS
 BPLUSTREE_TYPE::BPlusTree(const std::string &name,
                                 BufferPoolManager *buffer_pool_manager,
                                 const KeyComparator &comparator,
-                                page_id_t root_page_id)
+                                page_id_t root_page_id,
+                                LockManager *lock_manager)
     : index_name_(name), root_page_id_(root_page_id),
-      buffer_pool_manager_(buffer_pool_manager), comparator_(comparator) {}
+      buffer_pool_manager_(buffer_pool_manager), comparator_(comparator),
+      lock_manager_(lock_manager),
+      index_hash_(std::hash<std::string>()(name)) {}
 
 /*
  * Helper function to decide whether current b+tree is empty
@@ -39,16 +45,90 @@ INDEX_TEMPLATE_ARGUMENTS
 bool BPLUSTREE_TYPE::GetValue(const KeyType &key,
                               std::vector<ValueType> &result,
                               Transaction *transaction) {
+  mtx.lock();
+  // inserting key takes its lock, a unique key needs no gap lock
+  bool restart = IsLocking(transaction);
+  while (restart) {
+    if (LockKeys({KeyLockId(key)}, LockMode::SHARED, false, transaction,
+                 restart)) {
+      break;
+    }
+    if (!restart) {
+      mtx.unlock();
+      return false;
+    }
+  }
   if (root_page_id_ == INVALID_PAGE_ID) {
+    mtx.unlock();
     return false;
   }
-  mtx.lock();
   auto leaf_page = FindLeafPage(key, false);
   ValueType tmp_value;
   if (leaf_page->Lookup(key, tmp_value, comparator_)) {
     result.push_back(tmp_value);
   }
-  buffer_pool_manager_->UnpinPage(leaf_page->GetPageId(), true);
+  buffer_pool_manager_->UnpinPage(leaf_page->GetPageId(), false);
+  mtx.unlock();
+  return true;
+}
+
+/*
+ * Range scan: the keys read and the first key past high (or the end of the
+ * index) are locked shared, together they cover every gap an insert into
+ * the range would go to.
+ */
+INDEX_TEMPLATE_ARGUMENTS
+bool BPLUSTREE_TYPE::GetRange(const KeyType &low, const KeyType &high,
+                              std::vector<ValueType> &result,
+                              Transaction *transaction) {
+  mtx.lock();
+  size_t found = result.size();
+  bool locking = IsLocking(transaction);
+  bool restart = true;
+  while (restart) {
+    result.resize(found);
+    std::vector<RID> key_locks;
+    RID end_lock = LockManager::EndKeyLockId(index_hash_);
+    if (!IsEmpty()) {
+      auto leaf_page = FindLeafPage(low, false);
+      int index = leaf_page->KeyIndex(low, comparator_);
+      while (true) {
+        if (index == leaf_page->GetSize()) {
+          page_id_t next_page_id = leaf_page->GetNextPageId();
+          if (next_page_id == INVALID_PAGE_ID) {
+            break;
+          }
+          buffer_pool_manager_->UnpinPage(leaf_page->GetPageId(), false);
+          leaf_page = reinterpret_cast<B_PLUS_TREE_LEAF_PAGE_TYPE *>(
+              buffer_pool_manager_->FetchPage(next_page_id));
+          index = 0;
+          continue;
+        }
+        const MappingType &item = leaf_page->GetItem(index);
+        if (comparator_(item.first, high) > 0) {
+          if (locking) {
+            end_lock = KeyLockId(item.first);
+          }
+          break;
+        }
+        if (locking) {
+          key_locks.push_back(KeyLockId(item.first));
+        }
+        result.push_back(item.second);
+        index++;
+      }
+      buffer_pool_manager_->UnpinPage(leaf_page->GetPageId(), false);
+    }
+    key_locks.push_back(end_lock);
+    if (LockKeys(key_locks, LockMode::SHARED, false, transaction, restart)) {
+      break;
+    }
+    if (!restart) {
+      result.resize(found);
+      mtx.unlock();
+      return false;
+    }
+  }
   mtx.unlock();
   return true;
 }
@@ -67,12 +147,28 @@ INDEX_TEMPLATE_ARGUMENTS
 bool BPLUSTREE_TYPE::Insert(const KeyType &key, const ValueType &value,
                             Transaction *transaction) {
   mtx.lock();
+  // no range scan holding the gap of key may miss it
+  bool restart = IsLocking(transaction);
+  while (restart) {
+    if (LockKeys({NextKeyLockId(key), KeyLockId(key)}, LockMode::EXCLUSIVE,
+                 true, transaction, restart)) {
+      break;
+    }
+    if (!restart) {
+      mtx.unlock();
+      return false;
+    }
+  }
+  PageCapture capture;
+  BeginPageLog(capture);
+  bool ret = true;
   if (IsEmpty()) {
     StartNewTree(key, value);
-    mtx.unlock();
-    return true;
+  } else {
+    ret = InsertIntoLeaf(key, value, transaction);
   }
-  auto ret = InsertIntoLeaf(key, value, transaction);
+  EndPageLog(capture, transaction, ret ? IndexKeyOp::INSERT : IndexKeyOp::NONE,
+             key, value);
   mtx.unlock();
   return ret;
 }
@@ -109,6 +205,7 @@ bool BPLUSTREE_TYPE::InsertIntoLeaf(const KeyType &key, const ValueType &value,
   auto leaf_page = FindLeafPage(key, false);
   ValueType tmp_value;
   if (leaf_page->Lookup(key, tmp_value, comparator_)) {
+    buffer_pool_manager_->UnpinPage(leaf_page->GetPageId(), false);
     return false;
   }
   if (leaf_page->GetSize() < leaf_page->GetMaxSize()) {
@@ -216,10 +313,29 @@ void BPLUSTREE_TYPE::Remove(const KeyType &key, Transaction *transaction) {
     return;
   }
   mtx.lock();
+  // the gap left behind joins the one of the next key
+  bool restart = IsLocking(transaction);
+  while (restart) {
+    if (LockKeys({NextKeyLockId(key), KeyLockId(key)}, LockMode::EXCLUSIVE,
+                 false, transaction, restart)) {
+      break;
+    }
+    if (!restart) {
+      mtx.unlock();
+      return;
+    }
+  }
+  if (IsEmpty()) {
+    mtx.unlock();
+    return;
+  }
+  PageCapture capture;
+  BeginPageLog(capture);
   auto leaf_page = FindLeafPage(key, false);
   ValueType tmp_value;
   if (!leaf_page->Lookup(key, tmp_value, comparator_)) {
-    buffer_pool_manager_->UnpinPage(leaf_page->GetPageId(), true);
+    buffer_pool_manager_->UnpinPage(leaf_page->GetPageId(), false);
+    EndPageLog(capture, transaction, IndexKeyOp::NONE, key, tmp_value);
     mtx.unlock();
     //std::cout << "Unfind" << std::endl;
     return;
@@ -228,6 +344,7 @@ void BPLUSTREE_TYPE::Remove(const KeyType &key, Transaction *transaction) {
   leaf_page->RemoveAndDeleteRecord(key, comparator_);
   CoalesceOrRedistribute(leaf_page, transaction);
   buffer_pool_manager_->UnpinPage(leaf_page->GetPageId(), true);
+  EndPageLog(capture, transaction, IndexKeyOp::REMOVE, key, tmp_value);
   mtx.unlock();
 }
 
@@ -286,7 +403,7 @@ bool BPLUSTREE_TYPE::CoalesceOrRedistribute(N *node, Transaction *transaction) {
       Redistribute(neighbor_node, node, 0);
     } else {
       auto value_index = parent_node->ValueIndex(node->GetPageId());
-      Redistribute(neighbor_node, node, parent_node->ValueAt(value_index));
+      Redistribute(neighbor_node, node, value_index);
     }
   }
   
@@ -363,6 +480,7 @@ bool BPLUSTREE_TYPE::AdjustRoot(BPlusTreePage *old_root_node) {
   auto new_root_page = buffer_pool_manager_->FetchPage(root_page_id_);
   auto new_root_node = reinterpret_cast<BPlusTreePage*>(new_root_page);
   new_root_node->SetParentPageId(INVALID_PAGE_ID); 
+  buffer_pool_manager_->UnpinPage(root_page_id_, true);
   return true;
 }
 
@@ -419,7 +537,7 @@ B_PLUS_TREE_LEAF_PAGE_TYPE *BPLUSTREE_TYPE::FindLeafPage(const KeyType &key,
       } else {
         next_page_id = node->Lookup(key, comparator_);
       }
-      buffer_pool_manager_->UnpinPage(page->GetPageId(), true);
+      buffer_pool_manager_->UnpinPage(page->GetPageId(), false);
       page = buffer_pool_manager_->FetchPage(next_page_id);
     } else if (tmp_node->IsLeafPage()){
       auto node = reinterpret_cast<BPlusTreeLeafPage<KeyType, ValueType, KeyComparator>*>(page);
@@ -441,15 +559,168 @@ INDEX_TEMPLATE_ARGUMENTS
 void BPLUSTREE_TYPE::UpdateRootPageId(int insert_record) {
   HeaderPage *header_page = static_cast<HeaderPage *>(
       buffer_pool_manager_->FetchPage(HEADER_PAGE_ID));
-  if (insert_record)
-    // create a new record<index_name + root_page_id> in header_page
-    header_page->InsertRecord(index_name_, root_page_id_);
-  else
+  // create a new record<index_name + root_page_id> in header_page, a tree
+  // that was emptied before still has its record
+  if (!insert_record || !header_page->InsertRecord(index_name_, root_page_id_))
     // update root_page_id in header_page
     header_page->UpdateRecord(index_name_, root_page_id_);
   buffer_pool_manager_->UnpinPage(HEADER_PAGE_ID, true);
 }
 
+INDEX_TEMPLATE_ARGUMENTS
+bool BPLUSTREE_TYPE::IsLocking(Transaction *transaction) {
+  return lock_manager_ != nullptr && transaction != nullptr &&
+         !transaction->IsReadOnly();
+}
+
+INDEX_TEMPLATE_ARGUMENTS
+RID BPLUSTREE_TYPE::KeyLockId(const KeyType &key) {
+  std::string bytes(reinterpret_cast<const char *>(&key), sizeof(KeyType));
+  return LockManager::KeyLockId(index_hash_, std::hash<std::string>()(bytes));
+}
+
+INDEX_TEMPLATE_ARGUMENTS
+RID BPLUSTREE_TYPE::NextKeyLockId(const KeyType &key) {
+  if (IsEmpty()) {
+    return LockManager::EndKeyLockId(index_hash_);
+  }
+  auto leaf_page = FindLeafPage(key, false);
+  int index = leaf_page->KeyIndex(key, comparator_);
+  if (index < leaf_page->GetSize() &&
+      comparator_(leaf_page->KeyAt(index), key) == 0) {
+    index++;
+  }
+  while (index == leaf_page->GetSize()) {
+    page_id_t next_page_id = leaf_page->GetNextPageId();
+    buffer_pool_manager_->UnpinPage(leaf_page->GetPageId(), false);
+    if (next_page_id == INVALID_PAGE_ID) {
+      return LockManager::EndKeyLockId(index_hash_);
+    }
+    leaf_page = reinterpret_cast<B_PLUS_TREE_LEAF_PAGE_TYPE *>(
+        buffer_pool_manager_->FetchPage(next_page_id));
+    index = 0;
+  }
+  RID key_lock = KeyLockId(leaf_page->KeyAt(index));
+  buffer_pool_manager_->UnpinPage(leaf_page->GetPageId(), false);
+  return key_lock;
+}
+
+/*
+ * A lock is first asked for without waiting. Its holder may need mtx to go
+ * on, so mtx is never held while waiting for one.
+ */
+INDEX_TEMPLATE_ARGUMENTS
+bool BPLUSTREE_TYPE::LockKeys(const std::vector<RID> &key_locks,
+                              LockMode lock_mode, bool instant_first,
+                              Transaction *transaction, bool &restart) {
+  restart = false;
+  if (!IsLocking(transaction)) {
+    return true;
+  }
+  for (size_t i = 0; i < key_locks.size(); i++) {
+    bool instant = instant_first && i == 0;
+    if (lock_manager_->LockKey(transaction, key_locks[i], lock_mode, instant,
+                               false)) {
+      continue;
+    }
+    if (transaction->GetState() == TransactionState::ABORTED) {
+      return false;
+    }
+    mtx.unlock();
+    restart = lock_manager_->LockKey(transaction, key_locks[i], lock_mode,
+                                     instant, true);
+    mtx.lock();
+    return false;
+  }
+  return true;
+}
+
+/*
+ * With logging on, have the buffer pool remember the content of every page
+ * this thread fetches or creates from now on
+ */
+INDEX_TEMPLATE_ARGUMENTS
+void BPLUSTREE_TYPE::BeginPageLog(PageCapture &capture) {
+  if (ENABLE_LOGGING && buffer_pool_manager_->GetLogManager() != nullptr) {
+    buffer_pool_manager_->SetPageCapture(&capture);
+  }
+}
+
+/*
+ * Log what the operation wrote in one INDEXPAGE record: the changed bytes of
+ * every page it touched except the ones it deleted, and the key it inserted
+ * or removed for transaction, which recovery undoes if transaction loses.
+ * The pages get the lsn of the record before the pins of the capture are
+ * dropped, so none of them is written back ahead of its log. Only changed
+ * pages are made dirty, the deleted ones are deleted now.
+ */
+INDEX_TEMPLATE_ARGUMENTS
+void BPLUSTREE_TYPE::EndPageLog(PageCapture &capture, Transaction *transaction,
+                                IndexKeyOp op, const KeyType &key,
+                                const ValueType &value) {
+  buffer_pool_manager_->SetPageCapture(nullptr);
+  // latched in page id order, two trees may both hold the header page
+  std::map<page_id_t, Page *> pages(capture.frames.begin(),
+                                    capture.frames.end());
+  std::vector<Page *> changed;
+  for (auto &entry : pages) {
+    if (capture.deleted_pages.count(entry.first) != 0) {
+      continue;
+    }
+    Page *page = entry.second;
+    page->WLatch();
+    if (memcmp(capture.before_images[entry.first].data(), page->GetData(),
+               PAGE_SIZE) != 0) {
+      changed.push_back(page);
+    } else {
+      page->WUnlatch();
+    }
+  }
+
+  if (!changed.empty()) {
+    bool undoable = transaction != nullptr && op != IndexKeyOp::NONE;
+    LogRecord log(LogRecordType::INDEXPAGE,
+                  undoable ? transaction->GetTransactionId() : INVALID_TXN_ID,
+                  undoable ? transaction->GetPrevLSN() : INVALID_LSN);
+    if (undoable) {
+      std::vector<std::pair<TypeId, int32_t>> columns;
+      for (auto &column : comparator_.GetKeySchema()->GetColumns()) {
+        columns.emplace_back(column.GetType(), column.GetLength());
+      }
+      log.SetIndexKey(op, index_name_, reinterpret_cast<const char *>(&key),
+                      sizeof(KeyType), columns, value);
+    }
+    for (Page *page : changed) {
+      log.AddIndexPage(page->GetPageId(),
+                       capture.new_pages.count(page->GetPageId()) != 0,
+                       capture.before_images[page->GetPageId()].data(),
+                       page->GetData());
+    }
+    lsn_t lsn = buffer_pool_manager_->GetLogManager()->AppendLogRecord(log);
+    if (undoable) {
+      transaction->SetPrevLSN(lsn);
+    }
+    for (Page *page : changed) {
+      // the header page has no lsn field
+      if (page->GetPageId() == HEADER_PAGE_ID) {
+        page->SetRecLSN(lsn);
+      } else {
+        page->SetLSN(lsn);
+      }
+      page->WUnlatch();
+    }
+  }
+
+  for (auto &entry : pages) {
+    bool dirty = std::find(changed.begin(), changed.end(), entry.second) !=
+                 changed.end();
+    buffer_pool_manager_->UnpinPage(entry.first, dirty);
+    if (capture.deleted_pages.count(entry.first) != 0) {
+      buffer_pool_manager_->DeletePage(entry.first);
+    }
+  }
+}
+
 /*
  * This method is used for debug only
  * print out whole b+tree sturcture, rank by rank
@@ -498,4 +769,61 @@ template class BPlusTree<GenericKey<16>, RID, GenericComparator<16>>;
 template class BPlusTree<GenericKey<32>, RID, GenericComparator<32>>;
 template class BPlusTree<GenericKey<64>, RID, GenericComparator<64>>;
 
+template <size_t KeySize>
+static void UndoKey(LogRecord &log, Schema *key_schema, page_id_t root_page_id,
+                    BufferPoolManager *buffer_pool_manager) {
+  GenericComparator<KeySize> comparator(key_schema);
+  BPlusTree<GenericKey<KeySize>, RID, GenericComparator<KeySize>> tree(
+      log.GetIndexName(), buffer_pool_manager, comparator, root_page_id);
+  GenericKey<KeySize> key;
+  memcpy(key.data, log.GetIndexKey().data(), KeySize);
+  if (log.GetIndexKeyOp() == IndexKeyOp::INSERT) {
+    tree.Remove(key);
+  } else {
+    tree.Insert(key, log.GetIndexRID());
+  }
+}
+
+/*
+ * The tree is opened at the root in the header page, with a comparator on the
+ * key schema of the log record
+ */
+void UndoIndexKey(LogRecord &log, BufferPoolManager *buffer_pool_manager) {
+  auto *header_page = static_cast<HeaderPage *>(
+      buffer_pool_manager->FetchPage(HEADER_PAGE_ID));
+  assert(header_page != nullptr);
+  page_id_t root_page_id;
+  bool found = header_page->GetRootId(log.GetIndexName(), root_page_id);
+  buffer_pool_manager->UnpinPage(HEADER_PAGE_ID, false);
+  if (!found) {
+    throw Exception(EXCEPTION_TYPE_INDEX,
+                    "undo: no index " + log.GetIndexName());
+  }
+  std::vector<Column> columns;
+  for (auto &column : log.GetIndexKeyColumns()) {
+    columns.emplace_back(column.first, column.second, "");
+  }
+  Schema key_schema(columns);
+  switch (log.GetIndexKey().size()) {
+  case 4:
+    UndoKey<4>(log, &key_schema, root_page_id, buffer_pool_manager);
+    break;
+  case 8:
+    UndoKey<8>(log, &key_schema, root_page_id, buffer_pool_manager);
+    break;
+  case 16:
+    UndoKey<16>(log, &key_schema, root_page_id, buffer_pool_manager);
+    break;
+  case 32:
+    UndoKey<32>(log, &key_schema, root_page_id, buffer_pool_manager);
+    break;
+  case 64:
+    UndoKey<64>(log, &key_schema, root_page_id, buffer_pool_manager);
+    break;
+  default:
+    throw Exception(EXCEPTION_TYPE_INDEX,
+                    "undo: bad key size in index " + log.GetIndexName());
+  }
+}
+
 } // namespace cmudb
@@ -0,0 +1,106 @@
+/**
+ * checkpoint_manager.cpp
+ */
+
+#include <algorithm>
+
+#include "logging/checkpoint_manager.h"
+
+namespace cmudb {
+
+void CheckpointManager::RunCheckpointThread() {
+  std::lock_guard<std::mutex> lock(latch_);
+  if (checkpoint_thread_ != nullptr) {
+    return;
+  }
+  running_ = true;
+  checkpoint_thread_ = new std::thread([this] {
+    std::unique_lock<std::mutex> lock(latch_);
+    while (running_) {
+      if (!cv_.wait_for(lock, CHECKPOINT_TIMEOUT, [&] { return !running_; })) {
+        lock.unlock();
+        Checkpoint();
+        lock.lock();
+      }
+    }
+  });
+}
+
+void CheckpointManager::StopCheckpointThread() {
+  std::thread *checkpoint_thread;
+  {
+    std::lock_guard<std::mutex> lock(latch_);
+    running_ = false;
+    checkpoint_thread = checkpoint_thread_;
+    checkpoint_thread_ = nullptr;
+  }
+  cv_.notify_one();
+  if (checkpoint_thread != nullptr) {
+    checkpoint_thread->join();
+    delete checkpoint_thread;
+  }
+}
+
+/*
+ * 1. remember the next lsn, everything logged from there on is replayed
+ * 2. snapshot the dirty page table, which also waits for the page
+ *    modifications logged before step 1 to set their page lsn
+ * 3. snapshot the active transaction table
+ * 4. append the CHECKPOINT record, wait until it is durable and point the
+ *    master record at the log buffer holding it (recovery uses the last
+ *    checkpoint found there, buffers may be compressed)
+ * Redo starts at the smallest of the lsn of step 1 and every recLSN, the
+ * log is read from the oldest of that and the BEGIN of every running
+ * transaction (undo needs their whole chain). Log segments before that are
+ * deleted, in every log stream.
+ */
+lsn_t CheckpointManager::Checkpoint() {
+  // pages not recovered yet are missing from the dirty page table
+  if (!ENABLE_LOGGING || buffer_pool_manager_->IsRecovering()) {
+    return INVALID_LSN;
+  }
+  std::lock_guard<std::mutex> guard(checkpoint_latch_);
+  lsn_t redo_lsn = log_manager_->GetNextLSN();
+
+  std::unordered_map<page_id_t, lsn_t> dirty_pages;
+  buffer_pool_manager_->GetDirtyPageTable(dirty_pages);
+  std::vector<std::pair<txn_id_t, lsn_t>> active_txns;
+  lsn_t oldest_lsn;
+  transaction_manager_->GetActiveTxnTable(active_txns, oldest_lsn);
+
+  for (auto &entry : dirty_pages) {
+    redo_lsn = std::min(redo_lsn, entry.second);
+  }
+  lsn_t recovery_lsn = redo_lsn;
+  if (oldest_lsn != INVALID_LSN) {
+    recovery_lsn = std::min(recovery_lsn, oldest_lsn);
+  }
+  log_offset_t recovery_offset = log_manager_->GetLogOffset(recovery_lsn);
+  std::vector<log_offset_t> stream_offsets;
+  for (int i = 1; i < log_manager_->GetStreamCount(); i++) {
+    stream_offsets.push_back(log_manager_->GetLogOffset(recovery_lsn, i));
+  }
+
+  LogRecord log(LogRecordType::CHECKPOINT, redo_lsn, recovery_offset,
+                active_txns,
+                std::vector<std::pair<page_id_t, lsn_t>>(dirty_pages.begin(),
+                                                         dirty_pages.end()),
+                stream_offsets);
+  lsn_t lsn = log_manager_->AppendLogRecord(log);
+  log_manager_->WaitUntilPersistent(lsn);
+  if (log_manager_->GetPersistentLSN() < lsn) {
+    // logging stopped meanwhile
+    return INVALID_LSN;
+  }
+  disk_manager_->WriteMasterRecord(log_manager_->GetLogOffset(lsn));
+
+  truncate_offset_ = recovery_offset;
+  disk_manager_->TruncateLog(recovery_offset);
+  for (size_t i = 0; i < stream_offsets.size(); i++) {
+    log_manager_->GetDiskManager(i + 1)->TruncateLog(stream_offsets[i]);
+  }
+  log_manager_->DiscardLogOffsets(recovery_lsn);
+  return lsn;
+}
+
+} // namespace cmudb
@@ -0,0 +1,179 @@
+/**
+ * log_compression.cpp
+ */
+
+#include <cstring>
+#include <vector>
+
+#include "logging/log_compression.h"
+
+namespace cmudb {
+
+static inline uint32_t Read32(const char *data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(uint32_t));
+  return value;
+}
+
+// write a length beyond what fits in the token, @return: false if no room
+static inline bool PutLength(char *dst, int &pos, int limit, int length) {
+  while (length >= 255) {
+    if (pos >= limit) {
+      return false;
+    }
+    dst[pos++] = static_cast<char>(255);
+    length -= 255;
+  }
+  if (pos >= limit) {
+    return false;
+  }
+  dst[pos++] = static_cast<char>(length);
+  return true;
+}
+
+static inline bool GetLength(const char *src, int &pos, int end, int &length) {
+  uint8_t byte;
+  do {
+    if (pos >= end) {
+      return false;
+    }
+    byte = static_cast<uint8_t>(src[pos++]);
+    length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+/*
+ * Greedy LZ77: a hash of the next MIN_MATCH bytes finds the last position
+ * they were seen at, a match is extended as far as it goes. Gives up as soon
+ * as the output reaches the input size.
+ */
+int LogCompression::CompressBlock(const char *src, int size, char *dst) {
+  const int limit = size;
+  std::vector<int> table(1 << HASH_BITS, -1);
+  int pos = FRAME_HEADER_SIZE;
+  int ip = 0;
+  int anchor = 0;
+
+  while (ip + MIN_MATCH <= size) {
+    uint32_t sequence = Read32(src + ip);
+    uint32_t hash = (sequence * 2654435761U) >> (32 - HASH_BITS);
+    int ref = table[hash];
+    table[hash] = ip;
+    if (ref < 0 || ip - ref > MAX_OFFSET || Read32(src + ref) != sequence) {
+      ip++;
+      continue;
+    }
+    int match = MIN_MATCH;
+    while (ip + match < size && src[ref + match] == src[ip + match]) {
+      match++;
+    }
+
+    // token, literals, offset, match
+    int literals = ip - anchor;
+    int match_code = match - MIN_MATCH;
+    if (pos >= limit) {
+      return 0;
+    }
+    int token = pos++;
+    dst[token] = static_cast<char>(((literals < 15 ? literals : 15) << 4) |
+                                   (match_code < 15 ? match_code : 15));
+    if (literals >= 15 && !PutLength(dst, pos, limit, literals - 15)) {
+      return 0;
+    }
+    if (pos + literals + 2 > limit) {
+      return 0;
+    }
+    memcpy(dst + pos, src + anchor, literals);
+    pos += literals;
+    uint16_t offset = static_cast<uint16_t>(ip - ref);
+    memcpy(dst + pos, &offset, sizeof(uint16_t));
+    pos += sizeof(uint16_t);
+    if (match_code >= 15 && !PutLength(dst, pos, limit, match_code - 15)) {
+      return 0;
+    }
+    ip += match;
+    anchor = ip;
+  }
+
+  // last literals
+  int literals = size - anchor;
+  if (pos >= limit) {
+    return 0;
+  }
+  dst[pos++] = static_cast<char>((literals < 15 ? literals : 15) << 4);
+  if (literals >= 15 && !PutLength(dst, pos, limit, literals - 15)) {
+    return 0;
+  }
+  if (pos + literals >= limit) {
+    return 0;
+  }
+  memcpy(dst + pos, src + anchor, literals);
+  pos += literals;
+
+  int32_t data_size = pos - FRAME_HEADER_SIZE;
+  dst[0] = 0x00;
+  dst[1] = static_cast<char>(0xFF);
+  dst[2] = dst[3] = 0;
+  memcpy(dst + 4, &size, sizeof(int32_t));
+  memcpy(dst + 8, &data_size, sizeof(int32_t));
+  return pos;
+}
+
+bool LogCompression::IsFrame(const char *data, int available) {
+  return available >= FRAME_HEADER_SIZE && data[0] == 0x00 &&
+         static_cast<uint8_t>(data[1]) == 0xFF && data[2] == 0 && data[3] == 0;
+}
+
+int LogCompression::GetFrameSize(const char *data) {
+  return FRAME_HEADER_SIZE + *reinterpret_cast<const int32_t *>(data + 8);
+}
+
+bool LogCompression::DecompressBlock(const char *data, char *dst,
+                                     int capacity, int &raw_size) {
+  raw_size = *reinterpret_cast<const int32_t *>(data + 4);
+  int end = GetFrameSize(data);
+  if (raw_size < 0 || raw_size > capacity || end < FRAME_HEADER_SIZE) {
+    return false;
+  }
+  int ip = FRAME_HEADER_SIZE;
+  int op = 0;
+  while (ip < end) {
+    uint8_t token = static_cast<uint8_t>(data[ip++]);
+    int literals = token >> 4;
+    if (literals == 15 && !GetLength(data, ip, end, literals)) {
+      return false;
+    }
+    if (ip + literals > end || op + literals > raw_size) {
+      return false;
+    }
+    memcpy(dst + op, data + ip, literals);
+    ip += literals;
+    op += literals;
+    if (ip == end) {
+      break;
+    }
+
+    if (ip + 2 > end) {
+      return false;
+    }
+    uint16_t offset;
+    memcpy(&offset, data + ip, sizeof(uint16_t));
+    ip += sizeof(uint16_t);
+    int match = token & 0x0F;
+    if (match == 15 && !GetLength(data, ip, end, match)) {
+      return false;
+    }
+    match += MIN_MATCH;
+    if (offset == 0 || offset > op || op + match > raw_size) {
+      return false;
+    }
+    // the match may overlap the bytes it produces
+    for (int i = 0; i < match; i++, op++) {
+      dst[op] = dst[op - offset];
+    }
+  }
+  return op == raw_size;
+}
+
+} // namespace cmudb
@@ -2,93 +2,430 @@
  * log_manager.cpp
  */
 
+#include <unordered_map>
+
+#include "buffer/buffer_pool_manager.h"
+#include "concurrency/transaction.h"
+#include "logging/log_compression.h"
 #include "logging/log_manager.h"
 
 namespace cmudb {
+
+// helpers to pack/unpack LogManager::reserve_
+    static inline uint64_t MakeReservation(lsn_t lsn, int offset) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(lsn)) << 32) |
+               static_cast<uint32_t>(offset);
+    }
+
+    static inline lsn_t ReservedLSN(uint64_t reservation) {
+        return static_cast<lsn_t>(reservation >> 32);
+    }
+
+    static inline int ReservedOffset(uint64_t reservation) {
+        return static_cast<int>(reservation & 0xFFFFFFFF);
+    }
+
 /*
  * set ENABLE_LOGGING = true
  * Start a separate thread to execute flush to disk operation periodically
- * The flush can be triggered when the log buffer is full or buffer pool
- * manager wants to force flush (it only happens when the flushed page has a
- * larger LSN than persistent LSN)
+ * The flush can be triggered when the log buffer is full, when a committing
+ * transaction waits for its commit record, or when buffer pool manager wants
+ * to force flush (it only happens when the flushed page has a larger LSN than
+ * persistent LSN)
  */
     void LogManager::RunFlushThread() {
         if (!ENABLE_LOGGING) {
             ENABLE_LOGGING = true;
+            for (auto *stream : streams_) {
+                stream->flush_thread_ =
+                        new std::thread(&LogManager::FlushLoop, stream);
+            }
+        }
+    }
 
-            flush_thread_ = new std::thread([&]() {
-                while (ENABLE_LOGGING) {
-                    std::unique_lock<std::mutex> lock(latch_);
-                    // timeout?
-                    if (cv_.wait_for(lock, LOG_TIMEOUT) == std::cv_status::timeout &&
-                        offset_ != 0) {
-                        swapBuffer();
-                    }
-                    lsn_t delta = flush_lsn_;
-                    lock.unlock();
+/*
+ * Stop and join the flush thread, set ENABLE_LOGGING = false
+ * Whatever is still in the log buffer is flushed before the thread exits
+ */
+    void LogManager::StopFlushThread() {
+        if (ENABLE_LOGGING) {
+            {
+                std::lock_guard<std::mutex> lock(latch_);
+                ENABLE_LOGGING = false;
+            }
+            for (auto *stream : streams_) {
+                // a flush thread between its check and its wait holds latch_
+                std::lock_guard<std::mutex> lock(stream->latch_);
+                stream->cv_.notify_one();
+            }
+
+            for (auto *stream : streams_) {
+                if (stream->flush_thread_ && stream->flush_thread_->joinable()) {
+                    stream->flush_thread_->join();
+                }
+                delete stream->flush_thread_;
+                stream->flush_thread_ = nullptr;
+            }
+        }
+    }
 
-                    if (ENABLE_LOGGING && !disk_manager_->GetFlushState()
-                        && persistent_lsn_ + 1 != next_lsn_) {
-                        disk_manager_->WriteLog(flush_buffer_, LOG_BUFFER_SIZE);
-                        SetPersistentLSN(delta);
+/*
+ * body of the flush thread
+ * When several committers wait, a durability request does not flush right
+ * away: the thread waits up to GROUP_COMMIT_TIMEOUT (or until a log buffer
+ * fills up) so that every commit record appended meanwhile shares one write +
+ * fdatasync. A single waiter is flushed at once.
+ * All the sealed buffers of the ring are written together, straight from the
+ * ring with one gather write, and only their filled bytes are written. With
+ * COMPRESS_LOG each one is compressed into a frame first. The log file offset of a buffer is only known once the one
+ * before it is written, that is where offset_index_ learns it.
+ */
+    void LogManager::FlushLoop() {
+        std::unique_lock<std::mutex> lock(latch_);
+        while (true) {
+            if (async_lsn_ != INVALID_LSN && persistent_lsn_ >= async_lsn_) {
+                async_lsn_ = INVALID_LSN;
+            }
+            // sleep until LOG_TIMEOUT, or earlier if an async commit is due
+            std::chrono::steady_clock::time_point timeout =
+                    std::chrono::steady_clock::now() + LOG_TIMEOUT;
+            bool async_due = false;
+            while (num_sealed_ == 0 && !flush_requested_ && ENABLE_LOGGING &&
+                   !async_due) {
+                auto deadline = async_lsn_ == INVALID_LSN
+                                ? timeout
+                                : std::min(timeout, async_deadline_);
+                if (cv_.wait_until(lock, deadline) == std::cv_status::timeout &&
+                    deadline == timeout) {
+                    break;
+                }
+                async_due = async_lsn_ != INVALID_LSN &&
+                            std::chrono::steady_clock::now() >= async_deadline_;
+            }
+            // group commit, gather more commit records. A lone committer is
+            // flushed right away, there is nobody to share the flush with
+            if (num_sealed_ == 0 && flush_requested_ && !async_due &&
+                num_waiters_ > 1 && ENABLE_LOGGING &&
+                GROUP_COMMIT_TIMEOUT.count() > 0) {
+                cv_.wait_for(lock, GROUP_COMMIT_TIMEOUT, [&] {
+                    return num_sealed_ != 0 || !ENABLE_LOGGING;
+                });
+            }
+            // timeout or requested, flush what we have. If the ring is full
+            // the sealed buffers go first and the log buffer waits its turn
+            if (num_sealed_ < LOG_BUFFER_COUNT - 1 &&
+                (num_sealed_ == 0 || flush_requested_ || async_due ||
+                 !ENABLE_LOGGING)) {
+                ForceSealLogBuffer(lock);
+            }
+            flush_requested_ = false;
+            if (num_sealed_ == 0) {
+                if (!ENABLE_LOGGING) {
+                    break;
+                }
+                continue;
+            }
 
-                        if (promise != nullptr) {
-                            promise->set_value();
-                        }
-                    }
+            // sealed buffers are not touched by appenders until freed
+            int count = num_sealed_;
+            int size = 0;
+            int raw_size = 0;
+            lsn_t lsn = INVALID_LSN;
+            // first lsn of the buffer after each one -> its log file offset
+            std::vector<std::pair<lsn_t, log_offset_t>> offsets;
+            // the sealed buffers are written in place, one gather write
+            std::vector<struct iovec> frames(count);
+            int compressed = 0;
+            lock.unlock();
+            for (int i = 0; i < count; i++) {
+                int index = (tail_ + i) % LOG_BUFFER_COUNT;
+                int frame_size = 0;
+                if (COMPRESS_LOG) {
+                    frame_size = LogCompression::CompressBlock(
+                            buffers_[index], buffer_size_[index],
+                            compress_buffer_ + compressed);
+                }
+                if (frame_size == 0) {
+                    frames[i].iov_base = buffers_[index];
+                    frame_size = buffer_size_[index];
+                } else {
+                    frames[i].iov_base = compress_buffer_ + compressed;
+                    compressed += frame_size;
                 }
-            });
+                frames[i].iov_len = frame_size;
+                size += frame_size;
+                raw_size += buffer_size_[index];
+                lsn = buffer_lsn_[index];
+                offsets.emplace_back(lsn + 1, write_offset_ + size);
+            }
+            // after a failed write the log file may end in a torn record,
+            // appending to it would hide that
+            bool written = !write_failed_ &&
+                           disk_manager_->WriteLog(frames.data(), count);
+            lock.lock();
+
+            tail_ = (tail_ + count) % LOG_BUFFER_COUNT;
+            num_sealed_ -= count;
+            if (written) {
+                write_offset_ += size;
+                flushed_offset_ += raw_size;
+                offset_index_.insert(offsets.begin(), offsets.end());
+                SetPersistentLSN(lsn);
+            } else {
+                // the buffers are dropped so that appenders go on, but
+                // nothing from here on is durable: waiting committers fail
+                if (!write_failed_) {
+                    LOG_DEBUG("log write failed, the log is not durable anymore");
+                }
+                write_failed_ = true;
+                async_lsn_ = INVALID_LSN;
+            }
+            // wake up committers and appenders waiting for a free buffer
+            flushed_cv_.notify_all();
         }
+        flushed_cv_.notify_all();
     }
 
 /*
- * Stop and join the flush thread, set ENABLE_LOGGING = false
+ * The caller is the one whose reservation started at `size` and did not fit,
+ * so no record with an lsn >= next_lsn lives in the log buffer. Wait for the
+ * copies of all the successful reservations to complete (without the latch),
+ * then queue the buffer and reopen reservations on the next (empty) buffer of
+ * the ring.
  */
-    void LogManager::StopFlushThread() {
-        if (ENABLE_LOGGING) {
-            ENABLE_LOGGING = false;
+    void LogManager::SealLogBuffer(std::unique_lock<std::mutex> &lock, int size,
+                                   lsn_t next_lsn) {
+        // completed-up-to watermark must reach the sealed size. Nobody else
+        // can seal or reopen the buffer meanwhile, so latch_ is not needed
+        // and the copies in flight do not stall the latched callers
+        if (completed_.load() != size) {
+            lock.unlock();
+            while (completed_.load() != size) {
+                std::this_thread::yield();
+            }
+            lock.lock();
+        }
+        // the ring is full, wait for the flush thread to free a buffer
+        flushed_cv_.wait(lock,
+                         [&] { return num_sealed_ < LOG_BUFFER_COUNT - 1; });
 
-            cv_.notify_one();
+        buffer_size_[head_] = size;
+        buffer_lsn_[head_] = next_lsn - 1;
+        num_sealed_++;
+        head_ = (head_ + 1) % LOG_BUFFER_COUNT;
+        log_buffer_ = buffers_[head_];
+        log_offset_ += size;
 
-            std::unique_lock<std::mutex> lock(latch_);
-            if (flush_thread_ && flush_thread_->joinable()) {
-                lock.unlock();
-                flush_thread_->join();
+        completed_.store(0);
+        generation_++;
+        // reservations that failed meanwhile are dropped, they retry
+        reserve_.store(MakeReservation(next_lsn, 0));
+        switched_cv_.notify_all();
+    }
+
+/*
+ * should be called when holding the lock, and the ring must have a free buffer
+ * Pushing the offset past LOG_BUFFER_SIZE makes every later reservation fail,
+ * which turns the caller into the sealer of the current log buffer.
+ */
+    void LogManager::ForceSealLogBuffer(std::unique_lock<std::mutex> &lock) {
+        if (ReservedOffset(reserve_.load()) == 0) {
+            return;
+        }
+        uint64_t generation = generation_;
+        uint64_t cur = reserve_.fetch_add(LOG_BUFFER_SIZE + 1);
+        int offset = ReservedOffset(cur);
+        if (offset > LOG_BUFFER_SIZE) {
+            // an appender is already sealing it
+            switched_cv_.wait(lock, [&] { return generation_ != generation; });
+        } else if (offset == 0) {
+            // raced to an empty buffer, just reopen it
+            generation_++;
+            reserve_.store(MakeReservation(ReservedLSN(cur), 0));
+            switched_cv_.notify_all();
+        } else {
+            SealLogBuffer(lock, offset, ReservedLSN(cur));
+        }
+    }
+
+/*
+ * lsn the next appended log record will get, wait out a buffer switch
+ * because the lsn part of reserve_ is not exact while sealed
+ */
+    lsn_t LogManager::GetNextLSN() {
+        if (global_lsn_ != nullptr) {
+            return global_lsn_->load();
+        }
+        std::unique_lock<std::mutex> lock(latch_);
+        uint64_t cur;
+        switched_cv_.wait(lock, [&] {
+            cur = reserve_.load();
+            return ReservedOffset(cur) <= LOG_BUFFER_SIZE;
+        });
+        return ReservedLSN(cur);
+    }
+
+/*
+ * The offset of the log buffer that holds lsn, so reading from there finds
+ * lsn after a few log records. lsn older than every known log buffer maps to
+ * the oldest known offset, lsn not flushed yet to the last flushed buffer.
+ */
+    log_offset_t LogManager::GetLogOffset(lsn_t lsn, int stream) {
+        LogManager *log = streams_[stream];
+        std::lock_guard<std::mutex> lock(log->latch_);
+        auto it = log->offset_index_.upper_bound(lsn);
+        if (it != log->offset_index_.begin()) {
+            --it;
+        }
+        return it->second;
+    }
+
+/*
+ * keep the entry of the log buffer holding lsn, older ones are not needed
+ */
+    void LogManager::DiscardLogOffsets(lsn_t lsn) {
+        for (auto *log : streams_) {
+            std::lock_guard<std::mutex> lock(log->latch_);
+            auto it = log->offset_index_.upper_bound(lsn);
+            if (it != log->offset_index_.begin()) {
+                --it;
+            }
+            log->offset_index_.erase(log->offset_index_.begin(), it);
+        }
+    }
+
+/*
+ * called by recovery, the flush thread is not running yet. Recovery may have
+ * cut the tail of the log file, appending continues at its new end
+ */
+    void LogManager::Resume(lsn_t next_lsn, lsn_t oldest_lsn,
+                            log_offset_t oldest_offset, int stream) {
+        LogManager *log = streams_[stream];
+        std::lock_guard<std::mutex> lock(log->latch_);
+        assert(ReservedOffset(log->reserve_.load()) == 0 &&
+               log->num_sealed_ == 0);
+        if (global_lsn_ != nullptr) {
+            global_lsn_->store(next_lsn);
+        }
+        log->reserve_.store(MakeReservation(next_lsn, 0));
+        log->log_offset_ = log->disk_manager_->GetLogSize();
+        log->write_offset_ = log->log_offset_;
+        log->flushed_offset_ = log->log_offset_;
+        log->offset_index_.clear();
+        if (oldest_lsn != INVALID_LSN && oldest_lsn < next_lsn) {
+            log->offset_index_[oldest_lsn] = oldest_offset;
+        }
+        log->offset_index_[next_lsn] = log->write_offset_;
+    }
+
+/*
+ * with several streams every lsn before the first log record a stream has
+ * not flushed yet is durable (the other streams hold the lsns in between)
+ */
+    lsn_t LogManager::GetPersistentLSN() {
+        if (global_lsn_ == nullptr) {
+            return persistent_lsn_;
+        }
+        lsn_t lsn = global_lsn_->load() - 1;
+        for (auto *stream : streams_) {
+            std::lock_guard<std::mutex> append_lock(stream->append_latch_);
+            std::lock_guard<std::mutex> lock(stream->latch_);
+            if (stream->last_lsn_ > stream->persistent_lsn_) {
+                int index = stream->num_sealed_ > 0 ? stream->tail_ : stream->head_;
+                lsn = std::min(lsn, stream->buffer_first_lsn_[index] - 1);
             }
         }
+        return lsn;
+    }
+
+    lsn_t LogManager::GetStreamLSN(lsn_t lsn) {
+        std::lock_guard<std::mutex> lock(append_latch_);
+        return std::min(lsn, last_lsn_);
     }
 
 /*
- * should be called when holding the lock
+ * block the caller until log records up to lsn are durable, used by
+ * committing transactions. Returns right away if logging is stopped, or
+ * with false once a log write has failed.
  */
-    inline void LogManager::swapBuffer() {
-        char *tmp = log_buffer_;
-        log_buffer_ = flush_buffer_;
-        flush_buffer_ = tmp;
+    bool LogManager::WaitUntilPersistent(lsn_t lsn) {
+        if (global_lsn_ == nullptr) {
+            return WaitUntilStreamPersistent(lsn);
+        }
+        // ask every stream first so that their flushes overlap
+        std::vector<lsn_t> targets;
+        for (auto *stream : streams_) {
+            targets.push_back(stream->GetStreamLSN(lsn));
+            if (stream->persistent_lsn_ < targets.back()) {
+                std::lock_guard<std::mutex> lock(stream->latch_);
+                stream->flush_requested_ = true;
+                stream->cv_.notify_one();
+            }
+        }
+        bool durable = true;
+        for (size_t i = 0; i < streams_.size(); i++) {
+            durable = streams_[i]->WaitUntilStreamPersistent(targets[i]) &&
+                      durable;
+        }
+        return durable;
+    }
 
-        offset_ = 0;
-        flush_lsn_ = next_lsn_ - 1;
+    bool LogManager::WaitUntilStreamPersistent(lsn_t lsn) {
+        std::unique_lock<std::mutex> lock(latch_);
+        if (persistent_lsn_ >= lsn || !ENABLE_LOGGING) {
+            return true;
+        }
+        num_waiters_++;
+        while (persistent_lsn_ < lsn && ENABLE_LOGGING && !write_failed_) {
+            flush_requested_ = true;
+            cv_.notify_one();
+            flushed_cv_.wait(lock);
+        }
+        num_waiters_--;
+        return persistent_lsn_ >= lsn || !write_failed_;
     }
 
 /*
- * wake up flush thread, only called by buffer pool manager
- * when it wants to force flush
+ * used by async commits: lsn becomes durable by the deadline armed by the
+ * oldest pending async commit, or right away once ASYNC_COMMIT_BYTES of log
+ * are waiting. Does not block.
  */
-    void LogManager::WakeupFlushThread(std::promise<void> *p) {
-        {
-            std::lock_guard<std::mutex> lock(latch_);
-            swapBuffer();
-            SetPromise(p);
+    void LogManager::FlushAsync(lsn_t lsn) {
+        if (global_lsn_ == nullptr) {
+            FlushStreamAsync(lsn);
+            return;
         }
+        for (auto *stream : streams_) {
+            stream->FlushStreamAsync(stream->GetStreamLSN(lsn));
+        }
+    }
 
-        // wake up flush thread
+    void LogManager::FlushStreamAsync(lsn_t lsn) {
+        std::lock_guard<std::mutex> lock(latch_);
+        if (persistent_lsn_ >= lsn || !ENABLE_LOGGING || write_failed_) {
+            return;
+        }
+        if (async_lsn_ == INVALID_LSN) {
+            async_deadline_ = std::chrono::steady_clock::now() + ASYNC_COMMIT_WINDOW;
+        }
+        async_lsn_ = std::max(async_lsn_, lsn);
+        int buffered = std::min<int>(ReservedOffset(reserve_.load()), LOG_BUFFER_SIZE);
+        if (log_offset_ + buffered - flushed_offset_ >= ASYNC_COMMIT_BYTES) {
+            flush_requested_ = true;
+        }
+        // the flush thread may be sleeping past the new deadline
         cv_.notify_one();
+    }
 
-        // waiting for flush done
-        if (promise != nullptr) {
-            promise->get_future().wait();
+/*
+ * wake up flush thread, only called by buffer pool manager
+ * when it wants to force flush
+ */
+    void LogManager::WakeupFlushThread(std::promise<void> *p) {
+        WaitUntilPersistent(GetNextLSN() - 1);
+        if (p != nullptr) {
+            p->set_value();
         }
-        SetPromise(nullptr);
     }
 
 /*
@@ -96,68 +433,376 @@ namespace cmudb {
  * you MUST set the log record's lsn within this method
  * @return: lsn that is assigned to this log record
  *
- *
+ * lsn and buffer range come from one fetch_add on reserve_, so records are
+ * laid out in lsn order. The first appender that does not fit seals the
+ * buffer, the others wait for the switch and retry.
+ * With several streams the lsn comes from the shared counter instead, taken
+ * under append_latch_ of the stream together with the buffer range. Only the
+ * appenders of one stream serialize there, the copy is still concurrent.
+ */
+    lsn_t LogManager::AppendLogRecord(LogRecord &log_record) {
+        log_offset_t offset;
+        return AppendLogRecord(log_record, offset);
+    }
+
+    lsn_t LogManager::AppendLogRecord(LogRecord &log_record,
+                                      log_offset_t &log_offset) {
+        LogRecord *record = &log_record;
+        return GetStream(log_record.txn_id_)
+                ->AppendLogRecords(&record, 1, log_offset, false);
+    }
+
+    lsn_t LogManager::AppendLogRecords(LogRecord **records, int count,
+                                       log_offset_t &log_offset, bool chain) {
+        int size = 0;
+        for (int i = 0; i < count; i++) {
+            if (COMPACT_LOG_HEADER) {
+                records[i]->UseCompactHeader(chain && i > 0);
+            }
+            size += records[i]->size_;
+        }
+        assert(size <= LOG_BUFFER_SIZE);
+
+        std::unique_lock<std::mutex> append_lock(append_latch_, std::defer_lock);
+        lsn_t first_lsn = INVALID_LSN;
+        if (global_lsn_ != nullptr) {
+            append_lock.lock();
+            first_lsn = global_lsn_->fetch_add(count);
+            last_lsn_ = first_lsn + count - 1;
+        }
+        while (true) {
+            uint64_t generation = generation_;
+            uint64_t cur;
+            if (global_lsn_ == nullptr) {
+                cur = reserve_.fetch_add(MakeReservation(count, size));
+            } else {
+                // reserve_ keeps the lsn after the last one of the stream
+                cur = reserve_.load();
+                uint64_t next =
+                        ReservedOffset(cur) + size <= LOG_BUFFER_SIZE
+                        ? MakeReservation(first_lsn + count,
+                                          ReservedOffset(cur) + size)
+                        : cur + LOG_BUFFER_SIZE + 1;
+                if (ReservedOffset(cur) <= LOG_BUFFER_SIZE &&
+                    !reserve_.compare_exchange_strong(cur, next)) {
+                    continue;
+                }
+            }
+            int offset = ReservedOffset(cur);
+            if (offset + size <= LOG_BUFFER_SIZE) {
+                if (append_lock.owns_lock()) {
+                    if (offset == 0) {
+                        buffer_first_lsn_[head_] = first_lsn;
+                    }
+                    append_lock.unlock();
+                }
+                // stable while the reservation succeeds
+                log_offset = log_offset_ + offset;
+                lsn_t lsn = global_lsn_ == nullptr ? ReservedLSN(cur) : first_lsn;
+                for (int i = 0; i < count; i++, lsn++) {
+                    records[i]->lsn_ = lsn;
+                    if (chain && i > 0) {
+                        records[i]->prev_lsn_ = lsn - 1;
+                    }
+                    SerializeLogRecord(*records[i], log_buffer_ + offset);
+                    offset += records[i]->size_;
+                }
+                completed_.fetch_add(size);
+                return lsn - 1;
+            }
+
+            // log_buffer is full
+            std::unique_lock<std::mutex> lock(latch_);
+            if (offset <= LOG_BUFFER_SIZE) {
+                SealLogBuffer(lock, offset, ReservedLSN(cur));
+                // wake up flush thread
+                cv_.notify_one();
+            } else {
+                switched_cv_.wait(lock, [&] { return generation_ != generation; });
+            }
+        }
+    }
+
+/*
+ * INSERT and MARKDELETE only change the page of their own tuple, which the
+ * transaction holds an exclusive lock on, so they can reach the log later as
+ * long as their page is not written back meanwhile. The log record gets its
+ * lsn and prev lsn when the private log is published, the tuple is copied
+ * since the caller's may point into a page.
+ */
+    lsn_t LogManager::AppendTxnLogRecord(LogRecord &log_record, Transaction *txn,
+                                         Page *page) {
+        if (!PRIVATE_TXN_LOG ||
+            (log_record.log_record_type_ != LogRecordType::INSERT &&
+             log_record.log_record_type_ != LogRecordType::MARKDELETE)) {
+            return AppendLogRecord(log_record);
+        }
+        Tuple &tuple = log_record.log_record_type_ == LogRecordType::INSERT
+                       ? log_record.insert_tuple_
+                       : log_record.delete_tuple_;
+        if (!tuple.IsAllocated()) {
+            std::vector<char> image(sizeof(int32_t) + tuple.GetLength());
+            tuple.SerializeTo(image.data());
+            tuple.DeserializeFrom(image.data());
+        }
+        txn->GetPrivateLog().push_back(log_record);
+        // the 20-byte header size is an upper bound of the compact one
+        txn->SetPrivateLogSize(txn->GetPrivateLogSize() + log_record.size_);
+        if (txn->GetPrivateLogPages()
+                    .emplace(page->GetPageId(),
+                             std::make_pair(page, static_cast<BufferPoolManager *>(
+                                                          nullptr)))
+                    .second) {
+            // FlushPage must not write it before its log
+            page->AddPrivateLog();
+        }
+        return INVALID_LSN;
+    }
+
+/*
+ * The private log goes out in as few reservations as fit in a log buffer,
+ * usually one, with chained prev lsns. The pages it changed are made dirty
+ * since the lsn taken before appending (a checkpoint that does not see that
+ * recLSN starts redo after it anyway), and get the lsn of their last log
+ * record before their pins are dropped, so eviction flushes the log first.
+ */
+    lsn_t LogManager::PublishTxnLog(Transaction *txn, LogRecord *tail) {
+        auto &private_log = txn->GetPrivateLog();
+        auto &pages = txn->GetPrivateLogPages();
+        std::vector<LogRecord *> records;
+        for (auto &log_record : private_log) {
+            records.push_back(&log_record);
+        }
+        if (tail != nullptr) {
+            records.push_back(tail);
+        }
+        if (records.empty()) {
+            return INVALID_LSN;
+        }
+        if (!private_log.empty()) {
+            lsn_t next_lsn = GetNextLSN();
+            for (auto &entry : pages) {
+                entry.second.first->SetRecLSN(next_lsn);
+            }
+        }
+
+        lsn_t lsn = txn->GetPrevLSN();
+        size_t first = 0;
+        while (first < records.size()) {
+            size_t last = first;
+            int size = 0;
+            while (last < records.size() &&
+                   size + records[last]->size_ <= LOG_BUFFER_SIZE) {
+                size += records[last++]->size_;
+            }
+            records[first]->prev_lsn_ = lsn;
+            log_offset_t offset;
+            lsn = GetStream(txn->GetTransactionId())
+                    ->AppendLogRecords(&records[first], last - first, offset,
+                                       true);
+            first = last;
+        }
+        txn->SetPrevLSN(lsn);
+
+        std::unordered_map<page_id_t, lsn_t> page_lsns;
+        for (auto &log_record : private_log) {
+            page_id_t page_id =
+                    log_record.log_record_type_ == LogRecordType::INSERT
+                    ? log_record.insert_rid_.GetPageId()
+                    : log_record.delete_rid_.GetPageId();
+            page_lsns[page_id] = log_record.lsn_;
+        }
+        for (auto &entry : pages) {
+            Page *page = entry.second.first;
+            page->WLatch();
+            // without a kept pin the frame may hold another page by now
+            if (page->GetPageId() == entry.first) {
+                if (page->GetLSN() < page_lsns[entry.first]) {
+                    page->SetLSN(page_lsns[entry.first]);
+                }
+                page->DropPrivateLog();
+            }
+            page->WUnlatch();
+            if (entry.second.second != nullptr) {
+                entry.second.second->UnpinPage(entry.first, true);
+            }
+        }
+        private_log.clear();
+        pages.clear();
+        txn->SetPrivateLogSize(0);
+        return lsn;
+    }
+
+/*
+ * publish the private log if the next tuple change may not fit, or may pin
+ * one page too many. Called before the page of the change is latched
+ */
+    void LogManager::ReserveTxnLog(Transaction *txn) {
+        if (txn->GetPrivateLogSize() + PAGE_SIZE > TXN_LOG_BUFFER_SIZE ||
+            txn->GetPrivateLogPages().size() >= TXN_LOG_MAX_PAGES) {
+            PublishTxnLog(txn);
+        }
+    }
+
+/*
  * example below
  * // First, serialize the must have fields(20 bytes in total)
- * log_record.lsn_ = next_lsn_++;
- * memcpy(log_buffer_ + offset_, &log_record, 20);
- * int pos = offset_ + 20;
+ * memcpy(data, &log_record, 20);
+ * int pos = 20;
  *
  * if (log_record.log_record_type_ == LogRecordType::INSERT) {
- *    memcpy(log_buffer_ + pos, &log_record.insert_rid_, sizeof(RID));
+ *    memcpy(data + pos, &log_record.insert_rid_, sizeof(RID));
  *    pos += sizeof(RID);
  *    // we have provided serialize function for tuple class
- *    log_record.insert_tuple_.SerializeTo(log_buffer_ + pos);
+ *    log_record.insert_tuple_.SerializeTo(data + pos);
  *  }
- *
  */
-    lsn_t LogManager::AppendLogRecord(LogRecord &log_record) {
-        std::lock_guard<std::mutex> lock(latch_);
-
-        // log_buffer is almost full?
-        if (offset_ + log_record.size_ > LOG_BUFFER_SIZE) {
-            swapBuffer();
-            // wake up flush thread
-            cv_.notify_one();
-        }
-
-        // First, serialize the must have fields(20 bytes in total)
-        log_record.lsn_ = next_lsn_++;
-
+    void LogManager::SerializeLogRecord(const LogRecord &log_record, char *data) {
         // for begin/commit/abort, we are done
-        memcpy(log_buffer_ + offset_, &log_record, LogRecord::HEADER_SIZE);
-        int pos = offset_ + LogRecord::HEADER_SIZE;
+        int pos;
+        if (log_record.header_size_ == LogRecord::HEADER_SIZE) {
+            memcpy(data, &log_record, LogRecord::HEADER_SIZE);
+            pos = LogRecord::HEADER_SIZE;
+        } else {
+            uint8_t flags = LogRecord::COMPACT_HEADER;
+            if (log_record.txn_id_ == INVALID_TXN_ID) {
+                flags |= LogRecord::NO_TXN_ID;
+            }
+            if (log_record.prev_lsn_ == INVALID_LSN) {
+                flags |= LogRecord::NO_PREV_LSN;
+            } else if (log_record.chained_) {
+                assert(log_record.prev_lsn_ == log_record.lsn_ - 1);
+                flags |= LogRecord::CHAINED_PREV_LSN;
+            }
+            data[0] = static_cast<char>(log_record.log_record_type_);
+            data[1] = static_cast<char>(flags);
+            pos = 2;
+            pos += LogRecord::PutVarint(data + pos, log_record.size_);
+            memcpy(data + pos, &log_record.lsn_, sizeof(lsn_t));
+            pos += sizeof(lsn_t);
+            if (log_record.txn_id_ != INVALID_TXN_ID) {
+                pos += LogRecord::PutVarint(data + pos, log_record.txn_id_);
+            }
+            if (log_record.prev_lsn_ != INVALID_LSN && !log_record.chained_) {
+                pos += LogRecord::PutVarint(data + pos, log_record.prev_lsn_);
+            }
+            assert(pos == log_record.header_size_);
+        }
 
         if (log_record.log_record_type_ == LogRecordType::INSERT) {
             // for insert
-            memcpy(log_buffer_ + pos, &log_record.insert_rid_, sizeof(RID));
+            memcpy(data + pos, &log_record.insert_rid_, sizeof(RID));
             pos += sizeof(RID);
-            log_record.insert_tuple_.SerializeTo(log_buffer_ + pos);
+            log_record.insert_tuple_.SerializeTo(data + pos);
 
         } else if (log_record.log_record_type_ == LogRecordType::MARKDELETE ||
                    log_record.log_record_type_ == LogRecordType::ROLLBACKDELETE ||
                    log_record.log_record_type_ == LogRecordType::APPLYDELETE) {
 
             // for delete
-            memcpy(log_buffer_ + pos, &log_record.delete_rid_, sizeof(RID));
+            memcpy(data + pos, &log_record.delete_rid_, sizeof(RID));
             pos += sizeof(RID);
-            log_record.delete_tuple_.SerializeTo(log_buffer_ + pos);
+            log_record.delete_tuple_.SerializeTo(data + pos);
 
         } else if (log_record.log_record_type_ == LogRecordType::UPDATE) {
             // for update
-            memcpy(log_buffer_ + pos, &log_record.update_rid_, sizeof(RID));
+            memcpy(data + pos, &log_record.update_rid_, sizeof(RID));
             pos += sizeof(RID);
-            log_record.old_tuple_.SerializeTo(log_buffer_ + pos);
-            pos += log_record.old_tuple_.GetLength();
-            log_record.new_tuple_.SerializeTo(log_buffer_ + pos);
+            log_record.old_tuple_.SerializeTo(data + pos);
+            pos += sizeof(int32_t) + log_record.old_tuple_.GetLength();
+            log_record.new_tuple_.SerializeTo(data + pos);
+
+        } else if (log_record.log_record_type_ == LogRecordType::UPDATEDELTA) {
+            // for update, changed byte ranges only
+            memcpy(data + pos, &log_record.update_rid_, sizeof(RID));
+            pos += sizeof(RID);
+            memcpy(data + pos, log_record.update_delta_.data(),
+                   log_record.update_delta_.size());
 
         } else if (log_record.log_record_type_ == LogRecordType::NEWPAGE) {
             // for new page
-            memcpy(log_buffer_ + pos, &log_record.prev_page_id_, sizeof(page_id_t));
-        }
+            memcpy(data + pos, &log_record.prev_page_id_, sizeof(page_id_t));
+            pos += sizeof(page_id_t);
+            if (log_record.slot_locks_) {
+                int32_t slot_locks = 1;
+                memcpy(data + pos, &slot_locks, sizeof(int32_t));
+            }
 
-        offset_ += log_record.size_;
-        return log_record.lsn_;
+        } else if (log_record.log_record_type_ == LogRecordType::INDEXPAGE) {
+            // for index page, the key change then the changed byte ranges
+            int32_t value = static_cast<int32_t>(log_record.index_key_op_);
+            memcpy(data + pos, &value, sizeof(int32_t));
+            pos += sizeof(int32_t);
+            if (log_record.index_key_op_ != IndexKeyOp::NONE) {
+                value = log_record.index_name_.size();
+                memcpy(data + pos, &value, sizeof(int32_t));
+                pos += sizeof(int32_t);
+                memcpy(data + pos, log_record.index_name_.data(), value);
+                pos += value;
+                memcpy(data + pos, &log_record.index_rid_, sizeof(RID));
+                pos += sizeof(RID);
+                value = log_record.index_key_columns_.size();
+                memcpy(data + pos, &value, sizeof(int32_t));
+                pos += sizeof(int32_t);
+                for (auto &column : log_record.index_key_columns_) {
+                    value = static_cast<int32_t>(column.first);
+                    memcpy(data + pos, &value, sizeof(int32_t));
+                    memcpy(data + pos + sizeof(int32_t), &column.second,
+                           sizeof(int32_t));
+                    pos += 2 * sizeof(int32_t);
+                }
+                value = log_record.index_key_.size();
+                memcpy(data + pos, &value, sizeof(int32_t));
+                pos += sizeof(int32_t);
+                memcpy(data + pos, log_record.index_key_.data(), value);
+                pos += value;
+            }
+            value = log_record.index_pages_.size();
+            memcpy(data + pos, &value, sizeof(int32_t));
+            pos += sizeof(int32_t);
+            for (auto &page : log_record.index_pages_) {
+                memcpy(data + pos, &page.page_id, sizeof(page_id_t));
+                pos += sizeof(page_id_t);
+                value = page.new_page;
+                memcpy(data + pos, &value, sizeof(int32_t));
+                pos += sizeof(int32_t);
+                value = page.delta.size();
+                memcpy(data + pos, &value, sizeof(int32_t));
+                pos += sizeof(int32_t);
+                memcpy(data + pos, page.delta.data(), value);
+                pos += value;
+            }
+
+        } else if (log_record.log_record_type_ == LogRecordType::CHECKPOINT) {
+            // for checkpoint
+            memcpy(data + pos, &log_record.redo_lsn_, sizeof(lsn_t));
+            pos += sizeof(lsn_t);
+            memcpy(data + pos, &log_record.recovery_offset_, sizeof(log_offset_t));
+            pos += sizeof(log_offset_t);
+            int32_t count = log_record.active_txn_table_.size();
+            memcpy(data + pos, &count, sizeof(int32_t));
+            pos += sizeof(int32_t);
+            for (auto &entry : log_record.active_txn_table_) {
+                memcpy(data + pos, &entry.first, sizeof(txn_id_t));
+                memcpy(data + pos + sizeof(txn_id_t), &entry.second, sizeof(lsn_t));
+                pos += sizeof(txn_id_t) + sizeof(lsn_t);
+            }
+            count = log_record.dirty_page_table_.size();
+            memcpy(data + pos, &count, sizeof(int32_t));
+            pos += sizeof(int32_t);
+            for (auto &entry : log_record.dirty_page_table_) {
+                memcpy(data + pos, &entry.first, sizeof(page_id_t));
+                memcpy(data + pos + sizeof(page_id_t), &entry.second, sizeof(lsn_t));
+                pos += sizeof(page_id_t) + sizeof(lsn_t);
+            }
+            if (!log_record.stream_offsets_.empty()) {
+                count = log_record.stream_offsets_.size();
+                memcpy(data + pos, &count, sizeof(int32_t));
+                pos += sizeof(int32_t);
+                memcpy(data + pos, log_record.stream_offsets_.data(),
+                       count * sizeof(log_offset_t));
+            }
+        }
     }
 
 } // namespace cmudb
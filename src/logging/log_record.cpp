@@ -0,0 +1,292 @@
+/**
+ * log_record.cpp
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "logging/log_record.h"
+
+namespace cmudb {
+
+/*
+ * Diff old_tuple_ against new_tuple_ into update_delta_
+ * The common prefix and suffix of both images are never logged. If the
+ * tuple size does not change, the bytes in between are split further into
+ * ranges, two ranges are only kept apart when the unchanged bytes between
+ * them cost more than the header of a new range.
+ */
+    void LogRecord::BuildUpdateDelta() {
+        const char *old_data = old_tuple_.GetData();
+        const char *new_data = new_tuple_.GetData();
+        int old_size = old_tuple_.GetLength();
+        int new_size = new_tuple_.GetLength();
+        int min_size = std::min(old_size, new_size);
+
+        int prefix = 0;
+        while (prefix < min_size && old_data[prefix] == new_data[prefix]) {
+            prefix++;
+        }
+        int suffix = 0;
+        while (suffix < min_size - prefix &&
+               old_data[old_size - suffix - 1] == new_data[new_size - suffix - 1]) {
+            suffix++;
+        }
+
+        // (offset, old_len, new_len) of each range
+        std::vector<int32_t> ranges;
+        if (old_size != new_size) {
+            ranges.insert(ranges.end(), {prefix, old_size - suffix - prefix,
+                                         new_size - suffix - prefix});
+        } else {
+            int end = old_size - suffix;
+            int pos = prefix;
+            while (pos < end) {
+                int start = pos;
+                int last = pos; // last changed byte of this range
+                // unchanged bytes inside a range are logged twice
+                while (pos < end && 2 * (pos - last - 1) <= RANGE_HEADER_SIZE) {
+                    if (old_data[pos] != new_data[pos]) {
+                        last = pos;
+                    }
+                    pos++;
+                }
+                ranges.insert(ranges.end(),
+                              {start, last - start + 1, last - start + 1});
+                // skip to the next changed byte
+                pos = last + 1;
+                while (pos < end && old_data[pos] == new_data[pos]) {
+                    pos++;
+                }
+            }
+        }
+
+        int32_t range_count = ranges.size() / 3;
+        int delta_size = 3 * sizeof(int32_t) + range_count * RANGE_HEADER_SIZE;
+        for (size_t i = 0; i < ranges.size(); i += 3) {
+            delta_size += ranges[i + 1] + ranges[i + 2];
+        }
+        update_delta_.resize(delta_size);
+
+        char *data = update_delta_.data();
+        memcpy(data, &old_size, sizeof(int32_t));
+        memcpy(data + 4, &new_size, sizeof(int32_t));
+        memcpy(data + 8, &range_count, sizeof(int32_t));
+        int pos = 3 * sizeof(int32_t);
+        for (size_t i = 0; i < ranges.size(); i += 3) {
+            memcpy(data + pos, &ranges[i], RANGE_HEADER_SIZE);
+            pos += RANGE_HEADER_SIZE;
+            // same offset in both images, a size change makes a single range
+            memcpy(data + pos, old_data + ranges[i], ranges[i + 1]);
+            pos += ranges[i + 1];
+            memcpy(data + pos, new_data + ranges[i], ranges[i + 2]);
+            pos += ranges[i + 2];
+        }
+    }
+
+/*
+ * Copy the unchanged bytes of image and the logged bytes of each range into
+ * result. Ranges are described against the old image, when undoing their
+ * offset in the new image is shifted by the size changes of earlier ranges.
+ */
+    bool LogRecord::ApplyUpdateDelta(const Tuple &image, Tuple &result,
+                                     bool undo) const {
+        if (log_record_type_ != LogRecordType::UPDATEDELTA ||
+            update_delta_.size() < 3 * sizeof(int32_t)) {
+            return false;
+        }
+        const char *delta = update_delta_.data();
+        int32_t old_size = *reinterpret_cast<const int32_t *>(delta);
+        int32_t new_size = *reinterpret_cast<const int32_t *>(delta + 4);
+        int32_t range_count = *reinterpret_cast<const int32_t *>(delta + 8);
+        int32_t from_size = undo ? new_size : old_size;
+        int32_t to_size = undo ? old_size : new_size;
+        if (image.GetLength() != from_size) {
+            return false;
+        }
+
+        // result is deserialized from | size | data |
+        std::vector<char> storage(sizeof(int32_t) + to_size);
+        memcpy(storage.data(), &to_size, sizeof(int32_t));
+        char *to = storage.data() + sizeof(int32_t);
+        const char *from = image.GetData();
+
+        int pos = 3 * sizeof(int32_t);
+        int from_pos = 0, to_pos = 0, shift = 0;
+        for (int i = 0; i < range_count; i++) {
+            int32_t offset = *reinterpret_cast<const int32_t *>(delta + pos);
+            int32_t old_len = *reinterpret_cast<const int32_t *>(delta + pos + 4);
+            int32_t new_len = *reinterpret_cast<const int32_t *>(delta + pos + 8);
+            const char *old_bytes = delta + pos + RANGE_HEADER_SIZE;
+            const char *new_bytes = old_bytes + old_len;
+            pos += RANGE_HEADER_SIZE + old_len + new_len;
+
+            int from_offset = undo ? offset + shift : offset;
+            int from_len = undo ? new_len : old_len;
+            int to_len = undo ? old_len : new_len;
+            // unchanged bytes before the range
+            int gap = from_offset - from_pos;
+            memcpy(to + to_pos, from + from_pos, gap);
+            to_pos += gap;
+            memcpy(to + to_pos, undo ? old_bytes : new_bytes, to_len);
+            to_pos += to_len;
+            from_pos = from_offset + from_len;
+            shift += new_len - old_len;
+        }
+        // unchanged tail
+        memcpy(to + to_pos, from + from_pos, from_size - from_pos);
+        assert(to_pos + from_size - from_pos == to_size);
+
+        result.DeserializeFrom(storage.data());
+        return true;
+    }
+
+    void LogRecord::SetIndexKey(
+            IndexKeyOp op, const std::string &index_name, const char *key,
+            int key_size, const std::vector<std::pair<TypeId, int32_t>> &columns,
+            const RID &rid) {
+        assert(index_key_op_ == IndexKeyOp::NONE && op != IndexKeyOp::NONE);
+        index_key_op_ = op;
+        index_name_ = index_name;
+        index_key_.assign(key, key + key_size);
+        index_key_columns_ = columns;
+        index_rid_ = rid;
+        size_ += 3 * sizeof(int32_t) + index_name.size() + sizeof(RID) +
+                 columns.size() * 2 * sizeof(int32_t) + key_size;
+    }
+
+    void LogRecord::AddIndexPage(page_id_t page_id, bool new_page,
+                                 const char *old_data, const char *new_data) {
+        index_pages_.push_back({page_id, new_page, std::vector<char>()});
+        BuildPageDelta(old_data, new_data, index_pages_.back().delta);
+        size_ += sizeof(page_id_t) + 2 * sizeof(int32_t) +
+                 index_pages_.back().delta.size();
+    }
+
+    LogRecord LogRecord::GetIndexPagePart(int i) const {
+        LogRecord part(LogRecordType::INDEXPAGE, txn_id_, prev_lsn_);
+        part.lsn_ = lsn_;
+        part.index_pages_.push_back(index_pages_[i]);
+        part.size_ += sizeof(page_id_t) + 2 * sizeof(int32_t) +
+                      index_pages_[i].delta.size();
+        return part;
+    }
+
+/*
+ * Diff two images of a page into delta, changed bytes closer than a range
+ * header are logged as one range
+ */
+    void LogRecord::BuildPageDelta(const char *old_data, const char *new_data,
+                                   std::vector<char> &delta) {
+        std::vector<int32_t> ranges;
+        int pos = 0;
+        while (pos < PAGE_SIZE) {
+            if (old_data[pos] == new_data[pos]) {
+                pos++;
+                continue;
+            }
+            int start = pos;
+            int last = pos;
+            while (pos < PAGE_SIZE && pos - last <= PAGE_RANGE_HEADER_SIZE) {
+                if (old_data[pos] != new_data[pos]) {
+                    last = pos;
+                }
+                pos++;
+            }
+            ranges.insert(ranges.end(), {start, last - start + 1});
+            pos = last + 1;
+        }
+
+        int32_t range_count = ranges.size() / 2;
+        int delta_size = sizeof(int32_t) + range_count * PAGE_RANGE_HEADER_SIZE;
+        for (size_t i = 0; i < ranges.size(); i += 2) {
+            delta_size += ranges[i + 1];
+        }
+        delta.resize(delta_size);
+
+        char *data = delta.data();
+        memcpy(data, &range_count, sizeof(int32_t));
+        pos = sizeof(int32_t);
+        for (size_t i = 0; i < ranges.size(); i += 2) {
+            memcpy(data + pos, &ranges[i], PAGE_RANGE_HEADER_SIZE);
+            pos += PAGE_RANGE_HEADER_SIZE;
+            memcpy(data + pos, new_data + ranges[i], ranges[i + 1]);
+            pos += ranges[i + 1];
+        }
+    }
+
+    void LogRecord::ApplyPageDelta(char *data, int i) const {
+        if (index_pages_[i].new_page) {
+            memset(data, 0, PAGE_SIZE);
+        }
+        const char *delta = index_pages_[i].delta.data();
+        int32_t range_count = *reinterpret_cast<const int32_t *>(delta);
+        int pos = sizeof(int32_t);
+        for (int j = 0; j < range_count; j++) {
+            int32_t offset = *reinterpret_cast<const int32_t *>(delta + pos);
+            int32_t length = *reinterpret_cast<const int32_t *>(delta + pos + 4);
+            pos += PAGE_RANGE_HEADER_SIZE;
+            assert(offset >= 0 && offset + length <= PAGE_SIZE);
+            memcpy(data + offset, delta + pos, length);
+            pos += length;
+        }
+    }
+
+/*
+ * The body does not change, only the header: type, flags, the varint
+ * fields that are not INVALID and the 4-byte lsn. size_ counts its own
+ * varint, one more byte is needed when that pushes it over a 7-bit boundary.
+ */
+    void LogRecord::UseCompactHeader(bool chained) {
+        if (header_size_ != HEADER_SIZE) {
+            return;
+        }
+        chained_ = chained && prev_lsn_ != INVALID_LSN;
+        int body = size_ - HEADER_SIZE;
+        int header = 2 + sizeof(lsn_t);
+        if (txn_id_ != INVALID_TXN_ID) {
+            header += VarintSize(txn_id_);
+        }
+        if (prev_lsn_ != INVALID_LSN && !chained_) {
+            header += VarintSize(prev_lsn_);
+        }
+        int size_bytes = VarintSize(header + body + 1);
+        if (VarintSize(header + body + size_bytes) > size_bytes) {
+            size_bytes++;
+        }
+        header_size_ = header + size_bytes;
+        size_ = header_size_ + body;
+    }
+
+    int LogRecord::VarintSize(uint32_t value) {
+        int size = 1;
+        while (value >= 0x80) {
+            value >>= 7;
+            size++;
+        }
+        return size;
+    }
+
+    int LogRecord::PutVarint(char *data, uint32_t value) {
+        int pos = 0;
+        while (value >= 0x80) {
+            data[pos++] = static_cast<char>((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        data[pos++] = static_cast<char>(value);
+        return pos;
+    }
+
+    int LogRecord::GetVarint(const char *data, int available, uint32_t &value) {
+        value = 0;
+        for (int pos = 0; pos < available && pos < 5; pos++) {
+            uint8_t byte = static_cast<uint8_t>(data[pos]);
+            value |= static_cast<uint32_t>(byte & 0x7F) << (7 * pos);
+            if ((byte & 0x80) == 0) {
+                return pos + 1;
+            }
+        }
+        return 0;
+    }
+
+} // namespace cmudb
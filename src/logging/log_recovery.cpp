@@ -2,32 +2,102 @@
  * log_recovery.cpp
  */
 
+#include <algorithm>
+#include <cstring>
+
+#include "common/exception.h"
+#include "index/b_plus_tree.h"
+#include "logging/log_compression.h"
 #include "logging/log_recovery.h"
 #include "page/table_page.h"
 
 namespace cmudb {
 
+    static_assert(LOG_BUFFER_SIZE < 0x8000,
+                  "second byte of a 20-byte header must stay below 0x80");
+
+    // decode a compact header, @return: its size, 0 if incomplete
+    int LogRecovery::DeserializeCompactHeader(const char *data, int available,
+                                              uint32_t &size, lsn_t &lsn,
+                                              txn_id_t &txn_id, lsn_t &prev_lsn) {
+        uint8_t flags = static_cast<uint8_t>(data[1]);
+        int pos = 2;
+        int len = LogRecord::GetVarint(data + pos, available - pos, size);
+        if (len == 0 || pos + len + static_cast<int>(sizeof(lsn_t)) > available) {
+            return 0;
+        }
+        pos += len;
+        memcpy(&lsn, data + pos, sizeof(lsn_t));
+        pos += sizeof(lsn_t);
+        uint32_t value;
+        txn_id = INVALID_TXN_ID;
+        if ((flags & LogRecord::NO_TXN_ID) == 0) {
+            if ((len = LogRecord::GetVarint(data + pos, available - pos, value)) == 0) {
+                return 0;
+            }
+            txn_id = static_cast<txn_id_t>(value);
+            pos += len;
+        }
+        prev_lsn = INVALID_LSN;
+        if ((flags & LogRecord::CHAINED_PREV_LSN) != 0) {
+            prev_lsn = lsn - 1;
+        } else if ((flags & LogRecord::NO_PREV_LSN) == 0) {
+            if ((len = LogRecord::GetVarint(data + pos, available - pos, value)) == 0) {
+                return 0;
+            }
+            prev_lsn = static_cast<lsn_t>(value);
+            pos += len;
+        }
+        return pos;
+    }
+
 /*
- * deserialize a log record from log buffer
+ * deserialize a log record from log buffer, both header formats are read
  * @return: true means deserialize succeed, otherwise can't deserialize cause
- * incomplete log record
+ * incomplete log record (it does not fit in available bytes)
  */
     bool LogRecovery::DeserializeLogRecord(const char *data,
-                                           LogRecord &log_record) {
+                                           LogRecord &log_record, int available) {
         // deserialize header, must have fields
-        int32_t size_ = *reinterpret_cast<const int *>(data);
-        lsn_t lsn_ = *reinterpret_cast<const lsn_t *>(data + 4);;
-        txn_id_t txn_id_ = *reinterpret_cast<const lsn_t *>(data + 8);
-        lsn_t prev_lsn_ = *reinterpret_cast<const lsn_t *>(data + 12);
-        LogRecordType log_record_type_ = *reinterpret_cast<const LogRecordType *>(data + 16);
-
-        if (size_ < 0 || lsn_ == INVALID_LSN || txn_id_ == INVALID_TXN_ID ||
-            log_record_type_ == LogRecordType::INVALID) {
+        int32_t size_;
+        lsn_t lsn_;
+        txn_id_t txn_id_;
+        lsn_t prev_lsn_;
+        LogRecordType log_record_type_;
+        int header;
+        if (available >= 2 &&
+            (static_cast<uint8_t>(data[1]) & LogRecord::COMPACT_HEADER) != 0) {
+            uint32_t size;
+            header = DeserializeCompactHeader(data, available, size, lsn_,
+                                              txn_id_, prev_lsn_);
+            if (header == 0 || size > static_cast<uint32_t>(available)) {
+                return false;
+            }
+            size_ = size;
+            log_record_type_ = static_cast<LogRecordType>(data[0]);
+        } else {
+            if (available < LogRecord::HEADER_SIZE) {
+                return false;
+            }
+            header = LogRecord::HEADER_SIZE;
+            size_ = *reinterpret_cast<const int *>(data);
+            lsn_ = *reinterpret_cast<const lsn_t *>(data + 4);
+            txn_id_ = *reinterpret_cast<const lsn_t *>(data + 8);
+            prev_lsn_ = *reinterpret_cast<const lsn_t *>(data + 12);
+            log_record_type_ = *reinterpret_cast<const LogRecordType *>(data + 16);
+        }
+
+        if (size_ < header || size_ > available || lsn_ == INVALID_LSN ||
+            (txn_id_ == INVALID_TXN_ID && log_record_type_ != LogRecordType::CHECKPOINT &&
+             log_record_type_ != LogRecordType::INDEXPAGE) ||
+            log_record_type_ == LogRecordType::INVALID ||
+            log_record_type_ > LogRecordType::INDEXPAGE) {
             return false;
         }
 
-        // HEADER, 20bytes
+        // HEADER, 20bytes or compact
         log_record.size_ = size_;
+        log_record.header_size_ = header;
         log_record.lsn_ = lsn_;
         log_record.txn_id_ = txn_id_;
         log_record.prev_lsn_ = prev_lsn_;
@@ -35,27 +105,114 @@ namespace cmudb {
 
         switch (log_record_type_) {
             case LogRecordType::INSERT: {
-                log_record.insert_rid_ = *reinterpret_cast<const RID *>(data + LogRecord::HEADER_SIZE);
-                log_record.insert_tuple_.DeserializeFrom(data + LogRecord::HEADER_SIZE + sizeof(RID));
+                log_record.insert_rid_ = *reinterpret_cast<const RID *>(data + header);
+                log_record.insert_tuple_.DeserializeFrom(data + header + sizeof(RID));
                 break;
             }
             case LogRecordType::MARKDELETE:
             case LogRecordType::ROLLBACKDELETE:
             case LogRecordType::APPLYDELETE: {
-                log_record.delete_rid_ = *reinterpret_cast<const RID *>(data + LogRecord::HEADER_SIZE);
-                log_record.delete_tuple_.DeserializeFrom(data + LogRecord::HEADER_SIZE + sizeof(RID));
+                log_record.delete_rid_ = *reinterpret_cast<const RID *>(data + header);
+                log_record.delete_tuple_.DeserializeFrom(data + header + sizeof(RID));
                 break;
             }
             case LogRecordType::UPDATE: {
-                log_record.update_rid_ = *reinterpret_cast<const RID *>(data + LogRecord::HEADER_SIZE);
-                log_record.old_tuple_.DeserializeFrom(data + LogRecord::HEADER_SIZE + sizeof(RID));
-                log_record.new_tuple_.DeserializeFrom(data + LogRecord::HEADER_SIZE + sizeof(RID) +
-                                                      log_record.old_tuple_.GetLength());
+                log_record.update_rid_ = *reinterpret_cast<const RID *>(data + header);
+                log_record.old_tuple_.DeserializeFrom(data + header + sizeof(RID));
+                log_record.new_tuple_.DeserializeFrom(data + header + sizeof(RID) +
+                                                      sizeof(int32_t) + log_record.old_tuple_.GetLength());
+                break;
+            }
+            case LogRecordType::UPDATEDELTA: {
+                log_record.update_rid_ = *reinterpret_cast<const RID *>(data + header);
+                const char *delta = data + header + sizeof(RID);
+                log_record.update_delta_.assign(delta, data + size_);
                 break;
             }
             case LogRecordType::NEWPAGE: {
                 log_record.prev_page_id_ = *reinterpret_cast<const page_id_t *>(
-                        data + LogRecord::HEADER_SIZE);
+                        data + header);
+                log_record.slot_locks_ =
+                        size_ > header + static_cast<int>(sizeof(page_id_t));
+                break;
+            }
+            case LogRecordType::CHECKPOINT: {
+                int pos = header;
+                log_record.redo_lsn_ = *reinterpret_cast<const lsn_t *>(data + pos);
+                pos += sizeof(lsn_t);
+                memcpy(&log_record.recovery_offset_, data + pos, sizeof(log_offset_t));
+                pos += sizeof(log_offset_t);
+                int32_t count = *reinterpret_cast<const int32_t *>(data + pos);
+                pos += sizeof(int32_t);
+                log_record.active_txn_table_.clear();
+                for (int i = 0; i < count; i++) {
+                    log_record.active_txn_table_.emplace_back(
+                            *reinterpret_cast<const txn_id_t *>(data + pos),
+                            *reinterpret_cast<const lsn_t *>(data + pos + sizeof(txn_id_t)));
+                    pos += sizeof(txn_id_t) + sizeof(lsn_t);
+                }
+                count = *reinterpret_cast<const int32_t *>(data + pos);
+                pos += sizeof(int32_t);
+                log_record.dirty_page_table_.clear();
+                for (int i = 0; i < count; i++) {
+                    log_record.dirty_page_table_.emplace_back(
+                            *reinterpret_cast<const page_id_t *>(data + pos),
+                            *reinterpret_cast<const lsn_t *>(data + pos + sizeof(page_id_t)));
+                    pos += sizeof(page_id_t) + sizeof(lsn_t);
+                }
+                log_record.stream_offsets_.clear();
+                if (pos < size_) {
+                    count = *reinterpret_cast<const int32_t *>(data + pos);
+                    pos += sizeof(int32_t);
+                    log_record.stream_offsets_.resize(count);
+                    memcpy(log_record.stream_offsets_.data(), data + pos,
+                           count * sizeof(log_offset_t));
+                }
+                break;
+            }
+            case LogRecordType::INDEXPAGE: {
+                int pos = header;
+                log_record.index_key_op_ = static_cast<IndexKeyOp>(
+                        *reinterpret_cast<const int32_t *>(data + pos));
+                pos += sizeof(int32_t);
+                log_record.index_name_.clear();
+                log_record.index_key_.clear();
+                log_record.index_key_columns_.clear();
+                if (log_record.index_key_op_ != IndexKeyOp::NONE) {
+                    int32_t length = *reinterpret_cast<const int32_t *>(data + pos);
+                    pos += sizeof(int32_t);
+                    log_record.index_name_.assign(data + pos, length);
+                    pos += length;
+                    log_record.index_rid_ = *reinterpret_cast<const RID *>(data + pos);
+                    pos += sizeof(RID);
+                    int32_t count = *reinterpret_cast<const int32_t *>(data + pos);
+                    pos += sizeof(int32_t);
+                    for (int i = 0; i < count; i++) {
+                        log_record.index_key_columns_.emplace_back(
+                                static_cast<TypeId>(*reinterpret_cast<const int32_t *>(data + pos)),
+                                *reinterpret_cast<const int32_t *>(data + pos + sizeof(int32_t)));
+                        pos += 2 * sizeof(int32_t);
+                    }
+                    length = *reinterpret_cast<const int32_t *>(data + pos);
+                    pos += sizeof(int32_t);
+                    log_record.index_key_.assign(data + pos, data + pos + length);
+                    pos += length;
+                }
+                int32_t count = *reinterpret_cast<const int32_t *>(data + pos);
+                pos += sizeof(int32_t);
+                log_record.index_pages_.clear();
+                for (int i = 0; i < count; i++) {
+                    LogRecord::IndexPageDelta page;
+                    page.page_id = *reinterpret_cast<const page_id_t *>(data + pos);
+                    pos += sizeof(page_id_t);
+                    page.new_page = *reinterpret_cast<const int32_t *>(data + pos) != 0;
+                    pos += sizeof(int32_t);
+                    int32_t length = *reinterpret_cast<const int32_t *>(data + pos);
+                    pos += sizeof(int32_t);
+                    page.delta.assign(data + pos, data + pos + length);
+                    pos += length;
+                    log_record.index_pages_.push_back(std::move(page));
+                }
                 break;
             }
             default:break;
@@ -63,201 +220,751 @@ namespace cmudb {
         return true;
     }
 
+    void LogRecovery::OpenLogStreams() {
+        int count = log_manager_ != nullptr ? log_manager_->GetStreamCount()
+                                            : LOG_STREAMS;
+        streams_.push_back(disk_manager_);
+        for (int i = 1; i < count; i++) {
+            if (log_manager_ != nullptr) {
+                streams_.push_back(log_manager_->GetDiskManager(i));
+            } else {
+                owned_streams_.push_back(disk_manager_->OpenLogStream(i));
+                streams_.push_back(owned_streams_.back());
+            }
+        }
+    }
+
+/*
+ * read the log file block at reader.offset into its buffer: LOG_BUFFER_SIZE
+ * bytes of plain log records (frame_size is 0), or the log records of the
+ * compressed frame found there, decompressed. A frame that does not decode
+ * was cut short by a crash, it is the end of the log.
+ */
+    bool LogRecovery::ReadLogBlock(LogReader &reader) {
+        char *buffer = reader.buffer.data();
+        reader.pos = 0;
+        if (!reader.disk_manager->ReadLog(buffer, LOG_BUFFER_SIZE, reader.offset)) {
+            return false;
+        }
+        reader.size = LOG_BUFFER_SIZE;
+        reader.frame_size = 0;
+        if (!LogCompression::IsFrame(buffer, LOG_BUFFER_SIZE)) {
+            return true;
+        }
+        // a frame is smaller than the log buffer it holds
+        reader.frame_size = LogCompression::GetFrameSize(buffer);
+        if (reader.frame_size > LOG_BUFFER_SIZE) {
+            LOG_DEBUG("corrupt log frame");
+            return false;
+        }
+        memcpy(reader.frame.data(), buffer, reader.frame_size);
+        if (!LogCompression::DecompressBlock(reader.frame.data(), buffer,
+                                            LOG_BUFFER_SIZE, reader.size)) {
+            LOG_DEBUG("corrupt log frame");
+            return false;
+        }
+        return true;
+    }
+
+/*
+ * log records may span two blocks, a record that does not fit in the rest
+ * of a block is read again at the start of the next one
+ */
+    bool LogRecovery::NextLogRecord(LogReader &reader, LogRecord &log,
+                                    log_offset_t &log_offset) {
+        while (true) {
+            if (reader.loaded &&
+                DeserializeLogRecord(reader.buffer.data() + reader.pos, log,
+                                     reader.size - reader.pos)) {
+                // lsn -> offset mapping in WAL log, records of a compressed
+                // block are found by reading the whole block
+                log_offset = reader.frame_size == 0 ? reader.offset + reader.pos
+                                                    : reader.offset;
+                reader.record_pos = reader.pos;
+                reader.pos += log.GetSize();
+                return true;
+            }
+            if (reader.loaded) {
+                if (reader.frame_size == 0 && reader.pos == 0) {
+                    // end of log
+                    return false;
+                }
+                reader.offset += reader.frame_size != 0 ? reader.frame_size
+                                                        : reader.pos;
+            }
+            reader.loaded = ReadLogBlock(reader);
+            if (!reader.loaded) {
+                return false;
+            }
+        }
+    }
+
+/*
+ * new log records of the stream are appended where its replay stopped. The
+ * records kept from a compressed block are written back uncompressed
+ */
+    void LogRecovery::CutLogStream(LogReader &reader, bool at_record) {
+        if (!at_record) {
+            reader.disk_manager->TruncateLogTail(reader.offset);
+        } else if (reader.frame_size == 0) {
+            reader.disk_manager->TruncateLogTail(reader.offset + reader.record_pos);
+        } else {
+            reader.disk_manager->TruncateLogTail(reader.offset);
+            if (!reader.disk_manager->WriteLog(reader.buffer.data(),
+                                               reader.record_pos)) {
+                throw Exception(EXCEPTION_TYPE_SERIALIZATION,
+                                "recovery: can't write back the log tail");
+            }
+        }
+    }
+
+/*
+ * page changed by a log record other than NEWPAGE
+ */
+    page_id_t LogRecovery::GetLogPageId(LogRecord &log) {
+        if (log.GetLogRecordType() == LogRecordType::INSERT) {
+            return log.GetInsertRID().GetPageId();
+        } else if (log.GetLogRecordType() == LogRecordType::UPDATE ||
+                   log.GetLogRecordType() == LogRecordType::UPDATEDELTA) {
+            return log.GetUpdateRID().GetPageId();
+        } else if (log.GetLogRecordType() == LogRecordType::INDEXPAGE) {
+            return log.GetIndexPageId();
+        }
+        return log.GetDeleteRID().GetPageId();
+    }
+
+/*
+ * apply one log record to its page, if the page does not have it yet
+ */
+    void LogRecovery::RedoLogRecord(LogRecord &log) {
+        if (log.GetLogRecordType() == LogRecordType::NEWPAGE) {
+            page_id_t pre_page_id = log.prev_page_id_;
+            TablePage *page;
+
+            // the first page
+            if (pre_page_id == INVALID_PAGE_ID) {
+                page = reinterpret_cast<TablePage *>(
+                        buffer_pool_manager_->NewPage(pre_page_id));
+                assert(page != nullptr);
+                page->WLatch();
+                page->Init(pre_page_id, PAGE_SIZE, INVALID_PAGE_ID, nullptr, nullptr,
+                           log.HasSlotLocks());
+                // replay the allocation again until the page is written back
+                page->SetRecLSN(log.GetLSN());
+                page->WUnlatch();
+            } else {
+                page = reinterpret_cast<TablePage *>(
+                        buffer_pool_manager_->FetchPage(pre_page_id));
+                assert(page != nullptr);
+
+                if (page->GetNextPageId() == INVALID_PAGE_ID) {
+                    // alloc a new page
+                    page_id_t new_page_id;
+                    auto *new_page = reinterpret_cast<TablePage *>(
+                            buffer_pool_manager_->NewPage(new_page_id));
+                    assert(new_page != nullptr);
+                    new_page->WLatch();
+                    new_page->Init(new_page_id, PAGE_SIZE, pre_page_id, nullptr, nullptr,
+                                   log.HasSlotLocks());
+                    new_page->SetRecLSN(log.GetLSN());
+                    new_page->WUnlatch();
+                    page->WLatch();
+                    page->SetNextPageId(new_page_id);
+                    page->SetRecLSN(log.GetLSN());
+                    page->WUnlatch();
+
+                    buffer_pool_manager_->UnpinPage(new_page_id, true);
+                }
+            }
+            buffer_pool_manager_->UnpinPage(pre_page_id, true);
+            return;
+        }
+
+        page_id_t page_id = GetLogPageId(log);
+        Page *page = buffer_pool_manager_->FetchPage(page_id);
+        assert(page != nullptr);
+        page->WLatch();
+        RedoPage(log, page);
+        page->WUnlatch();
+        buffer_pool_manager_->UnpinPage(page_id, true);
+    }
+
+/*
+ * should be called when holding the write latch of page, an update that can't
+ * be replayed throws rather than write a bad image
+ */
+    void LogRecovery::RedoPage(LogRecord &log, Page *page) {
+        if (log.GetLogRecordType() == LogRecordType::INDEXPAGE) {
+            // the header page has no lsn, its ranges are simply rewritten. A
+            // new page is rebuilt from zeros, whatever is on disk.
+            if (page->GetPageId() == HEADER_PAGE_ID || log.IsNewIndexPage() ||
+                log.GetLSN() > page->GetLSN()) {
+                log.ApplyPageDelta(page->GetData());
+                if (page->GetPageId() != HEADER_PAGE_ID) {
+                    page->SetLSN(log.GetLSN());
+                }
+            }
+            return;
+        }
+        // log is newer than disk page?
+        if (log.GetLSN() <= page->GetLSN()) {
+            return;
+        }
+        auto *table_page = reinterpret_cast<TablePage *>(page);
+        if (log.GetLogRecordType() == LogRecordType::INSERT) {
+            auto res = table_page->InsertTupleAt(log.GetInserteTuple(),
+                                                 log.GetInsertRID());
+            assert(res);
+        } else if (log.GetLogRecordType() == LogRecordType::MARKDELETE) {
+            auto res = table_page->MarkDelete(log.GetDeleteRID(), nullptr,
+                                              nullptr, nullptr);
+            assert(res);
+        } else if (log.GetLogRecordType() == LogRecordType::ROLLBACKDELETE) {
+            table_page->RollbackDelete(log.GetDeleteRID(), nullptr, nullptr);
+        } else if (log.GetLogRecordType() == LogRecordType::APPLYDELETE) {
+            table_page->ApplyDelete(log.GetDeleteRID(), nullptr, nullptr);
+        } else if (log.GetLogRecordType() == LogRecordType::UPDATE ||
+                   log.GetLogRecordType() == LogRecordType::UPDATEDELTA) {
+            RID rid = log.GetUpdateRID();
+            if (log.GetLogRecordType() == LogRecordType::UPDATEDELTA) {
+                // the page still holds the old image
+                Tuple old_tuple;
+                if (!table_page->GetTuple(rid, old_tuple, nullptr, nullptr) ||
+                    !log.ApplyUpdateDelta(old_tuple, log.new_tuple_, false)) {
+                    throw Exception(EXCEPTION_TYPE_SERIALIZATION,
+                                    "redo: update delta does not apply to " +
+                                    rid.ToString());
+                }
+            }
+            if (!table_page->UpdateTuple(log.GetUpdateNewTuple(),
+                                         log.GetUpdateOldTuple(), rid, nullptr,
+                                         nullptr, nullptr)) {
+                throw Exception(EXCEPTION_TYPE_SERIALIZATION,
+                                "redo: can't update " + rid.ToString());
+            }
+        }
+        page->SetLSN(log.GetLSN());
+    }
+
+/*
+ * revert one change of a loser, should be called when holding the write
+ * latch of page. An update that can't be reverted throws rather than write
+ * a bad image
+ */
+    void LogRecovery::UndoPage(LogRecord &log, TablePage *page) {
+        if (log.log_record_type_ == LogRecordType::INSERT) {
+            page->ApplyDelete(log.GetInsertRID(), nullptr, nullptr);
+
+        } else if (log.log_record_type_ == LogRecordType::MARKDELETE) {
+            page->RollbackDelete(log.GetDeleteRID(), nullptr, nullptr);
+        } else if (log.log_record_type_ == LogRecordType::ROLLBACKDELETE) {
+            page->MarkDelete(log.GetDeleteRID(), nullptr, nullptr, nullptr);
+        } else if (log.log_record_type_ == LogRecordType::APPLYDELETE) {
+            page->InsertTupleAt(log.delete_tuple_, log.GetDeleteRID());
+
+        } else {
+            RID rid = log.GetUpdateRID();
+            if (log.log_record_type_ == LogRecordType::UPDATEDELTA) {
+                // rebuild the old image from the current one
+                Tuple new_tuple;
+                if (!page->GetTuple(rid, new_tuple, nullptr, nullptr) ||
+                    !log.ApplyUpdateDelta(new_tuple, log.old_tuple_, true)) {
+                    throw Exception(EXCEPTION_TYPE_SERIALIZATION,
+                                    "undo: update delta does not apply to " +
+                                    rid.ToString());
+                }
+            }
+            if (!page->UpdateTuple(log.old_tuple_, log.new_tuple_, rid,
+                                   nullptr, nullptr, nullptr)) {
+                throw Exception(EXCEPTION_TYPE_SERIALIZATION,
+                                "undo: can't update " + rid.ToString());
+            }
+        }
+    }
+
+/*
+ * queue a page change for the worker owning its page, in batches to keep
+ * the workers' latches cold (or for the page itself, in lazy recovery). An
+ * INDEXPAGE record is queued once per page it changed
+ */
+    void LogRecovery::DispatchRedo(LogRecord &log) {
+        if (log.GetLogRecordType() == LogRecordType::INDEXPAGE &&
+            log.GetIndexPageCount() != 1) {
+            // page by page, each part goes where its page goes
+            for (int i = 0; i < log.GetIndexPageCount(); i++) {
+                LogRecord part = log.GetIndexPagePart(i);
+                DispatchRedo(part);
+            }
+            return;
+        }
+        page_id_t page_id = GetLogPageId(log);
+        if (lazy_) {
+            // applied when the page is first fetched
+            lazy_pages_[page_id].redo.push_back(log);
+            return;
+        }
+        int worker = page_id % REDO_WORKERS;
+        redo_batches_[worker].push_back(log);
+        if (redo_batches_[worker].size() >= REDO_BATCH_SIZE) {
+            SubmitRedo(worker);
+        }
+    }
+
+    void LogRecovery::SubmitRedo(int worker) {
+        auto &batch = redo_batches_[worker];
+        if (batch.empty()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(redo_latch_);
+            redo_pending_ += batch.size();
+        }
+        RedoQueue &queue = redo_queues_[worker];
+        {
+            std::lock_guard<std::mutex> lock(queue.latch);
+            queue.records.insert(queue.records.end(), batch.begin(), batch.end());
+        }
+        queue.cv.notify_one();
+        batch.clear();
+    }
+
+/*
+ * submit every batch and block until the workers applied all of them
+ */
+    void LogRecovery::WaitRedoWorkers() {
+        for (int i = 0; i < REDO_WORKERS; i++) {
+            SubmitRedo(i);
+        }
+        std::unique_lock<std::mutex> lock(redo_latch_);
+        redo_idle_cv_.wait(lock, [&] { return redo_pending_ == 0; });
+    }
+
+/*
+ * body of a redo worker, records of a page always land in the same queue so
+ * they are applied in lsn order
+ */
+    void LogRecovery::RedoWorker(RedoQueue *queue) {
+        std::vector<LogRecord> records;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(queue->latch);
+                queue->cv.wait(lock, [&] { return !queue->records.empty() || queue->closed; });
+                if (queue->records.empty()) {
+                    return;
+                }
+                records.swap(queue->records);
+            }
+            for (auto &log : records) {
+                RedoLogRecord(log);
+            }
+            {
+                std::lock_guard<std::mutex> lock(redo_latch_);
+                redo_pending_ -= records.size();
+                if (redo_pending_ == 0) {
+                    redo_idle_cv_.notify_all();
+                }
+            }
+            records.clear();
+        }
+    }
+
 /*
  *redo phase on TABLE PAGE level(table/table_page.h)
  *read log file from the beginning to end (you must prefetch log records into
  *log buffer to reduce unnecessary I/O operations), remember to compare page's
  *LSN with log_record's sequence number, and also build active_txn_ table &
  *lsn_mapping_ table
+ *If the master record points at a checkpoint, the log is read from the
+ *checkpoint's recovery offset and changes older than its redo lsn are skipped
+ *This thread only decodes the log (merging the log streams by lsn), page
+ *changes are applied by REDO_WORKERS worker threads, partitioned by page id
  */
     void LogRecovery::Redo() {
-        // no checkpoint support, always replay history from start
-        offset_ = 0;
+        std::vector<std::thread> workers;
+        for (int i = 0; i < REDO_WORKERS; i++) {
+            redo_queues_[i].closed = false;
+            workers.emplace_back(&LogRecovery::RedoWorker, this, &redo_queues_[i]);
+        }
+        lsn_t redo_lsn = INVALID_LSN;
 
         // ENABLE_LOGGING must be false when recovery
         assert(ENABLE_LOGGING == false);
 
-        // have more log?
-        while (disk_manager_->ReadLog(log_buffer_, LOG_BUFFER_SIZE, offset_)) {
+        int stream_count = streams_.size();
+        std::vector<LogReader> readers(stream_count);
+        for (int i = 0; i < stream_count; i++) {
+            readers[i].disk_manager = streams_[i];
+        }
+        LogReader checkpoint_block;
+        checkpoint_block.disk_manager = disk_manager_;
+        if (disk_manager_->ReadMasterRecord(checkpoint_block.offset) &&
+            ReadLogBlock(checkpoint_block)) {
+            // the last checkpoint of the block, any later one is durable too
+            LogRecord checkpoint;
             LogRecord log;
-            int buffer_offset_ = 0;
-            while (DeserializeLogRecord(log_buffer_ + buffer_offset_, log)) {
-                // lsn -> offset mapping in WAL log
-                lsn_mapping_[log.GetLSN()] = offset_ + buffer_offset_;
+            while (DeserializeLogRecord(
+                    checkpoint_block.buffer.data() + checkpoint_block.pos, log,
+                    checkpoint_block.size - checkpoint_block.pos)) {
+                if (log.GetLogRecordType() == LogRecordType::CHECKPOINT) {
+                    checkpoint = log;
+                }
+                checkpoint_block.pos += log.GetSize();
+            }
+            if (checkpoint.GetLogRecordType() == LogRecordType::CHECKPOINT) {
+                redo_lsn = checkpoint.GetRedoLSN();
+                readers[0].offset = checkpoint.GetRecoveryOffset();
+                auto &stream_offsets = checkpoint.GetStreamOffsets();
+                for (int i = 1; i < stream_count &&
+                                static_cast<size_t>(i) <= stream_offsets.size();
+                     i++) {
+                    readers[i].offset = stream_offsets[i - 1];
+                }
+                for (auto &entry : checkpoint.GetActiveTxnTable()) {
+                    active_txn_[entry.first] = entry.second;
+                    // their BEGIN is read again further on
+                    int stream = LogManager::GetStreamOf(entry.first, stream_count);
+                    begin_offset_[entry.first] = readers[stream].offset;
+                }
+            }
+        }
 
-                if (log.GetLogRecordType() == LogRecordType::COMMIT ||
-                    log.GetLogRecordType() == LogRecordType::ABORT) {
-                    active_txn_.erase(log.GetTxnId());
+        // the next log record of each stream
+        std::vector<LogRecord> heads(stream_count);
+        std::vector<log_offset_t> head_offsets(stream_count);
+        std::vector<bool> has_head(stream_count);
+        std::vector<lsn_t> first_lsns(stream_count, INVALID_LSN);
+        std::vector<log_offset_t> first_offsets(stream_count);
+        for (int i = 0; i < stream_count; i++) {
+            first_offsets[i] = readers[i].offset;
+            has_head[i] = NextLogRecord(readers[i], heads[i], head_offsets[i]);
+        }
+        lsn_t max_lsn = INVALID_LSN;
+        page_id_t max_page_id = INVALID_PAGE_ID;
+        // with several streams, every lsn from redo_lsn on must be found
+        lsn_t next_lsn = redo_lsn == INVALID_LSN ? 0 : redo_lsn;
+
+        // have more log?
+        while (true) {
+            // streams are merged by lsn
+            int stream = -1;
+            for (int i = 0; i < stream_count; i++) {
+                if (has_head[i] &&
+                    (stream == -1 || heads[i].GetLSN() < heads[stream].GetLSN())) {
+                    stream = i;
+                }
+            }
+            if (stream == -1) {
+                break;
+            }
+            LogRecord &log = heads[stream];
+            log_offset_t log_offset = head_offsets[stream];
+            if (stream_count > 1 && log.GetLSN() >= next_lsn) {
+                if (log.GetLSN() != next_lsn) {
+                    // the stream holding next_lsn did not flush it
+                    break;
+                }
+                next_lsn++;
+            }
 
-                } else {
+            lsn_mapping_[log.GetLSN()] = log_offset;
+            if (first_lsns[stream] == INVALID_LSN) {
+                first_lsns[stream] = log.GetLSN();
+            }
+            max_lsn = std::max(max_lsn, log.GetLSN());
+            if (log.GetLogRecordType() == LogRecordType::INDEXPAGE) {
+                for (int i = 0; i < log.GetIndexPageCount(); i++) {
+                    max_page_id = std::max(max_page_id, log.GetIndexPageId(i));
+                }
+            } else if (log.GetLogRecordType() == LogRecordType::NEWPAGE) {
+                max_page_id = std::max(max_page_id, log.GetNewPageRecord());
+            } else if (log.GetLogRecordType() != LogRecordType::BEGIN &&
+                       log.GetLogRecordType() != LogRecordType::COMMIT &&
+                       log.GetLogRecordType() != LogRecordType::ABORT &&
+                       log.GetLogRecordType() != LogRecordType::CHECKPOINT) {
+                max_page_id = std::max(max_page_id, GetLogPageId(log));
+            }
+
+            if (log.GetLogRecordType() == LogRecordType::COMMIT ||
+                log.GetLogRecordType() == LogRecordType::ABORT) {
+                active_txn_.erase(log.GetTxnId());
+                begin_offset_.erase(log.GetTxnId());
+
+            } else if (log.GetLogRecordType() != LogRecordType::CHECKPOINT) {
+                // index page changes belong to no transaction
+                if (log.GetTxnId() != INVALID_TXN_ID) {
                     active_txn_[log.GetTxnId()] = log.GetLSN();
+                }
+                // a loser of an earlier crash has no BEGIN left in the log
+                if (log.GetLogRecordType() == LogRecordType::BEGIN ||
+                    (log.GetTxnId() != INVALID_TXN_ID &&
+                     begin_offset_.count(log.GetTxnId()) == 0)) {
+                    begin_offset_[log.GetTxnId()] = log_offset;
+                }
 
-                    // Begin and NewPage logs can be ignored
-                    if (log.GetLogRecordType() == LogRecordType::INSERT) {
-                        RID rid = log.GetInsertRID();
-                        auto *page = reinterpret_cast<TablePage *>(
-                                buffer_pool_manager_->FetchPage(rid.GetPageId()));
-                        assert(page != nullptr);
-
-                        // log is newer than disk page?
-                        if (log.GetLSN() > page->GetLSN()) {
-                            page->WLatch();
-                            auto res = page->InsertTuple(log.GetInserteTuple(), rid, nullptr, nullptr, nullptr);
-                            assert(res);
-                            page->WUnlatch();
-                        }
-                        buffer_pool_manager_->UnpinPage(rid.GetPageId(), true);
-
-                    } else if (log.GetLogRecordType() == LogRecordType::MARKDELETE ||
-                               log.GetLogRecordType() == LogRecordType::ROLLBACKDELETE ||
-                               log.GetLogRecordType() == LogRecordType::APPLYDELETE) {
-                        RID rid = log.GetDeleteRID();
-
-                        auto *page = reinterpret_cast<TablePage *>(
-                                buffer_pool_manager_->FetchPage(rid.GetPageId()));
-                        assert(page != nullptr);
-
-                        // log is newer than disk page?
-                        if (log.GetLSN() > page->GetLSN()) {
-                            page->WLatch();
-                            if (log.GetLogRecordType() == LogRecordType::MARKDELETE) {
-                                auto res = page->MarkDelete(rid, nullptr, nullptr, nullptr);
-                                assert(res);
-                            } else if (log.GetLogRecordType() == LogRecordType::ROLLBACKDELETE) {
-                                page->RollbackDelete(rid, nullptr, nullptr);
-                            } else {
-                                page->ApplyDelete(rid, nullptr, nullptr);
-                            }
-                            page->WUnlatch();
-                        }
-                        buffer_pool_manager_->UnpinPage(rid.GetPageId(), true);
-
-                    } else if (log.GetLogRecordType() == LogRecordType::UPDATE) {
-                        RID rid = log.GetUpdateRID();
-                        auto *page = reinterpret_cast<TablePage *>(
-                                buffer_pool_manager_->FetchPage(rid.GetPageId()));
-                        assert(page != nullptr);
-
-                        // log is newer than disk page?
-                        if (log.GetLSN() > page->GetLSN()) {
-                            page->WLatch();
-                            auto res = page->UpdateTuple(log.GetUpdateNewTuple(), log.GetUpdateOldTuple(),
-                                                         rid, nullptr, nullptr, nullptr);
-                            assert(res);
-                            page->WUnlatch();
-                        }
-                        buffer_pool_manager_->UnpinPage(rid.GetPageId(), true);
-
-                    } else if (log.GetLogRecordType() == LogRecordType::NEWPAGE) {
-                        page_id_t pre_page_id = log.prev_page_id_;
-                        TablePage *page;
-
-                        // the first page
-                        if (pre_page_id == INVALID_PAGE_ID) {
-                            page = reinterpret_cast<TablePage *>(
-                                    buffer_pool_manager_->NewPage(pre_page_id));
-                            assert(page != nullptr);
-                            page->WLatch();
-                            page->Init(pre_page_id, PAGE_SIZE, INVALID_PAGE_ID, nullptr, nullptr);
-                            page->WUnlatch();
-                        } else {
-                            page = reinterpret_cast<TablePage *>(
-                                    buffer_pool_manager_->FetchPage(pre_page_id));
-                            assert(page != nullptr);
-
-                            if (page->GetNextPageId() == INVALID_PAGE_ID) {
-                                // alloc a new page
-                                page_id_t new_page_id;
-                                auto *new_page = reinterpret_cast<TablePage *>(
-                                        buffer_pool_manager_->NewPage(new_page_id));
-                                assert(new_page != nullptr);
-                                page->WLatch();
-                                page->SetNextPageId(new_page_id);
-                                page->WUnlatch();
-
-                                buffer_pool_manager_->UnpinPage(new_page_id, false);
-                            }
-                        }
-                        buffer_pool_manager_->UnpinPage(pre_page_id, true);
-                    }
+                // Begin logs can be ignored
+                if (log.GetLSN() < redo_lsn) {
+                    // older than the checkpoint, already on disk
+                } else if (log.GetLogRecordType() == LogRecordType::NEWPAGE) {
+                    // links table pages, the pages it touches must be
+                    // up to date first
+                    WaitRedoWorkers();
+                    RedoLogRecord(log);
+                } else if (log.GetLogRecordType() != LogRecordType::BEGIN) {
+                    DispatchRedo(log);
                 }
-                buffer_offset_ += log.GetSize();
             }
-            offset_ += LOG_BUFFER_SIZE;
+            has_head[stream] =
+                    NextLogRecord(readers[stream], heads[stream], head_offsets[stream]);
+        }
+
+        WaitRedoWorkers();
+        for (int i = 0; i < REDO_WORKERS; i++) {
+            {
+                std::lock_guard<std::mutex> lock(redo_queues_[i].latch);
+                redo_queues_[i].closed = true;
+            }
+            redo_queues_[i].cv.notify_one();
+            workers[i].join();
+        }
+
+        // undo may split index pages, new pages must not take logged ones
+        disk_manager_->ReservePages(max_page_id);
+
+        // log records after a missing lsn were never durable as a whole
+        if (stream_count > 1) {
+            for (int i = 0; i < stream_count; i++) {
+                CutLogStream(readers[i], has_head[i]);
+            }
+        }
+        // new log records continue the lsn sequence
+        if (log_manager_ != nullptr) {
+            for (int i = 0; i < stream_count; i++) {
+                log_manager_->Resume(max_lsn + 1, first_lsns[i], first_offsets[i], i);
+            }
         }
     }
 
 /*
  *undo phase on TABLE PAGE level(table/table_page.h)
- *iterate through active txn map and undo each operation
+ *the log is read once more, sequentially and in LOG_BUFFER_SIZE chunks, from
+ *the BEGIN of the oldest active txn up to the last record of any of them (in
+ *each log stream).
+ *Their records are collected, split by page and undone newest first, so each
+ *page is fetched once however many records touch it. The index keys they
+ *inserted or removed are undone after, through their trees
  */
     void LogRecovery::Undo() {
         // ENABLE_LOGGING must be false when recovery
         assert(ENABLE_LOGGING == false);
 
-        char buffer[PAGE_SIZE];
+        // records of active txns in lsn order
+        std::vector<LogRecord> records;
+        CollectUndo(records);
+
+        // newest first within each page, index keys newest first overall
+        std::unordered_map<page_id_t, std::vector<LogRecord *>> pages;
+        std::vector<LogRecord *> index_keys;
+        for (auto it = records.rbegin(); it != records.rend(); ++it) {
+            if (it->GetLogRecordType() == LogRecordType::INDEXPAGE) {
+                index_keys.push_back(&*it);
+            } else {
+                pages[GetLogPageId(*it)].push_back(&*it);
+            }
+        }
 
-        for (auto it = active_txn_.begin(); it != active_txn_.end(); ++it) {
-            offset_ = lsn_mapping_[it->second];
-            LogRecord log;
+        for (auto &entry : pages) {
+            auto *page = reinterpret_cast<TablePage *>(
+                    buffer_pool_manager_->FetchPage(entry.first));
+            assert(page != nullptr);
+            page->WLatch();
+            for (LogRecord *log : entry.second) {
+                UndoPage(*log, page);
+            }
+            page->WUnlatch();
+            buffer_pool_manager_->UnpinPage(entry.first, true);
+        }
+        // through the trees, the pages holding a key have changed since
+        for (LogRecord *log : index_keys) {
+            UndoIndexKey(*log, buffer_pool_manager_);
+        }
 
-            // read log record, undo it, then get the pre_lsn
-            disk_manager_->ReadLog(buffer, offset_, PAGE_SIZE);
-            while (DeserializeLogRecord(buffer, log)) {
-                if (log.log_record_type_ == LogRecordType::BEGIN) {
-                    // current txn is done
-                    break;
-                }
+        active_txn_.clear();
+        lsn_mapping_.clear();
+        begin_offset_.clear();
+    }
 
-                // undo
-                if (log.log_record_type_ == LogRecordType::INSERT) {
-                    RID rid = log.GetInsertRID();
-                    auto *page = reinterpret_cast<TablePage *>(
-                            buffer_pool_manager_->FetchPage(rid.GetPageId()));
-                    page->WLatch();
-                    page->ApplyDelete(rid, nullptr, nullptr);
-                    page->WUnlatch();
-                    buffer_pool_manager_->UnpinPage(rid.GetPageId(), false);
+/*
+ * the changes of the active txns, in lsn order
+ */
+    void LogRecovery::CollectUndo(std::vector<LogRecord> &records) {
+        if (active_txn_.empty()) {
+            return;
+        }
+        // per log stream, a transaction logs to one stream only
+        int stream_count = streams_.size();
+        std::vector<log_offset_t> start_offsets(stream_count, -1);
+        std::vector<log_offset_t> end_offsets(stream_count, 0);
+        for (auto &entry : active_txn_) {
+            int stream = LogManager::GetStreamOf(entry.first, stream_count);
+            auto begin = begin_offset_.find(entry.first);
+            log_offset_t offset =
+                    begin == begin_offset_.end() ? 0 : begin->second;
+            if (start_offsets[stream] == -1 || offset < start_offsets[stream]) {
+                start_offsets[stream] = offset;
+            }
+            end_offsets[stream] =
+                    std::max(end_offsets[stream], lsn_mapping_[entry.second]);
+        }
 
-                } else if (log.log_record_type_ == LogRecordType::MARKDELETE ||
-                           log.log_record_type_ == LogRecordType::ROLLBACKDELETE ||
-                           log.log_record_type_ == LogRecordType::APPLYDELETE) {
+        for (int i = 0; i < stream_count; i++) {
+            if (start_offsets[i] == -1) {
+                continue;
+            }
+            LogReader reader;
+            reader.disk_manager = streams_[i];
+            reader.offset = start_offsets[i];
+            LogRecord log;
+            log_offset_t log_offset;
+            while (NextLogRecord(reader, log, log_offset) &&
+                   log_offset <= end_offsets[i]) {
+                if (active_txn_.count(log.GetTxnId()) != 0 &&
+                    (log.GetLogRecordType() == LogRecordType::INSERT ||
+                     log.GetLogRecordType() == LogRecordType::MARKDELETE ||
+                     log.GetLogRecordType() == LogRecordType::ROLLBACKDELETE ||
+                     log.GetLogRecordType() == LogRecordType::APPLYDELETE ||
+                     log.GetLogRecordType() == LogRecordType::UPDATE ||
+                     log.GetLogRecordType() == LogRecordType::UPDATEDELTA ||
+                     (log.GetLogRecordType() == LogRecordType::INDEXPAGE &&
+                      log.GetIndexKeyOp() != IndexKeyOp::NONE))) {
+                    records.push_back(log);
+                }
+            }
+        }
+        if (stream_count > 1) {
+            std::sort(records.begin(), records.end(),
+                      [](LogRecord &a, LogRecord &b) { return a.GetLSN() < b.GetLSN(); });
+        }
+    }
 
-                    RID rid = log.GetDeleteRID();
-                    auto *page = reinterpret_cast<TablePage *>(
-                            buffer_pool_manager_->FetchPage(rid.GetPageId()));
+/*
+ * instant restart: the log is analyzed as by Redo and Undo, but the page
+ * changes are only queued per page. The buffer pool applies them the first
+ * time a page is fetched, a background thread fetches the pages nobody asked
+ * for. Checkpoints wait until every page is recovered
+ */
+    void LogRecovery::StartLazyRecovery() {
+        lazy_ = true;
+        Redo();
+        std::vector<LogRecord> records;
+        CollectUndo(records);
+        std::vector<LogRecord *> index_keys;
+        for (auto it = records.rbegin(); it != records.rend(); ++it) {
+            if (it->GetLogRecordType() == LogRecordType::INDEXPAGE) {
+                index_keys.push_back(&*it);
+            } else {
+                lazy_pages_[GetLogPageId(*it)].undo.push_back(*it);
+            }
+        }
+        active_txn_.clear();
+        lsn_mapping_.clear();
+        begin_offset_.clear();
+        bool pending = !lazy_pages_.empty();
+        if (pending) {
+            lazy_pending_ = true;
+            buffer_pool_manager_->SetLazyRecovery(this);
+        }
+        // right away, the tree pages are recovered as they are fetched
+        for (LogRecord *log : index_keys) {
+            UndoIndexKey(*log, buffer_pool_manager_);
+        }
+        if (pending) {
+            lazy_thread_ = new std::thread(&LogRecovery::LazyRecoveryLoop, this);
+        }
+    }
 
-                    page->WLatch();
-                    if (log.log_record_type_ == LogRecordType::MARKDELETE) {
-                        page->RollbackDelete(rid, nullptr, nullptr);
-                    } else if (log.log_record_type_ == LogRecordType::ROLLBACKDELETE) {
-                        page->MarkDelete(rid, nullptr, nullptr, nullptr);
-                    } else {
-                        page->InsertTuple(log.delete_tuple_, rid, nullptr, nullptr, nullptr);
-                    }
-                    page->WUnlatch();
-                    buffer_pool_manager_->UnpinPage(rid.GetPageId(), false);
+    void LogRecovery::WaitLazyRecovery() {
+        if (lazy_thread_ == nullptr) {
+            return;
+        }
+        lazy_thread_->join();
+        delete lazy_thread_;
+        lazy_thread_ = nullptr;
+        buffer_pool_manager_->SetLazyRecovery(nullptr);
+    }
 
-                } else if (log.log_record_type_ == LogRecordType::UPDATE) {
-                    RID rid = log.GetUpdateRID();
-                    auto *page = reinterpret_cast<TablePage *>(
-                            buffer_pool_manager_->FetchPage(rid.GetPageId()));
-                    buffer_pool_manager_->UnpinPage(rid.GetPageId(), false);
+/*
+ * called by the buffer pool with page pinned, before anyone else sees it.
+ * Redo, then undo, the changes the page misses. A page another thread is
+ * recovering is waited for
+ */
+    bool LogRecovery::RecoverPage(Page *page) {
+        if (!lazy_pending_) {
+            return false;
+        }
+        page_id_t page_id = page->GetPageId();
+        std::unique_lock<std::mutex> lock(lazy_latch_);
+        auto it = lazy_pages_.find(page_id);
+        if (it == lazy_pages_.end()) {
+            return false;
+        }
+        if (it->second.recovering) {
+            lazy_cv_.wait(lock, [&] { return lazy_pages_.count(page_id) == 0; });
+            return false;
+        }
+        it->second.recovering = true;
+        LazyPage &pending = it->second;
+        lock.unlock();
+
+        page->WLatch();
+        // the undone changes may be on disk, replay them after another crash
+        if (!pending.undo.empty()) {
+            page->SetRecLSN(pending.redo.empty()
+                                ? pending.undo.back().GetLSN()
+                                : std::min(pending.redo.front().GetLSN(),
+                                           pending.undo.back().GetLSN()));
+        }
+        for (auto &log : pending.redo) {
+            RedoPage(log, page);
+        }
+        for (auto &log : pending.undo) {
+            UndoPage(log, reinterpret_cast<TablePage *>(page));
+        }
+        page->WUnlatch();
 
-                    page->WLatch();
-                    page->UpdateTuple(log.old_tuple_, log.new_tuple_, rid,
-                                      nullptr, nullptr, nullptr);
-                    page->WUnlatch();
-                    buffer_pool_manager_->UnpinPage(rid.GetPageId(), false);
-                }
+        lock.lock();
+        lazy_pages_.erase(page_id);
+        lazy_cv_.notify_all();
+        return true;
+    }
 
-                offset_ = lsn_mapping_[log.prev_lsn_];
-                disk_manager_->ReadLog(buffer, offset_, PAGE_SIZE);
+/*
+ * body of the lazy recovery thread, fetching a page recovers it
+ */
+    void LogRecovery::LazyRecoveryLoop() {
+        std::vector<page_id_t> page_ids;
+        {
+            std::lock_guard<std::mutex> lock(lazy_latch_);
+            for (auto &entry : lazy_pages_) {
+                page_ids.push_back(entry.first);
             }
         }
-
-        active_txn_.clear();
-        lsn_mapping_.clear();
+        for (page_id_t page_id : page_ids) {
+            while (!lazy_stop_) {
+                if (buffer_pool_manager_->FetchPage(page_id) != nullptr) {
+                    buffer_pool_manager_->UnpinPage(page_id, false);
+                    break;
+                }
+                // every frame is pinned, try again later
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            if (lazy_stop_) {
+                return;
+            }
+        }
+        // a page may still be recovered by the thread that fetched it
+        std::unique_lock<std::mutex> lock(lazy_latch_);
+        lazy_cv_.wait(lock, [&] { return lazy_pages_.empty(); });
+        lazy_pending_ = false;
     }
 
 } // namespace cmudb
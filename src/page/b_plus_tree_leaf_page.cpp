@@ -262,7 +262,7 @@ void B_PLUS_TREE_LEAF_PAGE_TYPE::MoveFirstToEndOf(
                                              KeyComparator> *>(page->GetData());
 
   //本节点在父节点中的key稍微调整
-  parent->SetKeyAt(parent->ValueIndex(GetPageId()), pair.first);
+  parent->SetKeyAt(parent->ValueIndex(GetPageId()), array[0].first);
 
   buffer_pool_manager->UnpinPage(GetParentPageId(), true);
 }
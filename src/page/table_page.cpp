@@ -7,16 +7,21 @@
 #include "page/table_page.h"
 
 namespace cmudb {
+// recovery replays changes without a transaction, they are not logged again
+    static inline bool IsLogged(Transaction *txn) {
+        return ENABLE_LOGGING && txn != nullptr;
+    }
+
 /**
  * Header related
  */
     void TablePage::Init(page_id_t page_id, size_t page_size,
                          page_id_t prev_page_id, LogManager *log_manager,
-                         Transaction *txn) {
+                         Transaction *txn, bool slot_locks) {
         memcpy(GetData(), &page_id, 4); // set page_id
-        if (ENABLE_LOGGING) {
+        if (IsLogged(txn)) {
             LogRecord log(txn->GetTransactionId(), txn->GetPrevLSN(),
-                          LogRecordType::NEWPAGE, prev_page_id);
+                          LogRecordType::NEWPAGE, prev_page_id, slot_locks);
             lsn_t lsn = log_manager->AppendLogRecord(log);
             txn->SetPrevLSN(lsn);
             SetLSN(lsn);
@@ -24,7 +29,8 @@ namespace cmudb {
         SetPrevPageId(prev_page_id);
         SetNextPageId(INVALID_PAGE_ID);
         SetFreeSpacePointer(page_size);
-        SetTupleCount(0);
+        int32_t tuple_count = slot_locks ? SLOT_LOCK_FLAG : 0;
+        memcpy(GetData() + 20, &tuple_count, 4);
     }
 
     page_id_t TablePage::GetPageId() {
@@ -63,7 +69,7 @@ namespace cmudb {
         for (i = 0; i < GetTupleCount(); ++i) {
             rid.Set(GetPageId(), i);
             if (GetTupleSize(i) == 0) { // empty slot
-                if (ENABLE_LOGGING) {
+                if (IsLogged(txn)) {
                     assert(txn->GetSharedLockSet()->find(rid) ==
                            txn->GetSharedLockSet()->end() &&
                            txn->GetExclusiveLockSet()->find(rid) ==
@@ -74,7 +80,8 @@ namespace cmudb {
         }
 
         // no free slot left
-        if (i == GetTupleCount() && GetFreeSpaceSize() < tuple.size_ + 8) {
+        if (i == GetTupleCount() &&
+            GetFreeSpaceSize() < tuple.size_ + GetSlotSize()) {
             return false; // not enough space
         }
 
@@ -85,22 +92,64 @@ namespace cmudb {
         SetTupleSize(i, tuple.size_);
         if (i == GetTupleCount()) {
             rid.Set(GetPageId(), i);
+            if (HasSlotLocks()) {
+                GetSlotLock(i)->store(INVALID_TXN_ID);
+            }
             SetTupleCount(GetTupleCount() + 1);
         }
         // write the log after set rid
-        if (ENABLE_LOGGING) {
+        if (IsLogged(txn)) {
             // acquire the exclusive lock
-            assert(lock_manager->LockExclusive(txn, rid.Get()));
+            assert(lock_manager->LockExclusive(txn, rid.Get(),
+                                               GetSlotLock(i)));
             LogRecord log(txn->GetTransactionId(), txn->GetPrevLSN(),
                           LogRecordType::INSERT, rid, tuple);
-            lsn_t lsn = log_manager->AppendLogRecord(log);
-            txn->SetPrevLSN(lsn);
-            SetLSN(lsn);
+            // may stay in the private log of txn, which sets the lsn later
+            lsn_t lsn = log_manager->AppendTxnLogRecord(log, txn, this);
+            if (lsn != INVALID_LSN) {
+                txn->SetPrevLSN(lsn);
+                SetLSN(lsn);
+            }
         }
         //LOG_DEBUG("Tuple inserted");
         return true;
     }
 
+/*
+ * InsertTupleAt puts a tuple at the slot of rid, which must be empty. Used by
+ * recovery: inserts kept in private transaction logs reach the log in commit
+ * order, so the logged slot is not always the first free one. Missing slots
+ * before it are added empty. No logging, no locking.
+ */
+    bool TablePage::InsertTupleAt(const Tuple &tuple, const RID &rid) {
+        assert(tuple.size_ > 0);
+        int slot_num = rid.GetSlotNum();
+        int tuple_count = GetTupleCount();
+        if (slot_num < tuple_count && GetTupleSize(slot_num) != 0) {
+            return false; // slot in use
+        }
+        int new_slots = slot_num < tuple_count ? 0 : slot_num + 1 - tuple_count;
+        if (GetFreeSpaceSize() < tuple.size_ + new_slots * GetSlotSize()) {
+            return false; // not enough space
+        }
+
+        for (int i = tuple_count; i <= slot_num; ++i) {
+            SetTupleOffset(i, 0);
+            SetTupleSize(i, 0);
+            if (HasSlotLocks()) {
+                GetSlotLock(i)->store(INVALID_TXN_ID);
+            }
+        }
+        if (new_slots > 0) {
+            SetTupleCount(slot_num + 1);
+        }
+        SetFreeSpacePointer(GetFreeSpacePointer() - tuple.size_);
+        memcpy(GetData() + GetFreeSpacePointer(), tuple.data_, tuple.size_);
+        SetTupleOffset(slot_num, GetFreeSpacePointer());
+        SetTupleSize(slot_num, tuple.size_);
+        return true;
+    }
+
 /*
  * MarkDelete method does not truly delete a tuple from table page
  * Instead it set the tuple as 'deleted' by changing the tuple size metadata to
@@ -111,7 +160,7 @@ namespace cmudb {
                                LockManager *lock_manager, LogManager *log_manager) {
         int slot_num = rid.GetSlotNum();
         if (slot_num >= GetTupleCount()) {
-            if (ENABLE_LOGGING) {
+            if (IsLogged(txn)) {
                 txn->SetState(TransactionState::ABORTED);
             }
             return false;
@@ -119,21 +168,23 @@ namespace cmudb {
 
         int32_t tuple_size = GetTupleSize(slot_num);
         if (tuple_size < 0) {
-            if (ENABLE_LOGGING) {
+            if (IsLogged(txn)) {
                 txn->SetState(TransactionState::ABORTED);
             }
             return false;
         }
 
-        if (ENABLE_LOGGING) {
+        if (IsLogged(txn)) {
             // acquire exclusive lock
             // if has shared lock
             if (txn->GetSharedLockSet()->find(rid) != txn->GetSharedLockSet()->end()) {
-                if (!lock_manager->LockUpgrade(txn, rid))
+                if (!lock_manager->LockUpgrade(txn, rid,
+                                               GetSlotLock(slot_num)))
                     return false;
             } else if (txn->GetExclusiveLockSet()->find(rid) ==
                        txn->GetExclusiveLockSet()->end() &&
-                       !lock_manager->LockExclusive(txn, rid)) { // no shared lock
+                       !lock_manager->LockExclusive(
+                           txn, rid, GetSlotLock(slot_num))) { // no shared lock
                 return false;
             }
 
@@ -148,9 +199,11 @@ namespace cmudb {
 
             LogRecord log(txn->GetTransactionId(), txn->GetPrevLSN(),
                           LogRecordType::MARKDELETE, rid, tuple);
-            lsn_t lsn = log_manager->AppendLogRecord(log);
-            txn->SetPrevLSN(lsn);
-            SetLSN(lsn);
+            lsn_t lsn = log_manager->AppendTxnLogRecord(log, txn, this);
+            if (lsn != INVALID_LSN) {
+                txn->SetPrevLSN(lsn);
+                SetLSN(lsn);
+            }
         }
 
         // set tuple size to negative value
@@ -165,14 +218,14 @@ namespace cmudb {
                                 LogManager *log_manager) {
         int slot_num = rid.GetSlotNum();
         if (slot_num >= GetTupleCount()) {
-            if (ENABLE_LOGGING) {
+            if (IsLogged(txn)) {
                 txn->SetState(TransactionState::ABORTED);
             }
             return false;
         }
         int32_t tuple_size = GetTupleSize(slot_num); // old tuple size
         if (tuple_size <= 0) {
-            if (ENABLE_LOGGING) {
+            if (IsLogged(txn)) {
                 txn->SetState(TransactionState::ABORTED);
             }
             return false;
@@ -193,15 +246,17 @@ namespace cmudb {
         old_tuple.rid_ = rid;
         old_tuple.allocated_ = true;
 
-        if (ENABLE_LOGGING) {
+        if (IsLogged(txn)) {
             // acquire exclusive lock
             // if has shared lock
             if (txn->GetSharedLockSet()->find(rid) != txn->GetSharedLockSet()->end()) {
-                if (!lock_manager->LockUpgrade(txn, rid))
+                if (!lock_manager->LockUpgrade(txn, rid,
+                                               GetSlotLock(slot_num)))
                     return false;
             } else if (txn->GetExclusiveLockSet()->find(rid) ==
                        txn->GetExclusiveLockSet()->end() &&
-                       !lock_manager->LockExclusive(txn, rid)) { // no shared lock
+                       !lock_manager->LockExclusive(
+                           txn, rid, GetSlotLock(slot_num))) { // no shared lock
                 return false;
             }
             LogRecord log(txn->GetTransactionId(), txn->GetPrevLSN(),
@@ -256,10 +311,9 @@ namespace cmudb {
         delete_tuple.rid_ = rid;
         delete_tuple.allocated_ = true;
 
-        if (ENABLE_LOGGING) {
+        if (IsLogged(txn)) {
             // must already grab the exclusive lock
-            assert(txn->GetExclusiveLockSet()->find(rid) !=
-                   txn->GetExclusiveLockSet()->end());
+            assert(LockManager::HoldsLock(txn, rid, LockMode::EXCLUSIVE));
 
             LogRecord log(txn->GetTransactionId(), txn->GetPrevLSN(),
                           LogRecordType::APPLYDELETE, rid, delete_tuple);
@@ -296,10 +350,9 @@ namespace cmudb {
         assert(slot_num < GetTupleCount());
         int32_t tuple_size = GetTupleSize(slot_num);
 
-        if (ENABLE_LOGGING) {
+        if (IsLogged(txn)) {
             // must have already grab the exclusive lock
-            assert(txn->GetExclusiveLockSet()->find(rid) !=
-                   txn->GetExclusiveLockSet()->end());
+            assert(LockManager::HoldsLock(txn, rid, LockMode::EXCLUSIVE));
 
             // first copy deleted tuple
             int32_t tuple_offset = GetTupleOffset(slot_num);
@@ -326,23 +379,23 @@ namespace cmudb {
                              LockManager *lock_manager) {
         int slot_num = rid.GetSlotNum();
         if (slot_num >= GetTupleCount()) {
-            if (ENABLE_LOGGING)
+            if (IsLogged(txn))
                 txn->SetState(TransactionState::ABORTED);
             return false;
         }
         int32_t tuple_size = GetTupleSize(slot_num);
         if (tuple_size <= 0) {
-            if (ENABLE_LOGGING)
+            if (IsLogged(txn))
                 txn->SetState(TransactionState::ABORTED);
             return false;
         }
 
-        if (ENABLE_LOGGING) {
+        if (IsLogged(txn)) {
             // acquire shared lock
             if (txn->GetExclusiveLockSet()->find(rid) ==
                 txn->GetExclusiveLockSet()->end() &&
                 txn->GetSharedLockSet()->find(rid) == txn->GetSharedLockSet()->end() &&
-                !lock_manager->LockShared(txn, rid)) {
+                !lock_manager->LockShared(txn, rid, GetSlotLock(slot_num))) {
                 return false;
             }
         }
@@ -361,9 +414,9 @@ namespace cmudb {
 /**
  * Tuple iterator
  */
-    bool TablePage::GetFirstTupleRid(RID &first_rid) {
+    bool TablePage::GetFirstTupleRid(RID &first_rid, bool all_slots) {
         for (int i = 0; i < GetTupleCount(); ++i) {
-            if (GetTupleSize(i) > 0) { // valid tuple
+            if (all_slots || GetTupleSize(i) > 0) { // valid tuple
                 first_rid.Set(GetPageId(), i);
                 return true;
             }
@@ -373,10 +426,11 @@ namespace cmudb {
         return false;
     }
 
-    bool TablePage::GetNextTupleRid(const RID &cur_rid, RID &next_rid) {
+    bool TablePage::GetNextTupleRid(const RID &cur_rid, RID &next_rid,
+                                    bool all_slots) {
         assert(cur_rid.GetPageId() == GetPageId());
         for (auto i = cur_rid.GetSlotNum() + 1; i < GetTupleCount(); ++i) {
-            if (GetTupleSize(i) > 0) { // valid tuple
+            if (all_slots || GetTupleSize(i) > 0) { // valid tuple
                 next_rid.Set(GetPageId(), i);
                 return true;
             }
@@ -384,25 +438,40 @@ namespace cmudb {
         return false; // End of last tuple
     }
 
+    std::atomic<txn_id_t> *TablePage::GetSlotLock(int slot_num) {
+        if (!HasSlotLocks()) {
+            return nullptr;
+        }
+        return reinterpret_cast<std::atomic<txn_id_t> *>(
+                GetData() + 32 + LOCK_SLOT_SIZE*slot_num);
+    }
+
+    bool TablePage::HasSlotLocks() {
+        return (*reinterpret_cast<int32_t *>(GetData() + 20) &
+                SLOT_LOCK_FLAG) != 0;
+    }
+
 /**
  * helper functions
  */
 
 // tuple slots
     int32_t TablePage::GetTupleOffset(int slot_num) {
-        return *reinterpret_cast<int32_t *>(GetData() + 24 + 8*slot_num);
+        return *reinterpret_cast<int32_t *>(GetData() + 24 +
+                                            GetSlotSize()*slot_num);
     }
 
     int32_t TablePage::GetTupleSize(int slot_num) {
-        return *reinterpret_cast<int32_t *>(GetData() + 28 + 8*slot_num);
+        return *reinterpret_cast<int32_t *>(GetData() + 28 +
+                                            GetSlotSize()*slot_num);
     }
 
     void TablePage::SetTupleOffset(int slot_num, int32_t offset) {
-        memcpy(GetData() + 24 + 8*slot_num, &offset, 4);
+        memcpy(GetData() + 24 + GetSlotSize()*slot_num, &offset, 4);
     }
 
     void TablePage::SetTupleSize(int slot_num, int32_t offset) {
-        memcpy(GetData() + 28 + 8*slot_num, &offset, 4);
+        memcpy(GetData() + 28 + GetSlotSize()*slot_num, &offset, 4);
     }
 
 // free space
@@ -416,15 +485,22 @@ namespace cmudb {
 
 // tuple count
     int32_t TablePage::GetTupleCount() {
-        return *reinterpret_cast<int32_t *>(GetData() + 20);
+        return *reinterpret_cast<int32_t *>(GetData() + 20) & ~SLOT_LOCK_FLAG;
     }
 
     void TablePage::SetTupleCount(int32_t tuple_count) {
+        if (HasSlotLocks()) {
+            tuple_count |= SLOT_LOCK_FLAG;
+        }
         memcpy(GetData() + 20, &tuple_count, 4);
     }
 
+    int32_t TablePage::GetSlotSize() {
+        return HasSlotLocks() ? LOCK_SLOT_SIZE : SLOT_SIZE;
+    }
+
 // for free space calculation
     int32_t TablePage::GetFreeSpaceSize() {
-        return GetFreeSpacePointer() - 24 - GetTupleCount()*8;
+        return GetFreeSpacePointer() - 24 - GetTupleCount()*GetSlotSize();
     }
 } // namespace cmudb
\ No newline at end of file
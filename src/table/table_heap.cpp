@@ -12,23 +12,25 @@ namespace cmudb {
 // open table
 TableHeap::TableHeap(BufferPoolManager *buffer_pool_manager,
                      LockManager *lock_manager, LogManager *log_manager,
-                     page_id_t first_page_id)
+                     page_id_t first_page_id, VersionStore *version_store)
     : buffer_pool_manager_(buffer_pool_manager), lock_manager_(lock_manager),
-      log_manager_(log_manager), first_page_id_(first_page_id) {}
+      log_manager_(log_manager), first_page_id_(first_page_id),
+      version_store_(version_store) {}
 
 // create table
 TableHeap::TableHeap(BufferPoolManager *buffer_pool_manager,
                      LockManager *lock_manager, LogManager *log_manager,
-                     Transaction *txn)
+                     Transaction *txn, VersionStore *version_store)
     : buffer_pool_manager_(buffer_pool_manager), lock_manager_(lock_manager),
-      log_manager_(log_manager) {
+      log_manager_(log_manager), version_store_(version_store) {
   auto first_page =
       static_cast<TablePage *>(buffer_pool_manager_->NewPage(first_page_id_));
   assert(first_page != nullptr); // todo: abort table creation?
   first_page->WLatch();
   LOG_DEBUG("new table page created %d", first_page_id_);
 
-  first_page->Init(first_page_id_, PAGE_SIZE, INVALID_LSN, log_manager_, txn);
+  first_page->Init(first_page_id_, PAGE_SIZE, INVALID_LSN, log_manager_, txn,
+                   SLOT_ROW_LOCKS);
   first_page->WUnlatch();
   buffer_pool_manager_->UnpinPage(first_page_id_, true);
 }
@@ -39,6 +41,12 @@ bool TableHeap::InsertTuple(const Tuple &tuple, RID &rid, Transaction *txn) {
     return false;
   }
 
+  if (ENABLE_LOGGING) {
+    log_manager_->ReserveTxnLog(txn);
+  }
+  if (!LockPage(first_page_id_, LockMode::INTENTION_EXCLUSIVE, txn)) {
+    return false;
+  }
   auto cur_page =
       static_cast<TablePage *>(buffer_pool_manager_->FetchPage(first_page_id_));
   if (cur_page == nullptr) {
@@ -54,6 +62,9 @@ bool TableHeap::InsertTuple(const Tuple &tuple, RID &rid, Transaction *txn) {
     if (next_page_id != INVALID_PAGE_ID) { // valid next page
       cur_page->WUnlatch();
       buffer_pool_manager_->UnpinPage(cur_page->GetPageId(), false);
+      if (!LockPage(next_page_id, LockMode::INTENTION_EXCLUSIVE, txn)) {
+        return false;
+      }
       cur_page = static_cast<TablePage *>(
           buffer_pool_manager_->FetchPage(next_page_id));
       cur_page->WLatch();
@@ -66,25 +77,34 @@ bool TableHeap::InsertTuple(const Tuple &tuple, RID &rid, Transaction *txn) {
         txn->SetState(TransactionState::ABORTED);
         return false;
       }
+      // nobody else can reach the page yet, this does not wait
+      LockPage(next_page_id, LockMode::INTENTION_EXCLUSIVE, txn);
       new_page->WLatch();
       // std::cout << "new table page " << next_page_id << " created" <<
       // std::endl;
       cur_page->SetNextPageId(next_page_id);
       new_page->Init(next_page_id, PAGE_SIZE, cur_page->GetPageId(),
-                     log_manager_, txn);
+                     log_manager_, txn, cur_page->HasSlotLocks());
       cur_page->WUnlatch();
       buffer_pool_manager_->UnpinPage(cur_page->GetPageId(), true);
       cur_page = new_page;
     }
   }
+  AddVersion(rid, nullptr, txn);
   cur_page->WUnlatch();
-  buffer_pool_manager_->UnpinPage(cur_page->GetPageId(), true);
+  ReleasePage(cur_page, txn);
   txn->GetWriteSet()->emplace_back(rid, WType::INSERT, Tuple{}, this);
   return true;
 }
 
 bool TableHeap::MarkDelete(const RID &rid, Transaction *txn) {
   // todo: remove empty page
+  if (ENABLE_LOGGING) {
+    log_manager_->ReserveTxnLog(txn);
+  }
+  if (!LockPage(rid.GetPageId(), LockMode::INTENTION_EXCLUSIVE, txn)) {
+    return false;
+  }
   auto page = reinterpret_cast<TablePage *>(
       buffer_pool_manager_->FetchPage(rid.GetPageId()));
   if (page == nullptr) {
@@ -92,15 +112,27 @@ bool TableHeap::MarkDelete(const RID &rid, Transaction *txn) {
     return false;
   }
   page->WLatch();
-  page->MarkDelete(rid, txn, lock_manager_, log_manager_);
+  Tuple old_tuple;
+  bool exists = version_store_ != nullptr &&
+                page->GetTuple(rid, old_tuple, nullptr, nullptr);
+  if (page->MarkDelete(rid, txn, lock_manager_, log_manager_) && exists) {
+    AddVersion(rid, &old_tuple, txn);
+  }
   page->WUnlatch();
-  buffer_pool_manager_->UnpinPage(page->GetPageId(), true);
+  ReleasePage(page, txn);
   txn->GetWriteSet()->emplace_back(rid, WType::DELETE, Tuple{}, this);
   return true;
 }
 
 bool TableHeap::UpdateTuple(const Tuple &tuple, const RID &rid,
                             Transaction *txn) {
+  // the log records of this change must follow the earlier ones of txn
+  if (ENABLE_LOGGING) {
+    log_manager_->PublishTxnLog(txn);
+  }
+  if (!LockPage(rid.GetPageId(), LockMode::INTENTION_EXCLUSIVE, txn)) {
+    return false;
+  }
   auto page = reinterpret_cast<TablePage *>(
       buffer_pool_manager_->FetchPage(rid.GetPageId()));
   if (page == nullptr) {
@@ -111,6 +143,9 @@ bool TableHeap::UpdateTuple(const Tuple &tuple, const RID &rid,
   page->WLatch();
   bool is_updated = page->UpdateTuple(tuple, old_tuple, rid, txn, lock_manager_,
                                       log_manager_);
+  if (is_updated) {
+    AddVersion(rid, &old_tuple, txn);
+  }
   page->WUnlatch();
   buffer_pool_manager_->UnpinPage(page->GetPageId(), is_updated);
   if (is_updated && txn->GetState() != TransactionState::ABORTED)
@@ -119,17 +154,26 @@ bool TableHeap::UpdateTuple(const Tuple &tuple, const RID &rid,
 }
 
 void TableHeap::ApplyDelete(const RID &rid, Transaction *txn) {
+  if (ENABLE_LOGGING) {
+    log_manager_->PublishTxnLog(txn);
+  }
   auto page = reinterpret_cast<TablePage *>(
       buffer_pool_manager_->FetchPage(rid.GetPageId()));
   assert(page != nullptr);
   page->WLatch();
   page->ApplyDelete(rid, txn, log_manager_);
-  lock_manager_->Unlock(txn, rid);
+  // unless a table or page lock covers the row
+  if (txn->GetExclusiveLockSet()->count(rid) != 0) {
+    lock_manager_->Unlock(txn, rid, page->GetSlotLock(rid.GetSlotNum()));
+  }
   page->WUnlatch();
   buffer_pool_manager_->UnpinPage(page->GetPageId(), true);
 }
 
 void TableHeap::RollbackDelete(const RID &rid, Transaction *txn) {
+  if (ENABLE_LOGGING) {
+    log_manager_->PublishTxnLog(txn);
+  }
   auto page = reinterpret_cast<TablePage *>(
       buffer_pool_manager_->FetchPage(rid.GetPageId()));
   assert(page != nullptr);
@@ -139,8 +183,32 @@ void TableHeap::RollbackDelete(const RID &rid, Transaction *txn) {
   buffer_pool_manager_->UnpinPage(page->GetPageId(), true);
 }
 
+bool TableHeap::LockPage(page_id_t page_id, LockMode lock_mode,
+                         Transaction *txn) {
+  return !ENABLE_LOGGING ||
+         lock_manager_->LockPage(txn, first_page_id_, page_id, lock_mode);
+}
+
+void TableHeap::AddVersion(const RID &rid, const Tuple *before,
+                           Transaction *txn) {
+  if (version_store_ != nullptr) {
+    version_store_->AddVersion(txn->GetTransactionId(), rid, before);
+  }
+}
+
+void TableHeap::ReleasePage(Page *page, Transaction *txn) {
+  if (!ENABLE_LOGGING || !txn->KeepPrivateLogPin(page, buffer_pool_manager_)) {
+    buffer_pool_manager_->UnpinPage(page->GetPageId(), true);
+  }
+}
+
 // called by tuple iterator
 bool TableHeap::GetTuple(const RID &rid, Tuple &tuple, Transaction *txn) {
+  bool snapshot = txn != nullptr && txn->IsReadOnly();
+  if (!snapshot &&
+      !LockPage(rid.GetPageId(), LockMode::INTENTION_SHARED, txn)) {
+    return false;
+  }
   auto page = static_cast<TablePage *>(
       buffer_pool_manager_->FetchPage(rid.GetPageId()));
   if (page == nullptr) {
@@ -148,7 +216,16 @@ bool TableHeap::GetTuple(const RID &rid, Tuple &tuple, Transaction *txn) {
     return false;
   }
   page->RLatch();
-  bool res = page->GetTuple(rid, tuple, txn, lock_manager_);
+  bool res;
+  if (snapshot) {
+    // the row on the page, then back to the version of the snapshot
+    res = page->GetTuple(rid, tuple, nullptr, nullptr);
+    if (version_store_ != nullptr) {
+      res = version_store_->Read(rid, txn->GetReadTimestamp(), tuple, res);
+    }
+  } else {
+    res = page->GetTuple(rid, tuple, txn, lock_manager_);
+  }
   page->RUnlatch();
   buffer_pool_manager_->UnpinPage(rid.GetPageId(), false);
   return res;
@@ -167,7 +244,7 @@ TableIterator TableHeap::begin(Transaction *txn) {
   RID rid;
   // if failed (no tuple), rid will be the result of default
   // constructor, which means eof
-  page->GetFirstTupleRid(rid);
+  page->GetFirstTupleRid(rid, txn != nullptr && txn->IsReadOnly());
   page->RUnlatch();
   buffer_pool_manager_->UnpinPage(first_page_id_, false);
   return TableIterator(this, rid, txn);
@@ -10,8 +10,9 @@ namespace cmudb {
 
 TableIterator::TableIterator(TableHeap *table_heap, RID rid, Transaction *txn)
     : table_heap_(table_heap), tuple_(new Tuple(rid)), txn_(txn) {
-  if (rid.GetPageId() != INVALID_PAGE_ID) {
-    table_heap_->GetTuple(tuple_->rid_, *tuple_, txn_);
+  if (rid.GetPageId() != INVALID_PAGE_ID &&
+      !table_heap_->GetTuple(tuple_->rid_, *tuple_, txn_) && IsSnapshot()) {
+    ++(*this);
   }
 };
 
@@ -25,6 +26,12 @@ Tuple *TableIterator::operator->() {
   return tuple_;
 }
 
+/*
+ * A snapshot scan visits every slot, the snapshot may still see an older
+ * version of a deleted tuple, and skips those without a version in the
+ * snapshot. It reads the tuple without the page latch, a writer may be
+ * waiting for it.
+ */
 TableIterator &TableIterator::operator++() {
   BufferPoolManager *buffer_pool_manager = table_heap_->buffer_pool_manager_;
   auto cur_page = static_cast<TablePage *>(
@@ -32,24 +39,36 @@ TableIterator &TableIterator::operator++() {
   cur_page->RLatch();
   assert(cur_page != nullptr); // all pages are pinned
 
-  RID next_tuple_rid;
-  if (!cur_page->GetNextTupleRid(tuple_->rid_,
-                                 next_tuple_rid)) { // end of this page
-    while (cur_page->GetNextPageId() != INVALID_PAGE_ID) {
-      auto next_page = static_cast<TablePage *>(
-          buffer_pool_manager->FetchPage(cur_page->GetNextPageId()));
-      cur_page->RUnlatch();
-      buffer_pool_manager->UnpinPage(cur_page->GetPageId(), false);
-      cur_page = next_page;
-      cur_page->RLatch();
-      if (cur_page->GetFirstTupleRid(next_tuple_rid))
-        break;
+  bool snapshot = IsSnapshot();
+  while (true) {
+    RID next_tuple_rid;
+    if (!cur_page->GetNextTupleRid(tuple_->rid_, next_tuple_rid,
+                                   snapshot)) { // end of this page
+      while (cur_page->GetNextPageId() != INVALID_PAGE_ID) {
+        auto next_page = static_cast<TablePage *>(
+            buffer_pool_manager->FetchPage(cur_page->GetNextPageId()));
+        cur_page->RUnlatch();
+        buffer_pool_manager->UnpinPage(cur_page->GetPageId(), false);
+        cur_page = next_page;
+        cur_page->RLatch();
+        if (cur_page->GetFirstTupleRid(next_tuple_rid, snapshot))
+          break;
+      }
+    }
+    tuple_->rid_ = next_tuple_rid;
+    if (*this == table_heap_->end()) {
+      break;
+    }
+    if (!snapshot) {
+      table_heap_->GetTuple(tuple_->rid_, *tuple_, txn_);
+      break;
+    }
+    cur_page->RUnlatch();
+    bool visible = table_heap_->GetTuple(tuple_->rid_, *tuple_, txn_);
+    cur_page->RLatch();
+    if (visible) {
+      break;
     }
-  }
-  tuple_->rid_ = next_tuple_rid;
-
-  if (*this != table_heap_->end()) {
-    table_heap_->GetTuple(tuple_->rid_, *tuple_, txn_);
   }
   // release until copy the tuple
   cur_page->RUnlatch();
@@ -57,6 +76,10 @@ TableIterator &TableIterator::operator++() {
   return *this;
 }
 
+bool TableIterator::IsSnapshot() {
+  return txn_ != nullptr && txn_->IsReadOnly();
+}
+
 TableIterator TableIterator::operator++(int) {
   TableIterator clone(*this);
   ++(*this);
@@ -53,6 +53,12 @@ Tuple::Tuple(const Tuple &other)
 }
 
 Tuple &Tuple::operator=(const Tuple &other) {
+  if (this == &other) {
+    return *this;
+  }
+  if (allocated_) {
+    delete[] data_;
+  }
   allocated_ = other.allocated_;
   rid_ = other.rid_;
   size_ = other.size_;
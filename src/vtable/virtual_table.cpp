@@ -158,9 +158,10 @@ int VtabDisconnect(sqlite3_vtab *pVtab) {
 
 int VtabOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor) {
   // LOG_DEBUG("VtabOpen");
-  // if read operation, begin transaction here
+  // if read operation, begin transaction here. It scans a snapshot without
+  // locks, writers are not held up by it
   if (global_transaction_ == nullptr) {
-    VtabBegin(pVtab);
+    global_transaction_ = storage_engine_->transaction_manager_->Begin(true);
   }
   VirtualTable *virtual_table = reinterpret_cast<VirtualTable *>(pVtab);
   Cursor *cursor = new Cursor(virtual_table);
@@ -360,8 +361,21 @@ __declspec(dllexport)
 
   // init storage engine
   storage_engine_ = new StorageEngine(db_file_name);
+  // recover the last run, with LAZY_RECOVERY queries are served right away
+  if (is_file_exist) {
+    storage_engine_->log_recovery_ = new LogRecovery(
+        storage_engine_->disk_manager_, storage_engine_->buffer_pool_manager_,
+        storage_engine_->log_manager_);
+    if (LAZY_RECOVERY) {
+      storage_engine_->log_recovery_->StartLazyRecovery();
+    } else {
+      storage_engine_->log_recovery_->Redo();
+      storage_engine_->log_recovery_->Undo();
+    }
+  }
   // start the logging
   storage_engine_->log_manager_->RunFlushThread();
+  storage_engine_->checkpoint_manager_->RunCheckpointThread();
   // create header page from BufferPoolManager if necessary
   if (!is_file_exist) {
     page_id_t header_page_id;
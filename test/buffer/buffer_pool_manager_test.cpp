@@ -3,9 +3,12 @@
  */
 
 #include <cstdio>
+#include <cstring>
 
 #include "buffer/buffer_pool_manager.h"
 #include "gtest/gtest.h"
+#include "logging/log_manager.h"
+#include "logging/log_record.h"
 
 namespace cmudb {
 
@@ -48,4 +51,92 @@ TEST(BufferPoolManagerTest, SampleTest) {
   remove("test.db");
 }
 
+TEST(BufferPoolManagerTest, EvictionTest) {
+  page_id_t temp_page_id;
+  DiskManager *disk_manager = new DiskManager("test.db");
+  LogManager *log_manager = new LogManager(disk_manager);
+  BufferPoolManager bpm(3, disk_manager, log_manager);
+
+  Page *pages[3];
+  const char *contents[3] = {"zero", "one", "two"};
+  for (int i = 0; i < 3; ++i) {
+    pages[i] = bpm.NewPage(temp_page_id);
+    ASSERT_NE(nullptr, pages[i]);
+    strcpy(pages[i]->GetData() + 64, contents[i]);
+  }
+  // page zero is durable in the log, page one is not, page two is clean
+  ENABLE_LOGGING = true;
+  pages[0]->SetLSN(5);
+  pages[1]->SetLSN(10);
+  log_manager->SetPersistentLSN(7);
+  EXPECT_TRUE(bpm.UnpinPage(1, true));
+  EXPECT_TRUE(bpm.UnpinPage(0, true));
+  EXPECT_TRUE(bpm.UnpinPage(2, false));
+
+  // the clean page goes first, although it was used last
+  char data[PAGE_SIZE];
+  EXPECT_NE(nullptr, bpm.NewPage(temp_page_id));
+  memset(data, 0, PAGE_SIZE);
+  disk_manager->ReadPage(2, data);
+  EXPECT_NE(0, strcmp(data + 64, contents[2]));
+
+  // then the page that needs no log flush
+  EXPECT_NE(nullptr, bpm.NewPage(temp_page_id));
+  memset(data, 0, PAGE_SIZE);
+  disk_manager->ReadPage(0, data);
+  EXPECT_EQ(0, strcmp(data + 64, contents[0]));
+  memset(data, 0, PAGE_SIZE);
+  disk_manager->ReadPage(1, data);
+  EXPECT_NE(0, strcmp(data + 64, contents[1]));
+  ENABLE_LOGGING = false;
+
+  delete log_manager;
+  delete disk_manager;
+  remove("test.db");
+  remove("test.log");
+}
+
+TEST(BufferPoolManagerTest, WriteAheadTest) {
+  page_id_t page_id, temp_page_id;
+  DiskManager *disk_manager = new DiskManager("test.db");
+  LogManager *log_manager = new LogManager(disk_manager);
+  BufferPoolManager bpm(3, disk_manager, log_manager);
+  auto log_timeout = LOG_TIMEOUT;
+  // the log is only flushed when someone asks for it
+  LOG_TIMEOUT = std::chrono::seconds(100);
+  log_manager->RunFlushThread();
+
+  // a page is not written back before its log record is durable
+  Page *page = bpm.NewPage(page_id);
+  ASSERT_NE(nullptr, page);
+  LogRecord begin(0, INVALID_LSN, LogRecordType::BEGIN);
+  page->SetLSN(log_manager->AppendLogRecord(begin));
+  strcpy(page->GetData() + 64, "flushed");
+  EXPECT_LT(log_manager->GetPersistentLSN(), page->GetLSN());
+  EXPECT_TRUE(bpm.FlushPage(page_id));
+  EXPECT_GE(log_manager->GetPersistentLSN(), page->GetLSN());
+
+  // nor when it is evicted
+  LogRecord commit(0, page->GetLSN(), LogRecordType::COMMIT);
+  page->SetLSN(log_manager->AppendLogRecord(commit));
+  strcpy(page->GetData() + 64, "evicted");
+  lsn_t lsn = page->GetLSN();
+  EXPECT_TRUE(bpm.UnpinPage(page_id, true));
+  EXPECT_NE(nullptr, bpm.NewPage(temp_page_id));
+  EXPECT_NE(nullptr, bpm.NewPage(temp_page_id));
+  EXPECT_LT(log_manager->GetPersistentLSN(), lsn);
+  EXPECT_NE(nullptr, bpm.NewPage(temp_page_id));
+  EXPECT_GE(log_manager->GetPersistentLSN(), lsn);
+  char data[PAGE_SIZE];
+  disk_manager->ReadPage(page_id, data);
+  EXPECT_EQ(0, strcmp(data + 64, "evicted"));
+
+  log_manager->StopFlushThread();
+  LOG_TIMEOUT = log_timeout;
+  delete log_manager;
+  delete disk_manager;
+  remove("test.db");
+  remove("test.log");
+}
+
 } // namespace cmudb
@@ -2,7 +2,10 @@
  * lock_manager_test.cpp
  */
 
+#include <atomic>
+#include <chrono>
 #include <thread>
+#include <vector>
 
 #include "concurrency/transaction_manager.h"
 #include "gtest/gtest.h"
@@ -40,4 +43,301 @@ TEST(LockManagerTest, BasicTest) {
   t0.join();
   t1.join();
 }
+TEST(LockManagerTest, WaitQueueTest) {
+  LockManager lock_mgr{false};
+  RID rid{0, 0};
+  RID other_rid{1, 0};
+
+  // the younger txn holds rid, the older one waits for it
+  Transaction young(1);
+  EXPECT_TRUE(lock_mgr.LockExclusive(&young, rid));
+  std::atomic<bool> granted{false};
+  std::thread waiter([&] {
+    Transaction old(0);
+    EXPECT_TRUE(lock_mgr.LockExclusive(&old, rid));
+    granted = true;
+    EXPECT_TRUE(lock_mgr.Unlock(&old, rid));
+  });
+
+  // other rows are not held up by the waiter, in any shard
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([&, i] {
+      for (int slot = 0; slot < 2 * LOCK_TABLE_SHARDS; slot++) {
+        Transaction txn(2 + i);
+        RID row{2 + i, slot};
+        EXPECT_TRUE(lock_mgr.LockShared(&txn, row));
+        EXPECT_TRUE(lock_mgr.Unlock(&txn, row));
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  Transaction reader(10);
+  EXPECT_TRUE(lock_mgr.LockShared(&reader, other_rid));
+  EXPECT_TRUE(lock_mgr.Unlock(&reader, other_rid));
+  EXPECT_FALSE(granted);
+
+  EXPECT_TRUE(lock_mgr.Unlock(&young, rid));
+  waiter.join();
+  EXPECT_TRUE(granted);
+
+  // a released row starts over, a younger txn does not die on it
+  Transaction youngest(20);
+  EXPECT_TRUE(lock_mgr.LockExclusive(&youngest, rid));
+  EXPECT_TRUE(lock_mgr.Unlock(&youngest, rid));
+}
+TEST(LockManagerTest, HierarchyTest) {
+  LockManager lock_mgr{false};
+  const page_id_t table = 5;
+  Transaction t0(0);
+  Transaction t1(1);
+  Transaction t2(2);
+
+  // intention locks of readers and writers go together
+  EXPECT_TRUE(lock_mgr.LockPage(&t1, table, 7, LockMode::INTENTION_EXCLUSIVE));
+  EXPECT_TRUE(lock_mgr.LockPage(&t0, table, 8, LockMode::INTENTION_SHARED));
+  EXPECT_EQ(LockMode::INTENTION_EXCLUSIVE,
+            t1.GetTableLockSet()[LockManager::TableLockId(table)]);
+
+  // a younger txn dies on a table lock the older writer conflicts with
+  EXPECT_FALSE(lock_mgr.LockTable(&t2, table, LockMode::SHARED));
+  EXPECT_EQ(TransactionState::ABORTED, t2.GetState());
+  EXPECT_EQ(1, lock_mgr.GetAbortCount(AbortReason::DIED));
+
+  // a page lock covers the rows of the page
+  EXPECT_TRUE(lock_mgr.LockPage(&t0, table, 8, LockMode::SHARED));
+  EXPECT_TRUE(lock_mgr.LockShared(&t0, RID{8, 3}));
+  EXPECT_EQ(0, t0.GetSharedLockSet()->size());
+  EXPECT_TRUE(LockManager::HoldsLock(&t0, RID{8, 3}, LockMode::SHARED));
+  EXPECT_FALSE(LockManager::HoldsLock(&t0, RID{8, 3}, LockMode::EXCLUSIVE));
+
+  EXPECT_TRUE(lock_mgr.Unlock(&t0, LockManager::PageLockId(8)));
+  EXPECT_TRUE(lock_mgr.Unlock(&t0, LockManager::TableLockId(table)));
+  EXPECT_TRUE(lock_mgr.Unlock(&t1, LockManager::PageLockId(7)));
+  EXPECT_TRUE(lock_mgr.Unlock(&t1, LockManager::TableLockId(table)));
+  EXPECT_TRUE(t0.GetTableLockSet().empty());
+}
+
+TEST(LockManagerTest, EscalationTest) {
+  int threshold = LOCK_ESCALATION_THRESHOLD;
+  LOCK_ESCALATION_THRESHOLD = 10;
+  LockManager lock_mgr{false};
+  const page_id_t table = 5;
+  RID table_lock = LockManager::TableLockId(table);
+  Transaction t0(0);
+  Transaction t1(1);
+  Transaction t2(2);
+
+  // enough row locks are traded for a table lock
+  EXPECT_TRUE(lock_mgr.LockPage(&t0, table, 7, LockMode::INTENTION_SHARED));
+  for (int slot = 0; slot < LOCK_ESCALATION_THRESHOLD; slot++) {
+    EXPECT_TRUE(lock_mgr.LockShared(&t0, RID{7, slot}));
+  }
+  EXPECT_EQ(0, t0.GetSharedLockSet()->size());
+  EXPECT_EQ(LockMode::SHARED, t0.GetTableLockSet()[table_lock]);
+
+  // readers still get in, writers do not
+  EXPECT_TRUE(lock_mgr.LockPage(&t1, table, 7, LockMode::INTENTION_SHARED));
+  EXPECT_TRUE(lock_mgr.LockShared(&t1, RID{7, 0}));
+  EXPECT_FALSE(lock_mgr.LockPage(&t2, table, 7, LockMode::INTENTION_EXCLUSIVE));
+
+  // writing on top of the table lock makes it SIX
+  EXPECT_TRUE(lock_mgr.LockPage(&t0, table, 7, LockMode::INTENTION_EXCLUSIVE));
+  EXPECT_EQ(LockMode::SHARED_INTENTION_EXCLUSIVE,
+            t0.GetTableLockSet()[table_lock]);
+  // the reader keeps the table from going X
+  for (int slot = 1; slot <= LOCK_ESCALATION_THRESHOLD; slot++) {
+    EXPECT_TRUE(lock_mgr.LockExclusive(&t0, RID{7, slot}));
+  }
+  EXPECT_EQ(LOCK_ESCALATION_THRESHOLD, t0.GetExclusiveLockSet()->size());
+  EXPECT_TRUE(lock_mgr.Unlock(&t1, RID{7, 0}));
+  EXPECT_TRUE(lock_mgr.Unlock(&t1, LockManager::PageLockId(7)));
+  EXPECT_TRUE(lock_mgr.Unlock(&t1, table_lock));
+  for (int slot = 11; slot <= 2 * LOCK_ESCALATION_THRESHOLD; slot++) {
+    EXPECT_TRUE(lock_mgr.LockExclusive(&t0, RID{7, slot}));
+  }
+  EXPECT_EQ(0, t0.GetExclusiveLockSet()->size());
+  EXPECT_EQ(LockMode::EXCLUSIVE, t0.GetTableLockSet()[table_lock]);
+  EXPECT_TRUE(LockManager::HoldsLock(&t0, RID{7, 100}, LockMode::EXCLUSIVE));
+
+  EXPECT_TRUE(lock_mgr.Unlock(&t0, LockManager::PageLockId(7)));
+  EXPECT_TRUE(lock_mgr.Unlock(&t0, table_lock));
+  LOCK_ESCALATION_THRESHOLD = threshold;
+}
+
+TEST(LockManagerTest, WoundWaitTest) {
+  LockManager lock_mgr{false, DeadlockPolicy::WOUND_WAIT};
+  TransactionManager txn_mgr{&lock_mgr};
+  RID a{0, 0};
+  RID b{0, 1};
+  Transaction old(0);
+  Transaction young(1);
+  EXPECT_TRUE(lock_mgr.LockExclusive(&old, a));
+  EXPECT_TRUE(lock_mgr.LockExclusive(&young, b));
+
+  // the younger txn waits for the older one
+  std::thread waiter([&] {
+    EXPECT_FALSE(lock_mgr.LockExclusive(&young, a));
+    EXPECT_EQ(TransactionState::ABORTED, young.GetState());
+    txn_mgr.Abort(&young);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+  // the older one wounds it instead of waiting
+  EXPECT_TRUE(lock_mgr.LockExclusive(&old, b));
+  waiter.join();
+  EXPECT_EQ(1, lock_mgr.GetAbortCount(AbortReason::WOUNDED));
+  EXPECT_EQ(0, lock_mgr.GetAbortCount(AbortReason::DIED));
+  txn_mgr.Commit(&old);
+}
+
+TEST(LockManagerTest, DeadlockDetectionTest) {
+  LockManager lock_mgr{false, DeadlockPolicy::DETECTION};
+  TransactionManager txn_mgr{&lock_mgr};
+  RID a{0, 0};
+  RID b{0, 1};
+  RID c{0, 2};
+  Transaction old(0);
+  Transaction young(1);
+  EXPECT_TRUE(lock_mgr.LockExclusive(&old, a));
+  EXPECT_TRUE(lock_mgr.LockExclusive(&young, b));
+  EXPECT_TRUE(lock_mgr.LockExclusive(&young, c));
+
+  // both wait, the older one holds fewer locks and is the victim
+  std::thread waiter([&] {
+    EXPECT_FALSE(lock_mgr.LockShared(&old, b));
+    txn_mgr.Abort(&old);
+  });
+  EXPECT_TRUE(lock_mgr.LockExclusive(&young, a));
+  waiter.join();
+  EXPECT_EQ(TransactionState::ABORTED, old.GetState());
+  EXPECT_EQ(1, lock_mgr.GetAbortCount(AbortReason::DEADLOCK));
+  EXPECT_EQ(0, lock_mgr.DetectDeadlocks());
+  txn_mgr.Commit(&young);
+}
+
+TEST(LockManagerTest, ReleaseAllTest) {
+  LockManager lock_mgr{true};
+  page_id_t table = 3;
+  Transaction old(0);
+  Transaction young(1);
+
+  // rows spread over the shards, with their page and table locks
+  EXPECT_TRUE(lock_mgr.LockPage(&young, table, 7,
+                                LockMode::INTENTION_EXCLUSIVE));
+  for (int slot = 0; slot < 2 * LOCK_TABLE_SHARDS; slot++) {
+    EXPECT_TRUE(slot % 2 == 0 ? lock_mgr.LockShared(&young, RID{7, slot})
+                              : lock_mgr.LockExclusive(&young, RID{7, slot}));
+  }
+  std::atomic<bool> granted{false};
+  std::thread waiter([&] {
+    EXPECT_TRUE(lock_mgr.LockTable(&old, table, LockMode::EXCLUSIVE));
+    granted = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_FALSE(granted);
+
+  // not before the txn ends under strict 2PL
+  EXPECT_FALSE(lock_mgr.ReleaseAll(&young));
+  EXPECT_EQ(TransactionState::ABORTED, young.GetState());
+  EXPECT_TRUE(lock_mgr.ReleaseAll(&young));
+  waiter.join();
+  EXPECT_TRUE(granted);
+  EXPECT_TRUE(young.GetSharedLockSet()->empty());
+  EXPECT_TRUE(young.GetExclusiveLockSet()->empty());
+  EXPECT_TRUE(young.GetTableLockSet().empty());
+
+  // nothing is left in the lock table
+  old.SetState(TransactionState::COMMITTED);
+  EXPECT_TRUE(lock_mgr.ReleaseAll(&old));
+  for (int slot = 0; slot < 2 * LOCK_TABLE_SHARDS; slot++) {
+    EXPECT_FALSE(lock_mgr.IsContended(RID{7, slot}));
+  }
+  EXPECT_FALSE(lock_mgr.IsContended(LockManager::TableLockId(table)));
+}
+
+TEST(LockManagerTest, SlotLockTest) {
+  SLOT_ROW_LOCKS = true;
+  LockManager lock_mgr{false};
+  RID rid{7, 0};
+  std::atomic<txn_id_t> slot_lock{INVALID_TXN_ID};
+
+  // an uncontended row lock is only its owner in the slot
+  Transaction owner(1);
+  EXPECT_TRUE(lock_mgr.LockExclusive(&owner, rid, &slot_lock));
+  EXPECT_EQ(1, slot_lock);
+  EXPECT_EQ(1, owner.GetSlotLockSet().count(rid));
+  EXPECT_FALSE(lock_mgr.IsContended(rid));
+
+  // the first waiter moves it to the lock table: the younger one dies
+  Transaction young(2);
+  EXPECT_FALSE(lock_mgr.LockShared(&young, rid, &slot_lock));
+  EXPECT_EQ(TransactionState::ABORTED, young.GetState());
+  EXPECT_TRUE(owner.GetSlotLockSet().empty());
+  EXPECT_TRUE(lock_mgr.IsContended(rid));
+
+  // and the older one waits for the owner
+  std::atomic<bool> granted{false};
+  std::thread waiter([&] {
+    Transaction old(0);
+    EXPECT_TRUE(lock_mgr.LockShared(&old, rid, &slot_lock));
+    granted = true;
+    EXPECT_TRUE(lock_mgr.Unlock(&old, rid));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_FALSE(granted);
+  EXPECT_TRUE(lock_mgr.Unlock(&owner, rid, &slot_lock));
+  waiter.join();
+  EXPECT_TRUE(granted);
+  EXPECT_FALSE(lock_mgr.IsContended(rid));
+
+  // a stale owner left in the slot is cleared by the next one
+  Transaction first(3);
+  EXPECT_TRUE(lock_mgr.LockExclusive(&first, rid, &slot_lock));
+  EXPECT_TRUE(lock_mgr.Unlock(&first, rid));
+  EXPECT_EQ(3, slot_lock);
+  Transaction second(4);
+  EXPECT_TRUE(lock_mgr.LockExclusive(&second, rid, &slot_lock));
+  EXPECT_EQ(4, slot_lock);
+  EXPECT_FALSE(lock_mgr.IsContended(rid));
+  EXPECT_TRUE(lock_mgr.Unlock(&second, rid, &slot_lock));
+  EXPECT_EQ(INVALID_TXN_ID, slot_lock);
+  SLOT_ROW_LOCKS = false;
+}
+
+TEST(LockManagerTest, EarlyReleaseTest) {
+  LockManager lock_mgr{false};
+  std::atomic<txn_id_t> slot_lock{INVALID_TXN_ID};
+
+  // one row in the lock table, one in its slot, released early at lsn 10
+  SLOT_ROW_LOCKS = true;
+  Transaction writer(0);
+  EXPECT_TRUE(lock_mgr.LockExclusive(&writer, RID{7, 0}));
+  EXPECT_TRUE(lock_mgr.LockExclusive(&writer, RID{7, 1}, &slot_lock));
+  EXPECT_EQ(0, slot_lock);
+  writer.SetState(TransactionState::COMMITTED);
+  EXPECT_TRUE(lock_mgr.ReleaseAll(&writer, 10));
+
+  // rows the writer did not hold do not wait for its commit, whatever shard
+  // they are in
+  Transaction reader(1);
+  for (int slot = 2; slot < 2 + 2 * LOCK_TABLE_SHARDS; slot++) {
+    EXPECT_TRUE(lock_mgr.LockShared(&reader, RID{7, slot}));
+  }
+  EXPECT_EQ(INVALID_LSN, reader.GetDependencyLSN());
+  EXPECT_TRUE(lock_mgr.LockShared(&reader, RID{7, 0}));
+  EXPECT_EQ(10, reader.GetDependencyLSN());
+  Transaction slot_writer(2);
+  EXPECT_TRUE(lock_mgr.LockExclusive(&slot_writer, RID{7, 1}, &slot_lock));
+  EXPECT_EQ(2, slot_lock);
+  EXPECT_EQ(10, slot_writer.GetDependencyLSN());
+
+  reader.SetState(TransactionState::COMMITTED);
+  EXPECT_TRUE(lock_mgr.ReleaseAll(&reader));
+  slot_writer.SetState(TransactionState::COMMITTED);
+  EXPECT_TRUE(lock_mgr.ReleaseAll(&slot_writer));
+  SLOT_ROW_LOCKS = false;
+}
 } // namespace cmudb
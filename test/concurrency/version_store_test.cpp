@@ -0,0 +1,144 @@
+/**
+ * version_store_test.cpp
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "vtable/virtual_table.h"
+#include "gtest/gtest.h"
+
+namespace cmudb {
+
+TEST(VersionStoreTest, SnapshotReadTest) {
+  remove("test.db");
+  remove("test.log");
+  StorageEngine *storage_engine = new StorageEngine("test.db");
+  storage_engine->log_manager_->RunFlushThread();
+  TransactionManager *txn_mgr = storage_engine->transaction_manager_;
+  VersionStore *version_store = storage_engine->version_store_;
+  Schema *schema = ParseCreateStatement("a bigint");
+  auto make_tuple = [&](int64_t a) {
+    return Tuple(std::vector<Value>{Value(TypeId::BIGINT, a)}, schema);
+  };
+
+  Transaction *txn = txn_mgr->Begin();
+  TableHeap *table = new TableHeap(storage_engine->buffer_pool_manager_,
+                                   storage_engine->lock_manager_,
+                                   storage_engine->log_manager_, txn,
+                                   version_store);
+  std::vector<RID> rids(10);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_TRUE(table->InsertTuple(make_tuple(i), rids[i], txn));
+  }
+  txn_mgr->Commit(txn);
+  delete txn;
+  EXPECT_EQ(0, version_store->GetVersionCount());
+
+  auto scan = [&](Transaction *reader) {
+    std::vector<int64_t> values;
+    for (auto it = table->begin(reader); it != table->end(); ++it) {
+      values.push_back(it->GetValue(schema, 0).GetAs<int64_t>());
+    }
+    std::sort(values.begin(), values.end());
+    return values;
+  };
+  std::vector<int64_t> before{0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+
+  // the writer holds its row locks, the reader neither waits nor dies
+  Transaction *old_reader = txn_mgr->Begin(true);
+  Transaction *writer = txn_mgr->Begin();
+  EXPECT_TRUE(table->UpdateTuple(make_tuple(100), rids[0], writer));
+  EXPECT_TRUE(table->MarkDelete(rids[1], writer));
+  RID new_rid;
+  EXPECT_TRUE(table->InsertTuple(make_tuple(10), new_rid, writer));
+  EXPECT_EQ(before, scan(old_reader));
+  Tuple tuple;
+  EXPECT_TRUE(table->GetTuple(rids[1], tuple, old_reader));
+  EXPECT_EQ(1, tuple.GetValue(schema, 0).GetAs<int64_t>());
+  EXPECT_FALSE(table->GetTuple(new_rid, tuple, old_reader));
+  EXPECT_EQ(TransactionState::GROWING, old_reader->GetState());
+
+  // a commit is seen by snapshots taken after it only
+  txn_mgr->Commit(writer);
+  delete writer;
+  Transaction *new_reader = txn_mgr->Begin(true);
+  EXPECT_EQ(before, scan(old_reader));
+  std::vector<int64_t> after{2, 3, 4, 5, 6, 7, 8, 9, 10, 100};
+  EXPECT_EQ(after, scan(new_reader));
+
+  // the versions go with the last snapshot that needs them
+  EXPECT_EQ(3, version_store->GetVersionCount());
+  txn_mgr->Commit(old_reader);
+  delete old_reader;
+  EXPECT_EQ(0, version_store->GetVersionCount());
+
+  // rolled back changes were never visible
+  Transaction *loser = txn_mgr->Begin();
+  EXPECT_TRUE(table->UpdateTuple(make_tuple(200), rids[2], loser));
+  EXPECT_EQ(after, scan(new_reader));
+  txn_mgr->Abort(loser);
+  delete loser;
+  EXPECT_EQ(0, version_store->GetVersionCount());
+  EXPECT_EQ(after, scan(new_reader));
+  txn_mgr->Commit(new_reader);
+  delete new_reader;
+
+  storage_engine->log_manager_->StopFlushThread();
+  delete table;
+  delete schema;
+  delete storage_engine;
+  remove("test.db");
+  remove("test.log");
+}
+
+class FailingDiskManager : public DiskManager {
+public:
+  using DiskManager::WriteLog;
+  bool WriteLog(const struct iovec *, int) override { return false; }
+};
+
+TEST(VersionStoreTest, FailedCommitTest) {
+  remove("test.db");
+  FailingDiskManager disk_manager;
+  LogManager log_manager(&disk_manager);
+  BufferPoolManager buffer_pool_manager(BUFFER_POOL_SIZE, &disk_manager,
+                                        &log_manager);
+  LockManager lock_manager(true);
+  VersionStore version_store;
+  TransactionManager txn_mgr(&lock_manager, &log_manager, &version_store);
+  Schema *schema = ParseCreateStatement("a bigint");
+  auto make_tuple = [&](int64_t a) {
+    return Tuple(std::vector<Value>{Value(TypeId::BIGINT, a)}, schema);
+  };
+
+  // created before logging starts
+  Transaction *txn = txn_mgr.Begin();
+  TableHeap *table = new TableHeap(&buffer_pool_manager, &lock_manager,
+                                   &log_manager, txn, &version_store);
+  RID rid;
+  EXPECT_TRUE(table->InsertTuple(make_tuple(1), rid, txn));
+  txn_mgr.Commit(txn);
+  delete txn;
+
+  // a commit whose COMMIT record never gets durable is never seen
+  log_manager.RunFlushThread();
+  Transaction *writer = txn_mgr.Begin();
+  EXPECT_TRUE(table->UpdateTuple(make_tuple(2), rid, writer));
+  EXPECT_THROW(txn_mgr.Commit(writer), Exception);
+  delete writer;
+  Transaction *reader = txn_mgr.Begin(true);
+  Tuple tuple;
+  EXPECT_TRUE(table->GetTuple(rid, tuple, reader));
+  EXPECT_EQ(1, tuple.GetValue(schema, 0).GetAs<int64_t>());
+  txn_mgr.Commit(reader);
+  delete reader;
+
+  log_manager.StopFlushThread();
+  delete table;
+  delete schema;
+  remove("test.db");
+}
+
+} // namespace cmudb
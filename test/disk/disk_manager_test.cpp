@@ -0,0 +1,183 @@
+/**
+ * disk_manager_test.cpp
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "disk/disk_manager.h"
+#include "gtest/gtest.h"
+
+namespace cmudb {
+
+TEST(DiskManagerTest, LogSegmentTest) {
+  remove("test.log");
+  std::vector<char> log(3 * LOG_SEGMENT_SIZE + 100);
+  for (size_t i = 0; i < log.size(); i++) {
+    log[i] = static_cast<char>(i % 251);
+  }
+
+  DiskManager *disk_manager = new DiskManager("test.db");
+  // odd sized writes, some of them cross a segment boundary
+  int written = 0;
+  while (written < static_cast<int>(log.size())) {
+    int size = std::min(LOG_BUFFER_SIZE - 7, static_cast<int>(log.size()) - written);
+    disk_manager->WriteLog(log.data() + written, size);
+    written += size;
+  }
+  EXPECT_EQ(written, disk_manager->GetLogSize());
+
+  // reads are not bounded by segments
+  std::vector<char> buffer(200);
+  EXPECT_TRUE(disk_manager->ReadLog(buffer.data(), 200, LOG_SEGMENT_SIZE - 100));
+  EXPECT_EQ(0, memcmp(buffer.data(), log.data() + LOG_SEGMENT_SIZE - 100, 200));
+  EXPECT_FALSE(disk_manager->ReadLog(buffer.data(), 200, written));
+  delete disk_manager;
+
+  // segments are found again after a restart
+  disk_manager = new DiskManager("test.db");
+  EXPECT_EQ(written, disk_manager->GetLogSize());
+  disk_manager->WriteLog(log.data(), 100);
+  EXPECT_EQ(written + 100, disk_manager->GetLogSize());
+
+  // only whole segments before the offset are dropped
+  disk_manager->TruncateLog(2 * LOG_SEGMENT_SIZE + 1);
+  EXPECT_FALSE(disk_manager->ReadLog(buffer.data(), 200, 0));
+  EXPECT_FALSE(disk_manager->ReadLog(buffer.data(), 200, LOG_SEGMENT_SIZE));
+  EXPECT_TRUE(disk_manager->ReadLog(buffer.data(), 200, 2 * LOG_SEGMENT_SIZE));
+  EXPECT_EQ(0, memcmp(buffer.data(), log.data() + 2 * LOG_SEGMENT_SIZE, 200));
+  EXPECT_EQ(nullptr, fopen("test.log", "r"));
+  // the segment being written is kept
+  disk_manager->TruncateLog(written + 100);
+  EXPECT_TRUE(disk_manager->ReadLog(buffer.data(), 200, 3 * LOG_SEGMENT_SIZE));
+  EXPECT_EQ(0, memcmp(buffer.data(), log.data() + 3 * LOG_SEGMENT_SIZE, 100));
+  delete disk_manager;
+
+  for (int segment = 0; segment <= 3; segment++) {
+    remove(segment == 0 ? "test.log"
+                        : ("test.log." + std::to_string(segment)).c_str());
+  }
+  remove("test.db");
+}
+
+TEST(DiskManagerTest, GatherWriteLogTest) {
+  remove("test.log");
+  std::vector<char> log(2 * LOG_SEGMENT_SIZE + 100);
+  for (size_t i = 0; i < log.size(); i++) {
+    log[i] = static_cast<char>(i % 251);
+  }
+
+  // odd sized pieces in one write, crossing both segment boundaries
+  DiskManager *disk_manager = new DiskManager("test.db");
+  std::vector<struct iovec> iov;
+  for (size_t pos = 0; pos < log.size(); pos += LOG_BUFFER_SIZE - 7) {
+    struct iovec piece;
+    piece.iov_base = log.data() + pos;
+    piece.iov_len = std::min<size_t>(LOG_BUFFER_SIZE - 7, log.size() - pos);
+    iov.push_back(piece);
+  }
+  disk_manager->WriteLog(iov.data(), iov.size());
+  EXPECT_EQ(1, disk_manager->GetNumFlushes());
+  EXPECT_EQ(static_cast<int>(log.size()), disk_manager->GetLogSize());
+
+  std::vector<char> buffer(log.size());
+  EXPECT_TRUE(disk_manager->ReadLog(buffer.data(), log.size(), 0));
+  EXPECT_EQ(0, memcmp(buffer.data(), log.data(), log.size()));
+  delete disk_manager;
+
+  remove("test.log");
+  remove("test.log.1");
+  remove("test.log.2");
+  remove("test.db");
+}
+
+TEST(DiskManagerTest, LogTailTest) {
+  remove("test_1.log");
+  std::vector<char> log(2 * LOG_SEGMENT_SIZE + 100);
+  for (size_t i = 0; i < log.size(); i++) {
+    log[i] = static_cast<char>(i % 251);
+  }
+
+  // an extra log stream has its own log file
+  DiskManager *primary = new DiskManager("test.db");
+  DiskManager *disk_manager = primary->OpenLogStream(1);
+  disk_manager->WriteLog(log.data(), log.size());
+  EXPECT_EQ(static_cast<int>(log.size()), disk_manager->GetLogSize());
+  EXPECT_EQ(0, primary->GetLogSize());
+
+  // the segments after the cut are deleted, appending goes on at the cut
+  disk_manager->TruncateLogTail(LOG_SEGMENT_SIZE + 10);
+  EXPECT_EQ(LOG_SEGMENT_SIZE + 10, disk_manager->GetLogSize());
+  EXPECT_EQ(nullptr, fopen("test_1.log.2", "r"));
+  disk_manager->WriteLog(log.data(), 100);
+  delete disk_manager;
+
+  disk_manager = primary->OpenLogStream(1);
+  EXPECT_EQ(LOG_SEGMENT_SIZE + 110, disk_manager->GetLogSize());
+  std::vector<char> buffer(110);
+  EXPECT_TRUE(disk_manager->ReadLog(buffer.data(), 110, LOG_SEGMENT_SIZE));
+  EXPECT_EQ(0, memcmp(buffer.data(), log.data() + LOG_SEGMENT_SIZE, 10));
+  EXPECT_EQ(0, memcmp(buffer.data() + 10, log.data(), 100));
+  delete disk_manager;
+  delete primary;
+
+  remove("test_1.log");
+  remove("test_1.log.1");
+  remove("test.log");
+  remove("test.db");
+}
+
+TEST(DiskManagerTest, LargeLogOffsetTest) {
+  // a log that has been written past 2 GiB, old segments long dropped
+  const int segment = 6000;
+  const log_offset_t start =
+      static_cast<log_offset_t>(segment) * LOG_SEGMENT_SIZE;
+  ASSERT_GT(start, static_cast<log_offset_t>(INT32_MAX));
+  std::string segment_name = "test.log." + std::to_string(segment);
+  fclose(fopen(segment_name.c_str(), "w"));
+
+  DiskManager *disk_manager = new DiskManager("test.db");
+  EXPECT_EQ(start, disk_manager->GetLogSize());
+  std::vector<char> log(LOG_SEGMENT_SIZE + 100);
+  for (size_t i = 0; i < log.size(); i++) {
+    log[i] = static_cast<char>(i % 251);
+  }
+  disk_manager->WriteLog(log.data(), log.size());
+  EXPECT_EQ(start + static_cast<log_offset_t>(log.size()),
+            disk_manager->GetLogSize());
+  std::vector<char> buffer(200);
+  EXPECT_TRUE(disk_manager->ReadLog(buffer.data(), 200,
+                                    start + LOG_SEGMENT_SIZE - 100));
+  EXPECT_EQ(0,
+            memcmp(buffer.data(), log.data() + LOG_SEGMENT_SIZE - 100, 200));
+  disk_manager->TruncateLog(start + LOG_SEGMENT_SIZE);
+  EXPECT_FALSE(disk_manager->ReadLog(buffer.data(), 200, start));
+
+  // the master record keeps the whole offset
+  disk_manager->WriteMasterRecord(start + 10);
+  log_offset_t checkpoint_offset;
+  EXPECT_TRUE(disk_manager->ReadMasterRecord(checkpoint_offset));
+  EXPECT_EQ(start + 10, checkpoint_offset);
+  delete disk_manager;
+
+  // master records of older databases hold an int
+  FILE *master = fopen("test.master", "w");
+  int32_t old_offset = 12345;
+  fwrite(&old_offset, sizeof(old_offset), 1, master);
+  fclose(master);
+  disk_manager = new DiskManager("test.db");
+  EXPECT_TRUE(disk_manager->ReadMasterRecord(checkpoint_offset));
+  EXPECT_EQ(12345, checkpoint_offset);
+  delete disk_manager;
+
+  remove(segment_name.c_str());
+  remove(("test.log." + std::to_string(segment + 1)).c_str());
+  remove("test.master");
+  remove("test.db");
+}
+
+} // namespace cmudb
@@ -0,0 +1,104 @@
+/**
+ * latency_disk_manager_test.cpp
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include "buffer/buffer_pool_manager.h"
+#include "disk/latency_disk_manager.h"
+#include "gtest/gtest.h"
+
+namespace cmudb {
+
+TEST(LatencyDiskManagerTest, InMemoryTest) {
+  DiskLatencyConfig config;
+  LatencyDiskManager disk_manager(config);
+
+  char data[PAGE_SIZE];
+  char buffer[PAGE_SIZE];
+  std::strcpy(data, "A test string.");
+
+  // never written page reads as zeros
+  disk_manager.ReadPage(3, buffer);
+  EXPECT_EQ(0, buffer[0]);
+
+  disk_manager.WritePage(3, data);
+  disk_manager.ReadPage(3, buffer);
+  EXPECT_EQ(0, std::strcmp(buffer, data));
+
+  // log is appended, reads beyond the end fail
+  EXPECT_FALSE(disk_manager.ReadLog(buffer, 10, 0));
+  disk_manager.WriteLog(data, 15);
+  disk_manager.WriteLog(data, 15);
+  EXPECT_EQ(2, disk_manager.GetNumFlushes());
+  EXPECT_TRUE(disk_manager.ReadLog(buffer, 20, 15));
+  EXPECT_EQ(0, std::strcmp(buffer, data));
+  EXPECT_FALSE(disk_manager.ReadLog(buffer, 10, 30));
+}
+
+TEST(LatencyDiskManagerTest, LatencyAndBandwidthTest) {
+  DiskLatencyConfig config;
+  config.write_page = IoLatency(std::chrono::milliseconds(2));
+  config.read_page = IoLatency(std::chrono::milliseconds(1),
+                               LatencyDistribution::UNIFORM,
+                               std::chrono::microseconds(500));
+  LatencyDiskManager disk_manager(config);
+
+  char data[PAGE_SIZE] = {0};
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 5; i++) {
+    disk_manager.WritePage(i, data);
+    disk_manager.ReadPage(i, data);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  // 5 * (2ms + at least 0.5ms)
+  EXPECT_GE(elapsed, std::chrono::microseconds(12500));
+  EXPECT_EQ(10, disk_manager.GetNumIOs());
+
+  // 10 pages through a device capped at 100 pages per second
+  DiskLatencyConfig throttled;
+  throttled.bandwidth = PAGE_SIZE * 100;
+  LatencyDiskManager slow_disk(throttled);
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 10; i++) {
+    slow_disk.WritePage(i, data);
+  }
+  elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_GE(elapsed, std::chrono::milliseconds(100));
+}
+
+TEST(LatencyDiskManagerTest, DecorateBufferPoolTest) {
+  DiskManager *disk_manager = new DiskManager("test.db");
+  DiskLatencyConfig config;
+  config.read_page = IoLatency(std::chrono::microseconds(100),
+                               LatencyDistribution::EXPONENTIAL);
+  config.write_page = IoLatency(std::chrono::microseconds(100),
+                                LatencyDistribution::EXPONENTIAL);
+  LatencyDiskManager slow_disk(disk_manager, config);
+  BufferPoolManager bpm(2, &slow_disk);
+
+  page_id_t page_id;
+  auto page_zero = bpm.NewPage(page_id);
+  ASSERT_NE(nullptr, page_zero);
+  std::strcpy(page_zero->GetData(), "Hello");
+  EXPECT_TRUE(bpm.UnpinPage(page_id, true));
+
+  // evict page zero, clean pages would be evicted first
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_NE(nullptr, bpm.NewPage(page_id));
+    EXPECT_TRUE(bpm.UnpinPage(page_id, true));
+  }
+  page_zero = bpm.FetchPage(0);
+  ASSERT_NE(nullptr, page_zero);
+  EXPECT_EQ(0, std::strcmp(page_zero->GetData(), "Hello"));
+  EXPECT_TRUE(bpm.UnpinPage(0, false));
+  EXPECT_GT(slow_disk.GetNumIOs(), 0);
+
+  delete disk_manager;
+  remove("test.db");
+  remove("test.log");
+}
+
+} // namespace cmudb
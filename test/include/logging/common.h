@@ -7,9 +7,12 @@
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <string>
 #include <sys/time.h>
 
 #include "table/tuple.h"
+#include "vtable/virtual_table.h"
+#include "gtest/gtest.h"
 
 namespace cmudb {
 
@@ -60,4 +63,40 @@ Tuple ConstructTuple(Schema *schema) {
   return Tuple(values, schema);
 }
 
+// storage engine on test.db for a test, its files are removed before and
+// after it. Start() again is a crash and restart: what isn't flushed is lost
+class StorageEngineTest : public ::testing::Test {
+protected:
+  void SetUp() override { RemoveFiles(); }
+
+  void TearDown() override {
+    delete storage_engine_;
+    storage_engine_ = nullptr;
+    RemoveFiles();
+  }
+
+  StorageEngine *Start() {
+    delete storage_engine_;
+    storage_engine_ = new StorageEngine("test.db");
+    return storage_engine_;
+  }
+
+  // database, master record and the segments of every log stream
+  static void RemoveFiles() {
+    remove("test.db");
+    remove("test.master");
+    for (int stream = 0; stream < 4; stream++) {
+      std::string log_name =
+          stream == 0 ? "test.log" : "test_" + std::to_string(stream) + ".log";
+      for (int segment = 0; segment < 4; segment++) {
+        remove(segment == 0
+                   ? log_name.c_str()
+                   : (log_name + "." + std::to_string(segment)).c_str());
+      }
+    }
+  }
+
+  StorageEngine *storage_engine_ = nullptr;
+};
+
 } // namespace cmudb
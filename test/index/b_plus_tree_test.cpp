@@ -6,10 +6,14 @@
 #include <cstdio>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 #include "buffer/buffer_pool_manager.h"
 #include "common/logger.h"
+#include "concurrency/transaction_manager.h"
 #include "index/b_plus_tree.h"
+#include "logging/log_recovery.h"
+#include "page/header_page.h"
 #include "vtable/virtual_table.h"
 #include "gtest/gtest.h"
 
@@ -390,4 +394,215 @@ TEST(BPlusTreeTests, ScaleTest) {
   remove("test.db");
   remove("test.log");
 }
+TEST(BPlusTreeTests, RecoveryTest) {
+  Schema *key_schema = ParseCreateStatement("a bigint");
+  GenericComparator<8> comparator(key_schema);
+
+  DiskManager *disk_manager = new DiskManager("test.db");
+  LogManager *log_manager = new LogManager(disk_manager);
+  BufferPoolManager *bpm = new BufferPoolManager(50, disk_manager, log_manager);
+  page_id_t page_id;
+  bpm->NewPage(page_id);
+  bpm->UnpinPage(HEADER_PAGE_ID, true);
+  log_manager->RunFlushThread();
+
+  // enough keys for splits, then enough removes for merges
+  BPlusTree<GenericKey<8>, RID, GenericComparator<8>> tree("foo_pk", bpm,
+                                                           comparator);
+  GenericKey<8> index_key;
+  RID rid;
+  const int64_t num_keys = 300;
+  for (int64_t key = 1; key <= num_keys; key++) {
+    rid.Set(0, key);
+    index_key.SetFromInteger(key);
+    EXPECT_TRUE(tree.Insert(index_key, rid));
+  }
+  for (int64_t key = 1; key <= num_keys; key += 3) {
+    index_key.SetFromInteger(key);
+    tree.Remove(index_key);
+  }
+
+  // crash, no index page reaches the disk
+  log_manager->StopFlushThread();
+  delete bpm;
+  delete log_manager;
+  delete disk_manager;
+
+  disk_manager = new DiskManager("test.db");
+  bpm = new BufferPoolManager(50, disk_manager);
+  LogRecovery log_recovery(disk_manager, bpm);
+  log_recovery.Redo();
+  log_recovery.Undo();
+
+  auto header_page = static_cast<HeaderPage *>(bpm->FetchPage(HEADER_PAGE_ID));
+  page_id_t root_page_id;
+  EXPECT_TRUE(header_page->GetRootId("foo_pk", root_page_id));
+  bpm->UnpinPage(HEADER_PAGE_ID, false);
+  BPlusTree<GenericKey<8>, RID, GenericComparator<8>> recovered_tree(
+      "foo_pk", bpm, comparator, root_page_id);
+  std::vector<RID> rids;
+  for (int64_t key = 1; key <= num_keys; key++) {
+    rids.clear();
+    index_key.SetFromInteger(key);
+    recovered_tree.GetValue(index_key, rids);
+    if (key % 3 == 1) {
+      EXPECT_EQ(0, rids.size());
+    } else {
+      ASSERT_EQ(1, rids.size());
+      EXPECT_EQ(key, rids[0].GetSlotNum());
+    }
+  }
+
+  delete key_schema;
+  delete bpm;
+  delete disk_manager;
+  remove("test.db");
+  remove("test.log");
+}
+
+TEST(BPlusTreeTests, LoserRecoveryTest) {
+  Schema *key_schema = ParseCreateStatement("a bigint");
+  GenericComparator<8> comparator(key_schema);
+
+  // BUFFER_POOL_SIZE frames: tree pages are written back as the tree grows
+  StorageEngine *storage_engine = new StorageEngine("test.db");
+  BufferPoolManager *bpm = storage_engine->buffer_pool_manager_;
+  page_id_t page_id;
+  bpm->NewPage(page_id);
+  bpm->UnpinPage(HEADER_PAGE_ID, true);
+  storage_engine->log_manager_->RunFlushThread();
+
+  BPlusTree<GenericKey<8>, RID, GenericComparator<8>> tree("foo_pk", bpm,
+                                                           comparator);
+  GenericKey<8> index_key;
+  RID rid;
+  const int64_t num_keys = 200;
+  Transaction *txn = storage_engine->transaction_manager_->Begin();
+  for (int64_t key = 1; key <= num_keys; key++) {
+    rid.Set(0, key);
+    index_key.SetFromInteger(key);
+    EXPECT_TRUE(tree.Insert(index_key, rid, txn));
+  }
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+
+  // the loser adds as many keys and removes half of the committed ones
+  Transaction *loser = storage_engine->transaction_manager_->Begin();
+  for (int64_t key = num_keys + 1; key <= 2 * num_keys; key++) {
+    rid.Set(0, key);
+    index_key.SetFromInteger(key);
+    EXPECT_TRUE(tree.Insert(index_key, rid, loser));
+  }
+  for (int64_t key = 1; key <= num_keys; key += 2) {
+    index_key.SetFromInteger(key);
+    tree.Remove(index_key, loser);
+  }
+
+  // crash, the loser never commits
+  storage_engine->log_manager_->StopFlushThread();
+  delete loser;
+  delete storage_engine;
+
+  storage_engine = new StorageEngine("test.db");
+  bpm = storage_engine->buffer_pool_manager_;
+  LogRecovery log_recovery(storage_engine->disk_manager_, bpm);
+  log_recovery.Redo();
+  log_recovery.Undo();
+
+  auto header_page = static_cast<HeaderPage *>(bpm->FetchPage(HEADER_PAGE_ID));
+  page_id_t root_page_id;
+  EXPECT_TRUE(header_page->GetRootId("foo_pk", root_page_id));
+  bpm->UnpinPage(HEADER_PAGE_ID, false);
+  BPlusTree<GenericKey<8>, RID, GenericComparator<8>> recovered_tree(
+      "foo_pk", bpm, comparator, root_page_id);
+  std::vector<RID> rids;
+  for (int64_t key = 1; key <= 2 * num_keys; key++) {
+    rids.clear();
+    index_key.SetFromInteger(key);
+    recovered_tree.GetValue(index_key, rids);
+    if (key > num_keys) {
+      EXPECT_EQ(0, rids.size());
+    } else {
+      ASSERT_EQ(1, rids.size());
+      EXPECT_EQ(key, rids[0].GetSlotNum());
+    }
+  }
+
+  delete key_schema;
+  delete storage_engine;
+  remove("test.db");
+  remove("test.log");
+}
+
+TEST(BPlusTreeTests, KeyRangeLockTest) {
+  Schema *key_schema = ParseCreateStatement("a bigint");
+  GenericComparator<8> comparator(key_schema);
+
+  DiskManager *disk_manager = new DiskManager("test.db");
+  BufferPoolManager *bpm = new BufferPoolManager(50, disk_manager);
+  page_id_t page_id;
+  bpm->NewPage(page_id);
+  bpm->UnpinPage(HEADER_PAGE_ID, true);
+  LockManager lock_mgr{true};
+  TransactionManager txn_mgr{&lock_mgr};
+  BPlusTree<GenericKey<8>, RID, GenericComparator<8>> tree(
+      "foo_pk", bpm, comparator, INVALID_PAGE_ID, &lock_mgr);
+  auto make_key = [](int64_t key) {
+    GenericKey<8> index_key;
+    index_key.SetFromInteger(key);
+    return index_key;
+  };
+
+  Transaction *loader = txn_mgr.Begin();
+  for (int64_t key = 10; key <= 50; key += 10) {
+    EXPECT_TRUE(tree.Insert(make_key(key), RID(0, key), loader));
+  }
+  txn_mgr.Commit(loader);
+  delete loader;
+
+  Transaction *writer = txn_mgr.Begin();
+  Transaction *scanner = txn_mgr.Begin();
+  Transaction *young = txn_mgr.Begin();
+  std::vector<RID> rids;
+  EXPECT_TRUE(tree.GetRange(make_key(20), make_key(30), rids, scanner));
+  ASSERT_EQ(2, rids.size());
+  EXPECT_EQ(20, rids[0].GetSlotNum());
+  EXPECT_EQ(30, rids[1].GetSlotNum());
+
+  // inserts past the range go on
+  EXPECT_TRUE(tree.Insert(make_key(60), RID(0, 60), writer));
+  EXPECT_TRUE(tree.Insert(make_key(5), RID(0, 5), writer));
+
+  // a phantom waits for the scan to end, or dies (wait-die)
+  EXPECT_FALSE(tree.Insert(make_key(35), RID(0, 35), young));
+  EXPECT_EQ(TransactionState::ABORTED, young->GetState());
+  std::atomic<bool> inserted{false};
+  std::thread phantom([&] {
+    EXPECT_TRUE(tree.Insert(make_key(25), RID(0, 25), writer));
+    inserted = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_FALSE(inserted);
+  rids.clear();
+  EXPECT_TRUE(tree.GetRange(make_key(20), make_key(30), rids, scanner));
+  EXPECT_EQ(2, rids.size());
+  txn_mgr.Commit(scanner);
+  phantom.join();
+  EXPECT_TRUE(inserted);
+  txn_mgr.Commit(writer);
+  txn_mgr.Abort(young);
+
+  rids.clear();
+  EXPECT_TRUE(tree.GetRange(make_key(20), make_key(30), rids));
+  EXPECT_EQ(3, rids.size());
+  delete writer;
+  delete scanner;
+  delete young;
+  delete key_schema;
+  delete bpm;
+  delete disk_manager;
+  remove("test.db");
+  remove("test.log");
+}
+
 } // namespace cmudb
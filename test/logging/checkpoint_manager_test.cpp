@@ -0,0 +1,87 @@
+/**
+ * checkpoint_manager_test.cpp
+ */
+
+#include <cstdio>
+
+#include "logging/common.h"
+#include "logging/log_recovery.h"
+#include "vtable/virtual_table.h"
+#include "gtest/gtest.h"
+
+namespace cmudb {
+
+class CheckpointManagerTest : public StorageEngineTest {};
+
+TEST_F(CheckpointManagerTest, RecoverFromCheckpointTest) {
+  StorageEngine *storage_engine = Start();
+  storage_engine->log_manager_->RunFlushThread();
+  Schema *schema = ParseCreateStatement("a bigint");
+
+  // committed and already on disk before the checkpoint
+  Transaction *txn = storage_engine->transaction_manager_->Begin();
+  TableHeap *test_table = new TableHeap(storage_engine->buffer_pool_manager_,
+                                        storage_engine->lock_manager_,
+                                        storage_engine->log_manager_, txn);
+  page_id_t first_page_id = test_table->GetFirstPageId();
+  std::vector<RID> flushed_rids(10);
+  for (auto &rid : flushed_rids) {
+    EXPECT_TRUE(test_table->InsertTuple(ConstructTuple(schema), rid, txn));
+  }
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+  EXPECT_TRUE(storage_engine->buffer_pool_manager_->FlushPage(first_page_id));
+
+  // running during the checkpoint, never commits
+  Transaction *loser = storage_engine->transaction_manager_->Begin();
+  RID loser_rid;
+  EXPECT_TRUE(test_table->InsertTuple(ConstructTuple(schema), loser_rid, loser));
+
+  lsn_t checkpoint_lsn = storage_engine->checkpoint_manager_->Checkpoint();
+  EXPECT_NE(INVALID_LSN, checkpoint_lsn);
+  // the log before the loser's BEGIN is not needed any more
+  EXPECT_GT(storage_engine->checkpoint_manager_->GetTruncateOffset(), 0);
+  log_offset_t checkpoint_offset;
+  EXPECT_TRUE(storage_engine->disk_manager_->ReadMasterRecord(checkpoint_offset));
+  EXPECT_GE(checkpoint_offset,
+            storage_engine->checkpoint_manager_->GetTruncateOffset());
+
+  // committed after the checkpoint
+  txn = storage_engine->transaction_manager_->Begin();
+  RID winner_rid;
+  EXPECT_TRUE(test_table->InsertTuple(ConstructTuple(schema), winner_rid, txn));
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+  delete test_table;
+
+  // crash, dirty pages are lost
+  storage_engine->log_manager_->StopFlushThread();
+  delete loser;
+
+  storage_engine = Start();
+  LogRecovery log_recovery(storage_engine->disk_manager_,
+                           storage_engine->buffer_pool_manager_,
+                           storage_engine->log_manager_);
+  log_recovery.Redo();
+  log_recovery.Undo();
+  // new log records continue after the old ones
+  EXPECT_GT(storage_engine->log_manager_->GetNextLSN(), checkpoint_lsn);
+
+  txn = storage_engine->transaction_manager_->Begin();
+  test_table = new TableHeap(storage_engine->buffer_pool_manager_,
+                             storage_engine->lock_manager_,
+                             storage_engine->log_manager_, first_page_id);
+  Tuple tuple;
+  for (auto &rid : flushed_rids) {
+    EXPECT_TRUE(test_table->GetTuple(rid, tuple, txn));
+  }
+  EXPECT_TRUE(test_table->GetTuple(winner_rid, tuple, txn));
+  EXPECT_FALSE(test_table->GetTuple(loser_rid, tuple, txn));
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+  delete test_table;
+
+  delete schema;
+}
+
+} // namespace cmudb
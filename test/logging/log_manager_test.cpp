@@ -1,16 +1,22 @@
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
 
 #include "logging/common.h"
+#include "logging/log_compression.h"
 #include "logging/log_recovery.h"
 #include "vtable/virtual_table.h"
 #include "gtest/gtest.h"
 
 namespace cmudb {
 
-TEST(LogManagerTest, BasicLogging) {
-  StorageEngine *storage_engine = new StorageEngine("test.db");
+class LogManagerTest : public StorageEngineTest {};
+
+TEST_F(LogManagerTest, BasicLogging) {
+  StorageEngine *storage_engine = Start();
 
   EXPECT_FALSE(ENABLE_LOGGING);
   LOG_DEBUG("Skip system recovering...");
@@ -51,15 +57,526 @@ TEST(LogManagerTest, BasicLogging) {
   LOG_DEBUG("size  = %d", size);
 
   delete txn;
-  delete storage_engine;
   LOG_DEBUG("Teared down the system");
-  remove("test.db");
-  remove("test.log");
 }
 
-// actually LogRecovery
-TEST(LogManagerTest, RedoTestWithOneTxn) {
-  StorageEngine *storage_engine = new StorageEngine("test.db");
+TEST_F(LogManagerTest, GroupCommitTest) {
+  StorageEngine *storage_engine = Start();
+  storage_engine->log_manager_->RunFlushThread();
+  EXPECT_TRUE(ENABLE_LOGGING);
+
+  const int num_threads = 8;
+  const int num_txns = 50;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; i++) {
+    threads.emplace_back([&] {
+      for (int j = 0; j < num_txns; j++) {
+        Transaction *txn = storage_engine->transaction_manager_->Begin();
+        storage_engine->transaction_manager_->Commit(txn);
+        // commit returns only after its commit record is durable
+        EXPECT_GE(storage_engine->log_manager_->GetPersistentLSN(),
+                  txn->GetPrevLSN());
+        delete txn;
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  // concurrent commits share flushes
+  EXPECT_LT(storage_engine->disk_manager_->GetNumFlushes(),
+            num_threads * num_txns);
+
+  storage_engine->log_manager_->StopFlushThread();
+  EXPECT_FALSE(ENABLE_LOGGING);
+}
+
+TEST_F(LogManagerTest, LoneCommitTest) {
+  StorageEngine *storage_engine = Start();
+  auto group_commit_timeout = GROUP_COMMIT_TIMEOUT;
+  GROUP_COMMIT_TIMEOUT = std::chrono::seconds(2);
+  storage_engine->log_manager_->RunFlushThread();
+
+  // nobody to share the flush with, the commit does not linger
+  auto start = std::chrono::steady_clock::now();
+  Transaction *txn = storage_engine->transaction_manager_->Begin();
+  storage_engine->transaction_manager_->Commit(txn);
+  EXPECT_GE(storage_engine->log_manager_->GetPersistentLSN(), txn->GetPrevLSN());
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+  delete txn;
+
+  storage_engine->log_manager_->StopFlushThread();
+  GROUP_COMMIT_TIMEOUT = group_commit_timeout;
+}
+
+// log device that fails every write
+class FailingDiskManager : public DiskManager {
+public:
+  using DiskManager::WriteLog;
+  bool WriteLog(const struct iovec *, int) override { return false; }
+};
+
+TEST_F(LogManagerTest, FailedWriteTest) {
+  FailingDiskManager disk_manager;
+  LogManager log_manager(&disk_manager);
+  LockManager lock_manager(false);
+  TransactionManager transaction_manager(&lock_manager, &log_manager);
+  log_manager.RunFlushThread();
+
+  // a commit whose log can't be written fails instead of returning
+  Transaction *txn = transaction_manager.Begin();
+  EXPECT_THROW(transaction_manager.Commit(txn), Exception);
+  EXPECT_EQ(INVALID_LSN, log_manager.GetPersistentLSN());
+  delete txn;
+
+  // appenders are not stuck behind the lost buffers, nothing gets durable
+  lsn_t lsn = INVALID_LSN;
+  for (int i = 0; i < LOG_BUFFER_COUNT * LOG_BUFFER_SIZE / 20; i++) {
+    LogRecord log(0, INVALID_LSN, LogRecordType::BEGIN);
+    lsn = log_manager.AppendLogRecord(log);
+  }
+  EXPECT_FALSE(log_manager.WaitUntilPersistent(lsn));
+  EXPECT_EQ(INVALID_LSN, log_manager.GetPersistentLSN());
+
+  log_manager.StopFlushThread();
+}
+
+TEST_F(LogManagerTest, AsyncCommitTest) {
+  StorageEngine *storage_engine = Start();
+  auto log_timeout = LOG_TIMEOUT;
+  auto window = ASYNC_COMMIT_WINDOW;
+  // only the async commit window may trigger a flush
+  LOG_TIMEOUT = std::chrono::seconds(100);
+  ASYNC_COMMIT_WINDOW = std::chrono::milliseconds(50);
+  storage_engine->log_manager_->RunFlushThread();
+
+  storage_engine->transaction_manager_->SetAsyncCommit(true);
+  Transaction *txn = storage_engine->transaction_manager_->Begin();
+  EXPECT_TRUE(txn->IsAsyncCommit());
+  auto start = std::chrono::steady_clock::now();
+  storage_engine->transaction_manager_->Commit(txn);
+  // commit does not wait for the flush
+  EXPECT_LT(storage_engine->log_manager_->GetPersistentLSN(), txn->GetPrevLSN());
+  // but it is durable once the window is over
+  while (storage_engine->log_manager_->GetPersistentLSN() < txn->GetPrevLSN() &&
+         std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  EXPECT_GE(storage_engine->log_manager_->GetPersistentLSN(), txn->GetPrevLSN());
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(40));
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+  delete txn;
+
+  // synchronous commits still wait
+  storage_engine->transaction_manager_->SetAsyncCommit(false);
+  txn = storage_engine->transaction_manager_->Begin();
+  EXPECT_FALSE(txn->IsAsyncCommit());
+  storage_engine->transaction_manager_->Commit(txn);
+  EXPECT_GE(storage_engine->log_manager_->GetPersistentLSN(), txn->GetPrevLSN());
+  delete txn;
+
+  storage_engine->log_manager_->StopFlushThread();
+  LOG_TIMEOUT = log_timeout;
+  ASYNC_COMMIT_WINDOW = window;
+}
+
+TEST_F(LogManagerTest, EarlyLockReleaseTest) {
+  StorageEngine *storage_engine = Start();
+  auto log_timeout = LOG_TIMEOUT;
+  auto window = ASYNC_COMMIT_WINDOW;
+  // nothing flushes the log but synchronous commits
+  LOG_TIMEOUT = std::chrono::seconds(100);
+  ASYNC_COMMIT_WINDOW = std::chrono::seconds(100);
+  EARLY_LOCK_RELEASE = true;
+  storage_engine->log_manager_->RunFlushThread();
+  TransactionManager *txn_mgr = storage_engine->transaction_manager_;
+  Schema *schema = ParseCreateStatement("a bigint");
+  auto make_tuple = [&](int64_t a) {
+    return Tuple(std::vector<Value>{Value(TypeId::BIGINT, a)}, schema);
+  };
+
+  Transaction *txn = txn_mgr->Begin();
+  TableHeap *table = new TableHeap(storage_engine->buffer_pool_manager_,
+                                   storage_engine->lock_manager_,
+                                   storage_engine->log_manager_, txn);
+  RID rid;
+  EXPECT_TRUE(table->InsertTuple(make_tuple(1), rid, txn));
+  txn_mgr->Commit(txn);
+  delete txn;
+
+  // the locks of the writer go with its commit record, before it is durable
+  Transaction *writer = txn_mgr->Begin();
+  writer->SetAsyncCommit(true);
+  EXPECT_TRUE(table->UpdateTuple(make_tuple(2), rid, writer));
+  txn_mgr->Commit(writer);
+  lsn_t commit_lsn = writer->GetPrevLSN();
+  EXPECT_LT(storage_engine->log_manager_->GetPersistentLSN(), commit_lsn);
+  EXPECT_TRUE(writer->GetExclusiveLockSet()->empty());
+
+  // a reader of the row does not wait for the flush, its commit does
+  Transaction *reader = txn_mgr->Begin();
+  reader->SetAsyncCommit(false);
+  Tuple tuple;
+  EXPECT_TRUE(table->GetTuple(rid, tuple, reader));
+  EXPECT_EQ(2, tuple.GetValue(schema, 0).GetAs<int64_t>());
+  EXPECT_EQ(commit_lsn, reader->GetDependencyLSN());
+  txn_mgr->Commit(reader);
+  EXPECT_GE(storage_engine->log_manager_->GetPersistentLSN(), commit_lsn);
+  delete writer;
+  delete reader;
+
+  storage_engine->log_manager_->StopFlushThread();
+  EARLY_LOCK_RELEASE = false;
+  LOG_TIMEOUT = log_timeout;
+  ASYNC_COMMIT_WINDOW = window;
+  delete table;
+  delete schema;
+}
+
+TEST_F(LogManagerTest, ConcurrentAppendTest) {
+  StorageEngine *storage_engine = Start();
+  LogManager *log_manager = storage_engine->log_manager_;
+  log_manager->RunFlushThread();
+
+  std::string createStmt = "a bigint, b varchar(16)";
+  Schema *schema = ParseCreateStatement(createStmt);
+  const int num_threads = 8;
+  const int num_records = 200;
+  std::vector<std::vector<lsn_t>> lsns(num_threads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; i++) {
+    threads.emplace_back([&, i] {
+      for (int j = 0; j < num_records; j++) {
+        Tuple tuple = ConstructTuple(schema);
+        LogRecord log(i, INVALID_LSN, LogRecordType::INSERT, RID(i, j),
+                      tuple);
+        lsns[i].push_back(log_manager->AppendLogRecord(log));
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  log_manager->StopFlushThread();
+
+  // every lsn is handed out exactly once
+  std::vector<bool> seen(num_threads * num_records, false);
+  for (auto &thread_lsns : lsns) {
+    for (auto lsn : thread_lsns) {
+      ASSERT_LT(lsn, num_threads * num_records);
+      EXPECT_FALSE(seen[lsn]);
+      seen[lsn] = true;
+    }
+  }
+
+  // records are laid out in lsn order on disk
+  LogRecovery log_recovery(storage_engine->disk_manager_,
+                           storage_engine->buffer_pool_manager_);
+  char *buffer = new char[LOG_BUFFER_SIZE];
+  int offset = 0;
+  lsn_t expected_lsn = 0;
+  while (storage_engine->disk_manager_->ReadLog(buffer, LOG_BUFFER_SIZE,
+                                                offset)) {
+    LogRecord log;
+    int pos = 0;
+    // records may span two blocks
+    while (log_recovery.DeserializeLogRecord(buffer + pos, log,
+                                             LOG_BUFFER_SIZE - pos)) {
+      EXPECT_EQ(expected_lsn++, log.GetLSN());
+      EXPECT_EQ(log.GetTxnId(), log.GetInsertRID().GetPageId());
+      pos += log.GetSize();
+    }
+    ASSERT_GT(pos, 0);
+    offset += pos;
+  }
+  EXPECT_EQ(num_threads * num_records, expected_lsn);
+  // only filled bytes are written, no padding between buffers
+  EXPECT_FALSE(storage_engine->disk_manager_->ReadLog(buffer, 1, offset));
+
+  delete[] buffer;
+  delete schema;
+}
+
+TEST_F(LogManagerTest, UpdateDeltaTest) {
+  StorageEngine *storage_engine = Start();
+  LogRecovery log_recovery(storage_engine->disk_manager_,
+                           storage_engine->buffer_pool_manager_);
+  Schema *schema = ParseCreateStatement(
+      "a integer, b bigint, c varchar(64), d integer, e varchar(64)");
+  std::string pad(40, 'x');
+  std::vector<Value> values{
+      Value(TypeId::INTEGER, 1), Value(TypeId::BIGINT, (int64_t)2),
+      Value(TypeId::VARCHAR, pad), Value(TypeId::INTEGER, 4),
+      Value(TypeId::VARCHAR, pad)};
+  Tuple old_tuple(values, schema);
+
+  // change two integers, size of the tuple does not change
+  values[0] = Value(TypeId::INTEGER, 10);
+  values[3] = Value(TypeId::INTEGER, 40);
+  Tuple new_tuple(values, schema);
+  // change a varchar to a longer one
+  values[2] = Value(TypeId::VARCHAR, pad + "yy");
+  Tuple longer_tuple(values, schema);
+
+  int offset = 0;
+  for (auto *tuple : {&new_tuple, &longer_tuple}) {
+    LogRecord log(0, INVALID_LSN, LogRecordType::UPDATE, RID(0, 0), old_tuple,
+                  *tuple);
+    EXPECT_EQ(LogRecordType::UPDATEDELTA, log.GetLogRecordType());
+    EXPECT_LT(log.GetSize(), old_tuple.GetLength() + tuple->GetLength());
+
+    // round trip through the log buffer, the flush thread is not running
+    storage_engine->log_manager_->AppendLogRecord(log);
+    LogRecord read_back;
+    ASSERT_TRUE(log_recovery.DeserializeLogRecord(
+        storage_engine->log_manager_->GetLogBuffer() + offset, read_back));
+    EXPECT_EQ(log.GetSize(), read_back.GetSize());
+    offset += log.GetSize();
+
+    Tuple redo, undo;
+    ASSERT_TRUE(read_back.ApplyUpdateDelta(old_tuple, redo, false));
+    ASSERT_TRUE(read_back.ApplyUpdateDelta(*tuple, undo, true));
+    ASSERT_EQ(tuple->GetLength(), redo.GetLength());
+    EXPECT_EQ(0, memcmp(tuple->GetData(), redo.GetData(), redo.GetLength()));
+    ASSERT_EQ(old_tuple.GetLength(), undo.GetLength());
+    EXPECT_EQ(0, memcmp(old_tuple.GetData(), undo.GetData(), undo.GetLength()));
+    // wrong image
+    EXPECT_FALSE(read_back.ApplyUpdateDelta(Tuple(), redo, false));
+  }
+
+  // a full rewrite is cheaper as a plain UPDATE
+  LogRecord log(0, INVALID_LSN, LogRecordType::UPDATE, RID(0, 0), old_tuple,
+                Tuple());
+  EXPECT_EQ(LogRecordType::UPDATE, log.GetLogRecordType());
+
+  delete schema;
+}
+
+TEST_F(LogManagerTest, CompactHeaderTest) {
+  StorageEngine *storage_engine = Start();
+  LogRecovery log_recovery(storage_engine->disk_manager_,
+                           storage_engine->buffer_pool_manager_);
+  Schema *schema = ParseCreateStatement("a bigint");
+  Tuple tuple = ConstructTuple(schema);
+
+  // old and new format records side by side, the flush thread is not running
+  std::vector<LogRecord> logs;
+  logs.emplace_back(300, INVALID_LSN, LogRecordType::BEGIN);
+  logs.emplace_back(300, 0, LogRecordType::INSERT, RID(1, 2), tuple);
+  logs.emplace_back(300, 1, LogRecordType::INSERT, RID(1, 3), tuple);
+  logs.emplace_back(7, 200, LogRecordType::COMMIT);
+  logs.emplace_back(7, INVALID_LSN, LogRecordType::BEGIN);
+  for (size_t i = 0; i < logs.size(); i++) {
+    COMPACT_LOG_HEADER = i >= 2;
+    storage_engine->log_manager_->AppendLogRecord(logs[i]);
+  }
+  EXPECT_EQ(20, logs[1].GetHeaderSize());
+  // 2 bytes type/flags, 1 byte size, 4 bytes lsn, 2+1 bytes txn/prevLSN
+  EXPECT_EQ(10, logs[2].GetHeaderSize());
+  EXPECT_EQ(logs[1].GetSize() - 10, logs[2].GetSize());
+  // prevLSN is left out
+  EXPECT_EQ(8, logs[4].GetHeaderSize());
+
+  const char *data = storage_engine->log_manager_->GetLogBuffer();
+  int offset = 0;
+  for (auto &log : logs) {
+    LogRecord read_back;
+    // a record cut short is incomplete
+    EXPECT_FALSE(log_recovery.DeserializeLogRecord(data + offset, read_back,
+                                                   log.GetSize() - 1));
+    ASSERT_TRUE(log_recovery.DeserializeLogRecord(data + offset, read_back,
+                                                  log.GetSize()));
+    EXPECT_EQ(log.GetSize(), read_back.GetSize());
+    EXPECT_EQ(log.GetLSN(), read_back.GetLSN());
+    EXPECT_EQ(log.GetTxnId(), read_back.GetTxnId());
+    EXPECT_EQ(log.GetPrevLSN(), read_back.GetPrevLSN());
+    EXPECT_EQ(log.GetLogRecordType(), read_back.GetLogRecordType());
+    if (log.GetLogRecordType() == LogRecordType::INSERT) {
+      EXPECT_EQ(log.GetInsertRID(), read_back.GetInsertRID());
+      ASSERT_EQ(tuple.GetLength(), read_back.GetInserteTuple().GetLength());
+      EXPECT_EQ(0, memcmp(tuple.GetData(), read_back.GetInserteTuple().GetData(),
+                          tuple.GetLength()));
+    }
+    offset += log.GetSize();
+  }
+
+  delete schema;
+}
+
+TEST_F(LogManagerTest, CompressedLogTest) {
+  // round trip of one block, random bytes do not compress
+  std::vector<char> block(LOG_BUFFER_SIZE);
+  for (size_t i = 0; i < block.size(); i++) {
+    block[i] = static_cast<char>(i % 7 == 0 ? rand() : i / 64);
+  }
+  std::vector<char> frame(LOG_BUFFER_SIZE), decompressed(LOG_BUFFER_SIZE);
+  int frame_size = LogCompression::CompressBlock(block.data(), LOG_BUFFER_SIZE,
+                                                 frame.data());
+  ASSERT_GT(frame_size, 0);
+  EXPECT_TRUE(LogCompression::IsFrame(frame.data(), frame_size));
+  EXPECT_EQ(frame_size, LogCompression::GetFrameSize(frame.data()));
+  int raw_size;
+  ASSERT_TRUE(LogCompression::DecompressBlock(frame.data(), decompressed.data(),
+                                              LOG_BUFFER_SIZE, raw_size));
+  EXPECT_EQ(LOG_BUFFER_SIZE, raw_size);
+  EXPECT_EQ(0, memcmp(block.data(), decompressed.data(), LOG_BUFFER_SIZE));
+  for (auto &byte : block) {
+    byte = static_cast<char>(rand());
+  }
+  EXPECT_EQ(0, LogCompression::CompressBlock(block.data(), LOG_BUFFER_SIZE,
+                                             frame.data()));
+
+  COMPRESS_LOG = true;
+  StorageEngine *storage_engine = Start();
+  storage_engine->log_manager_->RunFlushThread();
+  Schema *schema = ParseCreateStatement("a bigint, b varchar(16)");
+
+  Transaction *txn = storage_engine->transaction_manager_->Begin();
+  TableHeap *test_table = new TableHeap(storage_engine->buffer_pool_manager_,
+                                        storage_engine->lock_manager_,
+                                        storage_engine->log_manager_, txn);
+  page_id_t first_page_id = test_table->GetFirstPageId();
+  const int num_tuples = 100;
+  std::vector<RID> rids(num_tuples);
+  std::vector<Tuple> tuples;
+  int tuple_bytes = 0;
+  for (int i = 0; i < num_tuples; i++) {
+    std::vector<Value> values{Value(TypeId::BIGINT, (int64_t)i),
+                              Value(TypeId::VARCHAR, "bulk insert")};
+    tuples.emplace_back(values, schema);
+    tuple_bytes += tuples[i].GetLength();
+    EXPECT_TRUE(test_table->InsertTuple(tuples[i], rids[i], txn));
+  }
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+  EXPECT_NE(INVALID_LSN, storage_engine->checkpoint_manager_->Checkpoint());
+
+  // the loser's records are flushed (but what its private log still holds),
+  // it never commits
+  Transaction *loser = storage_engine->transaction_manager_->Begin();
+  std::vector<RID> loser_rids(20);
+  for (auto &rid : loser_rids) {
+    EXPECT_TRUE(test_table->InsertTuple(tuples[0], rid, loser));
+  }
+  delete test_table;
+
+  // crash
+  storage_engine->log_manager_->StopFlushThread();
+  // less than the tuple images alone, without the log record around them
+  EXPECT_LT(storage_engine->disk_manager_->GetLogSize(), tuple_bytes);
+  delete loser;
+
+  storage_engine = Start();
+  LogRecovery log_recovery(storage_engine->disk_manager_,
+                           storage_engine->buffer_pool_manager_);
+  log_recovery.Redo();
+  log_recovery.Undo();
+
+  txn = storage_engine->transaction_manager_->Begin();
+  test_table = new TableHeap(storage_engine->buffer_pool_manager_,
+                             storage_engine->lock_manager_,
+                             storage_engine->log_manager_, first_page_id);
+  for (int i = 0; i < num_tuples; i++) {
+    Tuple tuple;
+    ASSERT_TRUE(test_table->GetTuple(rids[i], tuple, txn));
+    ASSERT_EQ(tuples[i].GetLength(), tuple.GetLength());
+    EXPECT_EQ(0, memcmp(tuples[i].GetData(), tuple.GetData(), tuple.GetLength()));
+  }
+  for (auto &rid : loser_rids) {
+    Tuple tuple;
+    EXPECT_FALSE(test_table->GetTuple(rid, tuple, txn));
+  }
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+  delete test_table;
+  COMPRESS_LOG = false;
+
+  delete schema;
+}
+
+TEST_F(LogManagerTest, PrivateTxnLogTest) {
+  PRIVATE_TXN_LOG = true;
+  StorageEngine *storage_engine = Start();
+  storage_engine->log_manager_->RunFlushThread();
+  Schema *schema = ParseCreateStatement("a bigint, b varchar(16)");
+
+  Transaction *txn = storage_engine->transaction_manager_->Begin();
+  TableHeap *test_table = new TableHeap(storage_engine->buffer_pool_manager_,
+                                        storage_engine->lock_manager_,
+                                        storage_engine->log_manager_, txn);
+  page_id_t first_page_id = test_table->GetFirstPageId();
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+
+  // two transactions take turns on the same page, the second one commits
+  // first so its slots are logged before the first one's
+  Transaction *first = storage_engine->transaction_manager_->Begin();
+  Transaction *second = storage_engine->transaction_manager_->Begin();
+  const int num_tuples = 6;
+  std::vector<RID> rids(2 * num_tuples);
+  std::vector<Tuple> tuples;
+  lsn_t next_lsn = storage_engine->log_manager_->GetNextLSN();
+  for (int i = 0; i < 2 * num_tuples; i++) {
+    tuples.push_back(ConstructTuple(schema));
+    EXPECT_TRUE(
+        test_table->InsertTuple(tuples[i], rids[i], i % 2 ? second : first));
+  }
+  EXPECT_TRUE(test_table->MarkDelete(rids[0], first));
+  // a loser whose records never reach the log
+  Transaction *loser = storage_engine->transaction_manager_->Begin();
+  next_lsn++;
+  RID loser_rid;
+  EXPECT_TRUE(test_table->InsertTuple(tuples[0], loser_rid, loser));
+  // kept back in the private logs
+  EXPECT_EQ(next_lsn, storage_engine->log_manager_->GetNextLSN());
+  EXPECT_EQ(first_page_id, rids.back().GetPageId());
+  // and the page can't be written back ahead of them
+  EXPECT_FALSE(storage_engine->buffer_pool_manager_->FlushPage(first_page_id));
+
+  // published with the commit record, in one reservation
+  storage_engine->transaction_manager_->Commit(second);
+  EXPECT_EQ(next_lsn + num_tuples, second->GetPrevLSN());
+  EXPECT_EQ(next_lsn + num_tuples + 1,
+            storage_engine->log_manager_->GetNextLSN());
+  delete second;
+  storage_engine->transaction_manager_->Commit(first);
+  delete first;
+  delete test_table;
+
+  // crash
+  storage_engine->log_manager_->StopFlushThread();
+  delete loser;
+
+  storage_engine = Start();
+  LogRecovery log_recovery(storage_engine->disk_manager_,
+                           storage_engine->buffer_pool_manager_);
+  log_recovery.Redo();
+  log_recovery.Undo();
+
+  txn = storage_engine->transaction_manager_->Begin();
+  test_table = new TableHeap(storage_engine->buffer_pool_manager_,
+                             storage_engine->lock_manager_,
+                             storage_engine->log_manager_, first_page_id);
+  for (int i = 1; i < 2 * num_tuples; i++) {
+    Tuple tuple;
+    ASSERT_TRUE(test_table->GetTuple(rids[i], tuple, txn));
+    ASSERT_EQ(tuples[i].GetLength(), tuple.GetLength());
+    EXPECT_EQ(0, memcmp(tuples[i].GetData(), tuple.GetData(), tuple.GetLength()));
+  }
+  Tuple tuple;
+  EXPECT_FALSE(test_table->GetTuple(rids[0], tuple, txn));
+  EXPECT_FALSE(test_table->GetTuple(loser_rid, tuple, txn));
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+  delete test_table;
+
+  delete schema;
+  PRIVATE_TXN_LOG = false;
+}
+
+TEST_F(LogManagerTest, RedoTestWithOneTxn) {
+  StorageEngine *storage_engine = Start();
 
   EXPECT_FALSE(ENABLE_LOGGING);
   LOG_DEBUG("Skip system recovering...");
@@ -96,10 +613,9 @@ TEST(LogManagerTest, RedoTestWithOneTxn) {
   std::this_thread::sleep_for(std::chrono::seconds(2));
 
   // shutdown System
-  delete storage_engine;
 
   // restart system
-  storage_engine = new StorageEngine("test.db");
+  storage_engine = Start();
   LogRecovery *log_recovery = new LogRecovery(
       storage_engine->disk_manager_, storage_engine->buffer_pool_manager_);
 
@@ -118,10 +634,7 @@ TEST(LogManagerTest, RedoTestWithOneTxn) {
 
   EXPECT_EQ(old_tuple.GetValue(schema, 4).CompareEquals(val), 1);
 
-  delete storage_engine;
   LOG_DEBUG("Teared down the system");
-  remove("test.db");
-  remove("test.log");
 }
 
 } // namespace cmudb
@@ -0,0 +1,342 @@
+/**
+ * log_recovery_test.cpp
+ */
+
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "logging/common.h"
+#include "logging/log_recovery.h"
+#include "vtable/virtual_table.h"
+#include "gtest/gtest.h"
+
+namespace cmudb {
+
+class LogRecoveryTest : public StorageEngineTest {};
+
+TEST_F(LogRecoveryTest, LogStreamsTest) {
+  LOG_STREAMS = 3;
+  StorageEngine *storage_engine = Start();
+  LogManager *log_manager = storage_engine->log_manager_;
+  ASSERT_EQ(3, log_manager->GetStreamCount());
+  log_manager->RunFlushThread();
+  Schema *schema = ParseCreateStatement("a bigint, b varchar(16)");
+
+  Transaction *txn = storage_engine->transaction_manager_->Begin();
+  TableHeap *test_table = new TableHeap(storage_engine->buffer_pool_manager_,
+                                        storage_engine->lock_manager_,
+                                        log_manager, txn);
+  page_id_t first_page_id = test_table->GetFirstPageId();
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+
+  // one transaction per stream, committing concurrently
+  const int num_threads = 3;
+  const int num_tuples = 20;
+  std::vector<std::vector<RID>> rids(num_threads);
+  std::vector<std::vector<Tuple>> tuples(num_threads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; i++) {
+    for (int j = 0; j < num_tuples; j++) {
+      tuples[i].push_back(ConstructTuple(schema));
+    }
+    rids[i].resize(num_tuples);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    threads.emplace_back([&, i] {
+      Transaction *txn = storage_engine->transaction_manager_->Begin();
+      for (int j = 0; j < num_tuples; j++) {
+        EXPECT_TRUE(test_table->InsertTuple(tuples[i][j], rids[i][j], txn));
+      }
+      storage_engine->transaction_manager_->Commit(txn);
+      EXPECT_GE(log_manager->GetPersistentLSN(), txn->GetPrevLSN());
+      delete txn;
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  // a loser whose records reach the log
+  Transaction *loser = storage_engine->transaction_manager_->Begin();
+  RID loser_rid;
+  EXPECT_TRUE(test_table->InsertTuple(tuples[0][0], loser_rid, loser));
+  log_manager->PublishTxnLog(loser);
+  delete test_table;
+
+  // crash
+  log_manager->StopFlushThread();
+  lsn_t next_lsn = log_manager->GetNextLSN();
+  delete loser;
+
+  // each stream holds the records of its transactions in lsn order, and
+  // together they hold every lsn
+  LogRecovery reader(storage_engine->disk_manager_,
+                     storage_engine->buffer_pool_manager_, log_manager);
+  char *buffer = new char[LOG_BUFFER_SIZE];
+  std::vector<bool> seen(next_lsn, false);
+  std::vector<log_offset_t> log_sizes;
+  for (int stream = 0; stream < 3; stream++) {
+    DiskManager *disk_manager = log_manager->GetDiskManager(stream);
+    int offset = 0;
+    lsn_t last_lsn = INVALID_LSN;
+    while (disk_manager->ReadLog(buffer, LOG_BUFFER_SIZE, offset)) {
+      LogRecord log;
+      int pos = 0;
+      while (reader.DeserializeLogRecord(buffer + pos, log,
+                                         LOG_BUFFER_SIZE - pos)) {
+        EXPECT_LT(last_lsn, log.GetLSN());
+        last_lsn = log.GetLSN();
+        ASSERT_LT(log.GetLSN(), next_lsn);
+        seen[log.GetLSN()] = true;
+        EXPECT_EQ(stream, LogManager::GetStreamOf(log.GetTxnId(), 3));
+        pos += log.GetSize();
+      }
+      ASSERT_GT(pos, 0);
+      offset += pos;
+    }
+    EXPECT_NE(INVALID_LSN, last_lsn);
+    log_sizes.push_back(disk_manager->GetLogSize());
+  }
+  EXPECT_EQ(std::vector<bool>(next_lsn, true), seen);
+  delete[] buffer;
+
+  // stream 1 flushed a record that stream 0 or 2 did not get to flush before
+  // it: everything from the missing lsn on is dropped
+  int32_t orphan[5] = {20, next_lsn + 1, 4, INVALID_LSN,
+                       static_cast<int32_t>(LogRecordType::BEGIN)};
+  log_manager->GetDiskManager(1)->WriteLog(reinterpret_cast<char *>(orphan),
+                                           sizeof(orphan));
+
+  storage_engine = Start();
+  log_manager = storage_engine->log_manager_;
+  EXPECT_EQ(log_sizes[1] + static_cast<log_offset_t>(sizeof(orphan)),
+            log_manager->GetDiskManager(1)->GetLogSize());
+  LogRecovery log_recovery(storage_engine->disk_manager_,
+                           storage_engine->buffer_pool_manager_, log_manager);
+  log_recovery.Redo();
+  log_recovery.Undo();
+  for (int stream = 0; stream < 3; stream++) {
+    EXPECT_EQ(log_sizes[stream],
+              log_manager->GetDiskManager(stream)->GetLogSize());
+  }
+  EXPECT_EQ(next_lsn, log_manager->GetNextLSN());
+
+  txn = storage_engine->transaction_manager_->Begin();
+  test_table = new TableHeap(storage_engine->buffer_pool_manager_,
+                             storage_engine->lock_manager_, log_manager,
+                             first_page_id);
+  for (int i = 0; i < num_threads; i++) {
+    for (int j = 0; j < num_tuples; j++) {
+      Tuple tuple;
+      ASSERT_TRUE(test_table->GetTuple(rids[i][j], tuple, txn));
+      ASSERT_EQ(tuples[i][j].GetLength(), tuple.GetLength());
+      EXPECT_EQ(0, memcmp(tuples[i][j].GetData(), tuple.GetData(),
+                          tuple.GetLength()));
+    }
+  }
+  Tuple tuple;
+  EXPECT_FALSE(test_table->GetTuple(loser_rid, tuple, txn));
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+  delete test_table;
+
+  delete schema;
+  LOG_STREAMS = 1;
+}
+
+TEST_F(LogRecoveryTest, ParallelRedoTest) {
+  StorageEngine *storage_engine = Start();
+  storage_engine->log_manager_->RunFlushThread();
+  Schema *schema = ParseCreateStatement("a bigint, b varchar(16)");
+
+  // enough tuples to spread over several table pages
+  Transaction *txn = storage_engine->transaction_manager_->Begin();
+  TableHeap *test_table = new TableHeap(storage_engine->buffer_pool_manager_,
+                                        storage_engine->lock_manager_,
+                                        storage_engine->log_manager_, txn);
+  page_id_t first_page_id = test_table->GetFirstPageId();
+  const int num_tuples = 100;
+  std::vector<RID> rids(num_tuples);
+  std::vector<Tuple> tuples;
+  for (int i = 0; i < num_tuples; i++) {
+    tuples.push_back(ConstructTuple(schema));
+    EXPECT_TRUE(test_table->InsertTuple(tuples[i], rids[i], txn));
+  }
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+
+  txn = storage_engine->transaction_manager_->Begin();
+  for (int i = 0; i < num_tuples; i += 3) {
+    Tuple tuple = ConstructTuple(schema);
+    if (test_table->UpdateTuple(tuple, rids[i], txn)) {
+      tuples[i] = tuple;
+    }
+  }
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+  delete test_table;
+  EXPECT_NE(rids.front().GetPageId(), rids.back().GetPageId());
+
+  // crash, dirty pages are lost
+  storage_engine->log_manager_->StopFlushThread();
+
+  storage_engine = Start();
+  LogRecovery log_recovery(storage_engine->disk_manager_,
+                           storage_engine->buffer_pool_manager_);
+  log_recovery.Redo();
+  log_recovery.Undo();
+
+  txn = storage_engine->transaction_manager_->Begin();
+  test_table = new TableHeap(storage_engine->buffer_pool_manager_,
+                             storage_engine->lock_manager_,
+                             storage_engine->log_manager_, first_page_id);
+  for (int i = 0; i < num_tuples; i++) {
+    Tuple tuple;
+    ASSERT_TRUE(test_table->GetTuple(rids[i], tuple, txn));
+    ASSERT_EQ(tuples[i].GetLength(), tuple.GetLength());
+    EXPECT_EQ(0, memcmp(tuples[i].GetData(), tuple.GetData(), tuple.GetLength()));
+  }
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+  delete test_table;
+
+  delete schema;
+}
+
+TEST_F(LogRecoveryTest, UndoManyPagesTest) {
+  StorageEngine *storage_engine = Start();
+  storage_engine->log_manager_->RunFlushThread();
+  Schema *schema = ParseCreateStatement("a bigint, b varchar(16)");
+
+  Transaction *txn = storage_engine->transaction_manager_->Begin();
+  TableHeap *test_table = new TableHeap(storage_engine->buffer_pool_manager_,
+                                        storage_engine->lock_manager_,
+                                        storage_engine->log_manager_, txn);
+  page_id_t first_page_id = test_table->GetFirstPageId();
+  const int num_tuples = 20;
+  std::vector<RID> rids(num_tuples);
+  std::vector<Tuple> tuples;
+  for (int i = 0; i < num_tuples; i++) {
+    tuples.push_back(ConstructTuple(schema));
+    EXPECT_TRUE(test_table->InsertTuple(tuples[i], rids[i], txn));
+  }
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+
+  // the loser spreads over several pages, none of it may survive recovery
+  Transaction *loser = storage_engine->transaction_manager_->Begin();
+  std::vector<RID> loser_rids(100);
+  for (auto &rid : loser_rids) {
+    EXPECT_TRUE(test_table->InsertTuple(ConstructTuple(schema), rid, loser));
+  }
+  for (size_t i = 0; i < loser_rids.size(); i++) {
+    if (i % 5 == 0) {
+      EXPECT_TRUE(test_table->MarkDelete(loser_rids[i], loser));
+    } else if (i % 2 == 0) {
+      test_table->UpdateTuple(ConstructTuple(schema), loser_rids[i], loser);
+    }
+  }
+  EXPECT_NE(loser_rids.front().GetPageId(), loser_rids.back().GetPageId());
+  delete test_table;
+
+  // crash, the loser's records are flushed but it never commits
+  storage_engine->log_manager_->StopFlushThread();
+  delete loser;
+
+  storage_engine = Start();
+  LogRecovery log_recovery(storage_engine->disk_manager_,
+                           storage_engine->buffer_pool_manager_);
+  log_recovery.Redo();
+  log_recovery.Undo();
+
+  txn = storage_engine->transaction_manager_->Begin();
+  test_table = new TableHeap(storage_engine->buffer_pool_manager_,
+                             storage_engine->lock_manager_,
+                             storage_engine->log_manager_, first_page_id);
+  Tuple tuple;
+  for (int i = 0; i < num_tuples; i++) {
+    ASSERT_TRUE(test_table->GetTuple(rids[i], tuple, txn));
+    ASSERT_EQ(tuples[i].GetLength(), tuple.GetLength());
+    EXPECT_EQ(0, memcmp(tuples[i].GetData(), tuple.GetData(), tuple.GetLength()));
+  }
+  for (auto &rid : loser_rids) {
+    EXPECT_FALSE(test_table->GetTuple(rid, tuple, txn));
+  }
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+  delete test_table;
+
+  delete schema;
+}
+
+TEST_F(LogRecoveryTest, LazyRecoveryTest) {
+  StorageEngine *storage_engine = Start();
+  storage_engine->log_manager_->RunFlushThread();
+  Schema *schema = ParseCreateStatement("a bigint, b varchar(16)");
+
+  Transaction *txn = storage_engine->transaction_manager_->Begin();
+  TableHeap *test_table = new TableHeap(storage_engine->buffer_pool_manager_,
+                                        storage_engine->lock_manager_,
+                                        storage_engine->log_manager_, txn);
+  page_id_t first_page_id = test_table->GetFirstPageId();
+  const int num_tuples = 60;
+  std::vector<RID> rids(num_tuples);
+  std::vector<Tuple> tuples;
+  for (int i = 0; i < num_tuples; i++) {
+    tuples.push_back(ConstructTuple(schema));
+    EXPECT_TRUE(test_table->InsertTuple(tuples[i], rids[i], txn));
+  }
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+
+  Transaction *loser = storage_engine->transaction_manager_->Begin();
+  std::vector<RID> loser_rids(100);
+  for (auto &rid : loser_rids) {
+    EXPECT_TRUE(test_table->InsertTuple(ConstructTuple(schema), rid, loser));
+  }
+  for (size_t i = 0; i < loser_rids.size(); i += 5) {
+    EXPECT_TRUE(test_table->MarkDelete(loser_rids[i], loser));
+  }
+  delete test_table;
+
+  // crash
+  storage_engine->log_manager_->StopFlushThread();
+  delete loser;
+
+  // pages are recovered as they are fetched, the rest in the background
+  storage_engine = Start();
+  LogRecovery *log_recovery = new LogRecovery(
+      storage_engine->disk_manager_, storage_engine->buffer_pool_manager_,
+      storage_engine->log_manager_);
+  log_recovery->StartLazyRecovery();
+  storage_engine->log_manager_->RunFlushThread();
+
+  txn = storage_engine->transaction_manager_->Begin();
+  test_table = new TableHeap(storage_engine->buffer_pool_manager_,
+                             storage_engine->lock_manager_,
+                             storage_engine->log_manager_, first_page_id);
+  Tuple tuple;
+  for (int i = num_tuples - 1; i >= 0; i--) {
+    ASSERT_TRUE(test_table->GetTuple(rids[i], tuple, txn));
+    ASSERT_EQ(tuples[i].GetLength(), tuple.GetLength());
+    EXPECT_EQ(0, memcmp(tuples[i].GetData(), tuple.GetData(), tuple.GetLength()));
+  }
+  for (auto &rid : loser_rids) {
+    EXPECT_FALSE(test_table->GetTuple(rid, tuple, txn));
+  }
+  storage_engine->transaction_manager_->Commit(txn);
+  delete txn;
+  delete test_table;
+
+  // checkpoints wait until every page is recovered
+  log_recovery->WaitLazyRecovery();
+  EXPECT_FALSE(storage_engine->buffer_pool_manager_->IsRecovering());
+  EXPECT_NE(INVALID_LSN, storage_engine->checkpoint_manager_->Checkpoint());
+  delete log_recovery;
+  storage_engine->log_manager_->StopFlushThread();
+
+  delete schema;
+}
+
+} // namespace cmudb
@@ -0,0 +1,71 @@
+/**
+ * table_page_test.cpp
+ */
+
+#include <cstring>
+#include <vector>
+
+#include "page/table_page.h"
+#include "gtest/gtest.h"
+
+namespace cmudb {
+
+// tuple of size bytes, all of them value
+static void MakeTuple(Tuple &tuple, int32_t size, char value) {
+  std::vector<char> storage(sizeof(int32_t) + size, value);
+  memcpy(storage.data(), &size, sizeof(int32_t));
+  tuple.DeserializeFrom(storage.data());
+}
+
+// fill the page with tuples of 16 bytes, @return: number of tuples
+static int FillPage(TablePage *table_page) {
+  int count = 0;
+  RID rid;
+  Tuple tuple;
+  MakeTuple(tuple, 16, 'a');
+  while (table_page->InsertTuple(tuple, rid, nullptr, nullptr, nullptr)) {
+    EXPECT_EQ(count, rid.GetSlotNum());
+    count++;
+  }
+  return count;
+}
+
+TEST(TablePageTest, SlotLayoutTest) {
+  // pages keep the 8 byte slots of older databases
+  Page page;
+  TablePage *table_page = reinterpret_cast<TablePage *>(&page);
+  table_page->Init(1, PAGE_SIZE, INVALID_PAGE_ID, nullptr, nullptr);
+  EXPECT_FALSE(table_page->HasSlotLocks());
+  EXPECT_EQ((PAGE_SIZE - 24) / (16 + 8), FillPage(table_page));
+  EXPECT_EQ(nullptr, table_page->GetSlotLock(0));
+  int32_t offset;
+  memcpy(&offset, page.GetData() + 24 + 8, sizeof(int32_t));
+  EXPECT_EQ(PAGE_SIZE - 32, offset);
+
+  // a table with slot lock words has a third word in each slot
+  Page lock_page;
+  TablePage *lock_table_page = reinterpret_cast<TablePage *>(&lock_page);
+  lock_table_page->Init(2, PAGE_SIZE, INVALID_PAGE_ID, nullptr, nullptr, true);
+  EXPECT_TRUE(lock_table_page->HasSlotLocks());
+  int count = FillPage(lock_table_page);
+  EXPECT_EQ((PAGE_SIZE - 24) / (16 + 12), count);
+  EXPECT_EQ(reinterpret_cast<char *>(lock_table_page->GetSlotLock(1)),
+            lock_page.GetData() + 24 + 12 + 8);
+  EXPECT_EQ(INVALID_TXN_ID, lock_table_page->GetSlotLock(1)->load());
+  memcpy(&offset, lock_page.GetData() + 24 + 12, sizeof(int32_t));
+  EXPECT_EQ(PAGE_SIZE - 32, offset);
+
+  // the flag does not show in the tuple count
+  RID rid;
+  EXPECT_TRUE(lock_table_page->GetFirstTupleRid(rid));
+  for (int i = 1; i < count; i++) {
+    EXPECT_TRUE(lock_table_page->GetNextTupleRid(rid, rid));
+  }
+  EXPECT_FALSE(lock_table_page->GetNextTupleRid(rid, rid));
+  Tuple tuple;
+  EXPECT_TRUE(lock_table_page->GetTuple(rid, tuple, nullptr, nullptr));
+  EXPECT_EQ(16, tuple.GetLength());
+  EXPECT_EQ('a', tuple.GetData()[15]);
+}
+
+} // namespace cmudb